@@ -218,6 +218,37 @@ start_thread(struct pt_regs *regs, unsigned long new_ip, unsigned long new_sp)
 			    __USER_CS, __USER_DS, 0);
 }
 
+/**
+ * start_new_thread - Start a new task at a fresh user program
+ * @p: the new task, which has not run yet
+ * @new_ip: the first instruction IP of user thread
+ * @new_sp: the new stack pointer of user thread
+ *
+ * Same as start_thread() and flush_thread() of execve(), but for a task
+ * just created by copy_process(). Nothing is loaded into this CPU, @p picks
+ * its registers up at __switch_to() and ret_from_fork().
+ */
+void start_new_thread(struct task_struct *p, unsigned long new_ip,
+		      unsigned long new_sp)
+{
+	struct thread_struct *t = &p->thread;
+	struct pt_regs *regs = task_pt_regs(p);
+
+	memset(t->tls_array, 0, sizeof(t->tls_array));
+	fpstate_init(&t->fpu.state);
+
+	t->fsbase = t->gsbase = 0;
+	t->fsindex = t->gsindex = 0;
+	t->ds = t->es = 0;
+
+	memset(regs, 0, sizeof(*regs));
+	regs->ip		= new_ip;
+	regs->sp		= new_sp;
+	regs->cs		= __USER_CS;
+	regs->ss		= __USER_DS;
+	regs->flags		= X86_EFLAGS_IF;
+}
+
 #ifdef CONFIG_COMPAT
 void compat_start_thread(struct pt_regs *regs, u32 new_ip, u32 new_sp)
 {
@@ -103,11 +103,30 @@ struct process_snapshot {
 	struct list_head	list;
 };
 
+/*
+ * Flattened process_snapshot, shipped to memory and saved in images:
+ *
+ *	struct ss_image
+ *	struct ss_task_struct	tasks[nr_tasks]
+ *	struct ss_files		files[nr_files]
+ */
+struct ss_image {
+	char			comm[TASK_COMM_LEN];
+	unsigned int		nr_tasks;
+	unsigned int		nr_files;
+	struct sigaction	action[_NSIG];
+	sigset_t		blocked;
+} __packed;
+
+size_t process_snapshot_size(struct process_snapshot *pss);
+void pack_process_snapshot(struct process_snapshot *pss, void *buf);
+struct process_snapshot *unpack_process_snapshot(void *buf, size_t len);
+void free_process_snapshot(struct process_snapshot *pss);
+
 void enqueue_pss(struct process_snapshot *pss);
 struct process_snapshot *dequeue_pss(void);
 
-struct task_struct *
-restore_process_snapshot(struct process_snapshot *pss);
+int restore_process_snapshot(struct process_snapshot *pss);
 
 void dump_process_snapshot_files(struct process_snapshot *pss);
 void dump_process_snapshot_signals(struct process_snapshot *pss);
@@ -58,6 +58,13 @@
 #define F_SETPIPE_SZ	(F_LINUX_SPECIFIC_BASE + 7)
 #define F_GETPIPE_SZ	(F_LINUX_SPECIFIC_BASE + 8)
 
+/* Flags for splice() and vmsplice() */
+#define SPLICE_F_MOVE		(0x01)	/* move pages instead of copying */
+#define SPLICE_F_NONBLOCK	(0x02)	/* don't block on the pipe splicing */
+#define SPLICE_F_MORE		(0x04)	/* expect more data */
+#define SPLICE_F_GIFT		(0x08)	/* pages passed in are a gift */
+#define SPLICE_F_ALL		(SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_MORE|SPLICE_F_GIFT)
+
 /* for F_[GET|SET]FL */
 #define FD_CLOEXEC	1	/* actually anything with low bit set goes */
 
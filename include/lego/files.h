@@ -103,6 +103,9 @@ struct file {
 	int			fd;
 	const struct file_operations *f_op;
 
+	/* protects f_epi_links and f_poll_links */
+	spinlock_t		f_ep_lock;
+
 #ifdef CONFIG_EPOLL
 	struct list_head	f_epi_links;
 #endif
@@ -106,6 +106,20 @@ extern unsigned long sysctl_send_reply_max_timeout_sec;
 int ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr,
 			     int max_ret_size, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec);
+#ifdef CONFIG_FIT_REPLY_SLEEP
+int ibapi_send_reply_timeout_sleep(int target_node, void *addr, int size, void *ret_addr,
+				   int max_ret_size, int if_use_ret_phys_addr,
+				   unsigned long timeout_sec);
+#else
+static inline int
+ibapi_send_reply_timeout_sleep(int target_node, void *addr, int size, void *ret_addr,
+			       int max_ret_size, int if_use_ret_phys_addr,
+			       unsigned long timeout_sec)
+{
+	return ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
+					max_ret_size, if_use_ret_phys_addr, timeout_sec);
+}
+#endif
 int ibapi_send_reply_timeout_w_private_bits(int target_node, void *addr, int size, void *ret_addr,
 			     int max_ret_size, int *private_bits, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec);
@@ -121,21 +135,21 @@ int ibapi_num_connected_nodes(void);
 int ibapi_sock_send_message(int target_node, int dest_port, int if_internal_port, void *buf, int size, unsigned long timeout_sec, int if_userspace); 
 int ibapi_sock_receive_message(int *target_node, int port, uintptr_t *ret_addr, int ret_size, int if_userspace, int sock_type);
 
+struct iovec;
+int ibapi_sock_send_message_iov(int target_node, int dest_port, int if_internal_port,
+				const struct iovec *iov, int nr_iov, int if_userspace);
+int ibapi_sock_receive_message_iov(int *target_node, int port, const struct iovec *iov,
+				   int nr_iov, int if_userspace, int sock_type);
+
 #define SOCK_IB_MAX_SEND_RECV_SIZE 4096*3
 
 int get_internal_port(int target_node, int port);
 
 /* Shared by poll, and epoll if configured */
 int sock_set_write_ready(int target_node, int port);
-int sock_set_read_ready(int target_node, int port, int size);
+int sock_notify_read_ready(int target_node, int port, int size);
 int sock_unset_read_ready(int target_node, int port, int size);
 
-int sock_poll_callback(int target_node, int port);
-
-#ifdef CONFIG_EPOLL
-int sock_epoll_callback(int target_node, int port);
-#endif
-
 #endif /* CONFIG_SOCKET_O_IB */
 
 #else
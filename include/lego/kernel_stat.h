@@ -50,5 +50,6 @@ void account_process_tick(struct task_struct *, int user);
 unsigned long long nr_context_switches(void);
 unsigned long nr_running(void);
 unsigned long nr_iowait(void);
+bool single_task_running(void);
 
 #endif /* _LEGO_KERNEL_STAT_H_ */
@@ -122,6 +122,12 @@ struct mm_struct {
 	spinlock_t vmr_lock;			/* protect vma_roots array */
 #endif /* CONFIG_DISTRIBUTED_VMA_PROCESSOR */ 
 
+#ifdef CONFIG_COMP_PROCESSOR
+	struct task_struct *owner;		/* thread group leader that pcache
+						 * lines mapped by this mm belong to,
+						 * even if a vfork child borrows it */
+#endif
+
 	int gpid;
 	struct list_head list;
 
@@ -25,6 +25,8 @@
  * PG_dirty:		Page is dirty
  * PG_reserved:		Page is reserved by memblock during boot. DO NOT TOUCH.
  * PG_private:		Page->private has meaningful value.
+ * PG_filemap:		Page is owned by memory-side file mmap cache,
+ *			and may be mapped by multiple processes.
  */
 enum pageflags {
 	PG_locked,
@@ -37,6 +39,7 @@ enum pageflags {
 	PG_unevictable,
 	PG_slab,
 	PG_slob_free,
+	PG_filemap,
 
 	__NR_PAGEFLAGS,
 };
@@ -116,6 +119,7 @@ PAGE_FLAG(Reserved, reserved)
 PAGE_FLAG(Private, private)
 PAGE_FLAG(Slab, slab)
 PAGE_FLAG(SlobFree, slob_free)
+PAGE_FLAG(Filemap, filemap)
 
 /*
  * For pages that are never mapped to userspace, page->mapcount may be
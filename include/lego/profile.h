@@ -60,6 +60,12 @@ extern int prof_on __read_mostly;
 int profile_heatmap_init(void);
 void print_profile_heatmap_nr(int nr);
 
+#ifdef CONFIG_PROFILING_HEATMAP_STACKS
+void profile_heatmap_late_init(void);
+#else
+static inline void profile_heatmap_late_init(void) { }
+#endif
+
 /*
  * Add multiple profiler hits to a given address:
  */
@@ -92,6 +98,8 @@ static inline int profile_heatmap_init(void)
 	return 0;
 }
 
+static inline void profile_heatmap_late_init(void) { }
+
 static inline void profile_tick(int type)
 {
 	return;
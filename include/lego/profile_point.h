@@ -11,31 +11,63 @@
 #define _LEGO_PROFILE_FUNC_H_
 
 #include <lego/kernel.h>
-#include <lego/atomic.h>
+#include <lego/sched.h>
+#include <lego/bitops.h>
+#include <lego/percpu.h>
 #include <lego/stringify.h>
 
+/*
+ * Log-linear latency histogram:
+ * Values below PP_HIST_SUB have their own bucket. Above that, each power
+ * of two is split into PP_HIST_SUB buckets, so the error is within 12.5%.
+ * Anything longer than 2^PP_HIST_MAX_BITS ns (~68s) goes to the last one.
+ */
+#define PP_HIST_SUB_BITS	3
+#define PP_HIST_SUB		(1UL << PP_HIST_SUB_BITS)
+#define PP_HIST_MAX_BITS	36
+#define PP_HIST_NR_BUCKETS	((PP_HIST_MAX_BITS - PP_HIST_SUB_BITS + 1) * PP_HIST_SUB)
+
+/*
+ * Only touched by the local CPU, thus no atomic ops and no cacheline
+ * bouncing. Folded by print_profile_point().
+ */
+struct profile_point_cpu {
+	unsigned long	nr;
+	unsigned long	time_ns;
+	unsigned long	max_ns;
+	unsigned long	hist[PP_HIST_NR_BUCKETS];
+};
+
 struct profile_point {
 	bool		enabled;
 	char		pp_name[64];
-	atomic_long_t	nr;
-	atomic_long_t	time_ns;
+	struct profile_point_cpu __percpu *cpu;
 } ____cacheline_aligned;
 
 #define __profile_point		__section(.profile.point)
 
+/* @cmd of the profile_point syscall */
+#define PP_CMD_ENABLE		0
+#define PP_CMD_DISABLE		1
+#define PP_CMD_RESET		2
+#define PP_CMD_PRINT		3
+
 #ifdef CONFIG_PROFILING_POINTS
 
 #define _PP_TIME(name)	__profilepoint_start_ns_##name
 #define _PP_NAME(name)	__profilepoint_##name
+#define _PP_CPU(name)	__profilepoint_cpu_##name
 
 /*
  * Define a profile point
  * It is ON by default.
  */
 #define DEFINE_PROFILE_POINT(name)							\
+	DEFINE_PER_CPU(struct profile_point_cpu, _PP_CPU(name));			\
 	struct profile_point _PP_NAME(name) __profile_point = {				\
 		.enabled	=	true,						\
 		.pp_name	=	__stringify(name),				\
+		.cpu		=	&_PP_CPU(name),					\
 	};
 
 /*
@@ -45,22 +77,57 @@ struct profile_point {
 #define PROFILE_POINT_TIME(name)							\
 	unsigned long _PP_TIME(name) __maybe_unused;
 
+static inline unsigned int pp_hist_index(unsigned long ns)
+{
+	unsigned int msb;
+
+	if (ns < PP_HIST_SUB)
+		return ns;
+
+	msb = fls64(ns) - 1;
+	if (msb >= PP_HIST_MAX_BITS)
+		return PP_HIST_NR_BUCKETS - 1;
+
+	return (msb - PP_HIST_SUB_BITS + 1) * PP_HIST_SUB +
+	       ((ns >> (msb - PP_HIST_SUB_BITS)) & (PP_HIST_SUB - 1));
+}
+
+/*
+ * Each update is a single instruction on local CPU, thus safe against
+ * preemption and interrupts. The max may lose a race against an
+ * interrupt on the same CPU, which is fine.
+ */
+static inline void profile_point_record(struct profile_point *pp, unsigned long start)
+{
+	long diff = sched_clock() - start;
+
+	/* Migrated to a CPU whose clock is behind */
+	if (unlikely(diff < 0))
+		diff = 0;
+
+	this_cpu_inc(pp->cpu->nr);
+	this_cpu_add(pp->cpu->time_ns, diff);
+	this_cpu_inc(pp->cpu->hist[pp_hist_index(diff)]);
+	if (diff > this_cpu_read(pp->cpu->max_ns))
+		this_cpu_write(pp->cpu->max_ns, diff);
+}
+
+/*
+ * A point may be enabled between start and leave, thus start always
+ * sets the time, and PP_TIME_NONE tells leave there is nothing to record.
+ */
+#define PP_TIME_NONE	0UL
+
 #define profile_point_start(name)							\
 	do {										\
-		if (_PP_NAME(name).enabled)						\
-			_PP_TIME(name) = sched_clock();					\
+		_PP_TIME(name) = _PP_NAME(name).enabled ?				\
+				 sched_clock() : PP_TIME_NONE;				\
 	} while (0)
 
 #define profile_point_leave(name)							\
 	do {										\
-		if (_PP_NAME(name).enabled) {						\
-			unsigned long __PP_end_time;					\
-			unsigned long __PP_diff_time;					\
-			__PP_end_time = sched_clock();					\
-			__PP_diff_time = __PP_end_time - _PP_TIME(name);		\
-			atomic_long_inc(&(_PP_NAME(name).nr));				\
-			atomic_long_add(__PP_diff_time, &(_PP_NAME(name).time_ns));	\
-		}									\
+		if (_PP_NAME(name).enabled && _PP_TIME(name) != PP_TIME_NONE)	\
+			profile_point_record(&_PP_NAME(name), _PP_TIME(name));		\
 	} while (0)
 
 #define PROFILE_START(name)								\
@@ -70,16 +137,14 @@ struct profile_point {
 
 #define PROFILE_LEAVE(name)								\
 	do {										\
-		unsigned long __PP_end_time;						\
-		unsigned long __PP_diff_time;						\
-		__PP_end_time = sched_clock();						\
-		__PP_diff_time = __PP_end_time - _PP_TIME(name);			\
-		atomic_long_inc(&(_PP_NAME(name).nr));					\
-		atomic_long_add(__PP_diff_time, &(_PP_NAME(name).time_ns));		\
+		if (_PP_NAME(name).enabled)						\
+			profile_point_record(&_PP_NAME(name), _PP_TIME(name));		\
 	} while (0)
 
 void print_profile_point(struct profile_point *pp);
 void print_profile_points(void);
+void reset_profile_point(struct profile_point *pp);
+struct profile_point *find_profile_point(const char *name);
 
 #else
 
@@ -92,6 +157,11 @@ void print_profile_points(void);
 
 static inline void print_profile_point(struct profile_point *pp) { }
 static inline void print_profile_points(void) { }
+static inline void reset_profile_point(struct profile_point *pp) { }
+static inline struct profile_point *find_profile_point(const char *name)
+{
+	return NULL;
+}
 #endif
 
 #endif /* _LEGO_PROFILE_FUNC_H_ */
@@ -43,14 +43,18 @@
 #define P2M_MREMAP		((__u32)__NR_mremap)
 #define P2M_BRK			((__u32)__NR_brk)
 #define P2M_MSYNC		((__u32)__NR_msync)
+#define P2M_MADVISE		((__u32)__NR_madvise)
 #define P2M_FORK		((__u32)__NR_fork)
 #define P2M_EXECVE		((__u32)__NR_execve)
 #define P2M_CHECKPOINT		((__u32)__NR_checkpoint_process)
+#define P2M_RESTORE		((__u32)__NR_restore_process)
+#define P2M_SPAWN		((__u32)__NR_spawn)
 #define P2M_TEST		((__u32)0x0ffffff0)
 #define P2M_TEST_NOREPLY	((__u32)0x0ffffff1)
 #define P2M_RENAME		((__u32)__NR_rename)
 #define P2M_STAT		((__u32)__NR_stat)
 #define P2M_DROP_CACHE		((__u32)__NR_drop_page_cache)
+#define P2M_RPC_TRACE		((__u32)__NR_rpc_trace)
 
 /* Processor to Storage directly */
 #define P2S_OPEN		((__u32)__NR_open)	/* open() goes to storage directly */
@@ -30,6 +30,9 @@ struct common_header {
 	 * XXX: Useless. Rmove me.
 	 */
 	unsigned int length;
+
+	/* Used to be padding, see <lego/rpc_trace.h>. 0 if not traced */
+	unsigned int trace_id;
 } __aligned(COMMON_HEADER_ALIGNMENT);
 
 static inline struct common_header *to_common_header(void *msg)
@@ -43,6 +46,15 @@ static inline void *to_payload(void *msg)
 }
 
 #ifndef _LEGO_STORAGE_SOURCE_
+#ifdef CONFIG_PROFILING_RPC_TRACE
+unsigned int rpc_trace_stamp(void);
+#else
+static inline unsigned int rpc_trace_stamp(void)
+{
+	return 0;
+}
+#endif
+
 /*
  * Fill the common_header part of the given @msg
  * @msg must have the common_header at the top of its struct.
@@ -54,6 +66,7 @@ static __always_inline void fill_common_header(void *msg, unsigned int opcode)
 	hdr = to_common_header(msg);
 	hdr->opcode = opcode;
 	hdr->src_nid = LEGO_LOCAL_NID;
+	hdr->trace_id = rpc_trace_stamp();
 }
 #endif
 
@@ -155,6 +155,8 @@ struct fork_reply_struct {
 
 struct task_struct;
 void *p2m_fork(struct task_struct *p, unsigned long clone_flags);
+void fill_p2m_fork_struct(struct p2m_fork_struct *payload,
+			  struct task_struct *p, unsigned long clone_flags);
 void handle_p2m_fork(struct p2m_fork_struct *payload,
 		     struct common_header *hdr, struct thpool_buffer *tb);
 
@@ -194,6 +196,19 @@ struct m2p_execve_struct {
 void handle_p2m_execve(struct p2m_execve_struct *payload,
 		       struct common_header *hdr, struct thpool_buffer *tb);
 
+/*
+ * P2M_SPAWN
+ * fork() and execve() of a new process at once. The new process
+ * starts with the loaded program, nothing is copied from its parent.
+ * Reply is struct m2p_execve_struct.
+ */
+struct p2m_spawn_struct {
+	struct p2m_fork_struct		fork;
+	struct p2m_execve_struct	execve;	/* variable size, must be last */
+};
+void handle_p2m_spawn(struct p2m_spawn_struct *payload,
+		      struct common_header *hdr, struct thpool_buffer *tb);
+
 /*
  * P2M_MMAP
  */
@@ -268,6 +283,32 @@ struct p2m_mprotect_struct {
 void handle_p2m_mprotect(struct p2m_mprotect_struct *payload,
 			 struct thpool_buffer *tb);
 
+/*
+ * P2M_MADVISE
+ *
+ * MADV_DONTNEED and MADV_FREE take two rounds. The first one only checks
+ * the range and reports what it maps. Processor then drops its pcache
+ * lines, and the second one (@zap set) frees the pages. The other way
+ * around, a dirty line written back in between would bring a freed
+ * page back.
+ */
+struct p2m_madvise_struct {
+	__u32	pid;
+	__u32	behavior;
+	__u32	zap;
+	__u64	start;
+	__u64	len;
+};
+struct p2m_madvise_reply_struct {
+	int	ret;
+	__u32	flags;
+};
+
+#define P2M_MADVISE_SHARED	0x1	/* some pages are MAP_SHARED */
+
+void handle_p2m_madvise(struct p2m_madvise_struct *payload,
+			struct common_header *hdr, struct thpool_buffer *tb);
+
 /*
  * P2M_BRK
  */
@@ -300,11 +341,48 @@ int handle_p2m_msync(struct p2m_msync_struct *, u64, struct common_header *, voi
 
 /*
  * P2M_CHECKPOINT
+ * The flattened process snapshot follows the msg,
+ * the whole message is limited by memory side rxbuf size.
+ */
+#define P2M_CHECKPOINT_MAX_SIZE	(16 * PAGE_SIZE)
+struct p2m_checkpoint_msg {
+	__u32	pid;
+	__u32	len;		/* nrbytes of snapshot */
+};
+struct p2m_checkpoint_reply {
+	__s32	ret;
+	__u32	seq;		/* sequence number of the image */
+};
+void handle_p2m_checkpoint(struct p2m_checkpoint_msg *payload,
+			   struct common_header *hdr, struct thpool_buffer *tb);
+
+/*
+ * P2M_RESTORE
+ * Replace the address space of @pid with the one saved in image
+ * <image_node>.<image_pid>.<seq>. The flattened process snapshot
+ * follows the reply, which is limited by P2M_CHECKPOINT_MAX_SIZE.
  */
-int handle_p2m_checkpint(void *, u64, struct common_header *);
+struct p2m_restore_msg {
+	__u32	pid;
+	__u32	image_node;
+	__u32	image_pid;
+	__u32	seq;
+};
+struct p2m_restore_reply {
+	__s32	ret;
+	__u32	len;		/* nrbytes of snapshot */
+};
+void handle_p2m_restore(struct p2m_restore_msg *payload,
+			struct common_header *hdr, struct thpool_buffer *tb);
 
 void handle_p2m_drop_page_cache(struct common_header *hdr, struct thpool_buffer *tb);
 
+struct p2m_rpc_trace_msg {
+	__u32	cmd;		/* RPC_TRACE_CMD_XXX */
+};
+void handle_p2m_rpc_trace(struct p2m_rpc_trace_msg *payload,
+			  struct common_header *hdr, struct thpool_buffer *tb);
+
 #ifdef CONFIG_MEM_PAGE_CACHE
 struct p2m_lseek_struct {
 	char filename[MAX_FILENAME_LENGTH];
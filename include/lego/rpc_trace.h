@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_RPC_TRACE_H_
+#define _LEGO_RPC_TRACE_H_
+
+#include <lego/types.h>
+#include <lego/compiler.h>
+
+enum rpc_trace_event {
+	/* Client */
+	RPC_TRACE_SEND,
+	RPC_TRACE_SEND_NOREPLY,
+	RPC_TRACE_RECV_REPLY,
+
+	/* Server */
+	RPC_TRACE_ENQUEUE,
+	RPC_TRACE_DEQUEUE,
+	RPC_TRACE_HANDLER_END,
+	RPC_TRACE_REPLY,
+
+	NR_RPC_TRACE_EVENTS,
+};
+
+/*
+ * One record in the per-cpu ring.
+ * @peer is the target node at client side, the source node at server side.
+ */
+struct rpc_trace_record {
+	u64		ts_ns;
+	u32		trace_id;
+	u32		opcode;
+	u8		event;
+	u8		peer;
+	u16		_pad;
+};
+
+/* @cmd of the rpc_trace syscall and P2M_RPC_TRACE */
+#define RPC_TRACE_CMD_ENABLE	0
+#define RPC_TRACE_CMD_DISABLE	1
+#define RPC_TRACE_CMD_RESET	2
+#define RPC_TRACE_CMD_DUMP	3	/* also disables tracing */
+
+#ifdef CONFIG_PROFILING_RPC_TRACE
+extern bool rpc_trace_enabled;
+
+void __rpc_trace_record(unsigned int event, unsigned int trace_id,
+			unsigned int opcode, unsigned int peer);
+unsigned int __rpc_trace_send(void *msg, int target_node, bool noreply);
+void rpc_trace_serve(unsigned int trace_id);
+int rpc_trace_ctl(unsigned int cmd);
+void rpc_trace_dump(void);
+
+static inline void rpc_trace_record(unsigned int event, unsigned int trace_id,
+				    unsigned int opcode, unsigned int peer)
+{
+	if (rpc_trace_enabled && trace_id)
+		__rpc_trace_record(event, trace_id, opcode, peer);
+}
+
+/*
+ * Client side, called right before @msg is sent.
+ * Both common_header and the bare storage messages start with opcode.
+ * Return the trace ID to be passed to rpc_trace_recv_reply().
+ */
+static inline unsigned int rpc_trace_send(void *msg, int target_node, bool noreply)
+{
+	if (rpc_trace_enabled)
+		return __rpc_trace_send(msg, target_node, noreply);
+	return 0;
+}
+
+static inline void rpc_trace_recv_reply(unsigned int trace_id, void *msg,
+					int target_node)
+{
+	rpc_trace_record(RPC_TRACE_RECV_REPLY, trace_id, *(u32 *)msg, target_node);
+}
+#else
+static inline void rpc_trace_record(unsigned int event, unsigned int trace_id,
+				    unsigned int opcode, unsigned int peer) { }
+static inline unsigned int rpc_trace_send(void *msg, int target_node, bool noreply)
+{
+	return 0;
+}
+static inline void rpc_trace_recv_reply(unsigned int trace_id, void *msg,
+					int target_node) { }
+static inline void rpc_trace_serve(unsigned int trace_id) { }
+static inline void rpc_trace_dump(void) { }
+#endif /* CONFIG_PROFILING_RPC_TRACE */
+
+#endif /* _LEGO_RPC_TRACE_H_ */
@@ -76,6 +76,24 @@
 #define CLONE_IDLE_THREAD	0x100000000	/* set if we want to clone an idle thread */
 #define CLONE_GLOBAL_THREAD	0x200000000	/* set if it is global */
 
+/*
+ * A vfork() child runs in its parent's address space until it calls
+ * execve() or exits, while the parent sleeps. Instead of a full copy,
+ * both processor and memory component let the child borrow the parent's
+ * mm, and pcache lines it touches stay with the parent.
+ *
+ * Distributed VMA still copies, other memory nodes know nothing
+ * about the borrowed mm.
+ */
+static inline bool clone_borrows_vm(unsigned long clone_flags)
+{
+	const unsigned long mask = CLONE_VM | CLONE_VFORK | CLONE_THREAD;
+
+	if (IS_ENABLED(CONFIG_DISTRIBUTED_VMA))
+		return false;
+	return (clone_flags & mask) == (CLONE_VM | CLONE_VFORK);
+}
+
 /*
  * task->state and task->exit_state
  *
@@ -498,6 +516,11 @@ struct task_struct {
 
 	void *private_strace;
 
+#ifdef CONFIG_PROFILING_RPC_TRACE
+	unsigned int rpc_trace_serving;		/* ID of the request being handled */
+	unsigned int rpc_trace_stamped;		/* ID put into header, not sent yet */
+#endif
+
 	/* CPU-specific state of this task */
 	struct thread_struct thread;
 
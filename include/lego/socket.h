@@ -66,7 +66,6 @@
 #define SOCK_KERNEL_START_PORT_NUM 32768 /* starting port number assigned in kernel */
 #define MAX_KERNEL_SOCK_PORTS 28232 /* maximum number of kernel assigned port numbers */
 
-#define MAX_SOCK_SEND_SIZE 1024*1024*4
 
 #define SOCK_IMM_SEND		0x30000000 // socket send data
 #define SOCK_IMM_ACK		0x10000000 // socket ack new mr offset
@@ -158,7 +157,7 @@ struct lego_socket {
 	int			curr_num_conn;
 	int			ready_state;
 	struct lego_sock_conn	recvd_conn_list; /* we now assume only one thread calling socket listen, so no need to lock the list */
-	struct list_head	list;
+	struct hlist_node	index_node;	/* see find_socket_from_node_port() */
 	struct sock_options	sk_opt;
 };
 
@@ -28,6 +28,8 @@
 struct lego_dirent;
 struct epoll_event;
 struct pollfd;
+struct rusage;
+struct pcache_wss_stat;
 
 #ifdef CONFIG_DEBUG_SYSCALL
 #define debug_syscall_print()			\
@@ -129,6 +131,11 @@ asmlinkage long sys_statfs(const char __user *pathname, struct statfs __user *bu
 asmlinkage long sys_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg);
 asmlinkage long sys_pipe2(int __user *flides, int flags);
 asmlinkage long sys_pipe(int __user *flides);
+asmlinkage long sys_splice(int fd_in, loff_t __user *off_in,
+			   int fd_out, loff_t __user *off_out,
+			   size_t len, unsigned int flags);
+asmlinkage long sys_vmsplice(int fd, const struct iovec __user *iov,
+			     unsigned long nr_segs, unsigned int flags);
 asmlinkage long sys_sync(void);
 asmlinkage long sys_truncate(const char __user *path, long length);
 asmlinkage long sys_ftruncate(unsigned int fd, unsigned long length);
@@ -158,6 +165,8 @@ asmlinkage long sys_fork(void);
 asmlinkage long sys_vfork(void);
 asmlinkage long sys_clone(unsigned long, unsigned long, int __user *,
 			  int __user *, unsigned long);
+asmlinkage long sys_wait4(pid_t pid, int __user *stat_addr,
+			  int options, struct rusage __user *ru);
 
 asmlinkage long sys_brk(unsigned long);
 
@@ -214,6 +223,15 @@ asmlinkage long setitimer(int which, struct timeval __user *value,
 
 /* Lego only */
 asmlinkage long sys_checkpoint_process(pid_t pid);
+asmlinkage long sys_restore_process(unsigned int node, pid_t pid,
+				    unsigned int seq);
+asmlinkage long sys_spawn(const char __user *filename,
+			  const char __user *const __user *argv,
+			  const char __user *const __user *envp);
+asmlinkage long sys_profile_point(int cmd, const char __user *name);
+asmlinkage long sys_rpc_trace(unsigned int cmd);
+asmlinkage long sys_pcache_wss(int cmd, unsigned long arg,
+			       struct pcache_wss_stat __user *statbuf);
 
 /* x86-64 only */
 asmlinkage long sys_arch_prctl(int, unsigned long);
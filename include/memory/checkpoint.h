@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_MEMORY_CHECKPOINT_H_
+#define _LEGO_MEMORY_CHECKPOINT_H_
+
+#include <lego/types.h>
+#include <lego/kernel.h>
+#include <lego/comp_common.h>
+#include <memory/mm.h>
+
+/*
+ * Checkpoint image layout at storage,
+ * named <CONFIG_MEM_CHECKPOINT_PREFIX>.<node>.<pid>.<seq>:
+ *
+ *	struct chk_image_header
+ *	process snapshot from processor (struct ss_image ...), ss_len bytes
+ *	struct chk_image_vma	vmas[nr_vmas]
+ *	__u64			addrs[nr_pages], ascending
+ *	__u64			hot[nr_hot], ascending
+ *	hole up to data_offset, which is page aligned
+ *	page data of addrs[0..nr_pages)
+ *
+ * The image with seq == base_seq holds all mapped pages. Each later one
+ * only holds pages dirtied since its predecessor, thus restore applies
+ * images base_seq..seq in order. Pages never captured are zero-filled if
+ * anonymous, or read from the file otherwise.
+ *
+ * hot[] are pages accessed since the previous image, no matter whether
+ * they are captured by this one. Restore prefetches them.
+ */
+#define CHK_IMAGE_MAGIC		0x4b48434cU	/* "LCHK" */
+
+struct chk_image_header {
+	__u32	magic;
+	__u32	node;
+	__u32	pid;
+	__u32	ss_len;
+	__u64	seq;
+	__u64	base_seq;
+	__u64	nr_vmas;
+	__u64	nr_pages;
+	__u64	nr_hot;
+	__u64	data_offset;
+
+	/* Layout of the address space */
+	__u64	start_code, end_code, start_data, end_data;
+	__u64	start_brk, brk, start_stack;
+	__u64	arg_start, arg_end, env_start, env_end;
+	__u64	saved_auxv[AT_VECTOR_SIZE];
+};
+
+struct chk_image_vma {
+	__u64	vm_start;
+	__u64	vm_end;
+	__u64	vm_flags;
+	__u64	vm_pgoff;
+	char	filename[MAX_FILENAME_LENGTH];	/* empty if anonymous */
+};
+
+#ifdef CONFIG_MEM_CHECKPOINT
+/* Limited by storage side rxbuf size, same as processor write() */
+#define CHK_IO_SIZE		(16 * PAGE_SIZE)
+
+static inline void chk_image_name(char *f_name, unsigned int node,
+				  unsigned int pid, unsigned long seq)
+{
+	snprintf(f_name, MAX_FILENAME_LENGTH, "%s.%u.%u.%lu",
+		 CONFIG_MEM_CHECKPOINT_PREFIX, node, pid, seq);
+}
+
+void __init init_checkpoint_thread(void);
+void __init init_restore_thread(void);
+
+/* Old images no longer describe @mm, the next one has to be full */
+static inline void checkpoint_reset_base(struct lego_mm_struct *mm)
+{
+	mm->checkpoint_base = 0;
+}
+
+/* Called by lego_mm_init(), a forked mm copies its parent's fields */
+static inline void checkpoint_init_mm(struct lego_mm_struct *mm)
+{
+	mm->checkpoint_base = 0;
+	mm->checkpoint_restore = NULL;
+}
+
+/* True if some pages of @mm are still in checkpoint images */
+static inline bool checkpoint_restoring(struct lego_mm_struct *mm)
+{
+	return mm->checkpoint_restore != NULL;
+}
+
+int checkpoint_restore_fault(struct vm_area_struct *vma, unsigned long address,
+			     pmd_t *pmd, unsigned long *mapping_flags);
+void checkpoint_restore_unmap(struct lego_mm_struct *mm,
+			      unsigned long start, unsigned long end);
+int checkpoint_restore_populate(struct lego_mm_struct *mm);
+void checkpoint_restore_exit(struct lego_mm_struct *mm);
+#else
+static inline void init_checkpoint_thread(void) { }
+static inline void init_restore_thread(void) { }
+static inline void checkpoint_reset_base(struct lego_mm_struct *mm) { }
+static inline void checkpoint_init_mm(struct lego_mm_struct *mm) { }
+static inline bool checkpoint_restoring(struct lego_mm_struct *mm)
+{
+	return false;
+}
+static inline int
+checkpoint_restore_fault(struct vm_area_struct *vma, unsigned long address,
+			 pmd_t *pmd, unsigned long *mapping_flags)
+{
+	return 0;
+}
+static inline void checkpoint_restore_unmap(struct lego_mm_struct *mm,
+					    unsigned long start, unsigned long end) { }
+static inline int checkpoint_restore_populate(struct lego_mm_struct *mm)
+{
+	return 0;
+}
+static inline void checkpoint_restore_exit(struct lego_mm_struct *mm) { }
+#endif
+
+#endif /* _LEGO_MEMORY_CHECKPOINT_H_ */
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_MEMORY_ELF_CACHE_H_
+#define _LEGO_MEMORY_ELF_CACHE_H_
+
+#include <lego/list.h>
+#include <lego/atomic.h>
+#include <lego/comp_common.h>
+#include <memory/elf.h>
+#include <memory/loader.h>
+#include <memory/file_types.h>
+
+/*
+ * Parsed headers of an ELF binary, shared by all execve() of it.
+ * Never changed once cached, thus read without lock.
+ */
+struct elf_image {
+	char			filename[MAX_FILENAME_LENGTH];
+	unsigned int		key;
+	struct hlist_node	hlink;
+	struct list_head	lru;
+	atomic_t		refcount;
+
+	char			buf[BINPRM_BUF_SIZE];	/* starts with elfhdr */
+	struct elf_phdr		*phdrs;			/* e_phnum entries */
+	char			*interp;		/* NULL if static */
+};
+
+static inline struct elfhdr *elf_image_hdr(struct elf_image *image)
+{
+	return (struct elfhdr *)image->buf;
+}
+
+#ifdef CONFIG_MEM_ELF_CACHE
+struct elf_image *elf_image_get(struct lego_task_struct *tsk,
+				struct lego_file *file);
+void elf_image_put(struct elf_image *image);
+void elf_cache_invalidate(const char *filename);
+void elf_cache_drop_all(void);
+void elf_cache_map_text(struct lego_mm_struct *mm);
+#else
+static inline struct elf_image *
+elf_image_get(struct lego_task_struct *tsk, struct lego_file *file)
+{
+	return NULL;
+}
+static inline void elf_image_put(struct elf_image *image) { }
+static inline void elf_cache_invalidate(const char *filename) { }
+static inline void elf_cache_drop_all(void) { }
+static inline void elf_cache_map_text(struct lego_mm_struct *mm) { }
+#endif /* CONFIG_MEM_ELF_CACHE */
+
+#endif /* _LEGO_MEMORY_ELF_CACHE_H_ */
@@ -34,7 +34,13 @@ ssize_t storage_read(struct lego_task_struct *tsk,
 ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
 		       char __user *buf, size_t count, loff_t *pos);
 
+ssize_t storage_read_pages(struct lego_task_struct *tsk, char *f_name,
+			   unsigned long *pages, unsigned int nr_pages, loff_t pos);
+
 ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
 			const char *buf, size_t count, loff_t *pos);
 
+ssize_t __storage_write_flags(struct lego_task_struct *tsk, char *f_name,
+			      const char *buf, size_t count, loff_t *pos, int flags);
+
 #endif /* _LEGO_MEMORY_FILE_OPS_H_ */
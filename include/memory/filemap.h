@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_MEMORY_FILEMAP_H_
+#define _LEGO_MEMORY_FILEMAP_H_
+
+#include <lego/mm.h>
+#include <memory/vm.h>
+
+#ifdef CONFIG_MEM_FILEMAP
+/*
+ * MAP_SHARED writable mappings must see their own writes,
+ * and write back through msync. Keep them out of the cache.
+ */
+static inline bool filemap_vma_cacheable(struct vm_area_struct *vma)
+{
+	return !(vma->vm_flags & VM_SHARED);
+}
+
+/*
+ * @page is the kernel virtual address of a mapped user page.
+ * Return true if it is shared with the file mmap cache and must be
+ * copied before memory manager writes into it.
+ */
+static inline bool filemap_page_need_cow(unsigned long page)
+{
+	return PageFilemap(virt_to_page(page));
+}
+
+unsigned long filemap_find_page(const char *filename, pgoff_t pgoff);
+unsigned long filemap_add_page(const char *filename, pgoff_t pgoff,
+			       unsigned long page);
+int filemap_fault(struct vm_area_struct *vma, struct vm_fault *vmf);
+int filemap_break_cow(struct vm_area_struct *vma, unsigned long address,
+		      unsigned long *page);
+void filemap_invalidate(const char *filename, loff_t pos, size_t count);
+void filemap_drop_all(void);
+void filemap_map_cached(struct vm_area_struct *vma);
+#else
+static inline bool filemap_vma_cacheable(struct vm_area_struct *vma)
+{
+	return false;
+}
+
+static inline bool filemap_page_need_cow(unsigned long page)
+{
+	return false;
+}
+
+static inline unsigned long
+filemap_find_page(const char *filename, pgoff_t pgoff)
+{
+	return 0;
+}
+
+static inline unsigned long
+filemap_add_page(const char *filename, pgoff_t pgoff, unsigned long page)
+{
+	return 0;
+}
+
+static inline int filemap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	BUG();
+}
+
+static inline int filemap_break_cow(struct vm_area_struct *vma,
+				    unsigned long address, unsigned long *page)
+{
+	return 0;
+}
+
+static inline void filemap_invalidate(const char *filename, loff_t pos, size_t count) { }
+static inline void filemap_drop_all(void) { }
+static inline void filemap_map_cached(struct vm_area_struct *vma) { }
+#endif /* CONFIG_MEM_FILEMAP */
+
+#endif /* _LEGO_MEMORY_FILEMAP_H_ */
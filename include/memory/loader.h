@@ -20,6 +20,8 @@
 static inline void loader_debug(const char *fmt, ...) { }
 #endif
 
+struct elf_image;
+
 /* sizeof(lego_binprm->buf) */
 #define BINPRM_BUF_SIZE		128
 
@@ -33,6 +35,9 @@ struct lego_binprm {
 	unsigned long		vma_pages;
 	struct lego_file	*file;
 
+	/* Cached headers of @file, NULL if not cached */
+	struct elf_image	*image;
+
 	int			argc, envc;
 
 	unsigned long		exec;
@@ -23,6 +23,7 @@
 
 struct lego_task_struct;
 struct lego_mm_struct;
+struct chk_restore;
 struct lego_file;
 struct vm_area_struct;
 struct vm_fault;
@@ -36,6 +37,14 @@ struct vm_operations_struct {
 	void (*open)(struct vm_area_struct * area);
 	void (*close)(struct vm_area_struct * area);
 	int (*fault)(struct vm_area_struct *, struct vm_fault *);
+
+	/*
+	 * Used by fault-around. Fill @pages[i] with the page of
+	 * (@pgoff + i) if it is 0, skip the ones that are not 0.
+	 * Slots that can not be filled are left 0.
+	 */
+	void (*map_pages)(struct vm_area_struct *, pgoff_t pgoff,
+			  unsigned long *pages, unsigned int nr);
 };
 
 /*
@@ -76,6 +85,13 @@ struct vm_area_struct {
 	unsigned long vm_pgoff;		/* Offset (within vm_file) in PAGE_SIZE
 					   units */
 	struct lego_file *vm_file;	/* File we map to (can be NULL )*/
+
+#ifdef CONFIG_MEM_FAULT_AROUND
+	/* Fault-around window and its statistics, see vm/fault.c */
+	unsigned int fa_pages;
+	unsigned int fa_mapped;
+	unsigned int fa_hit;
+#endif
 };
 
 /* the node id is acquired by array index, so node id field is not necessary */
@@ -139,6 +155,21 @@ struct lego_mm_struct {
 	struct rw_semaphore mmap_sem;
 	struct lego_task_struct *task;
 
+	/* Mapped pages, refreshed by lego_mm_update_rss() */
+	unsigned long rss_private;
+	unsigned long rss_shared;
+
+#ifdef CONFIG_MEM_CHECKPOINT
+	/*
+	 * Sequence number of the full checkpoint image that later
+	 * incremental ones build on. 0 if the next one has to be full.
+	 */
+	unsigned long checkpoint_base;
+
+	/* Images that pages not faulted in yet are read from */
+	struct chk_restore *checkpoint_restore;
+#endif
+
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 	/*
 	 * distributed vma range limit management array. Unlike processor side, size of 
@@ -10,7 +10,7 @@
 #ifndef _LEGO_MEMORY_STAT_H_
 #define _LEGO_MEMORY_STAT_H_
 
-#include <lego/atomic.h>
+#include <lego/percpu.h>
 
 enum memory_manager_stat_item {
 	/* Handler */
@@ -28,24 +28,36 @@ enum memory_manager_stat_item {
 
 	NR_BATCHED_LOG_FLUSH,
 
+	NR_FILEMAP_HIT,
+	NR_FILEMAP_MISS,
+	NR_FILEMAP_COW,
+	NR_FILEMAP_PREMAP,
+
+	NR_ELF_CACHE_HIT,
+	NR_ELF_CACHE_MISS,
+
+	NR_COW_REUSE,
+	NR_COW_COPY,
+
+	NR_RESTORE_FAULT,
+	NR_RESTORE_PREFETCH,
+
 	NR_MEMORY_MANAGER_STAT_ITEMS,
 };
 
+/* Per-cpu, folded by mm_stat(). Same as pcache events at processor. */
 struct memory_manager_stat {
-	atomic_long_t stat[NR_MEMORY_MANAGER_STAT_ITEMS];
+	unsigned long stat[NR_MEMORY_MANAGER_STAT_ITEMS];
 };
 
-extern struct memory_manager_stat memory_manager_stats;
+DECLARE_PER_CPU(struct memory_manager_stat, memory_manager_stats);
 
-static inline unsigned long mm_stat(enum memory_manager_stat_item i)
-{
-	return atomic_long_read(&memory_manager_stats.stat[i]);
-}
+unsigned long mm_stat(enum memory_manager_stat_item i);
 
 #ifdef CONFIG_COUNTER_MEMORY_HANDLER
 static inline void inc_mm_stat(enum memory_manager_stat_item i)
 {
-	atomic_long_inc(&memory_manager_stats.stat[i]);
+	this_cpu_inc(memory_manager_stats.stat[i]);
 }
 
 void print_memory_manager_stats(void);
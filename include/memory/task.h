@@ -40,6 +40,10 @@ struct lego_task_struct {
 					 * - initialized normally by setup_new_exec
 					 */
 
+#ifdef CONFIG_MEM_CHECKPOINT
+	unsigned long checkpoint_seq;	/* nr of checkpoint images taken */
+#endif
+
 	LEGO_TASK_PADDING(_pad1_)
 	spinlock_t task_lock;
 
@@ -47,9 +51,14 @@ struct lego_task_struct {
 } ____cacheline_aligned;
 
 void dump_lego_tasks(void);
+void lego_tasks_rss(unsigned long *rss_private, unsigned long *rss_shared);
 struct lego_task_struct *alloc_lego_task_struct(void);
 void free_lego_task_struct(struct lego_task_struct *tsk);
 
+struct p2m_fork_struct;
+struct lego_task_struct *
+alloc_forked_lego_task(struct p2m_fork_struct *payload, unsigned int nid);
+
 static inline void lego_task_lock(struct lego_task_struct *p)
 {
 	spin_lock(&p->task_lock);
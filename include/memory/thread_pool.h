@@ -13,6 +13,7 @@
 #include <lego/list.h>
 #include <lego/sched.h>
 #include <lego/spinlock.h>
+#include <lego/wait.h>
 #include <lego/comp_common.h>
 
 /*
@@ -52,6 +53,10 @@ struct thpool_worker {
 	spinlock_t		lock;
 	struct list_head	work_head;
 	struct task_struct	*task;
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+	wait_queue_head_t	wq;
+	unsigned long		nr_sleeps;
+#endif
 	TW_PADDING(_pad1);
 
 	/* for debug usage */
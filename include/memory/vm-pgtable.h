@@ -99,6 +99,30 @@ int __lego_pud_alloc(struct lego_mm_struct *mm, pgd_t *pgd, unsigned long addres
 int __lego_pmd_alloc(struct lego_mm_struct *mm, pud_t *pud, unsigned long address);
 int __lego_pte_alloc(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long address);
 
+#ifdef CONFIG_MEM_ONDEMAND_FORK
+/*
+ * A pte table shared by fork() is pointed to by pmds without _PAGE_RW.
+ * It must be unshared before anyone changes it.
+ */
+static inline bool lego_pmd_shared(pmd_t pmd)
+{
+	return !pmd_none(pmd) && !(pmd_flags(pmd) & _PAGE_RW);
+}
+
+int __lego_pte_unshare(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long address);
+#else
+static inline bool lego_pmd_shared(pmd_t pmd)
+{
+	return false;
+}
+
+static inline int
+__lego_pte_unshare(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long address)
+{
+	return 0;
+}
+#endif /* CONFIG_MEM_ONDEMAND_FORK */
+
 static inline pud_t *
 lego_pud_alloc(struct lego_mm_struct *mm, pgd_t *pgd, unsigned long address)
 {
@@ -113,11 +137,18 @@ lego_pmd_alloc(struct lego_mm_struct *mm, pud_t *pud, unsigned long address)
 		NULL : lego_pmd_offset(pud, address);
 }
 
+/*
+ * Return the pte of @address, which is safe to change.
+ * Allocate the pte table if there is none, or unshare it if shared.
+ */
 static inline pte_t *
 lego_pte_alloc(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long address)
 {
-	return (unlikely(pmd_none(*pmd) && __lego_pte_alloc(mm, pmd, address))?
-		NULL : lego_pte_offset(pmd, address));
+	if (unlikely(pmd_none(*pmd)) && __lego_pte_alloc(mm, pmd, address))
+		return NULL;
+	if (unlikely(lego_pmd_shared(*pmd)) && __lego_pte_unshare(mm, pmd, address))
+		return NULL;
+	return lego_pte_offset(pmd, address);
 }
 
 static inline pte_t lego_vfn_pte(unsigned long vfn, pgprot_t pgprot)
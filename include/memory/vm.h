@@ -165,6 +165,10 @@ unsigned long vm_mmap_pgoff(struct lego_task_struct *p, struct lego_file *file,
 		unsigned long flag, unsigned long pgoff);
 
 int do_munmap(struct lego_mm_struct *mm, unsigned long start, size_t len);
+int split_vma(struct lego_mm_struct *mm, struct vm_area_struct *vma,
+	      unsigned long addr, int new_below);
+int do_madvise(struct lego_mm_struct *mm, unsigned long start, size_t len,
+	       int behavior, bool zap, unsigned int *flags);
 int do_brk(struct lego_task_struct *p, unsigned long addr,
 	   unsigned long request);
 
@@ -379,6 +383,8 @@ int faultin_page(struct vm_area_struct *vma, unsigned long start,
 
 unsigned long find_page(struct vm_area_struct *vma, unsigned long address);
 
+void lego_mm_update_rss(struct lego_mm_struct *mm);
+
 long get_user_pages(struct lego_task_struct *tsk, unsigned long start,
 		    unsigned long nr_pages, unsigned int gup_flags,
 		    unsigned long *pages, struct vm_area_struct **vmas);
@@ -74,6 +74,8 @@ struct m2mm_status_report {
 	unsigned long totalram;
 	unsigned long freeram;
 	unsigned long nr_request;
+	unsigned long rss_private;	/* pages mapped by one task only */
+	unsigned long rss_shared;	/* pages mapped by more, per task */
 };
 
 /*
@@ -19,6 +19,7 @@ struct file *fdget(int fd);
 
 void free_fd(struct files_struct *files, int fd);
 int alloc_fd(struct files_struct *files, char *filename);
+int alloc_fd_at(struct files_struct *files, int fd, char *filename);
 
 static inline int f_name_equal(char *f_name1, char *f_name2)
 {
@@ -59,6 +60,8 @@ static inline int default_file_open(struct file *f, char *f_name)
 
 void do_close_on_exec(struct files_struct *files);
 
+long pipe_fcntl(struct file *file, unsigned int cmd, unsigned long arg);
+
 /* common llseeks */
 loff_t dev_llseek(struct file *file, loff_t offset, int whence);
 loff_t no_llseek(struct file *file, loff_t offset, int whence);
@@ -614,6 +614,18 @@ int pcache_zap_pte(struct mm_struct *mm, unsigned long address,
 int pcache_move_pte(struct mm_struct *mm, pte_t *old_pte, pte_t *new_pte,
 		    unsigned long old_addr, unsigned long new_addr, spinlock_t *old_ptl);
 
+/*
+ * The process that pcache lines newly mapped into @mm belong to.
+ * Usually the faulting thread's group leader, but a vfork child
+ * maps lines on behalf of the parent whose mm it borrows.
+ */
+#ifdef CONFIG_COMP_PROCESSOR
+static inline struct task_struct *pcache_owner(struct mm_struct *mm)
+{
+	return mm->owner;
+}
+#endif
+
 int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 		    unsigned long address, struct mm_struct *owner_mm,
 		    struct task_struct *owner_process,
@@ -622,6 +634,29 @@ int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 void pcache_remove_rmap(struct pcache_meta *pcm, pte_t *ptep, unsigned long address,
 			struct mm_struct *owner_mm, struct task_struct *owner_process);
 
+/* kmalloc'ed rmaps allocated ahead of time, used by fork() */
+struct pcache_rmap_batch {
+	int			nr;
+	struct pcache_rmap	*rmaps[PTRS_PER_PTE];
+};
+
+int pcache_add_rmap_batch(struct pcache_meta *pcm, pte_t *page_table,
+			  unsigned long address, struct mm_struct *owner_mm,
+			  struct task_struct *owner_process,
+			  enum rmap_caller caller, struct pcache_rmap_batch *batch);
+void pcache_rmap_batch_refill(struct pcache_rmap_batch *batch, int nr);
+void pcache_rmap_batch_release(struct pcache_rmap_batch *batch);
+
+/*
+ * fork() copies pgtable of all VMAs with one batch: rmaps are allocated
+ * per pte table, and the write-protected range of the parent is flushed
+ * from TLB once at the end.
+ */
+struct pcache_copy_batch {
+	unsigned long			flush_start, flush_end;
+	struct pcache_rmap_batch	rmaps;
+};
+
 #ifdef CONFIG_COMP_PROCESSOR
 /* Called when fork() happens, duplicate the pcache */
 int fork_dup_pcache(struct task_struct *dst_task,
@@ -657,7 +692,18 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 			unsigned long flags, fill_func_t fill_func, void *arg,
 			enum rmap_caller caller, enum piggyback_options piggyback);
 
+#ifdef CONFIG_PCACHE_PREFETCH
+unsigned long pcache_prefetch_range(unsigned long start, unsigned long end);
+#else
+static inline unsigned long
+pcache_prefetch_range(unsigned long start, unsigned long end)
+{
+	return 0;
+}
+#endif
+
 #include <processor/pcache_victim.h>
 #include <processor/pcache_evict.h>
+#include <processor/pcache_wss.h>
 
 #endif /* _LEGO_PROCESSOR_PCACHE_H_ */
@@ -41,6 +41,7 @@ enum pcache_event_item {
 	PCACHE_FAULT_WP_REUSE,		/* nr of reused wp faults */
 
 	PCACHE_FAULT_CONCUR_EVICTION,	/* nr of faults due to concurrent eviction */
+	PCACHE_FAULT_CONCUR_FILL,	/* nr of yielded fills that lost the race */
 
 	PCACHE_FAULT_FILL_ZEROFILL,	/* nr of zero fill + async net */
 	PCACHE_FAULT_FILL_FROM_MEMORY,	/* nr of pcache fill from remote memory */
@@ -100,6 +101,8 @@ enum pcache_event_item {
 	PCACHE_MREMAP_PSET_SAME,
 	PCACHE_MREMAP_PSET_DIFF,
 
+	PCACHE_PREFETCH,		/* nr of lines filled by madvise(MADV_WILLNEED) */
+
 	PCACHE_RMAP_ALLOC,
 	PCACHE_RMAP_ALLOC_KMALLOC,
 	PCACHE_RMAP_FREE,
@@ -113,17 +116,21 @@ enum pcache_event_item {
 	NR_PCACHE_EVENT_ITEMS,
 };
 
+/*
+ * Each CPU counts into its own array, which is folded on read.
+ * Thus counting on hot paths never bounces a shared cache line.
+ */
 struct pcache_event_stat {
-	atomic_long_t event[NR_PCACHE_EVENT_ITEMS];
+	unsigned long event[NR_PCACHE_EVENT_ITEMS];
 };
 
-extern struct pcache_event_stat pcache_event_stats;
+DECLARE_PER_CPU(struct pcache_event_stat, pcache_event_stats);
 extern atomic_long_t nr_used_cachelines;
 
 #ifdef CONFIG_COUNTER_PCACHE
 static inline void inc_pcache_event(enum pcache_event_item item)
 {
-	atomic_long_inc(&pcache_event_stats.event[item]);
+	this_cpu_inc(pcache_event_stats.event[item]);
 }
 
 static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit)
@@ -132,10 +139,7 @@ static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit)
 		inc_pcache_event(item);
 }
 
-static inline unsigned long pcache_event(enum pcache_event_item item)
-{
-	return atomic_long_read(&pcache_event_stats.event[item]);
-}
+unsigned long pcache_event(enum pcache_event_item item);
 
 /*
  * pcache set counters
@@ -142,7 +142,15 @@ struct pcache_set {
 	atomic_t		nr_eviction_entries;
 #endif
 
+#ifdef CONFIG_COUNTER_PCACHE
+	/*
+	 * Per-cpu copies of these would cost nr_cachesets lines per cpu.
+	 * They are spread over sets already, and live in their own line,
+	 * thus counting does not bounce the fields above.
+	 */
+	PSET_PADDING(_pad_stat)
 	atomic_t		stat[NR_PSET_STAT_ITEMS];
+#endif
 } ____cacheline_aligned;
 
 static inline void lock_pset(struct pcache_set *pset)
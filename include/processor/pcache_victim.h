@@ -331,6 +331,8 @@ victim_submit_flush_wait(struct pcache_victim_meta *victim, bool dirty)
 }
 
 int victim_flush_sync(void);
+void victim_invalidate_range(struct task_struct *tsk,
+			     unsigned long start, unsigned long end);
 
 static inline void pcache_set_victim_inc(struct pcache_set *pset)
 {
@@ -432,6 +434,9 @@ static __always_inline struct victim_flush_job *steal_victim_flush_job(void)
 #else
 static inline void victim_cache_early_init(void) { }
 static inline void victim_cache_post_init(void) { }
+static inline int victim_flush_sync(void) { return 0; }
+static inline void victim_invalidate_range(struct task_struct *tsk,
+					   unsigned long start, unsigned long end) { }
 #endif /* CONFIG_PCACHE_EVICTION_VICTIM */
 
 #endif /* _LEGO_PROCESSOR_PCACHE_VICTIM_H_ */
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Working set sampling of pcache lines, see pcache/wss.c
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_WSS_H_
+#define _LEGO_PROCESSOR_PCACHE_WSS_H_
+
+struct seq_file;
+
+#ifdef CONFIG_PCACHE_WSS
+void __init alloc_pcache_wss_map(void);
+int __init pcache_wss_init(void);
+int pcache_wss_show(struct seq_file *m);
+#else
+static inline void __init alloc_pcache_wss_map(void) { }
+static inline int pcache_wss_init(void) { return 0; }
+#endif
+
+#endif /* _LEGO_PROCESSOR_PCACHE_WSS_H_ */
@@ -27,11 +27,17 @@ void free_pgd_range(struct mm_struct *mm,
 
 void unmap_page_range(struct mm_struct *mm,
 		      unsigned long addr, unsigned long end);
+void unmap_page_range_writeback(struct task_struct *tsk,
+				unsigned long addr, unsigned long end);
 
 /* Callback for fork() */
+struct pcache_copy_batch;
+void pcache_copy_batch_init(struct pcache_copy_batch *batch);
+void pcache_copy_batch_finish(struct mm_struct *src, struct pcache_copy_batch *batch);
 int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 			   unsigned long addr, unsigned long end,
-			   unsigned long vm_flags, struct task_struct *dst_task);
+			   unsigned long vm_flags, struct task_struct *dst_task,
+			   struct pcache_copy_batch *batch);
 
 void release_pgtable(struct task_struct *tsk,
 		     unsigned long __user start, unsigned long __user end);
@@ -41,4 +47,8 @@ unsigned long move_page_tables(struct task_struct *tsk,
 			       unsigned long __user old_addr,
 			       unsigned long __user new_addr, unsigned long len);
 
+/* Callback for checkpoint */
+long pcache_flush_dirty_range(struct task_struct *tsk,
+			      unsigned long __user start, unsigned long __user end);
+
 #endif /* _LEGO_PROCESSOR_PGTABLE_H_ */
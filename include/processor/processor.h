@@ -43,6 +43,7 @@ static inline int checkpoint_thread(struct task_struct *tsk) { return 0; }
 int do_execve(const char *filename,
 	      const char * const *argv,
 	      const char * const *envp);
+int flush_old_exec(void);
 
 void open_stdio_files(void);
 
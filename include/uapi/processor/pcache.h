@@ -30,4 +30,27 @@ struct pcache_stat {
 	unsigned long	nr_eviction;
 };
 
+/* @cmd of pcache_wss() */
+#define PCACHE_WSS_START	0	/* @arg: interval in msec, 0 for default */
+#define PCACHE_WSS_STOP		1
+#define PCACHE_WSS_RESET	2
+#define PCACHE_WSS_GET		3	/* @arg: tgid, 0 for all */
+
+/* Rounds of history kept for each line */
+#define PCACHE_WSS_NR_ROUNDS	32
+
+struct pcache_wss_stat {
+	unsigned long	nr_rounds;
+	unsigned long	interval_msec;
+
+	/* Sampled lines in pcache */
+	unsigned long	nr_resident;
+
+	/*
+	 * Working set size curve, in lines:
+	 * wss[i] lines are referenced within the last i + 1 rounds.
+	 */
+	unsigned long	wss[PCACHE_WSS_NR_ROUNDS];
+};
+
 #endif /* _LEGO_UAPI_PROCESSOR_PCACHE_H_ */
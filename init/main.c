@@ -128,6 +128,7 @@ static int kernel_init(void *unused)
 	cpu_stop_init();
 
 	init_workqueues();
+	profile_heatmap_late_init();
 
 	/*
 	 * Scan the PCI bus and build core PCI data structures.
@@ -265,12 +265,20 @@ static void complete_vfork_done(struct task_struct *tsk)
 	task_unlock(tsk);
 }
 
+/*
+ * A child that borrows our mm may have pcache lines that belong to us,
+ * thus we can not go away before it is done with the mm, see
+ * clone_borrows_vm(). Such a parent waits with @killable false.
+ */
 static int wait_for_vfork_done(struct task_struct *child,
-				struct completion *vfork)
+				struct completion *vfork, bool killable)
 {
-	int killed;
+	int killed = 0;
 
-	killed = wait_for_completion_killable(vfork);
+	if (killable)
+		killed = wait_for_completion_killable(vfork);
+	else
+		wait_for_completion(vfork);
 
 	if (unlikely(killed)) {
 		/* child was killded by signal */
@@ -340,6 +348,9 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p)
 	mm_init_cpumask(mm);
 	spin_lock_init(&mm->page_table_lock);
 	init_rwsem(&mm->mmap_sem);
+#ifdef CONFIG_COMP_PROCESSOR
+	mm->owner = p;
+#endif
 
 	/*
 	 * pgd_alloc() will duplicate the identity kernel mapping
@@ -741,6 +752,10 @@ struct task_struct *copy_process(unsigned long clone_flags,
 	p->start_time = ktime_get_ns();
 	p->real_start_time = ktime_get_boot_ns();
 	p->pagefault_disabled = 0;
+#ifdef CONFIG_PROFILING_RPC_TRACE
+	p->rpc_trace_serving = 0;
+	p->rpc_trace_stamped = 0;
+#endif
 
 	/*
 	 * Now do the dirty work.
@@ -961,8 +976,14 @@ pid_t do_fork(unsigned long clone_flags,
 		 * This step has to be postponed here after
 		 * we got VMA info from remote memory.
 		 * Walk through page table entries.
+		 *
+		 * A vfork child runs on our page table,
+		 * there is nothing to duplicate.
 		 */
-		ret = fork_dup_pcache(p, p->mm, current->mm, vmainfo);
+		ret = 0;
+		if (!clone_borrows_vm(clone_flags))
+			ret = fork_dup_pcache(p, p->mm, current->mm, vmainfo);
+		kfree(vmainfo);
 		if (ret) {
 			WARN_ON_ONCE(1);
 			return ret;
@@ -983,7 +1004,7 @@ pid_t do_fork(unsigned long clone_flags,
 	wake_up_new_task(p);
 
 	if (clone_flags & CLONE_VFORK)
-		wait_for_vfork_done(p, &vfork);
+		wait_for_vfork_done(p, &vfork, !clone_borrows_vm(clone_flags));
 
 	return p->pid;
 }
@@ -7,7 +7,133 @@
  * (at your option) any later version.
  */
 
+#include <lego/mm.h>
+#include <lego/kernel.h>
 #include <lego/syscalls.h>
+#include <lego/fit_ibapi.h>
+
+#if defined(CONFIG_COMP_PROCESSOR) && !defined(CONFIG_DISTRIBUTED_VMA_PROCESSOR)
+#include <processor/pcache.h>
+#include <processor/pgtable.h>
+#include <processor/processor.h>
+
+#include <asm/tlbflush.h>
+
+/* MADV_WILLNEED is served within the syscall, bound one call */
+#define MADV_WILLNEED_MAX_PAGES	256
+
+static long p2m_madvise(unsigned long start, unsigned long len, int behavior,
+			bool zap, unsigned int *flags)
+{
+	struct p2m_madvise_struct payload;
+	struct p2m_madvise_reply_struct reply;
+	int retlen;
+
+	payload.pid = current->tgid;
+	payload.behavior = behavior;
+	payload.zap = zap;
+	payload.start = start;
+	payload.len = len;
+
+	retlen = net_send_reply_timeout(current_memory_home_node(), P2M_MADVISE,
+			&payload, sizeof(payload), &reply, sizeof(reply),
+			false, DEF_NET_TIMEOUT);
+	if (unlikely(retlen != sizeof(reply)))
+		return -EIO;
+
+	*flags = reply.flags;
+	return reply.ret;
+}
+
+/*
+ * Drop the pcache lines of [@start, @end) without writing them back,
+ * then ask memory to free the pages. Memory keeps the pages of MAP_SHARED
+ * mappings, so their dirty lines are written back as they are zapped.
+ *
+ * Lines are dropped first. Otherwise a dirty one written back after
+ * memory freed the page would bring the old data back.
+ */
+static long madvise_dontneed(unsigned long start, unsigned long end,
+			     int behavior)
+{
+	struct mm_struct *mm = current->mm;
+	unsigned int flags;
+	long ret;
+
+	ret = p2m_madvise(start, end - start, behavior, false, &flags);
+	if (ret && ret != -ENOMEM)
+		return ret;
+
+	if (flags & P2M_MADVISE_SHARED)
+		unmap_page_range_writeback(current, start, end);
+	else
+		unmap_page_range(mm, start, end);
+	flush_tlb_mm_range(mm, start, end);
+
+	/* Lines evicted earlier may still be in victim cache */
+	victim_flush_sync();
+	victim_invalidate_range(pcache_owner(mm), start, end);
+
+	return p2m_madvise(start, end - start, behavior, true, &flags);
+}
+
+static long madvise_willneed(unsigned long start, unsigned long end)
+{
+	unsigned int flags;
+	long ret;
+
+	end = min(end, start + MADV_WILLNEED_MAX_PAGES * PAGE_SIZE);
+
+	/* Let memory read file pages from storage first */
+	ret = p2m_madvise(start, end - start, MADV_WILLNEED, false, &flags);
+	if (ret && ret != -ENOMEM)
+		return ret;
+
+	pcache_prefetch_range(start, end);
+	return ret;
+}
+
+static long do_madvise(unsigned long start, unsigned long end, int behavior)
+{
+	unsigned int flags;
+
+	switch (behavior) {
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		return madvise_dontneed(start, end, behavior);
+	case MADV_WILLNEED:
+		return madvise_willneed(start, end);
+	default:
+		return p2m_madvise(start, end - start, behavior, false, &flags);
+	}
+}
+#endif
+
+static bool madvise_behavior_valid(int behavior)
+{
+	switch (behavior) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+	case MADV_DONTNEED:
+	case MADV_FREE:
+	case MADV_REMOVE:
+	case MADV_DONTFORK:
+	case MADV_DOFORK:
+	case MADV_MERGEABLE:
+	case MADV_UNMERGEABLE:
+	case MADV_HUGEPAGE:
+	case MADV_NOHUGEPAGE:
+	case MADV_DONTDUMP:
+	case MADV_DODUMP:
+	case MADV_HWPOISON:
+	case MADV_SOFT_OFFLINE:
+		return true;
+	default:
+		return false;
+	}
+}
 
 /*
  * The madvise(2) system call.
@@ -67,7 +193,51 @@
  */
 SYSCALL_DEFINE3(madvise, unsigned long, start, size_t, len_in, int, behavior)
 {
+	unsigned long end;
+	size_t len;
+
 	syscall_enter("start: %#lx, len_in: %#lx, behavior: %d\n",
 		start, len_in, behavior);
+
+	if (!madvise_behavior_valid(behavior))
+		return -EINVAL;
+
+	if (offset_in_page(start))
+		return -EINVAL;
+
+	len = PAGE_ALIGN(len_in);
+
+	/* Check to see whether len was rounded up from small -ve to zero */
+	if (len_in && !len)
+		return -EINVAL;
+
+	end = start + len;
+	if (end < start)
+		return -EINVAL;
+
+	if (end == start)
+		return 0;
+
+	/*
+	 * Only the advice below is served, the rest is disregarded,
+	 * same as before. With DISTRIBUTED_VMA, vmas are spread over
+	 * memory nodes, all of it is disregarded.
+	 */
+	switch (behavior) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		break;
+	default:
+		return 0;
+	}
+
+#if defined(CONFIG_COMP_PROCESSOR) && !defined(CONFIG_DISTRIBUTED_VMA_PROCESSOR)
+	return do_madvise(start, end, behavior);
+#else
 	return 0;
+#endif
 }
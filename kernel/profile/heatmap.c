@@ -8,10 +8,17 @@
  */
 
 #include <lego/bug.h>
+#include <lego/slab.h>
+#include <lego/time.h>
+#include <lego/timer.h>
 #include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/percpu.h>
 #include <lego/profile.h>
+#include <lego/kthread.h>
 #include <lego/cpumask.h>
 #include <lego/kallsyms.h>
+#include <lego/sections.h>
 #include <asm/irq_regs.h>
 
 /*
@@ -19,59 +26,276 @@
  * on each timer interrupt, we check and interrupted IP address,
  * and increment its counter.
  *
- * This version use one global counter array, so it will affect runtime
- * performance a lot in a SMP system. Use with caution.
+ * Each CPU has its own counter array, which is only touched by its own
+ * timer interrupt, thus no atomic ops. They are merged when read.
+ *
+ * Functions are 16-byte aligned, thus a shift of 4 still tells them
+ * apart, while keeping the per-cpu arrays small.
  */
 
-struct profile_hit {
-	u32 pc, hits;
-};
-
-#define default_prof_shift	2
+#define default_prof_shift	4
 
-static atomic_t *prof_buffer;
+static DEFINE_PER_CPU(u32 *, prof_cpu_buffer);
 static unsigned long prof_buffer_bytes;
 static unsigned long prof_len, prof_shift;
 
 int prof_on __read_mostly;
 
+#ifdef CONFIG_PROFILING_HEATMAP_STACKS
+/*
+ * Stack samples
+ *
+ * Each CPU pushes samples into its own ring from timer interrupt, and
+ * the stream thread pops them. Single producer and single consumer,
+ * thus no locks either.
+ */
+
+#define PROFILE_STACK_DEPTH	16
+#define NR_PROFILE_SAMPLES	CONFIG_PROFILING_HEATMAP_NR_SAMPLES
+
+struct profile_sample {
+	char		comm[TASK_COMM_LEN];
+	unsigned int	user;			/* ip[0] is a user IP */
+	unsigned int	nr;
+	unsigned long	ip[PROFILE_STACK_DEPTH];	/* innermost first */
+};
+
+struct profile_sample_ring {
+	unsigned long		head;		/* producer */
+	unsigned long		tail;		/* consumer */
+	unsigned long		dropped;
+	struct profile_sample	*samples;
+};
+
+static DEFINE_PER_CPU(struct profile_sample_ring, profile_sample_rings);
+static DEFINE_PER_CPU(unsigned long, reported_dropped);
+
+/*
+ * Walk the frame pointers of the interrupted kernel context.
+ * Stop once a frame leaves the task stack, e.g., on an irq stack.
+ */
+static unsigned int profile_walk_stack(struct pt_regs *regs, unsigned long *ip)
+{
+	unsigned int nr = 0;
+#ifdef CONFIG_FRAME_POINTER
+	unsigned long stack = (unsigned long)task_stack_page(current);
+	unsigned long *bp = (unsigned long *)regs->bp;
+	unsigned long *next;
+#endif
+
+	ip[nr++] = GET_IP(regs);
+
+#ifdef CONFIG_FRAME_POINTER
+	while (nr < PROFILE_STACK_DEPTH) {
+		if ((unsigned long)bp < stack ||
+		    (unsigned long)(bp + 2) > stack + THREAD_SIZE)
+			break;
+		if (!__kernel_text_address(bp[1]))
+			break;
+		ip[nr++] = bp[1];
+
+		/* Frames only go up */
+		next = (unsigned long *)bp[0];
+		if (next <= bp)
+			break;
+		bp = next;
+	}
+#endif
+	return nr;
+}
+
+static void profile_sample(struct pt_regs *regs)
+{
+	struct profile_sample_ring *ring = this_cpu_ptr(&profile_sample_rings);
+	struct profile_sample *sample;
+	unsigned long head = ring->head;
+
+	if (!ring->samples)
+		return;
+
+	if (head - READ_ONCE(ring->tail) >= NR_PROFILE_SAMPLES) {
+		ring->dropped++;
+		return;
+	}
+
+	sample = &ring->samples[head & (NR_PROFILE_SAMPLES - 1)];
+	memcpy(sample->comm, current->comm, TASK_COMM_LEN);
+	if (user_mode(regs)) {
+		sample->user = 1;
+		sample->nr = 1;
+		sample->ip[0] = GET_IP(regs);
+	} else {
+		sample->user = 0;
+		sample->nr = profile_walk_stack(regs, sample->ip);
+	}
+
+	/* Publish the sample before head */
+	smp_wmb();
+	WRITE_ONCE(ring->head, head + 1);
+}
+
+static int profile_sample_cmp(const void *a, const void *b)
+{
+	const struct profile_sample *sa = *(const struct profile_sample **)a;
+	const struct profile_sample *sb = *(const struct profile_sample **)b;
+	int ret;
+
+	ret = strncmp(sa->comm, sb->comm, TASK_COMM_LEN);
+	if (ret)
+		return ret;
+	if (sa->user != sb->user)
+		return sa->user < sb->user ? -1 : 1;
+	if (sa->nr != sb->nr)
+		return sa->nr < sb->nr ? -1 : 1;
+	return memcmp(sa->ip, sb->ip, sa->nr * sizeof(sa->ip[0]));
+}
+
+static void print_profile_sample(struct profile_sample *sample, int count)
+{
+	char line[512];
+	int i, len;
+
+	len = scnprintf(line, sizeof(line), "%.*s", TASK_COMM_LEN, sample->comm);
+	if (sample->user) {
+		len += scnprintf(line + len, sizeof(line) - len,
+				 ";[user];%#lx", sample->ip[0]);
+	} else {
+		for (i = sample->nr - 1; i >= 0; i--)
+			len += scnprintf(line + len, sizeof(line) - len,
+					 ";%pf", (void *)sample->ip[i]);
+	}
+	pr_info("profile_stack: %s %d\n", line, count);
+}
+
+/*
+ * Pop what @cpu has pushed since last time, print them as folded stacks.
+ * @sorted has room for a full ring.
+ */
+static void profile_stream_cpu(int cpu, struct profile_sample **sorted)
+{
+	struct profile_sample_ring *ring = per_cpu_ptr(&profile_sample_rings, cpu);
+	unsigned long head, tail, dropped, n, i, start;
+
+	head = READ_ONCE(ring->head);
+	tail = ring->tail;
+	smp_rmb();
+
+	n = head - tail;
+	for (i = 0; i < n; i++)
+		sorted[i] = &ring->samples[(tail + i) & (NR_PROFILE_SAMPLES - 1)];
+	sort(sorted, n, sizeof(*sorted), profile_sample_cmp, NULL);
+
+	for (start = 0, i = 1; i <= n; i++) {
+		if (i < n && !profile_sample_cmp(&sorted[start], &sorted[i]))
+			continue;
+		print_profile_sample(sorted[start], i - start);
+		start = i;
+	}
+
+	/* Done reading before producer reuses them */
+	smp_mb();
+	WRITE_ONCE(ring->tail, head);
+
+	dropped = READ_ONCE(ring->dropped);
+	if (dropped != per_cpu(reported_dropped, cpu)) {
+		pr_info("profile_stack: CPU%d dropped %lu samples\n",
+			cpu, dropped - per_cpu(reported_dropped, cpu));
+		per_cpu(reported_dropped, cpu) = dropped;
+	}
+}
+
+static int profile_stream_func(void *unused)
+{
+	struct profile_sample **sorted;
+	int cpu;
+
+	sorted = kmalloc(NR_PROFILE_SAMPLES * sizeof(*sorted), GFP_KERNEL);
+	if (!sorted)
+		return -ENOMEM;
+
+	while (1) {
+		msleep(CONFIG_PROFILING_HEATMAP_STREAM_INTERVAL * MSEC_PER_SEC);
+		for_each_possible_cpu(cpu)
+			profile_stream_cpu(cpu, sorted);
+	}
+	return 0;
+}
+
+static int profile_sample_init(void)
+{
+	struct profile_sample *samples;
+	int cpu;
+
+	BUILD_BUG_ON(NR_PROFILE_SAMPLES & (NR_PROFILE_SAMPLES - 1));
+
+	for_each_possible_cpu(cpu) {
+		samples = kzalloc(NR_PROFILE_SAMPLES * sizeof(*samples), GFP_KERNEL);
+		if (!samples)
+			return -ENOMEM;
+		per_cpu(profile_sample_rings, cpu).samples = samples;
+	}
+	return 0;
+}
+
+/* Kthreads are not available at profile_heatmap_init() */
+void __init profile_heatmap_late_init(void)
+{
+	struct task_struct *p;
+
+	if (!prof_on)
+		return;
+
+	p = kthread_run(profile_stream_func, NULL, "profile_stream");
+	if (IS_ERR(p))
+		pr_err("heatmap: fail to create stream thread\n");
+}
+#else
+static inline void profile_sample(struct pt_regs *regs) { }
+static inline int profile_sample_init(void)
+{
+	return 0;
+}
+#endif /* CONFIG_PROFILING_HEATMAP_STACKS */
+
 int profile_heatmap_init(void)
 {
-	prof_on = CPU_PROFILING;
+	u32 *buf;
+	int cpu;
+
 	prof_shift = default_prof_shift;
 
 	/* only text is profiled */
 	prof_len = (__etext - __stext) >> prof_shift;
-	prof_buffer_bytes = prof_len * sizeof(atomic_t);
+	prof_buffer_bytes = prof_len * sizeof(u32);
+
+	for_each_possible_cpu(cpu) {
+		buf = kzalloc(prof_buffer_bytes, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		per_cpu(prof_cpu_buffer, cpu) = buf;
+	}
 
-	prof_buffer = kzalloc(prof_buffer_bytes, GFP_KERNEL);
-	if (!prof_buffer)
+	if (profile_sample_init())
 		return -ENOMEM;
 
-	pr_info("Kernel cpu_profiling enabled (shift: %ld, buffer_bytes: %lu)\n",
+	prof_on = CPU_PROFILING;
+	pr_info("Kernel cpu_profiling enabled (shift: %ld, buffer_bytes: %lu per cpu)\n",
 		prof_shift, prof_buffer_bytes);
 
 	return 0;
 }
 
-#if 1
-/* non-SMP version */
-#define profile_flip_buffers()		do { } while (0)
-#define profile_discard_flip_buffers()	do { } while (0)
-
-static void do_profile_hits(int type, void *__pc, unsigned int nr_hits)
+/* Called from timer interrupt only, thus the plain increment */
+void profile_hits(int type, void *__pc, unsigned int nr_hits)
 {
+	u32 *buf = this_cpu_read(prof_cpu_buffer);
 	unsigned long pc;
-	pc = ((unsigned long)__pc - (unsigned long)__stext) >> prof_shift;
-	atomic_add(nr_hits, &prof_buffer[min(pc, prof_len - 1)]);
-}
-#endif
 
-void profile_hits(int type, void *__pc, unsigned int nr_hits)
-{
-	if (!prof_buffer)
+	if (!buf)
 		return;
-	do_profile_hits(type, __pc, nr_hits);
+
+	pc = ((unsigned long)__pc - (unsigned long)__stext) >> prof_shift;
+	buf[min(pc, prof_len - 1)] += nr_hits;
 }
 
 void profile_tick(int type)
@@ -80,6 +304,9 @@ void profile_tick(int type)
 
 	if (!user_mode(regs))
 		profile_hit(type, (void *)GET_IP(regs));
+
+	if (prof_on == type)
+		profile_sample(regs);
 }
 
 struct readprofile {
@@ -102,20 +329,24 @@ static int readprofile_sort(const void *a, const void *b)
  */
 void print_profile_heatmap_nr(int nr)
 {
-	atomic_t *buf;
+	u32 *buf, *cpu_buf;
 	struct readprofile *profile, *p;
 	unsigned long sym_start, addr_prof;
-	int i, idx_counter, idx_profile;
+	int i, cpu, idx_counter, idx_profile;
 	s64 total_nr = 0;
 
-	if (!prof_buffer || !prof_on)
+	if (!prof_on)
 		return;
 
-	/* Copy counters */
-	buf = kmalloc(prof_buffer_bytes, GFP_KERNEL);
+	/* Merge per-cpu counters */
+	buf = kzalloc(prof_buffer_bytes, GFP_KERNEL);
 	if (!buf)
 		return;
-	memcpy(buf, prof_buffer, prof_buffer_bytes);
+	for_each_possible_cpu(cpu) {
+		cpu_buf = per_cpu(prof_cpu_buffer, cpu);
+		for (idx_counter = 0; idx_counter < prof_len; idx_counter++)
+			buf[idx_counter] += READ_ONCE(cpu_buf[idx_counter]);
+	}
 
 	profile = kzalloc(sizeof(*profile) * prof_len, GFP_KERNEL);
 	if (!profile) {
@@ -125,7 +356,7 @@ void print_profile_heatmap_nr(int nr)
 
 	/* Aggregate counters by symbols */
 	for (idx_counter = 0; idx_counter < prof_len; idx_counter++) {
-		if (!atomic_read(&buf[idx_counter]))
+		if (!buf[idx_counter])
 			continue;
 
 		addr_prof = (idx_counter << prof_shift) + (unsigned long)__stext;
@@ -139,8 +370,8 @@ void print_profile_heatmap_nr(int nr)
 		idx_profile = (sym_start - (unsigned long)__stext) >> prof_shift;
 		p = &profile[idx_profile];
 
-		p->nr += atomic_read(&buf[idx_counter]);
-		total_nr += atomic_read(&buf[idx_counter]);
+		p->nr += buf[idx_counter];
+		total_nr += buf[idx_counter];
 
 		/*
 		 * If merge does happen, merge the high address one
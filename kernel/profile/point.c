@@ -9,33 +9,86 @@
 
 #include <lego/bug.h>
 #include <lego/kernel.h>
-#include <lego/atomic.h>
+#include <lego/string.h>
+#include <lego/cpumask.h>
 #include <lego/profile.h>
+#include <lego/uaccess.h>
+#include <lego/syscalls.h>
 
 /* Profile Point */
 extern struct profile_point __sprofilepoint[], __eprofilepoint[];
 
+/* Largest value that falls into bucket @idx */
+static unsigned long pp_hist_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < PP_HIST_SUB)
+		return idx;
+
+	shift = idx / PP_HIST_SUB - 1;
+	return ((PP_HIST_SUB + idx % PP_HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Walk the buckets summed across CPUs, and fill @pct with the bucket
+ * where the cumulative count reaches each of @permil (per mille). This does not
+ * need a folded copy of the histogram, which is too large for stack.
+ */
+static void pp_hist_percentiles(struct profile_point *pp, unsigned long nr,
+				const unsigned long *permil, unsigned long *pct,
+				int nr_pct)
+{
+	unsigned long sum = 0;
+	unsigned int idx;
+	int cpu, i = 0;
+
+	for (idx = 0; idx < PP_HIST_NR_BUCKETS && i < nr_pct; idx++) {
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(pp->cpu, cpu)->hist[idx];
+
+		while (i < nr_pct && sum * 1000 >= nr * permil[i])
+			pct[i++] = pp_hist_bucket_max(idx);
+	}
+
+	/* Counters moved while we walk */
+	while (i < nr_pct)
+		pct[i++] = pp_hist_bucket_max(PP_HIST_NR_BUCKETS - 1);
+}
+
 void print_profile_point(struct profile_point *pp)
 {
+	static const unsigned long permil[] = { 500, 990, 999 };
+	unsigned long pct[ARRAY_SIZE(permil)] = { 0 };
 	struct timespec ts = {0, 0};
-	long nr = 0, avg_ns = 0, time_ns = 0;
+	unsigned long nr = 0, avg_ns = 0, time_ns = 0, max_ns = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct profile_point_cpu *ppc = per_cpu_ptr(pp->cpu, cpu);
 
-	nr = atomic_long_read(&pp->nr);
-	time_ns = atomic_long_read(&pp->time_ns);
+		nr += ppc->nr;
+		time_ns += ppc->time_ns;
+		max_ns = max(max_ns, ppc->max_ns);
+	}
 	ts = ns_to_timespec(time_ns);
 
 	if (!nr)
 		goto print;
 
 	avg_ns = DIV_ROUND_UP(time_ns, nr);
+	pp_hist_percentiles(pp, nr, permil, pct, ARRAY_SIZE(permil));
+
+	/* A bucket is wider than the largest value in it */
+	for (i = 0; i < ARRAY_SIZE(pct); i++)
+		pct[i] = min(pct[i], max_ns);
 
 print:
-	pr_info("%s  %35s  %6Ld.%09Ld  %16ld  %16ld\n",
+	pr_info("%s  %35s  %6Ld.%09Ld  %12lu  %10lu  %10lu  %10lu  %10lu  %10lu\n",
 		pp->enabled? "     on" : "    off",
 		pp->pp_name,
 		(s64)ts.tv_sec, (s64)ts.tv_nsec,
-		nr,
-		avg_ns);
+		nr, avg_ns, pct[0], pct[1], pct[2], max_ns);
 }
 
 void print_profile_points(void)
@@ -45,12 +98,91 @@ void print_profile_points(void)
 
 	pr_info("\n");
 	pr_info("Kernel Profile Points\n");
-	pr_info(" Status                                 Name          Total(s)                NR           Avg(ns)\n");
-	pr_info("-------  -----------------------------------  ----------------  ----------------  ----------------\n");
+	pr_info(" Status                                 Name          Total(s)            NR     Avg(ns)     p50(ns)     p99(ns)    p999(ns)     Max(ns)\n");
+	pr_info("-------  -----------------------------------  ----------------  ------------  ----------  ----------  ----------  ----------  ----------\n");
 	for (pp = __sprofilepoint; pp < __eprofilepoint; pp++) {
 		print_profile_point(pp);
 		count++;
 	}
-	pr_info("-------  -----------------------------------  ----------------  ----------------  ----------------\n");
+	pr_info("-------  -----------------------------------  ----------------  ------------  ----------  ----------  ----------  ----------  ----------\n");
 	pr_info("\n");
 }
+
+/*
+ * Updates from other CPUs that race with us may survive,
+ * which does not matter for a profile.
+ */
+void reset_profile_point(struct profile_point *pp)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(pp->cpu, cpu), 0, sizeof(struct profile_point_cpu));
+}
+
+struct profile_point *find_profile_point(const char *name)
+{
+	struct profile_point *pp;
+
+	for (pp = __sprofilepoint; pp < __eprofilepoint; pp++) {
+		if (!strncmp(pp->pp_name, name, sizeof(pp->pp_name)))
+			return pp;
+	}
+	return NULL;
+}
+
+static void profile_point_ctl(struct profile_point *pp, int cmd)
+{
+	switch (cmd) {
+	case PP_CMD_ENABLE:
+		WRITE_ONCE(pp->enabled, true);
+		break;
+	case PP_CMD_DISABLE:
+		WRITE_ONCE(pp->enabled, false);
+		break;
+	case PP_CMD_RESET:
+		reset_profile_point(pp);
+		break;
+	}
+}
+
+/*
+ * Apply @cmd to the profile point named @name,
+ * or to all of them if @name is NULL.
+ */
+SYSCALL_DEFINE2(profile_point, int, cmd, const char __user *, name)
+{
+	struct profile_point *pp;
+	char kname[sizeof(pp->pp_name)];
+	long len;
+
+	if (cmd < PP_CMD_ENABLE || cmd > PP_CMD_PRINT)
+		return -EINVAL;
+
+	if (!name) {
+		if (cmd == PP_CMD_PRINT) {
+			print_profile_points();
+			return 0;
+		}
+
+		for (pp = __sprofilepoint; pp < __eprofilepoint; pp++)
+			profile_point_ctl(pp, cmd);
+		return 0;
+	}
+
+	len = strncpy_from_user(kname, name, sizeof(kname));
+	if (len < 0)
+		return len;
+	if (len == sizeof(kname))
+		return -ENAMETOOLONG;
+
+	pp = find_profile_point(kname);
+	if (!pp)
+		return -ENOENT;
+
+	if (cmd == PP_CMD_PRINT)
+		print_profile_point(pp);
+	else
+		profile_point_ctl(pp, cmd);
+	return 0;
+}
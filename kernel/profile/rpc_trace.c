@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Cross-node RPC tracing
+ *
+ * A trace ID is allocated when processor fills a common_header, and
+ * carried to memory in the header. While memory handles the request,
+ * the RPCs it sends, including the bare storage ones, are recorded with
+ * the same ID. The records are dumped into kernel log, and stitched by
+ * scripts/rpc_trace.py.
+ *
+ * Records are written by local CPU only, thus no locks. Not to be used
+ * in interrupt context.
+ */
+
+#include <lego/smp.h>
+#include <lego/sched.h>
+#include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/percpu.h>
+#include <lego/kthread.h>
+#include <lego/cpumask.h>
+#include <lego/syscalls.h>
+#include <lego/rpc_trace.h>
+#include <lego/comp_common.h>
+
+#ifdef CONFIG_COMP_PROCESSOR
+#include <processor/node.h>
+#endif
+
+#ifdef CONFIG_COMP_MEMORY
+#include <memory/thread_pool.h>
+#endif
+
+#define NR_RPC_TRACE_RECORDS	CONFIG_PROFILING_RPC_TRACE_NR_RECORDS
+
+struct rpc_trace_ring {
+	unsigned long		head;
+	struct rpc_trace_record	records[NR_RPC_TRACE_RECORDS];
+};
+
+static DEFINE_PER_CPU(struct rpc_trace_ring, rpc_trace_rings);
+static DEFINE_PER_CPU(unsigned int, rpc_trace_seq);
+
+/* Off until the rpc_trace syscall asks for it */
+bool rpc_trace_enabled __read_mostly;
+
+void __rpc_trace_record(unsigned int event, unsigned int trace_id,
+			unsigned int opcode, unsigned int peer)
+{
+	struct rpc_trace_ring *ring;
+	struct rpc_trace_record *r;
+
+	preempt_disable();
+	ring = this_cpu_ptr(&rpc_trace_rings);
+	r = &ring->records[ring->head++ & (NR_RPC_TRACE_RECORDS - 1)];
+	r->ts_ns = sched_clock();
+	r->trace_id = trace_id;
+	r->opcode = opcode;
+	r->event = event;
+	r->peer = peer;
+	preempt_enable();
+}
+
+/*
+ * [31:24] node, [23:16] cpu, [15:0] per-cpu sequence.
+ * Unique within the window of the rings, which is all we need.
+ */
+static unsigned int rpc_trace_new_id(void)
+{
+	unsigned int seq, cpu;
+
+	preempt_disable();
+	cpu = smp_processor_id();
+	do {
+		seq = __this_cpu_inc_return(rpc_trace_seq) & 0xffff;
+	} while (!seq);
+	preempt_enable();
+
+	return (LEGO_LOCAL_NID & 0xff) << 24 | (cpu & 0xff) << 16 | seq;
+}
+
+/* Called by fill_common_header() */
+unsigned int rpc_trace_stamp(void)
+{
+	unsigned int id;
+
+	if (!rpc_trace_enabled)
+		return 0;
+
+	id = current->rpc_trace_serving;
+	if (!id)
+		id = rpc_trace_new_id();
+	current->rpc_trace_stamped = id;
+	return id;
+}
+
+unsigned int __rpc_trace_send(void *msg, int target_node, bool noreply)
+{
+	unsigned int id;
+
+	/*
+	 * Use the one put into the header if any. Otherwise it is a bare
+	 * storage message, which has no room for the ID.
+	 */
+	id = current->rpc_trace_stamped;
+	if (!id)
+		id = current->rpc_trace_serving;
+	if (!id)
+		id = rpc_trace_new_id();
+	current->rpc_trace_stamped = 0;
+
+	__rpc_trace_record(noreply ? RPC_TRACE_SEND_NOREPLY : RPC_TRACE_SEND,
+			   id, *(u32 *)msg, target_node);
+	return id;
+}
+
+/* Set by memory thpool worker while handling a request */
+void rpc_trace_serve(unsigned int trace_id)
+{
+	current->rpc_trace_serving = trace_id;
+}
+
+static void rpc_trace_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&rpc_trace_rings, cpu), 0,
+		       sizeof(struct rpc_trace_ring));
+}
+
+/*
+ * Print the records oldest first, one line each:
+ *	rpc_trace: <nid> <cpu> <ts_ns> <event> <trace_id> <opcode> <peer>
+ * Tracing should be disabled, otherwise we may print torn records.
+ */
+void rpc_trace_dump(void)
+{
+	struct rpc_trace_ring *ring;
+	struct rpc_trace_record *r;
+	unsigned long i, start;
+	int cpu;
+
+	BUILD_BUG_ON(NR_RPC_TRACE_RECORDS & (NR_RPC_TRACE_RECORDS - 1));
+
+	pr_info("rpc_trace: begin nid=%u\n", LEGO_LOCAL_NID);
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&rpc_trace_rings, cpu);
+
+		start = 0;
+		if (ring->head > NR_RPC_TRACE_RECORDS)
+			start = ring->head - NR_RPC_TRACE_RECORDS;
+
+		for (i = start; i < ring->head; i++) {
+			r = &ring->records[i & (NR_RPC_TRACE_RECORDS - 1)];
+			pr_info("rpc_trace: %u %d %Lu %u %x %x %u\n",
+				LEGO_LOCAL_NID, cpu, r->ts_ns, r->event,
+				r->trace_id, r->opcode, r->peer);
+		}
+	}
+	pr_info("rpc_trace: end nid=%u\n", LEGO_LOCAL_NID);
+}
+
+int rpc_trace_ctl(unsigned int cmd)
+{
+	switch (cmd) {
+	case RPC_TRACE_CMD_ENABLE:
+		WRITE_ONCE(rpc_trace_enabled, true);
+		break;
+	case RPC_TRACE_CMD_DISABLE:
+		WRITE_ONCE(rpc_trace_enabled, false);
+		break;
+	case RPC_TRACE_CMD_RESET:
+		rpc_trace_reset();
+		break;
+	case RPC_TRACE_CMD_DUMP:
+		WRITE_ONCE(rpc_trace_enabled, false);
+		rpc_trace_dump();
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+#ifdef CONFIG_COMP_PROCESSOR
+/*
+ * Apply @cmd to this processor and its home memory node.
+ * The two dump into their own kernel log.
+ */
+SYSCALL_DEFINE1(rpc_trace, unsigned int, cmd)
+{
+	int ret, retval, retlen;
+
+	ret = rpc_trace_ctl(cmd);
+	if (ret)
+		return ret;
+
+	retlen = net_send_reply_timeout(current_memory_home_node(), P2M_RPC_TRACE,
+					&cmd, sizeof(cmd), &retval, sizeof(retval),
+					false, DEF_NET_TIMEOUT);
+	if (unlikely(retlen != sizeof(retval)))
+		return -EIO;
+	return retval;
+}
+#endif
+
+#ifdef CONFIG_COMP_MEMORY
+static int rpc_trace_dump_func(void *unused)
+{
+	rpc_trace_dump();
+	return 0;
+}
+
+/*
+ * Dumping takes long, do it in background,
+ * so that the processor does not time out.
+ */
+void handle_p2m_rpc_trace(struct p2m_rpc_trace_msg *payload,
+			  struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct task_struct *p;
+	int *retval;
+
+	retval = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*retval));
+
+	if (payload->cmd != RPC_TRACE_CMD_DUMP) {
+		*retval = rpc_trace_ctl(payload->cmd);
+		return;
+	}
+
+	rpc_trace_ctl(RPC_TRACE_CMD_DISABLE);
+	p = kthread_run(rpc_trace_dump_func, NULL, "rpc_trace_dump");
+	*retval = IS_ERR(p) ? PTR_ERR(p) : 0;
+}
+#endif
@@ -77,6 +77,15 @@ unsigned long nr_running(void)
 	return sum;
 }
 
+/*
+ * Check if only the current task is running on the CPU.
+ * The answer may be stale as soon as it returns, it is a hint only.
+ */
+bool single_task_running(void)
+{
+	return raw_rq()->nr_running == 1;
+}
+
 unsigned long nr_iowait(void)
 {
 	unsigned long i, sum = 0;
@@ -548,6 +557,11 @@ void set_task_cpu(struct task_struct *p, unsigned int new_cpu)
 	WARN_ON_ONCE(p->state != TASK_RUNNING && p->state != TASK_WAKING &&
 			!p->on_rq);
 
+	if (task_cpu(p) != new_cpu) {
+		if (p->sched_class->migrate_task_rq)
+			p->sched_class->migrate_task_rq(p);
+	}
+
 	__set_task_cpu(p, new_cpu);
 }
 
@@ -1143,6 +1157,8 @@ void scheduler_tick(void)
 	update_rq_clock(rq);
 	curr->sched_class->task_tick(rq, curr, 0);
 	spin_unlock(&rq->lock);
+
+	trigger_load_balance(rq);
 }
 
 /*
@@ -1946,6 +1962,7 @@ void __init sched_init(void)
 #ifdef CONFIG_SMP
 		rq->cpu = i;
 		rq->online = 0;
+		rq->next_balance = jiffies;
 #endif
 	}
 
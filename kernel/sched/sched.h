@@ -160,6 +160,9 @@ struct rq {
 	int			cpu;
 	int			online;
 	struct llist_head	wake_list;
+
+	/* jiffies of next periodic load balance */
+	unsigned long		next_balance;
 #endif
 };
 
@@ -176,6 +179,7 @@ DECLARE_PER_CPU_SHARED_ALIGNED(struct rq, runqueues);
 
 #define cpu_rq(cpu)		(&per_cpu(runqueues, (cpu)))
 #define this_rq()		this_cpu_ptr(&runqueues)
+#define raw_rq()		raw_cpu_ptr(&runqueues)
 #define task_rq(p)		cpu_rq(task_cpu(p))
 #define cpu_curr(cpu)		(cpu_rq(cpu)->curr)
 
@@ -362,10 +366,19 @@ extern unsigned int sysctl_sched_latency;
 extern unsigned int sysctl_sched_min_granularity;
 extern unsigned int sysctl_sched_child_runs_first;
 extern unsigned int sysctl_sched_wakeup_granularity;
+extern unsigned int sysctl_sched_migration_cost;
+extern unsigned int sysctl_sched_nr_migrate;
+extern unsigned int sysctl_sched_balance_interval;
 
 void update_rq_clock(struct rq *rq);
 void check_preempt_curr(struct rq *rq, struct task_struct *p, int flags);
 void resched_curr(struct rq *rq);
 int try_to_wake_up(struct task_struct *p, unsigned int state, int wake_flags);
 
+#ifdef CONFIG_SMP
+void trigger_load_balance(struct rq *rq);
+#else
+static inline void trigger_load_balance(struct rq *rq) { }
+#endif
+
 #endif /* _KERNEL_SCHED_SCHED_H_ */
@@ -8,6 +8,10 @@
  */
 
 #include <lego/sched.h>
+#include <lego/jiffies.h>
+#include <lego/cpumask.h>
+#include <asm/numa.h>
+
 #include "sched.h"
 
 /*
@@ -54,6 +58,30 @@ unsigned int sysctl_sched_child_runs_first __read_mostly;
 unsigned int sysctl_sched_wakeup_granularity = 1000000UL;
 unsigned int normalized_sysctl_sched_wakeup_granularity = 1000000UL;
 
+/*
+ * A task that ran within this long is considered cache hot,
+ * periodic balancing leaves it alone. (units: nanoseconds)
+ */
+unsigned int sysctl_sched_migration_cost = 500000UL;
+
+/* Max number of tasks moved by one load balance */
+unsigned int sysctl_sched_nr_migrate = 8;
+
+/*
+ * Interval of periodic load balance of busy CPUs.
+ * Idle CPUs balance at every tick. (units: milliseconds)
+ */
+unsigned int sysctl_sched_balance_interval = 32;
+
+#ifdef CONFIG_SMP
+static int idle_balance(struct rq *this_rq);
+#else
+static inline int idle_balance(struct rq *this_rq)
+{
+	return 0;
+}
+#endif
+
 static inline void update_load_add(struct load_weight *lw, unsigned long inc)
 {
 	lw->weight += inc;
@@ -680,9 +708,11 @@ pick_next_task_fair(struct rq *rq, struct task_struct *prev)
 	struct sched_entity *se = &prev->se;
 	struct cfs_rq *cfs_rq = cfs_rq_of(se);
 	struct task_struct *p;
+	int new_tasks;
 
+again:
 	if (!cfs_rq->nr_running)
-		return NULL;
+		goto idle;
 
 	put_prev_task(rq, prev);
 
@@ -691,6 +721,19 @@ pick_next_task_fair(struct rq *rq, struct task_struct *prev)
 
 	p = task_of(se);
 	return p;
+
+idle:
+	new_tasks = idle_balance(rq);
+
+	/*
+	 * rq->lock may be dropped by idle_balance(),
+	 * tasks of higher class may have been woken up.
+	 */
+	if (rq->nr_running != rq->cfs.nr_running)
+		return RETRY_TASK;
+	if (new_tasks > 0 || cfs_rq->nr_running)
+		goto again;
+	return NULL;
 }
 
 void init_cfs_rq(struct cfs_rq *cfs_rq)
@@ -984,19 +1027,43 @@ static void yield_task_fair(struct rq *rq)
 }
 
 #ifdef CONFIG_SMP
+/*
+ * CPUs reserved for pinned threads, e.g., thpool workers and FIT polling
+ * threads, are cleared from cpu_active_mask by pin_current_thread().
+ * Placement and load balance only use active CPUs.
+ */
+static inline bool cpu_available(struct task_struct *p, int cpu)
+{
+	return cpu_active(cpu) && cpumask_test_cpu(cpu, &p->cpus_allowed);
+}
+
+static inline bool idle_cpu(int cpu)
+{
+	struct rq *rq = cpu_rq(cpu);
+
+	return rq->curr == rq->idle && !rq->nr_running &&
+	       llist_empty(&rq->wake_list);
+}
+
 static int find_lowest_rq(struct task_struct *p, int prev_cpu)
 {
 	int cpu, target = prev_cpu;
 	unsigned int nr_running_min = UINT_MAX;
 
-	for_each_online_cpu(cpu) {
-		struct cfs_rq *cfs_rq = &(cpu_rq(cpu)->cfs);
+	if (cpu_available(p, prev_cpu)) {
+		if (idle_cpu(prev_cpu))
+			return prev_cpu;
+		nr_running_min = cpu_rq(prev_cpu)->nr_running;
+	}
+
+	for_each_cpu_and(cpu, &p->cpus_allowed, cpu_active_mask) {
+		unsigned int nr_running = cpu_rq(cpu)->nr_running;
 
-		if (cfs_rq->nr_running == 0)
+		if (idle_cpu(cpu))
 			return cpu;
 
-		if (cfs_rq->nr_running < nr_running_min) {
-			nr_running_min = cfs_rq->nr_running;
+		if (nr_running < nr_running_min) {
+			nr_running_min = nr_running;
 			target = cpu;
 		}
 	}
@@ -1004,12 +1071,50 @@ static int find_lowest_rq(struct task_struct *p, int prev_cpu)
 }
 
 /*
- * select_task_rq_fair: Select target runqueue for the waking task in domains
- * that have the 'sd_flag' flag set. In practice, this is SD_BALANCE_WAKE,
- * SD_BALANCE_FORK, or SD_BALANCE_EXEC.
+ * Find an idle CPU for @p, @target and then @prev are preferred.
+ * CPUs of the same node as @target come next.
+ */
+static int select_idle_sibling(struct task_struct *p, int prev, int target)
+{
+	int cpu;
+
+	if (cpu_available(p, target) && idle_cpu(target))
+		return target;
+
+	if (prev != target && cpu_available(p, prev) && idle_cpu(prev))
+		return prev;
+
+	for_each_cpu_and(cpu, &p->cpus_allowed, cpumask_of_node(cpu_to_node(target))) {
+		if (cpu_active(cpu) && idle_cpu(cpu))
+			return cpu;
+	}
+
+	for_each_cpu_and(cpu, &p->cpus_allowed, cpu_active_mask) {
+		if (idle_cpu(cpu))
+			return cpu;
+	}
+	return target;
+}
+
+/*
+ * Pull the wakee to the waker's CPU if the waker is about to sleep,
+ * and is the only one running there. They share data most likely.
+ */
+static bool wake_affine(struct task_struct *p, int this_cpu, int prev_cpu,
+			int wake_flags)
+{
+	if (this_cpu == prev_cpu || !cpu_available(p, this_cpu))
+		return false;
+
+	return (wake_flags & WF_SYNC) && cpu_rq(this_cpu)->nr_running == 1;
+}
+
+/*
+ * select_task_rq_fair: Select target runqueue for the waking task.
+ * In practice, sd_flag is SD_BALANCE_WAKE, SD_BALANCE_FORK, or SD_BALANCE_EXEC.
  *
- * Balances load by selecting the idlest cpu in the idlest group, or under
- * certain conditions an idle sibling cpu if the domain has SD_WAKE_AFFINE set.
+ * Fork and exec go to the least loaded CPU. Wakeup stays on the previous
+ * CPU, or the waker's CPU if affine, unless an idle CPU is found.
  *
  * Returns the target cpu number.
  *
@@ -1018,12 +1123,188 @@ static int find_lowest_rq(struct task_struct *p, int prev_cpu)
 static int
 select_task_rq_fair(struct task_struct *p, int prev_cpu, int sd_flag, int wake_flags)
 {
-	int new_cpu = prev_cpu;
+	int this_cpu = smp_processor_id();
+	int target = prev_cpu;
+
+	if (sd_flag & (SD_BALANCE_FORK | SD_BALANCE_EXEC))
+		return find_lowest_rq(p, prev_cpu);
+
+	if (wake_affine(p, this_cpu, prev_cpu, wake_flags))
+		target = this_cpu;
+
+	return select_idle_sibling(p, prev_cpu, target);
+}
+
+/*
+ * Called by set_task_cpu() before @p moves to another CPU.
+ * A waking task still has the vruntime of the old runqueue,
+ * while enqueue with ENQUEUE_MIGRATED adds the new min_vruntime.
+ */
+static void migrate_task_rq_fair(struct task_struct *p)
+{
+	if (p->state == TASK_WAKING) {
+		struct sched_entity *se = &p->se;
+
+		se->vruntime -= cfs_rq_of(se)->min_vruntime;
+	}
+}
+
+/*
+ * Load balance
+ *
+ * Pull based: a CPU looks for the busiest active CPU and pulls queued
+ * fair tasks from it, when it goes idle, and periodically from the tick.
+ * There are no sched domains, all active CPUs are scanned.
+ */
+
+/*
+ * Lock @busiest with @this_rq held, in the order of rq address.
+ * Return 1 if @this_rq->lock was dropped in between.
+ */
+static int double_lock_balance(struct rq *this_rq, struct rq *busiest)
+{
+	if (likely(spin_trylock(&busiest->lock)))
+		return 0;
+
+	if (busiest < this_rq) {
+		spin_unlock(&this_rq->lock);
+		spin_lock(&busiest->lock);
+		spin_lock(&this_rq->lock);
+		return 1;
+	}
+	spin_lock(&busiest->lock);
+	return 0;
+}
+
+static struct rq *find_busiest_rq(struct rq *this_rq)
+{
+	struct rq *rq, *busiest = NULL;
+	unsigned int max = this_rq->nr_running + 1;
+	int cpu;
+
+	for_each_cpu(cpu, cpu_active_mask) {
+		rq = cpu_rq(cpu);
+		if (rq == this_rq)
+			continue;
+
+		/* At least two runnable fair tasks, one of them is queued */
+		if (READ_ONCE(rq->cfs.nr_running) < 2)
+			continue;
+
+		if (READ_ONCE(rq->nr_running) > max) {
+			max = rq->nr_running;
+			busiest = rq;
+		}
+	}
+	return busiest;
+}
+
+static bool can_migrate_task(struct task_struct *p, struct rq *busiest,
+			     struct rq *this_rq, bool idle)
+{
+	s64 delta;
+
+	if (!cpumask_test_cpu(cpu_of(this_rq), &p->cpus_allowed))
+		return false;
+
+	/* Being switched out */
+	if (task_running(busiest, p))
+		return false;
+
+	if (idle)
+		return true;
+
+	delta = rq_clock_task(busiest) - p->se.exec_start;
+	return delta >= (s64)sysctl_sched_migration_cost;
+}
+
+/*
+ * Move up to @imbalance fair tasks from @busiest to @this_rq, both locked.
+ * Tasks at the right of the tree, which waited least, are picked first.
+ */
+static int detach_attach_tasks(struct rq *this_rq, struct rq *busiest,
+			       int imbalance, bool idle)
+{
+	struct rb_node *node, *prev;
+	struct task_struct *p;
+	int loop = 0, moved = 0;
+
+	update_rq_clock(busiest);
+	update_rq_clock(this_rq);
+
+	for (node = rb_last(&busiest->cfs.tasks_timeline); node; node = prev) {
+		prev = rb_prev(node);
+		if (++loop > 4 * sysctl_sched_nr_migrate)
+			break;
+
+		p = task_of(rb_entry(node, struct sched_entity, run_node));
+		if (!can_migrate_task(p, busiest, this_rq, idle))
+			continue;
+
+		p->on_rq = TASK_ON_RQ_MIGRATING;
+		dequeue_task_fair(busiest, p, 0);
+		set_task_cpu(p, cpu_of(this_rq));
+		enqueue_task_fair(this_rq, p, 0);
+		p->on_rq = TASK_ON_RQ_QUEUED;
+		check_preempt_curr(this_rq, p, 0);
+
+		if (++moved >= imbalance)
+			break;
+	}
+	return moved;
+}
+
+/*
+ * Caller holds @this_rq->lock, which may be dropped in between.
+ * Return the number of tasks pulled.
+ */
+static int load_balance(struct rq *this_rq, bool idle)
+{
+	struct rq *busiest;
+	int imbalance, moved = 0;
+
+	/* Reserved CPUs run their pinned thread only */
+	if (!cpu_active(cpu_of(this_rq)))
+		return 0;
+
+	busiest = find_busiest_rq(this_rq);
+	if (!busiest)
+		return 0;
+
+	double_lock_balance(this_rq, busiest);
+
+	/* Things may have changed before we got the locks */
+	imbalance = ((int)busiest->nr_running - (int)this_rq->nr_running) / 2;
+	imbalance = min_t(int, imbalance, sysctl_sched_nr_migrate);
+	if (imbalance > 0 && busiest->cfs.nr_running > 1)
+		moved = detach_attach_tasks(this_rq, busiest, imbalance, idle);
+
+	spin_unlock(&busiest->lock);
+	return moved;
+}
+
+/* Called by pick_next_task_fair() when there is nothing to run */
+static int idle_balance(struct rq *this_rq)
+{
+	return load_balance(this_rq, true);
+}
+
+/*
+ * Called from scheduler_tick() with interrupts disabled.
+ * Idle CPUs balance at every tick, busy ones at the interval.
+ */
+void trigger_load_balance(struct rq *rq)
+{
+	bool idle = idle_cpu(cpu_of(rq));
+
+	if (!idle && time_before(jiffies, rq->next_balance))
+		return;
+
+	spin_lock(&rq->lock);
+	load_balance(rq, idle);
+	spin_unlock(&rq->lock);
 
-	/* Only fork time? */
-	if (sd_flag == SD_BALANCE_FORK)
-		new_cpu = find_lowest_rq(p, prev_cpu);
-	return new_cpu;
+	rq->next_balance = jiffies + msecs_to_jiffies(sysctl_sched_balance_interval);
 }
 #endif
 
@@ -1041,6 +1322,7 @@ const struct sched_class fair_sched_class = {
 
 #ifdef CONFIG_SMP
 	.select_task_rq		= select_task_rq_fair,
+	.migrate_task_rq	= migrate_task_rq_fair,
 	.set_cpus_allowed	= set_cpus_allowed_common,
 #endif
 
@@ -426,6 +426,28 @@ SYSCALL_DEFINE1(sysinfo, struct sysinfo __user *, info)
 	return 0;
 }
 
+#ifndef CONFIG_PROFILING_POINTS
+SYSCALL_DEFINE2(profile_point, int, cmd, const char __user *, name)
+{
+	return -ENOSYS;
+}
+#endif
+
+#if !defined(CONFIG_PROFILING_RPC_TRACE) || !defined(CONFIG_COMP_PROCESSOR)
+SYSCALL_DEFINE1(rpc_trace, unsigned int, cmd)
+{
+	return -ENOSYS;
+}
+#endif
+
+#ifndef CONFIG_PCACHE_WSS
+SYSCALL_DEFINE3(pcache_wss, int, cmd, unsigned long, arg,
+		struct pcache_wss_stat __user *, statbuf)
+{
+	return -ENOSYS;
+}
+#endif
+
 #ifndef CONFIG_FUTEX
 SYSCALL_DEFINE2(set_robust_list, struct robust_list_head __user *, head,
 		size_t, len)
@@ -571,6 +593,19 @@ SYSCALL_DEFINE1(checkpoint_process, pid_t, pid)
 	BUG();
 }
 
+SYSCALL_DEFINE3(restore_process, unsigned int, node, pid_t, pid,
+		unsigned int, seq)
+{
+	BUG();
+}
+
+SYSCALL_DEFINE3(spawn, const char __user *, filename,
+		const char __user *const __user *, argv,
+		const char __user *const __user *, envp)
+{
+	BUG();
+}
+
 SYSCALL_DEFINE3(ioctl, unsigned int, fd, unsigned int, cmd, unsigned long, arg)
 {
 	BUG();
@@ -63,10 +63,12 @@
 #define IMM_SEND_REPLY_SEND	0x80000000
 #define IMM_SEND_REPLY_RECV	0x40000000
 #define IMM_ACK			0x20000000
+#define IMM_SEND_REPLY_BATCH	0x40000000	/* only valid with IMM_SEND_REPLY_SEND */
 #define IMM_PORT_PUSH_BIT	24
 #define IMM_GET_PORT_NUMBER(imm) (imm<<2)>>26
 #define IMM_GET_OFFSET		0x00ffffff
-#define IMM_GET_SEMAPHORE	0x00ffffff
+#define IMM_REPLY_ACK		0x00080000	/* reply also ACKs the request's ring offset */
+#define IMM_GET_SEMAPHORE	0x0007ffff
 //#define IMM_NODE_BITS		24
 //#define IMM_GET_NODE_ID(imm)	(imm>>24)&0xff
 #define IMM_GET_OPCODE		0x0f000000
@@ -486,6 +488,7 @@ struct lego_context {
 	
 	//local reply ready indicator related
 	void **reply_ready_indicators;
+	int *reply_ack_offsets;
 	unsigned long *reply_ready_indicators_bitmap;
 	spinlock_t reply_ready_indicators_lock;
 #ifdef ADAPTIVE_MODEL
@@ -26,6 +26,9 @@
 #define CONFIG_FIT_FIRST_QPN		(80)
 #define CONFIG_FIT_NR_QPS_PER_PAIR	(12)
 
+/* Same as CONFIG_FIT_NR_SUBRINGS in P and M, 1 if FIT_LOCKFREE_RING=n */
+#define CONFIG_FIT_NR_SUBRINGS		(1)
+
 //#define CONFIG_SOCKET_O_IB
 
 #endif /* _LINUX_MODULE_FIT_CONFIG_H_ */
@@ -349,6 +349,7 @@ struct lego_context *fit_init_ctx(int size, int rx_depth, int port, struct ib_de
 
 	//Do IMM local ring setup (imm-send-reply)
 	ctx->reply_ready_indicators = (void **)kmalloc(sizeof(void*)*IMM_NUM_OF_SEMAPHORE, GFP_KERNEL);
+	ctx->reply_ack_offsets = kzalloc(sizeof(int)*IMM_NUM_OF_SEMAPHORE, GFP_KERNEL);
 	ctx->reply_ready_indicators_bitmap = kzalloc(sizeof(unsigned long) * BITS_TO_LONGS(IMM_NUM_OF_SEMAPHORE), GFP_KERNEL);
 	spin_lock_init(&ctx->reply_ready_indicators_lock);
 
@@ -1094,7 +1095,7 @@ int fit_receive_message(struct lego_context *ctx, unsigned int port, void *ret_a
 	int ret = 0;
 	struct imm_message_metadata *descriptor;
 	struct imm_header_from_cq_to_port *new_request;
-	int last_ack;
+	int last_ack, ack_idx;
 	int ack_flag=0;
 
 	//printk(KERN_CRIT "%s port %d\n", __func__, port);
@@ -1151,15 +1152,17 @@ int fit_receive_message(struct lego_context *ctx, unsigned int port, void *ret_a
 	
 	//do ack based on the last_ack_index, submit a request to waiting_queue_handler	
 	//printk(KERN_CRIT "%s last_ack %d offset %d\n", __func__, last_ack, offset);
-	spin_lock(&ctx->local_last_ack_index_lock[node_id]);
-	last_ack = ctx->local_last_ack_index[node_id];
-	if( (offset>= last_ack && offset - last_ack >= IMM_ACK_FREQ) || 
-	    (offset< last_ack && offset + IMM_PORT_CACHE_SIZE - last_ack >= IMM_ACK_FREQ))
+	//each sub-ring is ACKed on its own, same as Lego
+	ack_idx = node_id * FIT_NR_SUBRINGS + offset / FIT_SUBRING_SIZE;
+	spin_lock(&ctx->local_last_ack_index_lock[ack_idx]);
+	last_ack = ctx->local_last_ack_index[ack_idx] % FIT_SUBRING_SIZE;
+	if( (offset % FIT_SUBRING_SIZE >= last_ack && offset % FIT_SUBRING_SIZE - last_ack >= FIT_SUBRING_ACK_FREQ) ||
+	    (offset % FIT_SUBRING_SIZE < last_ack && offset % FIT_SUBRING_SIZE + FIT_SUBRING_SIZE - last_ack >= FIT_SUBRING_ACK_FREQ))
 	{
 		ack_flag = 1;
-		ctx->local_last_ack_index[node_id] = offset;
+		ctx->local_last_ack_index[ack_idx] = offset;
 	}
-	spin_unlock(&ctx->local_last_ack_index_lock[node_id]);
+	spin_unlock(&ctx->local_last_ack_index_lock[ack_idx]);
 
 	if(ack_flag)
 	{	
@@ -1495,21 +1498,36 @@ static int fit_poll_cq(struct lego_context *ctx, struct ib_cq *target_cq)
 
 				if(wc[i].wc_flags&&IB_WC_WITH_IMM) {
 					if (wc[i].ex.imm_data & IMM_SEND_REPLY_SEND) {
+						int end;
+
 						offset = wc[i].ex.imm_data & IMM_GET_OFFSET; 
 						port = IMM_GET_PORT_NUMBER(wc[i].ex.imm_data);
 
-						tmp = kmalloc(sizeof(struct imm_header_from_cq_to_port), GFP_KERNEL);
-						if (!tmp) {
-							WARN_ON(1);
-							return -ENOMEM;
+						/* A coalesced write carries several framed requests */
+						if (wc[i].ex.imm_data & IMM_SEND_REPLY_BATCH)
+							end = offset + wc[i].byte_len;
+						else
+							end = offset + 1;
+
+						while (offset < end) {
+							struct imm_message_metadata *m;
+
+							m = ctx->local_rdma_recv_rings[node_id] + offset;
+
+							tmp = kmalloc(sizeof(struct imm_header_from_cq_to_port), GFP_KERNEL);
+							if (!tmp) {
+								WARN_ON(1);
+								return -ENOMEM;
+							}
+							tmp->source_node_id = node_id;
+							tmp->offset = offset;
+							offset += FIT_COALESCE_FRAME_SIZE(m->size);
+
+							/* ibapi_receive_message will dequeue */
+							spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
+							list_add_tail(&(tmp->list), &ctx->imm_waitqueue_perport[port].list);
+							spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
 						}
-						tmp->source_node_id = node_id;
-						tmp->offset = offset;
-
-						/* ibapi_receive_message will dequeue */
-						spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
-						list_add_tail(&(tmp->list), &ctx->imm_waitqueue_perport[port].list);
-						spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
 					} else if (wc[i].ex.imm_data & IMM_ACK || wc[i].byte_len == 0) {
 						/* Internal ACK */
 						offset = wc[i].ex.imm_data & IMM_GET_OFFSET;
@@ -1534,6 +1552,9 @@ static int fit_poll_cq(struct lego_context *ctx, struct ib_cq *target_cq)
 							WARN_ON_ONCE(1);
 							continue;
 						}
+						//receiver ACKed our request along with the reply
+						if (wc[i].ex.imm_data & IMM_REPLY_ACK)
+							ctx->remote_last_ack_index[node_id] = ctx->reply_ack_offsets[semaphore];
 						memcpy((void *)ctx->reply_ready_indicators[semaphore], &length, sizeof(int));
 
 						ctx->reply_ready_indicators[semaphore] = NULL;
@@ -1809,6 +1830,7 @@ int fit_send_reply_with_rdma_write_with_imm(struct lego_context *ctx, int target
 
 	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
 	inbox_id = fit_get_inbox_by_addr(ctx, &wait_send_reply_id);
+	ctx->reply_ack_offsets[inbox_id] = tar_offset_start;
 	
 	imm_data = IMM_SEND_REPLY_SEND | tar_offset_start; 
 	
@@ -2180,13 +2202,13 @@ struct lego_context *fit_establish_conn(struct ib_device *ib_dev, int ib_port, i
 	ctx->remote_rdma_ring_mrs = (struct fit_ibv_mr *)kmalloc(MAX_NODE * sizeof(struct fit_ibv_mr), GFP_KERNEL);
 	ctx->remote_rdma_ring_mrs_offset = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
 	ctx->remote_last_ack_index = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
-	ctx->local_last_ack_index = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
-	ctx->local_last_ack_index_lock = (spinlock_t *)kmalloc(MAX_NODE * sizeof(spinlock_t), GFP_KERNEL);
+	ctx->local_last_ack_index = (int *)kzalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(int), GFP_KERNEL);
+	ctx->local_last_ack_index_lock = (spinlock_t *)kmalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(spinlock_t), GFP_KERNEL);
 	ctx->remote_imm_offset_lock = (spinlock_t *)kmalloc(MAX_NODE * sizeof(spinlock_t), GFP_KERNEL); 
-	for(i=0; i<MAX_NODE; i++) {
+	for(i=0; i<MAX_NODE; i++)
 		spin_lock_init(&ctx->remote_imm_offset_lock[i]);
+	for(i=0; i<MAX_NODE * FIT_NR_SUBRINGS; i++)
 		spin_lock_init(&ctx->local_last_ack_index_lock[i]);
-	}
 
 #ifdef CONFIG_SOCKET_O_IB
 	/*
@@ -14,6 +14,21 @@
 
 #define NUM_POLLING_THREADS 1
 
+/*
+ * Frame size of each request inside a coalesced RDMA-WRITE-IMM
+ * (IMM_SEND_REPLY_BATCH). Must match the Lego side.
+ */
+#define FIT_COALESCE_FRAME_SIZE(size)	\
+	ALIGN(sizeof(struct imm_message_metadata) + (size), 8)
+
+/*
+ * Receiver tracks and ACKs each sub-ring of a node pair on its own.
+ * Must match the Lego side.
+ */
+#define FIT_NR_SUBRINGS		(CONFIG_FIT_NR_SUBRINGS)
+#define FIT_SUBRING_SIZE	(RDMA_RING_SIZE / FIT_NR_SUBRINGS)
+#define FIT_SUBRING_ACK_FREQ	(FIT_SUBRING_SIZE / 8)
+
 /* THREAD_HANDLER_MODEL - CHOOSE ONE*/
 #define WAITING_QUEUE_IMPLEMENTATION
 //#define IMPLEMENTATION_THREAD_SPAWN
@@ -83,6 +83,8 @@ void handle_m2mm_status_report(struct m2mm_status_report *payload, u64 desc)
 	ms->totalram = payload->totalram;
 	ms->freeram = payload->freeram;
 	ms->nr_request = payload->nr_request;
+	ms->rss_private = payload->rss_private;
+	ms->rss_shared = payload->rss_shared;
 
 	//pr_info("%s():  [src_nid=%d] [nr_reqs=%lu]\n",
 	//	__func__, src_nid, ms->nr_request);
@@ -16,6 +16,8 @@ struct mnode_struct {
 	unsigned long totalram;
 	unsigned long freeram;
 	unsigned long nr_request;
+	unsigned long rss_private;
+	unsigned long rss_shared;
 	struct list_head list;
 };
 
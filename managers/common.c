@@ -83,8 +83,7 @@ int net_send_reply_timeout(u32 node, u32 opcode,
 	}
 
 	hdr = to_common_header(msg);
-	hdr->opcode = opcode;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, opcode);
 
 	payload_msg = to_payload(msg);
 	memcpy(payload_msg, payload, len_payload);
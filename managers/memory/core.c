@@ -15,6 +15,7 @@
 #include <lego/jiffies.h>
 #include <lego/kthread.h>
 #include <lego/profile.h>
+#include <lego/rpc_trace.h>
 #include <lego/sysinfo.h>
 #include <lego/memblock.h>
 #include <lego/fit_ibapi.h>
@@ -28,6 +29,7 @@
 #include <memory/loader.h>
 #include <memory/distvm.h>
 #include <memory/replica.h>
+#include <memory/checkpoint.h>
 #include <memory/thread_pool.h>
 #include <memory/pgcache.h>
 
@@ -83,6 +85,11 @@ enqueue_tail_thpool_worker(struct thpool_worker *worker, struct thpool_buffer *b
 	inc_queued_thpool_worker(worker);
 	update_max_queued_thpool_worker(worker);
 	spin_unlock(&worker->lock);
+
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+	if (wq_has_sleeper(&worker->wq))
+		wake_up(&worker->wq);
+#endif
 }
 
 static inline struct thpool_buffer *
@@ -200,6 +207,12 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		handle_p2m_drop_page_cache(hdr, buffer);
 		break;
 
+#ifdef CONFIG_PROFILING_RPC_TRACE
+	case P2M_RPC_TRACE:
+		handle_p2m_rpc_trace(payload, hdr, buffer);
+		break;
+#endif
+
 #ifdef CONFIG_MEM_PAGE_CACHE
 	case P2M_LSEEK:
 		handle_p2m_lseek(payload, hdr, buffer);
@@ -248,6 +261,10 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		handle_p2m_msync(payload, desc, hdr, tx);
 		break;
 
+	case P2M_MADVISE:
+		handle_p2m_madvise(payload, hdr, buffer);
+		break;
+
 	case P2M_FORK:
 		handle_p2m_fork(payload, hdr, buffer);
 		break;
@@ -256,8 +273,16 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		handle_p2m_execve(payload, hdr, buffer);
 		break;
 
+	case P2M_SPAWN:
+		handle_p2m_spawn(payload, hdr, buffer);
+		break;
+
 	case P2M_CHECKPOINT:
-		handle_p2m_checkpint(payload, desc, hdr);
+		handle_p2m_checkpoint(payload, hdr, buffer);
+		break;
+
+	case P2M_RESTORE:
+		handle_p2m_restore(payload, hdr, buffer);
 		break;
 
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
@@ -323,6 +348,42 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 	}
 }
 
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+#define THPOOL_IDLE_BUDGET_NS	(CONFIG_FIT_ADAPTIVE_POLL_IDLE_US * NSEC_PER_USEC)
+
+/*
+ * Spin within the idle budget, then sleep until
+ * enqueue_tail_thpool_worker() wakes us up.
+ */
+static void thpool_worker_idle(struct thpool_worker *w, unsigned long *idle_start_ns)
+{
+	unsigned long now = sched_clock();
+
+	if (!*idle_start_ns) {
+		*idle_start_ns = now;
+		return;
+	}
+
+	if (now - *idle_start_ns < THPOOL_IDLE_BUDGET_NS) {
+		cpu_relax();
+		return;
+	}
+
+	preempt_enable();
+	wait_event(w->wq, nr_queued_thpool_worker(w));
+	preempt_disable();
+
+	w->nr_sleeps++;
+	*idle_start_ns = 0;
+}
+#else
+static inline void
+thpool_worker_idle(struct thpool_worker *w, unsigned long *idle_start_ns)
+{
+	cpu_relax();
+}
+#endif
+
 DEFINE_PROFILE_POINT(thpool_worker_handler)
 DEFINE_PROFILE_POINT(thpool_worker_fit_ack_reply)
 
@@ -330,7 +391,10 @@ static int thpool_worker_func(void *_worker)
 {
 	struct thpool_worker *w = _worker;
 	struct thpool_buffer *b;
+	struct common_header *hdr;
+	unsigned int trace_id, opcode, src_nid;
 	unsigned long queuing_delay;
+	unsigned long idle_start_ns = 0;
 	PROFILE_POINT_TIME(thpool_worker_handler)
 	PROFILE_POINT_TIME(thpool_worker_fit_ack_reply)
 
@@ -350,8 +414,11 @@ static int thpool_worker_func(void *_worker)
 	 * However, if our software watchdog is enabled, we want to enable
 	 * the interrupt, so whenever watchdog noticed a dead thread, it
 	 * will be able to send interrupt and dump the current stack.
+	 *
+	 * With FIT_ADAPTIVE_POLL, idle workers sleep, so interrupts
+	 * have to stay enabled as well.
 	 */
-#ifndef CONFIG_SOFT_WATCHDOG
+#if !defined(CONFIG_SOFT_WATCHDOG) && !defined(CONFIG_FIT_ADAPTIVE_POLL)
 	local_irq_disable();
 #endif
 
@@ -359,7 +426,8 @@ static int thpool_worker_func(void *_worker)
 	while (1) {
 		/* Check comments on enqueue */
 		while (!nr_queued_thpool_worker(w))
-			cpu_relax();
+			thpool_worker_idle(w, &idle_start_ns);
+		idle_start_ns = 0;
 
 		spin_lock(&w->lock);
 		while (!list_empty(&w->work_head)) {
@@ -380,6 +448,14 @@ static int thpool_worker_func(void *_worker)
 			set_in_handler_thpool_worker(w);
 			set_wip_buffer_thpool_worker(w, b);
 
+			/* rx may be gone after reply */
+			hdr = to_common_header(thpool_buffer_rx(b));
+			trace_id = hdr->trace_id;
+			opcode = hdr->opcode;
+			src_nid = b->fit_node_id;
+			rpc_trace_record(RPC_TRACE_DEQUEUE, trace_id, opcode, src_nid);
+			rpc_trace_serve(trace_id);
+
 			PROFILE_START(thpool_worker_handler);
 
 			/* Invoke the real handler */
@@ -393,6 +469,7 @@ static int thpool_worker_func(void *_worker)
 			 */
 			BUG_ON(!b->tx_size);
 			PROFILE_LEAVE(thpool_worker_handler);
+			rpc_trace_record(RPC_TRACE_HANDLER_END, trace_id, opcode, src_nid);
 
 			/*
 			 * Callback to FIT layer to perform the
@@ -401,6 +478,8 @@ static int thpool_worker_func(void *_worker)
 			PROFILE_START(thpool_worker_fit_ack_reply);
 			fit_ack_reply_callback(b);
 			PROFILE_LEAVE(thpool_worker_fit_ack_reply);
+			rpc_trace_record(RPC_TRACE_REPLY, trace_id, opcode, src_nid);
+			rpc_trace_serve(0);
 
 			clear_wip_buffer_thpool_worker(w);
 			clear_in_handler_thpool_worker(w);
@@ -416,7 +495,7 @@ static int thpool_worker_func(void *_worker)
 	}
 	preempt_enable();
 
-#ifndef CONFIG_SOFT_WATCHDOG
+#if !defined(CONFIG_SOFT_WATCHDOG) && !defined(CONFIG_FIT_ADAPTIVE_POLL)
 	local_irq_enable();
 #endif
 
@@ -439,6 +518,9 @@ void thpool_callback(void *fit_ctx, void *fit_imm,
 	b->fit_offset = fit_offset;
 	b->fit_node_id = node_id;
 
+	rpc_trace_record(RPC_TRACE_ENQUEUE, to_common_header(rx)->trace_id,
+			 to_common_header(rx)->opcode, node_id);
+
 	/*
 	 * Select a worker thread and pass the buffer
 	 * to it. The worker should do ACK and REPLY.
@@ -469,6 +551,10 @@ void __init thpool_init(void)
 		worker->min_queuing_delay_ns = ULONG_MAX;
 		INIT_LIST_HEAD(&worker->work_head);
 		spin_lock_init(&worker->lock);
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+		init_waitqueue_head(&worker->wq);
+		worker->nr_sleeps = 0;
+#endif
 		memset(worker->queuing_stats, 0, sizeof(worker->queuing_stats));
 
 		init_completion(&thpool_init_completion);
@@ -497,6 +583,8 @@ void __init memory_component_init(void)
 	thpool_init();
 
 	init_memory_flush_thread();
+	init_checkpoint_thread();
+	init_restore_thread();
 
 #ifdef CONFIG_VMA_MEMORY_UNITTEST
 	mem_vma_unittest();
@@ -610,6 +698,9 @@ void print_thpool_stats(void)
 			tw->nr_handled, nr_thpool_reqs,
 			tw->total_queuing_delay_ns, tw->nr_handled ? (tw->total_queuing_delay_ns / tw->nr_handled) : 0,
 			tw->max_queuing_delay_ns, tw->min_queuing_delay_ns);
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+		pr_info("        nr_sleeps=%lu\n", tw->nr_sleeps);
+#endif
 
 		for (j = 0; j < QUEUING_STAT_ENTRIES; j++) {
 			if (!tw->queuing_stats[i])
@@ -7,12 +7,584 @@
  * (at your option) any later version.
  */
 
+/*
+ * Process checkpoint, memory side.
+ *
+ * Processor parks all threads, writes back dirty pcache lines, then ships
+ * the process snapshot here. We walk the page table, pin every page that
+ * is dirty since the last image (all pages for the first one), mark the
+ * pte clean and write-protect it. A later write faults and goes to a copy
+ * (do_wp_page), thus pinned pages keep their content at checkpoint time.
+ * The reply is sent right after the walk, and kcheckpointd writes the
+ * image to storage in background, then drops the pins.
+ *
+ * Young ptes are recorded as the hot set and made old during the walk.
+ * Pcache misses and flushes make them young again.
+ *
+ * Pages of MAP_SHARED mappings are written in place, they are copied
+ * during the walk instead.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
 #include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
+#include <lego/fit_ibapi.h>
 #include <lego/comp_common.h>
 
-int handle_p2m_checkpint(void *payload, u64 desc,
-			struct common_header *hdr)
+#include <memory/vm.h>
+#include <memory/pid.h>
+#include <memory/task.h>
+#include <memory/file_ops.h>
+#include <memory/checkpoint.h>
+#include <memory/vm-pgtable.h>
+#include <memory/thread_pool.h>
+
+#ifdef CONFIG_MEM_CHECKPOINT
+
+/* Each pte table pass needs PTRS_PER_PTE free entries */
+#define CHK_CHUNK_NR_ENTRIES	(PTRS_PER_PTE * 4)
+
+/* Set in chk_entry->address if the page is hot */
+#define CHK_ENTRY_HOT		0x1UL
+
+struct chk_entry {
+	unsigned long		address;
+	unsigned long		page;		/* kernel virtual address, pinned,
+						   0 if not captured */
+};
+
+struct chk_chunk {
+	struct list_head	next;
+	unsigned int		nr;
+	struct chk_entry	entries[CHK_CHUNK_NR_ENTRIES];
+};
+
+struct chk_job {
+	struct list_head	next;
+	struct lego_mm_struct	*mm;		/* holds a mm_count */
+	struct chk_image_header	header;
+	void			*snapshot;
+	struct chk_image_vma	*vmas;
+	struct list_head	chunks;
+};
+
+static DEFINE_SPINLOCK(checkpointd_lock);
+static LIST_HEAD(checkpointd_queue);
+static atomic_t nr_checkpointd_jobs;
+
+static struct task_struct *checkpointd_task;
+
+#define for_each_chk_entry(job, chunk, i)				\
+	list_for_each_entry(chunk, &(job)->chunks, next)		\
+		for (i = 0; i < chunk->nr; i++)
+
+static struct chk_job *alloc_chk_job(void *snapshot, unsigned int len)
+{
+	struct chk_job *job;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return NULL;
+
+	job->snapshot = kmalloc(len, GFP_KERNEL);
+	if (!job->snapshot) {
+		kfree(job);
+		return NULL;
+	}
+	memcpy(job->snapshot, snapshot, len);
+	job->header.ss_len = len;
+	INIT_LIST_HEAD(&job->chunks);
+	return job;
+}
+
+static void free_chk_job(struct chk_job *job)
+{
+	struct chk_chunk *chunk, *tmp;
+	unsigned int i;
+
+	list_for_each_entry_safe(chunk, tmp, &job->chunks, next) {
+		for (i = 0; i < chunk->nr; i++) {
+			if (chunk->entries[i].page)
+				free_page(chunk->entries[i].page);
+		}
+		kfree(chunk);
+	}
+	if (job->mm)
+		lego_mmdrop(job->mm);
+	kfree(job->vmas);
+	kfree(job->snapshot);
+	kfree(job);
+}
+
+/* Return a chunk that has room for a whole pte table */
+static struct chk_chunk *chk_reserve_chunk(struct chk_job *job)
+{
+	struct chk_chunk *chunk;
+
+	if (!list_empty(&job->chunks)) {
+		chunk = list_last_entry(&job->chunks, struct chk_chunk, next);
+		if (chunk->nr + PTRS_PER_PTE <= CHK_CHUNK_NR_ENTRIES)
+			return chunk;
+	}
+
+	chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+	chunk->nr = 0;
+	list_add_tail(&chunk->next, &job->chunks);
+	return chunk;
+}
+
+static pmd_t *chk_pmd_offset(struct lego_mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = lego_pgd_offset(mm, address);
+	if (pgd_none(*pgd))
+		return NULL;
+
+	pud = lego_pud_offset(pgd, address);
+	if (pud_none(*pud))
+		return NULL;
+
+	pmd = lego_pmd_offset(pud, address);
+	if (pmd_none(*pmd))
+		return NULL;
+	return pmd;
+}
+
+/*
+ * Pin pages within [@addr, @end) that checkpoint has not seen,
+ * and record the hot ones.
+ * A pte table shared by fork() is left untouched, it is copied
+ * before anyone writes into it, thus the pins protect the pages
+ * already. Its dirty pages will be captured again next time.
+ */
+static void checkpoint_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
+				 unsigned long addr, unsigned long end,
+				 struct chk_job *job, struct chk_chunk *chunk,
+				 bool full)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	bool shared = lego_pmd_shared(*pmd);
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	pte = lego_pte_offset_lock(mm, pmd, addr, &ptl);
+	do {
+		pte_t ptent = *pte;
+		struct chk_entry *entry;
+		bool hot, capture;
+
+		if (pte_none(ptent) || !pte_present(ptent))
+			continue;
+
+		hot = pte_young(ptent);
+		capture = full || pte_dirty(ptent);
+		if (!hot && !capture)
+			continue;
+
+		entry = &chunk->entries[chunk->nr++];
+		entry->address = addr;
+		entry->page = 0;
+		if (hot) {
+			entry->address |= CHK_ENTRY_HOT;
+			job->header.nr_hot++;
+		}
+		if (capture) {
+			entry->page = lego_pte_to_virt(ptent);
+			get_page(virt_to_page(entry->page));
+			job->header.nr_pages++;
+		}
+
+		if (shared)
+			continue;
+
+		if (capture) {
+			ptent = pte_mkclean(ptent);
+			if (is_cow_mapping(vma->vm_flags))
+				ptent = pte_wrprotect(ptent);
+		}
+		pte_set(pte, pte_mkold(ptent));
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+	spin_unlock(ptl);
+}
+
+/* MAP_SHARED pages are written in place, copy them now */
+static int checkpoint_copy_entries(struct chk_chunk *chunk, unsigned int start)
+{
+	unsigned long page;
+	unsigned int i;
+
+	for (i = start; i < chunk->nr; i++) {
+		if (!chunk->entries[i].page)
+			continue;
+
+		page = __get_free_page(GFP_KERNEL);
+		if (unlikely(!page))
+			return -ENOMEM;
+
+		memcpy((void *)page, (void *)chunk->entries[i].page, PAGE_SIZE);
+		free_page(chunk->entries[i].page);
+		chunk->entries[i].page = page;
+	}
+	return 0;
+}
+
+static int checkpoint_vma(struct vm_area_struct *vma, struct chk_job *job, bool full)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	struct chk_chunk *chunk;
+	unsigned long addr, next;
+	unsigned int start;
+	pmd_t *pmd;
+	int ret;
+
+	for (addr = vma->vm_start; addr != vma->vm_end; addr = next) {
+		next = pmd_addr_end(addr, vma->vm_end);
+
+		pmd = chk_pmd_offset(mm, addr);
+		if (!pmd)
+			continue;
+
+		chunk = chk_reserve_chunk(job);
+		if (!chunk)
+			return -ENOMEM;
+
+		start = chunk->nr;
+		checkpoint_pte_range(vma, pmd, addr, next, job, chunk, full);
+
+		if (vma->vm_flags & VM_SHARED) {
+			ret = checkpoint_copy_entries(chunk, start);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Caller holds mmap_sem.
+ * On failure, ptes may have been cleaned already,
+ * and the caller must force the next image to be full.
+ */
+static int checkpoint_mm(struct lego_task_struct *tsk, struct chk_job *job, bool full)
+{
+	struct lego_mm_struct *mm = tsk->mm;
+	struct vm_area_struct *vma;
+	struct chk_image_vma *dst;
+	int ret;
+
+	job->vmas = kcalloc(mm->map_count, sizeof(*job->vmas), GFP_KERNEL);
+	if (mm->map_count && !job->vmas)
+		return -ENOMEM;
+
+	dst = job->vmas;
+	for (vma = mm->mmap; vma; vma = vma->vm_next, dst++) {
+		dst->vm_start = vma->vm_start;
+		dst->vm_end = vma->vm_end;
+		dst->vm_flags = vma->vm_flags;
+		dst->vm_pgoff = vma->vm_pgoff;
+		if (vma->vm_file)
+			strlcpy(dst->filename, vma->vm_file->filename,
+				MAX_FILENAME_LENGTH);
+
+		ret = checkpoint_vma(vma, job, full);
+		if (ret)
+			return ret;
+	}
+	job->header.nr_vmas = dst - job->vmas;
+	return 0;
+}
+
+static void checkpoint_mm_layout(struct lego_mm_struct *mm,
+				 struct chk_image_header *header)
 {
-	WARN_ON(1);
+	header->start_code = mm->start_code;
+	header->end_code = mm->end_code;
+	header->start_data = mm->start_data;
+	header->end_data = mm->end_data;
+	header->start_brk = mm->start_brk;
+	header->brk = mm->brk;
+	header->start_stack = mm->start_stack;
+	header->arg_start = mm->arg_start;
+	header->arg_end = mm->arg_end;
+	header->env_start = mm->env_start;
+	header->env_end = mm->env_end;
+
+	BUILD_BUG_ON(sizeof(header->saved_auxv) != sizeof(mm->saved_auxv));
+	memcpy(header->saved_auxv, mm->saved_auxv, sizeof(header->saved_auxv));
+}
+
+static void enqueue_checkpointd_job(struct chk_job *job)
+{
+	spin_lock(&checkpointd_lock);
+	list_add_tail(&job->next, &checkpointd_queue);
+	atomic_inc(&nr_checkpointd_jobs);
+	spin_unlock(&checkpointd_lock);
+
+	wake_up_process(checkpointd_task);
+}
+
+void handle_p2m_checkpoint(struct p2m_checkpoint_msg *payload,
+			   struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_checkpoint_reply *reply;
+	struct lego_task_struct *tsk;
+	struct lego_mm_struct *mm;
+	struct chk_job *job;
+	unsigned long seq;
+	bool full;
+	int ret;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->seq = 0;
+
+	tsk = find_lego_task_by_pid(hdr->src_nid, payload->pid);
+	if (unlikely(!tsk)) {
+		reply->ret = -ESRCH;
+		return;
+	}
+
+	job = alloc_chk_job((void *)payload + sizeof(*payload), payload->len);
+	if (!job) {
+		reply->ret = -ENOMEM;
+		return;
+	}
+
+	mm = tsk->mm;
+	atomic_inc(&mm->mm_count);
+	job->mm = mm;
+
+	down_read(&mm->mmap_sem);
+	seq = ++tsk->checkpoint_seq;
+	full = !mm->checkpoint_base;
+	ret = checkpoint_mm(tsk, job, full);
+	if (unlikely(ret)) {
+		checkpoint_reset_base(mm);
+		up_read(&mm->mmap_sem);
+
+		free_chk_job(job);
+		reply->ret = ret;
+		return;
+	}
+	if (full)
+		mm->checkpoint_base = seq;
+	checkpoint_mm_layout(mm, &job->header);
+
+	job->header.magic = CHK_IMAGE_MAGIC;
+	job->header.node = tsk->node;
+	job->header.pid = tsk->pid;
+	job->header.seq = seq;
+	job->header.base_seq = mm->checkpoint_base;
+	up_read(&mm->mmap_sem);
+
+	enqueue_checkpointd_job(job);
+
+	reply->ret = 0;
+	reply->seq = seq;
+}
+
+static ssize_t chk_write(char *f_name, const void *buf, size_t count,
+			 loff_t *pos, int flags)
+{
+	ssize_t ret;
+
+	while (count) {
+		size_t len = min_t(size_t, count, CHK_IO_SIZE);
+
+		ret = __storage_write_flags(NULL, f_name, buf, len, pos, flags);
+		if (ret != len)
+			return ret < 0 ? ret : -EIO;
+
+		*pos += len;
+		buf += len;
+		count -= len;
+	}
+	return 0;
+}
+
+/*
+ * Write addresses of the captured pages, or of the hot ones if @hot.
+ * They are staged in @buf, which has CHK_IO_SIZE bytes.
+ */
+static int chk_write_addrs(struct chk_job *job, char *f_name, void *buf,
+			   loff_t *pos, bool hot)
+{
+	struct chk_chunk *chunk;
+	struct chk_entry *entry;
+	size_t len = 0;
+	unsigned int i;
+	int ret;
+
+	for_each_chk_entry(job, chunk, i) {
+		entry = &chunk->entries[i];
+		if (hot ? !(entry->address & CHK_ENTRY_HOT) : !entry->page)
+			continue;
+
+		*(__u64 *)(buf + len) = entry->address & PAGE_MASK;
+		len += sizeof(__u64);
+		if (len == CHK_IO_SIZE) {
+			ret = chk_write(f_name, buf, len, pos, O_WRONLY);
+			if (ret)
+				return ret;
+			len = 0;
+		}
+	}
+	if (len)
+		return chk_write(f_name, buf, len, pos, O_WRONLY);
+	return 0;
+}
+
+/*
+ * Write @job into one image file. The page data are staged in
+ * @buf, which has CHK_IO_SIZE bytes.
+ */
+static int checkpoint_write_image(struct chk_job *job, void *buf)
+{
+	struct chk_image_header *header = &job->header;
+	char f_name[MAX_FILENAME_LENGTH];
+	struct chk_chunk *chunk;
+	size_t len, meta_len;
+	loff_t pos = 0;
+	unsigned int i;
+	int ret;
+
+	chk_image_name(f_name, header->node, header->pid, header->seq);
+
+	meta_len = sizeof(*header) + header->ss_len +
+		   sizeof(*job->vmas) * header->nr_vmas +
+		   sizeof(__u64) * (header->nr_pages + header->nr_hot);
+	header->data_offset = PAGE_ALIGN(meta_len);
+
+	ret = chk_write(f_name, header, sizeof(*header), &pos,
+			O_WRONLY | O_CREAT | O_TRUNC);
+	if (ret)
+		return ret;
+
+	ret = chk_write(f_name, job->snapshot, header->ss_len, &pos, O_WRONLY);
+	if (ret)
+		return ret;
+
+	ret = chk_write(f_name, job->vmas, sizeof(*job->vmas) * header->nr_vmas,
+			&pos, O_WRONLY);
+	if (ret)
+		return ret;
+
+	ret = chk_write_addrs(job, f_name, buf, &pos, false);
+	if (ret)
+		return ret;
+
+	ret = chk_write_addrs(job, f_name, buf, &pos, true);
+	if (ret)
+		return ret;
+
+	/* Page data */
+	pos = header->data_offset;
+	len = 0;
+	for_each_chk_entry(job, chunk, i) {
+		if (!chunk->entries[i].page)
+			continue;
+
+		memcpy(buf + len, (void *)chunk->entries[i].page, PAGE_SIZE);
+		len += PAGE_SIZE;
+		if (len == CHK_IO_SIZE) {
+			ret = chk_write(f_name, buf, len, &pos, O_WRONLY);
+			if (ret)
+				return ret;
+			len = 0;
+		}
+	}
+	if (len)
+		ret = chk_write(f_name, buf, len, &pos, O_WRONLY);
+	return ret;
+}
+
+/*
+ * The ptes captured by @job are clean and write-protected already, later
+ * incremental images would depend on the missing one. Make the next image
+ * a full one, unless the chain has been restarted meanwhile.
+ */
+static void checkpoint_write_failed(struct chk_job *job)
+{
+	struct lego_mm_struct *mm = job->mm;
+
+	down_write(&mm->mmap_sem);
+	if (mm->checkpoint_base == job->header.base_seq)
+		checkpoint_reset_base(mm);
+	up_write(&mm->mmap_sem);
+}
+
+static int checkpointd(void *_unused)
+{
+	void *buf;
+
+	set_cpus_allowed_ptr(current, cpu_active_mask);
+
+	buf = kmalloc(CHK_IO_SIZE, GFP_KERNEL);
+	if (!buf)
+		panic("Fail to allocate checkpointd buffer");
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&nr_checkpointd_jobs))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		spin_lock(&checkpointd_lock);
+		while (!list_empty(&checkpointd_queue)) {
+			struct chk_job *job;
+			int ret;
+
+			/* Dequeue from head, images of one process stay in order */
+			job = list_entry(checkpointd_queue.next,
+					 struct chk_job, next);
+
+			list_del_init(&job->next);
+			atomic_dec(&nr_checkpointd_jobs);
+			spin_unlock(&checkpointd_lock);
+
+			ret = checkpoint_write_image(job, buf);
+			if (ret) {
+				pr_err("checkpoint: fail to write image %u-%u seq %llu: %d\n",
+					job->header.node, job->header.pid,
+					(unsigned long long)job->header.seq, ret);
+				checkpoint_write_failed(job);
+			}
+			free_chk_job(job);
+
+			spin_lock(&checkpointd_lock);
+		}
+		spin_unlock(&checkpointd_lock);
+	}
+	BUG();
 	return 0;
 }
+
+void __init init_checkpoint_thread(void)
+{
+	checkpointd_task = kthread_run(checkpointd, NULL, "kcheckpointd");
+	if (IS_ERR(checkpointd_task))
+		panic("Fail to create kcheckpointd");
+}
+
+#else
+
+void handle_p2m_checkpoint(struct p2m_checkpoint_msg *payload,
+			   struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_checkpoint_reply *reply;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->ret = -ENOSYS;
+	reply->seq = 0;
+}
+
+#endif /* CONFIG_MEM_CHECKPOINT */
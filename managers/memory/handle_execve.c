@@ -15,6 +15,7 @@
 
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/task.h>
 #include <memory/loader.h>
 #include <memory/distvm.h>
 #include <memory/thread_pool.h>
@@ -46,36 +47,24 @@ debug_argv_envp_array(u32 argc, const char **argv, unsigned long *argv_len,
 { }
 #endif
 
-void handle_p2m_execve(struct p2m_execve_struct *payload,
-		       struct common_header *hdr, struct thpool_buffer *tb)
+static void do_handle_p2m_execve(struct lego_task_struct *tsk,
+				 struct p2m_execve_struct *payload,
+				 struct m2p_execve_struct *reply)
 {
 	__u32 argc, envc;
 	size_t len;
 	unsigned long *argv_len, *envp_len;
 	const char **argv, **envp;
 	const char *filename, *str;
-	__u32 pid;
-	struct lego_task_struct *tsk;
 	int i, ret;
 	__u64 new_ip, new_sp;
-	struct m2p_execve_struct *reply;
 
-	reply = thpool_buffer_tx(tb);
-	tb_set_tx_size(tb, sizeof(*reply));
-
-	pid = payload->pid;
 	argc = payload->argc;
 	envc = payload->envc;
 	filename = payload->filename;
 
 	execve_debug("pid:%u,argc:%u,envc:%u,file:%s",
-		pid, argc, envc, filename);
-
-	tsk = find_lego_task_by_pid(hdr->src_nid, pid);
-	if (!tsk) {
-		reply->status = RET_ESRCH;
-		return;
-	}
+		payload->pid, argc, envc, filename);
 
 	argv = kzalloc(sizeof(*argv) * (argc + envc), GFP_KERNEL);
 	if (!argv) {
@@ -139,3 +128,74 @@ out:
 	dump_reply(&reply->map);
 #endif
 }
+
+void handle_p2m_execve(struct p2m_execve_struct *payload,
+		       struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct lego_task_struct *tsk;
+	struct m2p_execve_struct *reply;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+
+	tsk = find_lego_task_by_pid(hdr->src_nid, payload->pid);
+	if (!tsk) {
+		reply->status = RET_ESRCH;
+		return;
+	}
+
+	do_handle_p2m_execve(tsk, payload, reply);
+}
+
+/*
+ * fork() + execve() of a new process. Since execve() replaces the
+ * address space anyway, the new task starts with an empty one
+ * instead of a copy of its parent's.
+ */
+void handle_p2m_spawn(struct p2m_spawn_struct *payload,
+		      struct common_header *hdr, struct thpool_buffer *tb)
+{
+	unsigned int nid = hdr->src_nid;
+	struct lego_task_struct *tsk;
+	struct m2p_execve_struct *reply;
+	int ret;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+
+	execve_debug("nid:%u,tgid:%u,parent_tgid:%u",
+		nid, payload->fork.tgid, payload->fork.parent_tgid);
+
+	/* Tasks are never freed, a reused pid may be there */
+	tsk = find_lego_task_by_pid(nid, payload->fork.tgid);
+	if (!tsk) {
+		tsk = alloc_forked_lego_task(&payload->fork, nid);
+		if (!tsk) {
+			reply->status = RET_ENOMEM;
+			return;
+		}
+
+		/* execve() swaps it with the loaded one */
+		tsk->mm = lego_mm_alloc(tsk, NULL);
+		if (!tsk->mm) {
+			free_lego_task_struct(tsk);
+			reply->status = RET_ENOMEM;
+			return;
+		}
+
+		ret = ht_insert_lego_task(tsk);
+		if (ret) {
+			lego_mmput(tsk->mm);
+			free_lego_task_struct(tsk);
+
+			/* Same process? */
+			tsk = find_lego_task_by_pid(nid, payload->fork.tgid);
+			if (!tsk) {
+				reply->status = RET_ESRCH;
+				return;
+			}
+		}
+	}
+
+	do_handle_p2m_execve(tsk, &payload->execve, reply);
+}
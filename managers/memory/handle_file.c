@@ -20,6 +20,8 @@
 
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/filemap.h>
+#include <memory/elf_cache.h>
 #include <memory/file_ops.h>
 #include <memory/pgcache.h>
 #include <memory/thread_pool.h>
@@ -136,6 +138,8 @@ void handle_p2m_write(struct p2m_read_write_payload *payload,
 #else
 	storage_node = STORAGE_NODE;
 #endif /* CONFIG_GSM */
+	filemap_invalidate(payload->filename, offset, payload->len);
+	elf_cache_invalidate(payload->filename);
 	*retval = lego_pgcache_write(NULL, payload->filename, storage_node, content,
 				     payload->len, &offset);
 #endif /* CONFIG_MEM_PAGE_CACHE */
@@ -155,8 +159,11 @@ void handle_p2m_drop_page_cache(struct common_header *hdr, struct thpool_buffer
 	retval = thpool_buffer_tx(tb);
 	tb_set_tx_size(tb, sizeof(*retval));
 
+	filemap_drop_all();
+	elf_cache_drop_all();
 #ifndef CONFIG_MEM_PAGE_CACHE
-	*retval = -EIO;
+	*retval = (IS_ENABLED(CONFIG_MEM_FILEMAP) ||
+		   IS_ENABLED(CONFIG_MEM_ELF_CACHE)) ? 0 : -EIO;
 #else
 	*retval = drop_pgcache();
 #endif
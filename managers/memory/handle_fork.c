@@ -9,6 +9,7 @@
 
 #include <lego/rbtree.h>
 #include <lego/slab.h>
+#include <lego/sched.h>
 #include <lego/fit_ibapi.h>
 
 #include <memory/vm.h>
@@ -16,6 +17,7 @@
 #include <memory/task.h>
 #include <memory/file_types.h>
 #include <memory/distvm.h>
+#include <memory/checkpoint.h>
 #include <memory/thread_pool.h>
 
 #ifdef CONFIG_DEBUG_HANDLE_FORK
@@ -406,6 +408,11 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 
 	down_write(&mm->mmap_sem);
 
+	/* ptes are copied below, read pages left in checkpoint images first */
+	ret = checkpoint_restore_populate(oldmm);
+	if (ret)
+		goto out;
+
 	mm->total_vm = oldmm->total_vm;
 	mm->data_vm = oldmm->data_vm;
 	mm->exec_vm = oldmm->exec_vm;
@@ -476,6 +483,11 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 
 	down_write(&mm->mmap_sem);
 
+	/* ptes are copied below, read pages left in checkpoint images first */
+	ret = checkpoint_restore_populate(oldmm);
+	if (ret)
+		goto out;
+
 	mm->total_vm = oldmm->total_vm;
 	mm->data_vm = oldmm->data_vm;
 	mm->exec_vm = oldmm->exec_vm;
@@ -560,11 +572,24 @@ out:
  */
 static int dup_lego_mm(struct lego_task_struct *t,
 		       struct lego_task_struct *parent,
+		       unsigned long clone_flags,
 		       struct fork_reply_struct *reply)
 {
 	struct lego_mm_struct *mm, *oldmm;
 	int err;
 
+	/*
+	 * vfork() child borrows parent's mm until it calls execve(),
+	 * which puts this reference. Processor does not walk its
+	 * page table either, so reply no VMA.
+	 */
+	if (parent && clone_borrows_vm(clone_flags)) {
+		atomic_inc(&parent->mm->mm_users);
+		t->mm = parent->mm;
+		reply->vma_count = 0;
+		return 0;
+	}
+
 	mm = lego_mm_alloc(t, parent);
 	if (!mm)
 		return -ENOMEM;
@@ -591,6 +616,33 @@ out:
 	return err;
 }
 
+/*
+ * Allocate the task of a new process described by @payload.
+ * Its mm is left to the caller.
+ *
+ * All threads within process share one VM
+ * So we actually use tgid (thread-group-id) to create
+ * a lego-tsk entity.
+ *
+ * All following requests sent from processor must use tgid.
+ */
+struct lego_task_struct *
+alloc_forked_lego_task(struct p2m_fork_struct *payload, unsigned int nid)
+{
+	struct lego_task_struct *tsk;
+
+	tsk = alloc_lego_task_struct();
+	if (!tsk)
+		return NULL;
+
+	tsk->pid = payload->tgid;
+	tsk->parent_pid = payload->parent_tgid;
+	tsk->node = nid;
+	mem_set_memory_home_node(tsk, LEGO_LOCAL_NID);
+	lego_set_task_comm(tsk, payload->comm);
+	return tsk;
+}
+
 /*
  * The flow of this function:
  * 1) allocate task struct, duplicate VMA info
@@ -619,28 +671,14 @@ void handle_p2m_fork(struct p2m_fork_struct *payload,
 	if (!parent && parent_tgid != 1)
 		WARN_ONCE(1, "From processor-daemon?");
 
-	tsk = alloc_lego_task_struct();
+	tsk = alloc_forked_lego_task(payload, nid);
 	if (!tsk) {
 		reply->ret = -ENOMEM;
 		return;
 	}
 
-	/*
-	 * All threads within process share one VM
-	 * So we actually use tgid (thread-group-id) to create
-	 * a lego-tsk entity.
-	 *
-	 * All following requests sent from processor must use tgid.
-	 */
-
-	tsk->pid = tgid;
-	tsk->parent_pid = parent_tgid;
-	tsk->node = nid;
-	mem_set_memory_home_node(tsk, LEGO_LOCAL_NID);
-	lego_set_task_comm(tsk, payload->comm);
-
 	/* Duplicate the mmap from parent */
-	reply->ret = dup_lego_mm(tsk, parent, reply);
+	reply->ret = dup_lego_mm(tsk, parent, payload->clone_flags, reply);
 	if (reply->ret) {
 		WARN_ONCE(1, "Fail to dup mm");
 		free_lego_task_struct(tsk);
@@ -690,6 +690,37 @@ out:
 }
 #endif /* CONFIG_DISTRIBUTED_VMA_MEMORY */
 
+void handle_p2m_madvise(struct p2m_madvise_struct *payload,
+			struct common_header *hdr, struct thpool_buffer *tb)
+{
+	u32 nid = hdr->src_nid;
+	u32 pid = payload->pid;
+	struct lego_task_struct *tsk;
+	struct p2m_madvise_reply_struct *reply;
+
+	mmap_debug("src_nid:%u, pid:%u, start:%#Lx, len:%#Lx, behavior:%u, zap:%u",
+		   nid, pid, payload->start, payload->len, payload->behavior,
+		   payload->zap);
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->flags = 0;
+
+	tsk = find_lego_task_by_pid(nid, pid);
+	if (unlikely(!tsk)) {
+		reply->ret = -ESRCH;
+		return;
+	}
+
+#ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
+	/* vmas are spread over memory nodes, processor does not ask */
+	reply->ret = -ENOSYS;
+#else
+	reply->ret = do_madvise(tsk->mm, payload->start, payload->len,
+				payload->behavior, payload->zap, &reply->flags);
+#endif
+}
+
 void handle_p2m_mprotect(struct p2m_mprotect_struct *payload,
 			 struct thpool_buffer *tb)
 {
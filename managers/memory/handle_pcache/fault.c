@@ -192,7 +192,7 @@ void handle_p2m_flush_one(struct p2m_flush_msg *msg, struct thpool_buffer *tb)
 	}
 
 	down_read(&p->mm->mmap_sem);
-	ret = get_user_pages(p, msg->user_va, 1, 0, &dst_page, NULL);
+	ret = get_user_pages(p, msg->user_va, 1, FOLL_WRITE, &dst_page, NULL);
 	up_read(&p->mm->mmap_sem);
 	if (likely(ret == 1)) {
 		memcpy((void *)dst_page, msg->pcacheline, PCACHE_LINE_SIZE);
@@ -230,7 +230,7 @@ static void do_piggyback_flush(void *_msg, unsigned int src_nid,
 	}
 
 	down_read(&flush_task->mm->mmap_sem);
-	ret = get_user_pages(flush_task, flush_msg->user_va, 1, 0, &dst_page, NULL);
+	ret = get_user_pages(flush_task, flush_msg->user_va, 1, FOLL_WRITE, &dst_page, NULL);
 	up_read(&flush_task->mm->mmap_sem);
 
 	if (likely(ret == 1))
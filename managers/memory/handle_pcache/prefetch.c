@@ -13,6 +13,7 @@
 #include <lego/comp_storage.h>
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/checkpoint.h>
 #include <processor/pcache.h>
 
 #ifdef CONFIG_MEM_PREFETCH
@@ -36,6 +37,10 @@ void do_mmap_prefetch(struct lego_task_struct *p, u64 vaddr,
 		goto unlock;
 	}
 
+	/* Empty ptes may still have their pages in checkpoint images */
+	if (unlikely(checkpoint_restoring(mm)))
+		goto unlock;
+
 	/* file backed pages */
 	if (unlikely(round_down(vaddr, PAGE_SIZE) + PAGE_SIZE*nr_pages)
 			> vma->vm_end)
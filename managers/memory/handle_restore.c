@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Process restore, memory side.
+ *
+ * P2M_RESTORE replaces the address space of the caller with VMAs of the
+ * latest image, and returns the process snapshot. No page is read at
+ * that point. Only the page addresses of images base_seq..seq are loaded,
+ * which are sorted already. A pte_none fault looks up the latest image
+ * holding the address, and reads the page from there, along with its
+ * neighbours that are contiguous in the same image. Pages not in any
+ * image are handled as usual, i.e., zero-filled or read from file.
+ *
+ * The hot set of the latest image is prefetched by krestored in
+ * background. Prefetched ptes are old, so that the next checkpoint
+ * only records pages that are really used.
+ *
+ * mm->checkpoint_restore is changed with mmap_sem held for write,
+ * and used with mmap_sem held for read. fork() and mremap() read all
+ * remaining pages first, since they move or copy ptes, and then drop it.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
+#include <lego/comp_common.h>
+
+#include <memory/vm.h>
+#include <memory/pid.h>
+#include <memory/task.h>
+#include <memory/stat.h>
+#include <memory/file_ops.h>
+#include <memory/checkpoint.h>
+#include <memory/vm-pgtable.h>
+#include <memory/thread_pool.h>
+
+#ifdef CONFIG_MEM_CHECKPOINT
+
+#define CHK_IO_NR_PAGES		(CHK_IO_SIZE / PAGE_SIZE)
+
+/* Set in an address of chk_restore_image->addrs if it is unmapped */
+#define CHK_ADDR_DEAD		0x1ULL
+
+struct chk_restore_image {
+	char			f_name[MAX_FILENAME_LENGTH];
+	__u64			*addrs;
+	unsigned long		nr_pages;
+	__u64			data_offset;
+};
+
+struct chk_restore {
+	unsigned int		nr_images;
+	struct chk_restore_image images[0];	/* base_seq first */
+};
+
+struct chk_prefetch {
+	struct list_head	next;
+	struct lego_mm_struct	*mm;
+	__u64			*hot;
+	unsigned long		nr_hot;
+};
+
+static DEFINE_SPINLOCK(restored_lock);
+static LIST_HEAD(restored_queue);
+static atomic_t nr_restored_jobs;
+
+static struct task_struct *restored_task;
+
+static int chk_read(char *f_name, void *buf, size_t count, loff_t *pos)
+{
+	ssize_t ret;
+
+	while (count) {
+		size_t len = min_t(size_t, count, CHK_IO_SIZE);
+
+		ret = __storage_read(NULL, f_name, (char __user *)buf, len, pos);
+		if (ret != len)
+			return ret < 0 ? ret : -EIO;
+
+		*pos += len;
+		buf += len;
+		count -= len;
+	}
+	return 0;
+}
+
+static void chk_free_restore(struct chk_restore *rs)
+{
+	unsigned int i;
+
+	for (i = 0; i < rs->nr_images; i++)
+		kfree(rs->images[i].addrs);
+	kfree(rs);
+}
+
+/* Index of the first address of @image that is not below @address */
+static unsigned long chk_image_search(struct chk_restore_image *image,
+				      unsigned long address)
+{
+	unsigned long lo = 0, hi = image->nr_pages, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((image->addrs[mid] & PAGE_MASK) < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Find the latest image that holds @address, and its index there.
+ * Return NULL if none does, or the address was unmapped since restore.
+ */
+static struct chk_restore_image *
+chk_restore_lookup(struct chk_restore *rs, unsigned long address,
+		   unsigned long *idx)
+{
+	struct chk_restore_image *image;
+	unsigned long i;
+	int n;
+
+	for (n = rs->nr_images - 1; n >= 0; n--) {
+		image = &rs->images[n];
+
+		i = chk_image_search(image, address);
+		if (i == image->nr_pages ||
+		    (image->addrs[i] & PAGE_MASK) != address)
+			continue;
+
+		if (image->addrs[i] & CHK_ADDR_DEAD)
+			return NULL;
+		*idx = i;
+		return image;
+	}
+	return NULL;
+}
+
+static bool chk_pte_none(struct lego_mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = lego_pgd_offset(mm, address);
+	if (pgd_none(*pgd))
+		return true;
+
+	pud = lego_pud_offset(pgd, address);
+	if (pud_none(*pud))
+		return true;
+
+	pmd = lego_pmd_offset(pud, address);
+	if (pmd_none(*pmd))
+		return true;
+
+	return pte_none(*lego_pte_offset(pmd, address));
+}
+
+static pmd_t *chk_pmd_alloc(struct lego_mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = lego_pgd_offset(mm, address);
+	pud = lego_pud_alloc(mm, pgd, address);
+	if (!pud)
+		return NULL;
+	pmd = lego_pmd_alloc(mm, pud, address);
+	if (!pmd)
+		return NULL;
+	if (!lego_pte_alloc(mm, pmd, address))
+		return NULL;
+	return pmd;
+}
+
+/* Map @page at @address, unless someone has done it already */
+static void chk_install_page(struct vm_area_struct *vma, unsigned long address,
+			     pmd_t *pmd, unsigned long page, bool young)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	spinlock_t *ptl;
+	pte_t *pte, entry;
+
+	entry = lego_vfn_pte(((signed long)page >> PAGE_SHIFT),
+			     vma->vm_page_prot);
+	if (vma->vm_flags & VM_WRITE)
+		entry = pte_mkwrite(pte_mkdirty(entry));
+	if (!young)
+		entry = pte_mkold(entry);
+
+	pte = lego_pte_offset_lock(mm, pmd, address, &ptl);
+	if (pte_none(*pte)) {
+		pte_set(pte, entry);
+		page = 0;
+	}
+	lego_pte_unlock(pte, ptl);
+
+	if (page)
+		free_page(page);
+}
+
+/*
+ * Read pages of @image starting from addrs[@idx] with one request, as
+ * long as they are contiguous both in address and in the image, below
+ * @end, and not in later images. Map the ones whose pte is still empty.
+ * Only the first one is young if @young.
+ *
+ * Return the number of pages read, or -errno. Caller holds mmap_sem.
+ */
+static long chk_read_run(struct lego_mm_struct *mm, struct vm_area_struct *vma,
+			 struct chk_restore_image *image, unsigned long idx,
+			 unsigned long end, bool young)
+{
+	struct chk_restore *rs = mm->checkpoint_restore;
+	unsigned long pages[CHK_IO_NR_PAGES];
+	unsigned long start = image->addrs[idx];
+	unsigned long addr, i, n, unused;
+	ssize_t ret;
+	pmd_t *pmd;
+
+	for (n = 1; n < CHK_IO_NR_PAGES && idx + n < image->nr_pages; n++) {
+		addr = start + n * PAGE_SIZE;
+		if (addr >= end || image->addrs[idx + n] != addr)
+			break;
+		if (chk_restore_lookup(rs, addr, &unused) != image)
+			break;
+	}
+
+	memset(pages, 0, sizeof(pages));
+	for (i = 0; i < n; i++) {
+		if (!chk_pte_none(mm, start + i * PAGE_SIZE))
+			continue;
+
+		pages[i] = __get_free_page(GFP_KERNEL);
+		if (unlikely(!pages[i])) {
+			ret = -ENOMEM;
+			goto free;
+		}
+	}
+
+	ret = storage_read_pages(NULL, image->f_name, pages, n,
+				 image->data_offset + idx * PAGE_SIZE);
+	if (unlikely(ret != n * PAGE_SIZE)) {
+		ret = ret < 0 ? ret : -EIO;
+		goto free;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!pages[i])
+			continue;
+
+		addr = start + i * PAGE_SIZE;
+		pmd = chk_pmd_alloc(mm, addr);
+		if (unlikely(!pmd)) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		chk_install_page(vma, addr, pmd, pages[i], young && !i);
+		pages[i] = 0;
+	}
+	return n;
+
+free:
+	for (i = 0; i < n; i++) {
+		if (pages[i])
+			free_page(pages[i]);
+	}
+	return ret;
+}
+
+/*
+ * Called for a pte_none fault of a mm that is being restored.
+ * Return 0 if @address is not in the images, and the fault goes on
+ * as usual. Otherwise the page is read from its image, together with
+ * a few neighbours, and VM_FAULT_NOPAGE is returned.
+ */
+int checkpoint_restore_fault(struct vm_area_struct *vma, unsigned long address,
+			     pmd_t *pmd, unsigned long *mapping_flags)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	struct chk_restore_image *image;
+	unsigned long idx;
+	long ret;
+
+	address &= PAGE_MASK;
+	image = chk_restore_lookup(mm->checkpoint_restore, address, &idx);
+	if (!image)
+		return 0;
+
+	ret = chk_read_run(mm, vma, image, idx, vma->vm_end, true);
+	if (unlikely(ret < 0))
+		return ret == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+
+	inc_mm_stat(NR_RESTORE_FAULT);
+	if (mapping_flags)
+		*mapping_flags = vma->vm_file ? PCACHE_MAPPING_FILE :
+						PCACHE_MAPPING_ANON;
+	return VM_FAULT_NOPAGE;
+}
+
+/* Pages within [@start, @end) are gone. Caller holds mmap_sem for write */
+void checkpoint_restore_unmap(struct lego_mm_struct *mm,
+			      unsigned long start, unsigned long end)
+{
+	struct chk_restore *rs = mm->checkpoint_restore;
+	struct chk_restore_image *image;
+	unsigned long i;
+	unsigned int n;
+
+	if (!rs)
+		return;
+
+	for (n = 0; n < rs->nr_images; n++) {
+		image = &rs->images[n];
+
+		for (i = chk_image_search(image, start);
+		     i < image->nr_pages && (image->addrs[i] & PAGE_MASK) < end; i++)
+			image->addrs[i] |= CHK_ADDR_DEAD;
+	}
+}
+
+/*
+ * Read all pages left in the images, and stop restoring.
+ * Caller holds mmap_sem for write.
+ */
+int checkpoint_restore_populate(struct lego_mm_struct *mm)
+{
+	struct chk_restore *rs = mm->checkpoint_restore;
+	struct chk_restore_image *image, *latest;
+	struct vm_area_struct *vma;
+	unsigned long i, idx, address;
+	long ret;
+	int n;
+
+	if (!rs)
+		return 0;
+
+	for (n = rs->nr_images - 1; n >= 0; n--) {
+		image = &rs->images[n];
+
+		for (i = 0; i < image->nr_pages; i += ret) {
+			ret = 1;
+			address = image->addrs[i];
+			if (address & CHK_ADDR_DEAD)
+				continue;
+
+			latest = chk_restore_lookup(rs, address, &idx);
+			if (latest != image || !chk_pte_none(mm, address))
+				continue;
+
+			vma = find_vma(mm, address);
+			if (WARN_ON_ONCE(!vma || vma->vm_start > address))
+				continue;
+
+			ret = chk_read_run(mm, vma, image, i, vma->vm_end, false);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	mm->checkpoint_restore = NULL;
+	chk_free_restore(rs);
+	return 0;
+}
+
+void checkpoint_restore_exit(struct lego_mm_struct *mm)
+{
+	if (mm->checkpoint_restore) {
+		chk_free_restore(mm->checkpoint_restore);
+		mm->checkpoint_restore = NULL;
+	}
+}
+
+static int chk_load_image(struct chk_restore_image *image,
+			  struct chk_image_header *header, unsigned int node,
+			  unsigned int pid, unsigned long seq, unsigned long base_seq)
+{
+	loff_t pos = 0;
+	int ret;
+
+	chk_image_name(image->f_name, node, pid, seq);
+
+	ret = chk_read(image->f_name, header, sizeof(*header), &pos);
+	if (ret)
+		return ret;
+	if (header->magic != CHK_IMAGE_MAGIC || header->seq != seq ||
+	    header->base_seq != base_seq)
+		return -EINVAL;
+
+	image->nr_pages = header->nr_pages;
+	image->data_offset = header->data_offset;
+	if (!image->nr_pages)
+		return 0;
+
+	image->addrs = kmalloc(sizeof(__u64) * image->nr_pages, GFP_KERNEL);
+	if (!image->addrs)
+		return -ENOMEM;
+
+	pos = sizeof(*header) + header->ss_len +
+	      sizeof(struct chk_image_vma) * header->nr_vmas;
+	return chk_read(image->f_name, image->addrs,
+			sizeof(__u64) * image->nr_pages, &pos);
+}
+
+/*
+ * Load page addresses of images base_seq..@seq.
+ * The header of image @seq is returned in @latest.
+ */
+static struct chk_restore *
+chk_load_images(unsigned int node, unsigned int pid, unsigned long seq,
+		struct chk_image_header *latest)
+{
+	struct chk_image_header *header;
+	struct chk_restore *rs;
+	unsigned long nr, i;
+	char f_name[MAX_FILENAME_LENGTH];
+	loff_t pos = 0;
+	int ret;
+
+	chk_image_name(f_name, node, pid, seq);
+	ret = chk_read(f_name, latest, sizeof(*latest), &pos);
+	if (ret)
+		return ERR_PTR(ret);
+	if (latest->magic != CHK_IMAGE_MAGIC || latest->seq != seq ||
+	    !latest->base_seq || latest->base_seq > seq)
+		return ERR_PTR(-EINVAL);
+
+	header = kmalloc(sizeof(*header), GFP_KERNEL);
+	if (!header)
+		return ERR_PTR(-ENOMEM);
+
+	nr = seq - latest->base_seq + 1;
+	rs = kzalloc(sizeof(*rs) + nr * sizeof(rs->images[0]), GFP_KERNEL);
+	if (!rs) {
+		kfree(header);
+		return ERR_PTR(-ENOMEM);
+	}
+	rs->nr_images = nr;
+
+	for (i = 0; i < nr; i++) {
+		ret = chk_load_image(&rs->images[i], header, node, pid,
+				     latest->base_seq + i, latest->base_seq);
+		if (ret) {
+			pr_err("checkpoint: fail to load image %u-%u seq %llu: %d\n",
+				node, pid, (unsigned long long)(latest->base_seq + i), ret);
+			chk_free_restore(rs);
+			rs = ERR_PTR(ret);
+			break;
+		}
+	}
+
+	kfree(header);
+	return rs;
+}
+
+static int chk_build_vma(struct lego_task_struct *tsk, struct lego_mm_struct *mm,
+			 struct chk_image_vma *src)
+{
+	struct vm_area_struct *vma;
+	struct lego_file *file;
+	int ret;
+
+	vma = kzalloc(sizeof(*vma), GFP_KERNEL);
+	if (!vma)
+		return -ENOMEM;
+
+	vma->vm_mm = mm;
+	vma->vm_start = src->vm_start;
+	vma->vm_end = src->vm_end;
+	vma->vm_flags = src->vm_flags;
+	vma->vm_pgoff = src->vm_pgoff;
+	vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+
+	if (src->filename[0]) {
+		file = file_open(tsk, src->filename);
+		if (IS_ERR(file)) {
+			kfree(vma);
+			return PTR_ERR(file);
+		}
+
+		/* The reference from open is the vma's one */
+		vma->vm_file = file;
+		ret = file->f_op->mmap(tsk, file, vma);
+		if (ret)
+			goto out;
+	}
+
+	ret = insert_vm_struct(mm, vma);
+	if (ret)
+		goto out;
+
+	mm->total_vm += vma_pages(vma);
+	return 0;
+
+out:
+	if (vma->vm_file)
+		file_close(vma->vm_file);
+	kfree(vma);
+	return ret;
+}
+
+static struct lego_mm_struct *
+chk_build_mm(struct lego_task_struct *tsk, struct chk_image_header *header,
+	     struct chk_image_vma *vmas)
+{
+	struct lego_mm_struct *mm;
+	unsigned long i;
+	int ret;
+
+	mm = lego_mm_alloc(tsk, NULL);
+	if (!mm)
+		return ERR_PTR(-ENOMEM);
+
+	arch_pick_mmap_layout(mm);
+	mm->task_size = TASK_SIZE;
+
+	mm->start_code = header->start_code;
+	mm->end_code = header->end_code;
+	mm->start_data = header->start_data;
+	mm->end_data = header->end_data;
+	mm->start_brk = header->start_brk;
+	mm->brk = header->brk;
+	mm->start_stack = header->start_stack;
+	mm->arg_start = header->arg_start;
+	mm->arg_end = header->arg_end;
+	mm->env_start = header->env_start;
+	mm->env_end = header->env_end;
+	memcpy(mm->saved_auxv, header->saved_auxv, sizeof(mm->saved_auxv));
+
+	for (i = 0; i < header->nr_vmas; i++) {
+		ret = chk_build_vma(tsk, mm, &vmas[i]);
+		if (ret) {
+			lego_mmput(mm);
+			return ERR_PTR(ret);
+		}
+	}
+	return mm;
+}
+
+/* @job->hot is freed by krestored */
+static void enqueue_restored_job(struct chk_prefetch *job)
+{
+	spin_lock(&restored_lock);
+	list_add_tail(&job->next, &restored_queue);
+	atomic_inc(&nr_restored_jobs);
+	spin_unlock(&restored_lock);
+
+	wake_up_process(restored_task);
+}
+
+static int chk_queue_prefetch(struct lego_mm_struct *mm, __u64 *hot,
+			      unsigned long nr_hot)
+{
+	struct chk_prefetch *job;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	/* Hold the mm until prefetch is done */
+	atomic_inc(&mm->mm_users);
+
+	job->mm = mm;
+	job->hot = hot;
+	job->nr_hot = nr_hot;
+	enqueue_restored_job(job);
+	return 0;
+}
+
+void handle_p2m_restore(struct p2m_restore_msg *payload,
+			struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_restore_reply *reply;
+	struct chk_image_header *header;
+	struct chk_image_vma *vmas = NULL;
+	struct lego_mm_struct *mm, *old_mm;
+	struct lego_task_struct *tsk;
+	struct chk_restore *rs;
+	__u64 *hot = NULL;
+	char *f_name;
+	loff_t pos;
+	int ret;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->len = 0;
+
+	tsk = find_lego_task_by_pid(hdr->src_nid, payload->pid);
+	if (unlikely(!tsk)) {
+		reply->ret = -ESRCH;
+		return;
+	}
+
+	header = kmalloc(sizeof(*header), GFP_KERNEL);
+	if (!header) {
+		reply->ret = -ENOMEM;
+		return;
+	}
+
+	rs = chk_load_images(payload->image_node, payload->image_pid,
+			     payload->seq, header);
+	if (IS_ERR(rs)) {
+		ret = PTR_ERR(rs);
+		rs = NULL;
+		goto out;
+	}
+
+	if (header->ss_len > P2M_CHECKPOINT_MAX_SIZE - sizeof(*reply)) {
+		ret = -E2BIG;
+		goto out;
+	}
+
+	/* The latest image has the snapshot, VMAs and the hot set */
+	f_name = rs->images[rs->nr_images - 1].f_name;
+	pos = sizeof(*header);
+	ret = chk_read(f_name, (void *)reply + sizeof(*reply), header->ss_len, &pos);
+	if (ret)
+		goto out;
+
+	ret = -ENOMEM;
+	vmas = kcalloc(header->nr_vmas, sizeof(*vmas), GFP_KERNEL);
+	if (header->nr_vmas && !vmas)
+		goto out;
+	ret = chk_read(f_name, vmas, sizeof(*vmas) * header->nr_vmas, &pos);
+	if (ret)
+		goto out;
+
+	if (header->nr_hot) {
+		ret = -ENOMEM;
+		hot = kmalloc(sizeof(*hot) * header->nr_hot, GFP_KERNEL);
+		if (!hot)
+			goto out;
+
+		pos += sizeof(__u64) * header->nr_pages;
+		ret = chk_read(f_name, hot, sizeof(*hot) * header->nr_hot, &pos);
+		if (ret)
+			goto out;
+	}
+
+	mm = chk_build_mm(tsk, header, vmas);
+	if (IS_ERR(mm)) {
+		ret = PTR_ERR(mm);
+		goto out;
+	}
+	mm->checkpoint_restore = rs;
+	rs = NULL;
+
+	/* Same as execve(), the old mm goes away */
+	lego_task_lock(tsk);
+	old_mm = tsk->mm;
+	tsk->mm = mm;
+	lego_task_unlock(tsk);
+	lego_mmput(old_mm);
+
+	/* The process runs fine without prefetch */
+	if (hot && !chk_queue_prefetch(mm, hot, header->nr_hot))
+		hot = NULL;
+
+	reply->len = header->ss_len;
+	tb_set_tx_size(tb, sizeof(*reply) + header->ss_len);
+	ret = 0;
+
+out:
+	reply->ret = ret;
+	if (rs)
+		chk_free_restore(rs);
+	kfree(hot);
+	kfree(vmas);
+	kfree(header);
+}
+
+/*
+ * Prefetch the hot pages that contiguous to @hot[0] with one request.
+ * Return the number of @hot consumed, or -errno.
+ */
+static long chk_prefetch_run(struct lego_mm_struct *mm, __u64 *hot,
+			     unsigned long nr_hot)
+{
+	struct chk_restore_image *image;
+	struct vm_area_struct *vma;
+	unsigned long address = hot[0], idx, n;
+
+	image = chk_restore_lookup(mm->checkpoint_restore, address, &idx);
+	if (!image || !chk_pte_none(mm, address))
+		return 1;
+
+	vma = find_vma(mm, address);
+	if (!vma || vma->vm_start > address)
+		return 1;
+
+	for (n = 1; n < nr_hot && hot[n] == address + n * PAGE_SIZE; n++)
+		;
+
+	return chk_read_run(mm, vma, image, idx,
+			    min(address + n * PAGE_SIZE, vma->vm_end), false);
+}
+
+static void chk_prefetch(struct chk_prefetch *job)
+{
+	struct lego_mm_struct *mm = job->mm;
+	unsigned long i = 0;
+	long ret;
+
+	while (i < job->nr_hot) {
+		/* The process has exited */
+		if (atomic_read(&mm->mm_users) == 1)
+			break;
+
+		/* Drop mmap_sem between requests, faults go first */
+		down_read(&mm->mmap_sem);
+		if (!mm->checkpoint_restore) {
+			up_read(&mm->mmap_sem);
+			break;
+		}
+		ret = chk_prefetch_run(mm, job->hot + i, job->nr_hot - i);
+		up_read(&mm->mmap_sem);
+
+		if (ret < 0) {
+			pr_err("checkpoint: prefetch of %u-%s failed: %ld\n",
+				mm->task->pid, mm->task->comm, ret);
+			break;
+		}
+		if (ret > 1 || i + 1 == job->nr_hot)
+			inc_mm_stat(NR_RESTORE_PREFETCH);
+		i += ret;
+	}
+	lego_mmput(mm);
+}
+
+static int restored(void *_unused)
+{
+	set_cpus_allowed_ptr(current, cpu_active_mask);
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&nr_restored_jobs))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		spin_lock(&restored_lock);
+		while (!list_empty(&restored_queue)) {
+			struct chk_prefetch *job;
+
+			job = list_entry(restored_queue.next,
+					 struct chk_prefetch, next);
+
+			list_del_init(&job->next);
+			atomic_dec(&nr_restored_jobs);
+			spin_unlock(&restored_lock);
+
+			chk_prefetch(job);
+			kfree(job->hot);
+			kfree(job);
+
+			spin_lock(&restored_lock);
+		}
+		spin_unlock(&restored_lock);
+	}
+	BUG();
+	return 0;
+}
+
+void __init init_restore_thread(void)
+{
+	restored_task = kthread_run(restored, NULL, "krestored");
+	if (IS_ERR(restored_task))
+		panic("Fail to create krestored");
+}
+
+#else
+
+void handle_p2m_restore(struct p2m_restore_msg *payload,
+			struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_restore_reply *reply;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->ret = -ENOSYS;
+	reply->len = 0;
+}
+
+#endif /* CONFIG_MEM_CHECKPOINT */
@@ -28,6 +28,7 @@
 #include <memory/loader.h>
 #include <memory/file_ops.h>
 #include <memory/distvm.h>
+#include <memory/elf_cache.h>
 
 /*
  * The least possible virtual address a process can map to:
@@ -313,10 +314,15 @@ int exec_loader(struct lego_task_struct *tsk, const char *filename,
 	if (retval)
 		goto out;
 
-	/* Read the binary format header from the file */
-	retval = file_read(tsk, bprm->file, bprm->buf, BINPRM_BUF_SIZE, &offset);
-	if (WARN_ON(retval < 0))
-		goto out;
+	/* Read the binary format header from the file, or the cache */
+	bprm->image = elf_image_get(tsk, bprm->file);
+	if (bprm->image) {
+		memcpy(bprm->buf, bprm->image->buf, BINPRM_BUF_SIZE);
+	} else {
+		retval = file_read(tsk, bprm->file, bprm->buf, BINPRM_BUF_SIZE, &offset);
+		if (WARN_ON(retval < 0))
+			goto out;
+	}
 
 	/*
 	 * They will install the new mm and release the old mm,
@@ -331,6 +337,7 @@ int exec_loader(struct lego_task_struct *tsk, const char *filename,
 	remove_reply_buffer(tsk->mm);
 #endif
 
+	elf_image_put(bprm->image);
 	kfree(bprm);
 
 #ifdef CONFIG_DEBUG_LOADER
@@ -343,6 +350,7 @@ int exec_loader(struct lego_task_struct *tsk, const char *filename,
 	return 0;
 
 out:
+	elf_image_put(bprm->image);
 	if (bprm->mm)
 		lego_mmput(bprm->mm);
 out_free:
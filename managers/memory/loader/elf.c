@@ -26,6 +26,7 @@
 #include <memory/elf.h>
 #include <memory/loader.h>
 #include <memory/file_ops.h>
+#include <memory/elf_cache.h>
 
 #define ELF_MIN_ALIGN		PAGE_SIZE
 #define ELF_CORE_EFLAGS		0
@@ -342,13 +343,15 @@ static unsigned long total_mapping_size(struct elf_phdr *cmds, int nr)
  * @tsk:      lego task struct
  * @elf_ex:   ELF header of the binary whose program headers should be loaded
  * @elf_file: ELF binary file
+ * @image:    cached headers of elf_file, or NULL
  *
  * Loads ELF program headers from the binary file elf_file, which has the ELF
  * header pointed to by elf_ex, into a newly allocated array. The caller is
  * responsible for freeing the allocated data. Returns an ERR_PTR upon failure.
  */
 static struct elf_phdr *load_elf_phdrs(struct lego_task_struct *tsk,
-			struct elfhdr *elf_ex, struct lego_file *elf_file)
+			struct elfhdr *elf_ex, struct lego_file *elf_file,
+			struct elf_image *image)
 {
 	struct elf_phdr *elf_phdata = NULL;
 	int retval, size, err = -1;
@@ -375,6 +378,12 @@ static struct elf_phdr *load_elf_phdrs(struct lego_task_struct *tsk,
 	if (!elf_phdata)
 		goto out;
 
+	if (image) {
+		memcpy(elf_phdata, image->phdrs, size);
+		err = 0;
+		goto out;
+	}
+
 	/* Read in the program headers */
 	pos = elf_ex->e_phoff;
 	retval= file_read(tsk, elf_file, (char *)elf_phdata, size, &pos);
@@ -525,6 +534,7 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 			   u64 *new_ip, u64 *new_sp, unsigned long *argv_len, unsigned long *envp_len)
 {
 	struct lego_file *interpreter = NULL;
+	struct elf_image *interp_image = NULL;
 	char *elf_interpreter = NULL;
  	unsigned long load_addr = 0, load_bias = 0;
 	int load_addr_set = 0;
@@ -573,7 +583,7 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 	if (!elf_check_arch(&loc->elf_ex))
 		goto out;
 
-	elf_phdata = load_elf_phdrs(tsk, &loc->elf_ex, bprm->file);
+	elf_phdata = load_elf_phdrs(tsk, &loc->elf_ex, bprm->file, bprm->image);
 	if (!elf_phdata)
 		goto out;
 
@@ -609,9 +619,14 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 				goto out_free_ph;
 
 			/* Get ELF interpreter file name */
-			retval = kernel_read(tsk, bprm->file, elf_ppnt->p_offset,
-					     elf_interpreter,
-					     elf_ppnt->p_filesz);
+			if (bprm->image) {
+				memcpy(elf_interpreter, bprm->image->interp,
+				       elf_ppnt->p_filesz);
+				retval = elf_ppnt->p_filesz;
+			} else
+				retval = kernel_read(tsk, bprm->file, elf_ppnt->p_offset,
+						     elf_interpreter,
+						     elf_ppnt->p_filesz);
 			if (retval != elf_ppnt->p_filesz) {
 				WARN_ON(1);
 				if (retval >= 0)
@@ -632,9 +647,15 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 				goto out_free_interp;
 
 			/* Get the exec headers */
-			retval = kernel_read(tsk, interpreter, 0,
-					     (void *)&loc->interp_elf_ex,
-					     sizeof(loc->interp_elf_ex));
+			interp_image = elf_image_get(tsk, interpreter);
+			if (interp_image) {
+				memcpy(&loc->interp_elf_ex, interp_image->buf,
+				       sizeof(loc->interp_elf_ex));
+				retval = sizeof(loc->interp_elf_ex);
+			} else
+				retval = kernel_read(tsk, interpreter, 0,
+						     (void *)&loc->interp_elf_ex,
+						     sizeof(loc->interp_elf_ex));
 			if (retval != sizeof(loc->interp_elf_ex)) {
 				WARN_ON(1);
 				if (retval >= 0)
@@ -671,9 +692,12 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 
 		/* Load the interpreter program headers */
 		interp_elf_phdata = load_elf_phdrs(tsk, &loc->interp_elf_ex,
-						   interpreter);
+						   interpreter, interp_image);
 		if (!interp_elf_phdata)
 			goto out_free_dentry;
+
+		elf_image_put(interp_image);
+		interp_image = NULL;
 	}
 
 	/*
@@ -939,6 +963,9 @@ static int load_elf_binary(struct lego_task_struct *tsk, struct lego_binprm *bpr
 		kfree(interp_elf_phdata);
 	kfree(elf_phdata);
 
+	/* Save the text faults of binaries executed over and over again */
+	elf_cache_map_text(tsk->mm);
+
 #ifdef ARCH_HAS_SETUP_ADDITIONAL_PAGES
 	/*
 	 * TODO: vdso
@@ -975,6 +1002,7 @@ out_ret:
 
 	/* error cleanup */
 out_free_dentry:
+	elf_image_put(interp_image);
 	kfree(interp_elf_phdata);
 	if (interpreter)
 		put_lego_file(interpreter);
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * ELF header cache
+ *
+ * execve() of a binary needs its ELF header, program headers, and the
+ * path of its interpreter, and then the same for the interpreter. Each
+ * of them used to be a storage request. They are cached by filename
+ * here, so that a binary executed again is loaded without storage.
+ *
+ * A new binary is read with one request of its first page, which holds
+ * all of them unless the binary is unusual.
+ *
+ * Only binaries that pass the checks of load_elf_binary() are cached.
+ * Others are loaded the old way, which reports the error.
+ *
+ * There is no cheap way to learn that a file was changed at storage.
+ * Same as the file mmap cache, an entry is dropped when its file is
+ * written through this memory component, or on P2M_DROP_CACHE.
+ */
+
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/spinlock.h>
+#include <lego/hashtable.h>
+
+#include <memory/vm.h>
+#include <memory/stat.h>
+#include <memory/filemap.h>
+#include <memory/file_ops.h>
+#include <memory/elf_cache.h>
+
+#define ELF_CACHE_HASH_BITS	6
+
+static DEFINE_SPINLOCK(elf_cache_lock);
+static DEFINE_HASHTABLE(elf_cache, ELF_CACHE_HASH_BITS);
+static LIST_HEAD(elf_cache_lru);
+static unsigned long nr_elf_images;
+
+static unsigned int elf_cache_key(const char *str)
+{
+	unsigned int seed = 131;
+	unsigned int hash = 0;
+
+	while (*str)
+		hash = hash * seed + (*str++);
+
+	return hash & 0x7fffffff;
+}
+
+static void free_elf_image(struct elf_image *image)
+{
+	kfree(image->phdrs);
+	kfree(image->interp);
+	kfree(image);
+}
+
+void elf_image_put(struct elf_image *image)
+{
+	if (image && atomic_dec_and_test(&image->refcount))
+		free_elf_image(image);
+}
+
+/* Drop the cache's reference. Caller must hold elf_cache_lock */
+static void __elf_cache_remove(struct elf_image *image)
+{
+	hash_del(&image->hlink);
+	list_del(&image->lru);
+	nr_elf_images--;
+
+	elf_image_put(image);
+}
+
+/* Caller must hold elf_cache_lock */
+static struct elf_image *__elf_cache_find(const char *filename, unsigned int key)
+{
+	struct elf_image *image;
+
+	hash_for_each_possible(elf_cache, image, hlink, key) {
+		if (image->key == key &&
+		    !strncmp(image->filename, filename, MAX_FILENAME_LENGTH))
+			return image;
+	}
+	return NULL;
+}
+
+/*
+ * Copy [@pos, @pos + @count) of the file into @dst. Take it from @page,
+ * which has the first @nr bytes of the file, if possible.
+ */
+static int elf_cache_read(struct lego_task_struct *tsk, struct lego_file *file,
+			  void *page, ssize_t nr, void *dst, loff_t pos,
+			  size_t count)
+{
+	ssize_t ret;
+
+	if (pos + count <= nr) {
+		memcpy(dst, page + pos, count);
+		return 0;
+	}
+
+	ret = kernel_read(tsk, file, pos, dst, count);
+	return ret == count ? 0 : -EIO;
+}
+
+/*
+ * Read and check headers of @file.
+ * Return NULL if it is not a valid ELF binary, or any error.
+ */
+static struct elf_image *elf_image_read(struct lego_task_struct *tsk,
+					struct lego_file *file)
+{
+	struct elf_image *image;
+	struct elf_phdr *phdr;
+	struct elfhdr *hdr;
+	size_t size;
+	ssize_t nr;
+	void *page;
+	int i;
+
+	page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!page)
+		return NULL;
+
+	image = kzalloc(sizeof(*image), GFP_KERNEL);
+	if (!image)
+		goto free_page;
+
+	nr = kernel_read(tsk, file, 0, page, PAGE_SIZE);
+	if (nr < (ssize_t)sizeof(*hdr))
+		goto free_image;
+	memcpy(image->buf, page, min_t(size_t, nr, BINPRM_BUF_SIZE));
+
+	/* Same checks as load_elf_binary() and load_elf_phdrs() */
+	hdr = elf_image_hdr(image);
+	if (memcmp(hdr->e_ident, ELFMAG, SELFMAG) != 0)
+		goto free_image;
+	if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN)
+		goto free_image;
+	if (!elf_check_arch(hdr))
+		goto free_image;
+	if (hdr->e_phentsize != sizeof(struct elf_phdr))
+		goto free_image;
+	if (hdr->e_phnum < 1 || hdr->e_phnum > 65536U / sizeof(struct elf_phdr))
+		goto free_image;
+	size = sizeof(struct elf_phdr) * hdr->e_phnum;
+	if (size > PAGE_SIZE)
+		goto free_image;
+
+	image->phdrs = kmalloc(size, GFP_KERNEL);
+	if (!image->phdrs)
+		goto free_image;
+	if (elf_cache_read(tsk, file, page, nr, image->phdrs, hdr->e_phoff, size))
+		goto free_image;
+
+	for (i = 0, phdr = image->phdrs; i < hdr->e_phnum; i++, phdr++) {
+		if (phdr->p_type != PT_INTERP)
+			continue;
+
+		if (phdr->p_filesz > PATH_MAX || phdr->p_filesz < 2)
+			goto free_image;
+
+		image->interp = kmalloc(phdr->p_filesz, GFP_KERNEL);
+		if (!image->interp)
+			goto free_image;
+		if (elf_cache_read(tsk, file, page, nr, image->interp,
+				   phdr->p_offset, phdr->p_filesz))
+			goto free_image;
+		if (image->interp[phdr->p_filesz - 1] != '\0')
+			goto free_image;
+		break;
+	}
+
+	kfree(page);
+	return image;
+
+free_image:
+	free_elf_image(image);
+free_page:
+	kfree(page);
+	return NULL;
+}
+
+/**
+ * elf_image_get - Get parsed headers of @file
+ *
+ * Return the cached entry with one reference for the caller,
+ * which must be dropped by elf_image_put(). Return NULL if @file
+ * is not a valid ELF binary, or can not be read, in which case
+ * the caller should go through the uncached path.
+ */
+struct elf_image *elf_image_get(struct lego_task_struct *tsk,
+				struct lego_file *file)
+{
+	struct elf_image *image, *old, *victim = NULL;
+	unsigned int key = elf_cache_key(file->filename);
+
+	spin_lock(&elf_cache_lock);
+	image = __elf_cache_find(file->filename, key);
+	if (image) {
+		atomic_inc(&image->refcount);
+		list_move(&image->lru, &elf_cache_lru);
+		spin_unlock(&elf_cache_lock);
+
+		inc_mm_stat(NR_ELF_CACHE_HIT);
+		return image;
+	}
+	spin_unlock(&elf_cache_lock);
+
+	inc_mm_stat(NR_ELF_CACHE_MISS);
+
+	image = elf_image_read(tsk, file);
+	if (!image)
+		return NULL;
+
+	strncpy(image->filename, file->filename, MAX_FILENAME_LENGTH);
+	image->key = key;
+
+	/* One for the cache, one for the caller */
+	atomic_set(&image->refcount, 2);
+
+	spin_lock(&elf_cache_lock);
+	old = __elf_cache_find(file->filename, key);
+	if (old) {
+		/* Lost the race */
+		atomic_inc(&old->refcount);
+		spin_unlock(&elf_cache_lock);
+
+		free_elf_image(image);
+		return old;
+	}
+
+	if (nr_elf_images >= CONFIG_MEM_ELF_CACHE_NR_IMAGES) {
+		victim = list_last_entry(&elf_cache_lru, struct elf_image, lru);
+		__elf_cache_remove(victim);
+	}
+
+	hash_add(elf_cache, &image->hlink, key);
+	list_add(&image->lru, &elf_cache_lru);
+	nr_elf_images++;
+	spin_unlock(&elf_cache_lock);
+
+	return image;
+}
+
+/* Called whenever @filename is written through this memory component */
+void elf_cache_invalidate(const char *filename)
+{
+	struct elf_image *image;
+
+	spin_lock(&elf_cache_lock);
+	image = __elf_cache_find(filename, elf_cache_key(filename));
+	if (image)
+		__elf_cache_remove(image);
+	spin_unlock(&elf_cache_lock);
+}
+
+void elf_cache_drop_all(void)
+{
+	struct elf_image *image, *tmp;
+
+	spin_lock(&elf_cache_lock);
+	list_for_each_entry_safe(image, tmp, &elf_cache_lru, lru)
+		__elf_cache_remove(image);
+	spin_unlock(&elf_cache_lock);
+}
+
+/*
+ * Map text pages that the file mmap cache already has into @mm,
+ * which is just loaded by execve(). Writable mappings are left
+ * alone, they are copied on write anyway.
+ */
+void elf_cache_map_text(struct lego_mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+
+	if (!IS_ENABLED(CONFIG_MEM_FILEMAP))
+		return;
+
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!vma->vm_file || (vma->vm_flags & VM_WRITE) ||
+		    !filemap_vma_cacheable(vma))
+			continue;
+
+		filemap_map_cached(vma);
+	}
+	up_read(&mm->mmap_sem);
+}
@@ -17,6 +17,8 @@
 #include <memory/task.h>
 #include <memory/pid.h>
 #include <memory/vm.h>
+#include <memory/filemap.h>
+#include <memory/elf_cache.h>
 #include <memory/file_types.h>
 
 #ifdef CONFIG_DEBUG_M2S_READ_WRITE
@@ -27,25 +29,28 @@
 static inline void m2s_debug(const char *fmt, ...) { }
 #endif
 
-ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
-		       char __user *buf, size_t count, loff_t *pos)
+/*
+ * Send M2S_READ, and return the reply buffer on success.
+ * Reply buffer = nr of bytes been read (ssize_t) + content.
+ * Caller must kfree() it.
+ */
+static void *m2s_read(char *f_name, size_t count, loff_t pos)
 {
 	u32 len_msg, len_ret, *opcode;
-	void *msg, *retbuf, *content;
-	ssize_t retval, *retval_ptr;
+	void *msg, *retbuf;
 	struct m2s_read_write_payload *payload;
 
 	len_msg = sizeof(*opcode) + sizeof(*payload);
 	msg = kmalloc(len_msg, GFP_KERNEL);
 	if (!msg)
-		return -ENOMEM;
+		return NULL;
 
 	/* retbuf = retval + content */
-	len_ret = sizeof(retval) + count;
+	len_ret = sizeof(ssize_t) + count;
 	retbuf = kmalloc(len_ret, GFP_KERNEL);
 	if(!retbuf) {
 		kfree(msg);
-		return -ENOMEM;
+		return NULL;
 	}
 
 	opcode = msg;
@@ -55,7 +60,7 @@ ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
 	payload->uid = current_uid();
 	payload->flags = O_RDONLY;
 	payload->len = count;
-	payload->offset = *pos;
+	payload->offset = pos;
 	strncpy(payload->filename, f_name, MAX_FILENAME_LENGTH);
 
 	m2s_debug("f_name:[%s] len:%#lx offset:%#Lx",
@@ -63,6 +68,20 @@ ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
 
 	ibapi_send_reply_imm(STORAGE_NODE, msg, len_msg, retbuf, len_ret, false);
 
+	kfree(msg);
+	return retbuf;
+}
+
+ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
+		       char __user *buf, size_t count, loff_t *pos)
+{
+	void *retbuf, *content;
+	ssize_t retval, *retval_ptr;
+
+	retbuf = m2s_read(f_name, count, *pos);
+	if (!retbuf)
+		return -ENOMEM;
+
 	/* The first 8 bytes are the nr of bytes been read */
 	retval_ptr = retbuf;
 	retval = *retval_ptr;
@@ -78,7 +97,41 @@ ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
 	 */
 	lego_copy_to_user(tsk, buf, content, count);
 
-	kfree(msg);
+	kfree(retbuf);
+	return retval;
+}
+
+/*
+ * Read @nr_pages pages starting from @pos with one request.
+ * @pages[i] is the kernel virtual address of the i-th page, the ones
+ * that are 0 are skipped. Bytes beyond EOF are zeroed.
+ */
+ssize_t storage_read_pages(struct lego_task_struct *tsk, char *f_name,
+			   unsigned long *pages, unsigned int nr_pages, loff_t pos)
+{
+	void *retbuf, *content;
+	ssize_t retval;
+	size_t valid, bytes;
+	unsigned int i;
+
+	retbuf = m2s_read(f_name, nr_pages * PAGE_SIZE, pos);
+	if (!retbuf)
+		return -ENOMEM;
+
+	retval = *(ssize_t *)retbuf;
+	content = retbuf + sizeof(retval);
+	valid = retval > 0 ? retval : 0;
+
+	for (i = 0; i < nr_pages; i++, valid -= bytes) {
+		bytes = min_t(size_t, valid, PAGE_SIZE);
+		if (!pages[i])
+			continue;
+
+		memcpy((void *)pages[i], content + i * PAGE_SIZE, bytes);
+		if (bytes < PAGE_SIZE)
+			memset((void *)pages[i] + bytes, 0, PAGE_SIZE - bytes);
+	}
+
 	kfree(retbuf);
 	return retval;
 }
@@ -97,10 +150,11 @@ ssize_t storage_read(struct lego_task_struct *tsk,
  * @f_name: filename to write to
  * @count: nrbytes of write
  * @pos: offset where nrbytes write start
+ * @flags: open flags used by storage, e.g., O_CREAT
  * return value: nrbytes no success, -errno on fail
  */
-ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
-			const char *buf, size_t count, loff_t *pos)
+ssize_t __storage_write_flags(struct lego_task_struct *tsk, char *f_name,
+			      const char *buf, size_t count, loff_t *pos, int flags)
 {
 	u32 len_msg, *opcode;
 	void *msg, *content;
@@ -119,13 +173,17 @@ ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
 
 	payload = msg + sizeof(*opcode);
 	payload->uid = current_uid();
-	payload->flags = O_WRONLY;
+	payload->flags = flags;
 	payload->len = count;
 	payload->offset = *pos;
 	strncpy(payload->filename, f_name, MAX_FILENAME_LENGTH);
 
 	content = msg + sizeof(*opcode) + sizeof(*payload);
 
+	/* Do not let future mmap faults and execve see stale pages */
+	filemap_invalidate(f_name, *pos, count);
+	elf_cache_invalidate(f_name);
+
 	//lego_copy_from_user(tsk, content, buf, count);
 	memcpy(content, buf, count);
 
@@ -142,7 +200,12 @@ ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
 
 	kfree(msg);
 	return retval;
+}
 
+ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
+			const char *buf, size_t count, loff_t *pos)
+{
+	return __storage_write_flags(tsk, f_name, buf, count, pos, O_WRONLY);
 }
 
 static ssize_t storage_write(struct lego_task_struct *tsk, struct lego_file *file,
@@ -160,6 +223,9 @@ static int storage_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	loff_t pos;
 	unsigned long page;
 
+	if (filemap_vma_cacheable(vma))
+		return filemap_fault(vma, vmf);
+
 	page = __get_free_page(GFP_KERNEL);
 	if (unlikely(!page))
 		return VM_FAULT_OOM;
@@ -176,8 +242,73 @@ static int storage_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return 0;
 }
 
+#ifdef CONFIG_MEM_FAULT_AROUND
+static void storage_vma_map_pages(struct vm_area_struct *vma, pgoff_t pgoff,
+				  unsigned long *pages, unsigned int nr)
+{
+	struct lego_file *file = vma->vm_file;
+	unsigned long fresh[CONFIG_MEM_FAULT_AROUND_MAX_PAGES] = { 0 };
+	bool cacheable = filemap_vma_cacheable(vma);
+	int i, first = -1, last = -1;
+	ssize_t ret;
+
+	if (WARN_ON_ONCE(nr > CONFIG_MEM_FAULT_AROUND_MAX_PAGES))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			continue;
+
+		/* Take what the file mmap cache already has */
+		if (cacheable) {
+			pages[i] = filemap_find_page(file->filename, pgoff + i);
+			if (pages[i])
+				continue;
+		}
+
+		fresh[i] = __get_free_page(GFP_KERNEL);
+		if (unlikely(!fresh[i]))
+			break;
+
+		if (first < 0)
+			first = i;
+		last = i;
+	}
+
+	if (first < 0)
+		return;
+
+	/* Read the rest with one request */
+	ret = storage_read_pages(vma->vm_mm->task, file->filename, fresh + first,
+				 last - first + 1, (pgoff + first) << PAGE_SHIFT);
+
+	for (i = first; i <= last; i++) {
+		unsigned long cached;
+
+		if (!fresh[i])
+			continue;
+
+		/* Neither cache nor map a page the read did not reach */
+		if (ret <= (ssize_t)((i - first) * PAGE_SIZE)) {
+			free_page(fresh[i]);
+			continue;
+		}
+
+		pages[i] = fresh[i];
+		if (cacheable) {
+			cached = filemap_add_page(file->filename, pgoff + i, fresh[i]);
+			if (cached)
+				pages[i] = cached;
+		}
+	}
+}
+#endif
+
 static struct vm_operations_struct storage_vma_ops = {
 	.fault = &storage_vma_fault,
+#ifdef CONFIG_MEM_FAULT_AROUND
+	.map_pages = &storage_vma_map_pages,
+#endif
 };
 
 static int storage_mmap(struct lego_task_struct *tsk, struct lego_file *file,
@@ -163,6 +163,19 @@ SYSCALL_DEFINE1(checkpoint_process, pid_t, pid)
 	BUG();
 }
 
+SYSCALL_DEFINE3(restore_process, unsigned int, node, pid_t, pid,
+		unsigned int, seq)
+{
+	BUG();
+}
+
+SYSCALL_DEFINE3(spawn, const char __user *, filename,
+		const char __user *const __user *, argv,
+		const char __user *const __user *, envp)
+{
+	BUG();
+}
+
 SYSCALL_DEFINE3(ioctl, unsigned int, fd, unsigned int, cmd, unsigned long, arg)
 {
 	BUG();
@@ -263,6 +276,19 @@ SYSCALL_DEFINE1(pipe, int __user *, flides)
 	BUG();
 }
 
+SYSCALL_DEFINE6(splice, int, fd_in, loff_t __user *, off_in,
+		int, fd_out, loff_t __user *, off_out,
+		size_t, len, unsigned int, flags)
+{
+	BUG();
+}
+
+SYSCALL_DEFINE4(vmsplice, int, fd, const struct iovec __user *, uiov,
+		unsigned long, nr_segs, unsigned int, flags)
+{
+	BUG();
+}
+
 SYSCALL_DEFINE2(rename, const char __user *, oldname,
 		const char __user *, newname)
 {
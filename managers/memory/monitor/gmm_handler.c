@@ -15,6 +15,7 @@
 #include <lego/fit_ibapi.h>
 #include <lego/kthread.h>
 #include <memory/stat.h>
+#include <memory/task.h>
 #include <memory/thread_pool.h>
 #include <monitor/common.h>
 #include <monitor/gmm_handler.h>
@@ -29,6 +30,7 @@ static int m2mm_status_report(void *_unused)
 
 	r.hdr.src_nid = LEGO_LOCAL_NID;
 	r.hdr.opcode = M2MM_STATUS_REPORT;
+	r.hdr.trace_id = 0;
 
 	while (1) {
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -39,6 +41,7 @@ static int m2mm_status_report(void *_unused)
 		r.totalram = info.totalram;
 		r.freeram = info.freeram;
 		r.nr_request = mm_stat(HANDLE_PCACHE_MISS) + mm_stat(HANDLE_PCACHE_FLUSH);
+		lego_tasks_rss(&r.rss_private, &r.rss_shared);
 
 		//pr_info("%s(): r.nr_req:%lu mm_stat:%lu\n", __func__, r.nr_request, mm_stat(HANDLE_PCACHE_MISS));
 		ibapi_send_reply_timeout(CONFIG_GMM_NODEID, &r, sizeof(r),
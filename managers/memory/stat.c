@@ -8,10 +8,10 @@
  */
 
 #include <lego/kernel.h>
+#include <lego/cpumask.h>
 #include <memory/stat.h>
 
-
-struct memory_manager_stat memory_manager_stats;
+DEFINE_PER_CPU(struct memory_manager_stat, memory_manager_stats);
 
 static const char *const memory_manager_stat_text[] = {
 	/* Handler group */
@@ -29,9 +29,38 @@ static const char *const memory_manager_stat_text[] = {
 	"handle_write",
 
 	/* replication */
-	"nr_batched_log_flush"
+	"nr_batched_log_flush",
+
+	/* file mmap cache */
+	"nr_filemap_hit",
+	"nr_filemap_miss",
+	"nr_filemap_cow",
+	"nr_filemap_premap",
+
+	/* execve ELF cache */
+	"nr_elf_cache_hit",
+	"nr_elf_cache_miss",
+
+	/* copy-on-write */
+	"nr_cow_reuse",
+	"nr_cow_copy",
+
+	/* checkpoint restore */
+	"nr_restore_fault",
+	"nr_restore_prefetch"
 };
 
+/* Fold the per-cpu counters, CPUs keep counting while we walk */
+unsigned long mm_stat(enum memory_manager_stat_item i)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(memory_manager_stats, cpu).stat[i];
+	return sum;
+}
+
 #ifdef CONFIG_COUNTER_MEMORY_HANDLER
 void print_memory_manager_stats(void)
 {
@@ -39,9 +68,7 @@ void print_memory_manager_stats(void)
 
 	BUILD_BUG_ON(NR_MEMORY_MANAGER_STAT_ITEMS != ARRAY_SIZE(memory_manager_stat_text));
 
-	for (i = 0; i < NR_MEMORY_MANAGER_STAT_ITEMS; i++) {
-		pr_info("%s: %lu\n", memory_manager_stat_text[i],
-			atomic_long_read(&memory_manager_stats.stat[i]));
-	}
+	for (i = 0; i < NR_MEMORY_MANAGER_STAT_ITEMS; i++)
+		pr_info("%s: %lu\n", memory_manager_stat_text[i], mm_stat(i));
 }
 #endif
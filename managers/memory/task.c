@@ -134,3 +134,62 @@ void dump_lego_tasks(void)
 	pr_info("----- Finish Dump Tasks\n");
 	spin_unlock(&hashtable_lock);
 }
+
+/*
+ * Refresh the RSS counters of all tasks, and return the sums in pages.
+ * Pages shared by several tasks are counted once per task.
+ *
+ * Updating a task may sleep on its mmap_sem, thus tasks are collected
+ * first, and looked up again without hashtable_lock.
+ */
+void lego_tasks_rss(unsigned long *rss_private, unsigned long *rss_shared)
+{
+	struct lego_task_struct *p;
+	struct lego_mm_struct *mm;
+	struct {
+		unsigned int node, pid;
+	} *keys;
+	int i, nr, max;
+
+	*rss_private = 0;
+	*rss_shared = 0;
+
+	max = 0;
+	spin_lock(&hashtable_lock);
+	hash_for_each(node_pid_hash, i, p, link)
+		max++;
+	spin_unlock(&hashtable_lock);
+	if (!max)
+		return;
+
+	/* Tasks created meanwhile are counted next time */
+	keys = kmalloc(max * sizeof(*keys), GFP_KERNEL);
+	if (!keys)
+		return;
+
+	nr = 0;
+	spin_lock(&hashtable_lock);
+	hash_for_each(node_pid_hash, i, p, link) {
+		if (nr < max) {
+			keys[nr].node = p->node;
+			keys[nr].pid = p->pid;
+			nr++;
+		}
+	}
+	spin_unlock(&hashtable_lock);
+
+	for (i = 0; i < nr; i++) {
+		p = find_lego_task_by_pid(keys[i].node, keys[i].pid);
+		if (!p || !p->mm)
+			continue;
+
+		mm = p->mm;
+		down_read(&mm->mmap_sem);
+		lego_mm_update_rss(mm);
+		up_read(&mm->mmap_sem);
+
+		*rss_private += mm->rss_private;
+		*rss_shared += mm->rss_shared;
+	}
+	kfree(keys);
+}
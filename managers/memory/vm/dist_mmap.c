@@ -624,7 +624,7 @@ static int consult_gmm(unsigned long request,
 	manager_meminfo(&info);
 	send.totalram = info.totalram;
 	send.freeram = info.freeram;
-	send.nr_request = atomic_long_read(&memory_manager_stats.stat[HANDLE_PCACHE_MISS]);
+	send.nr_request = mm_stat(HANDLE_PCACHE_MISS);
 	send.len = request;
 
 	ret = net_send_reply_timeout(CONFIG_GMM_NODEID, M2MM_CONSULT,
@@ -16,24 +16,77 @@
 #include <lego/comp_storage.h>
 
 #include <memory/vm.h>
+#include <memory/stat.h>
 #include <memory/file_ops.h>
+#include <memory/checkpoint.h>
 #include <memory/vm-pgtable.h>
 
+/*
+ * Write to a write-protected pte.
+ *
+ * ptes of private writable mappings are write-protected by fork(), or if
+ * they are established by a read fault. The page is reused if nobody else
+ * holds it. Otherwise this mm gets its own copy, which happens on the
+ * first write-miss or flush from either side after fork().
+ *
+ * Called with @ptl held, which is released before return.
+ */
 static int do_wp_page(struct vm_area_struct *vma, unsigned long address,
 		      unsigned int flags, pte_t *ptep, pmd_t *pmd, pte_t entry,
 		      spinlock_t *ptl)
 {
-#if 0
+	unsigned long old_page, new_page;
+	struct page *page;
+
+	if (!is_cow_mapping(vma->vm_flags)) {
+		/* Shared mappings are written in place */
+		if (vma->vm_flags & VM_WRITE)
+			pte_set(ptep, pte_mkwrite(pte_mkdirty(entry)));
+		spin_unlock(ptl);
+		return 0;
+	}
+
+	old_page = lego_pte_to_virt(entry);
+	page = virt_to_page(old_page);
+
 	/*
-	 * TODO:
-	 * We missed the mprotect() syscall.
-	 * So the VMA actually has the READ/WRITE permission, so as the PTE.
+	 * Only this pte holds it. The file mmap cache holds its
+	 * pages as well, so they never get here.
 	 */
-	dump_vma(vma);
-	dump_pte(ptep, NULL);
-	WARN_ON(1);
-#endif
+	if (page_ref_count(page) == 1) {
+		pte_set(ptep, pte_mkwrite(pte_mkdirty(entry)));
+		spin_unlock(ptl);
+		inc_mm_stat(NR_COW_REUSE);
+		return 0;
+	}
+
+	/* Keep old_page alive while copying */
+	get_page(page);
 	spin_unlock(ptl);
+
+	new_page = __get_free_page(GFP_KERNEL);
+	if (unlikely(!new_page)) {
+		free_page(old_page);
+		return VM_FAULT_OOM;
+	}
+	memcpy((void *)new_page, (void *)old_page, PAGE_SIZE);
+
+	spin_lock(ptl);
+	if (likely(pte_same(*ptep, entry))) {
+		entry = lego_vfn_pte(((signed long)new_page >> PAGE_SHIFT),
+				     vma->vm_page_prot);
+		pte_set(ptep, pte_mkwrite(pte_mkdirty(entry)));
+		new_page = 0;
+
+		/* Drop the pte's reference */
+		free_page(old_page);
+		inc_mm_stat(NR_COW_COPY);
+	}
+	spin_unlock(ptl);
+
+	if (new_page)
+		free_page(new_page);
+	free_page(old_page);
 	return 0;
 }
 
@@ -66,6 +119,9 @@ static int __do_fault(struct lego_mm_struct *mm, struct vm_area_struct *vma,
 		if (flags & FAULT_FLAG_WRITE)
 			entry = pte_mkwrite(pte_mkdirty(entry));
 		pte_set(page_table, entry);
+	} else {
+		/* Someone else has mapped it, drop ours */
+		free_page(vmf.page);
 	}
 
 	lego_pte_unlock(page_table, ptl);
@@ -126,6 +182,150 @@ DEFINE_PROFILE_POINT(anon_fault)
 DEFINE_PROFILE_POINT(file_fault)
 DEFINE_PROFILE_POINT(wp_fault)
 
+#ifdef CONFIG_MEM_FAULT_AROUND
+/*
+ * Fault-around
+ *
+ * Once a pte_none fault is handled, the empty neighbours within the same
+ * pte table are populated as well, by ->map_pages() for file mappings,
+ * and with zeroed pages for anonymous ones.
+ *
+ * Populated ptes are marked old. A later fault that finds an old pte
+ * counts as a hit. Every 4 windows of populated pages, the window of the
+ * VMA doubles if at least half of them were hit, and halves if less than
+ * a quarter were. A window of 1 means disabled, and is probed again after
+ * FAULT_AROUND_PROBE faults. The statistics are updated without lock,
+ * they are heuristics anyway.
+ *
+ * madvise(MADV_SEQUENTIAL) pins the window at its maximum, and
+ * madvise(MADV_RANDOM) disables it.
+ */
+#define FAULT_AROUND_MAX_PAGES	CONFIG_MEM_FAULT_AROUND_MAX_PAGES
+#define FAULT_AROUND_PROBE	64
+
+static unsigned int fault_around_pages(struct vm_area_struct *vma)
+{
+	unsigned int nr = vma->fa_pages;
+
+	if (vma->vm_flags & VM_RAND_READ)
+		return 1;
+	if (vma->vm_flags & VM_SEQ_READ)
+		return FAULT_AROUND_MAX_PAGES;
+
+	if (unlikely(!nr)) {
+		nr = FAULT_AROUND_MAX_PAGES / 2;
+	} else if (nr == 1) {
+		if (++vma->fa_mapped < FAULT_AROUND_PROBE)
+			return 1;
+		nr = 2;
+	} else if (vma->fa_mapped >= nr * 4) {
+		if (vma->fa_hit * 2 >= vma->fa_mapped)
+			nr = min(nr * 2, (unsigned int)FAULT_AROUND_MAX_PAGES);
+		else if (vma->fa_hit * 4 < vma->fa_mapped)
+			nr /= 2;
+	} else
+		return nr;
+
+	vma->fa_pages = nr;
+	vma->fa_mapped = 0;
+	vma->fa_hit = 0;
+	return nr;
+}
+
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+			    pmd_t *pmd)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	unsigned long pages[FAULT_AROUND_MAX_PAGES];
+	unsigned long start, end, nr_mapped = 0;
+	unsigned int i, nr;
+	spinlock_t *ptl;
+	pte_t *pte, entry;
+
+	nr = fault_around_pages(vma);
+	if (nr <= 1)
+		return;
+
+	/* Aligned window, clamped to the VMA and the pte table */
+	address &= PAGE_MASK;
+	start = address - ((address >> PAGE_SHIFT) % nr) * PAGE_SIZE;
+	start = max3(start, vma->vm_start, address & PMD_MASK);
+	end = start + (unsigned long)nr * PAGE_SIZE;
+	end = min3(end, vma->vm_end, (address & PMD_MASK) + PMD_SIZE);
+	nr = (end - start) >> PAGE_SHIFT;
+
+	/* Racy peek, rechecked with ptl held below */
+	pte = lego_pte_offset(pmd, start);
+	for (i = 0; i < nr; i++)
+		pages[i] = pte_none(pte[i]) ? 0 : 1;
+
+	if (vma->vm_ops && vma->vm_ops->map_pages) {
+		pgoff_t pgoff = ((start - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+
+		vma->vm_ops->map_pages(vma, pgoff, pages, nr);
+	} else if (vma->vm_ops) {
+		return;
+	} else {
+		for (i = 0; i < nr; i++) {
+			if (pages[i])
+				continue;
+			pages[i] = __get_free_page(GFP_KERNEL | __GFP_ZERO);
+			if (unlikely(!pages[i]))
+				break;
+		}
+	}
+
+	pte = lego_pte_offset_lock(mm, pmd, start, &ptl);
+	for (i = 0; i < nr; i++) {
+		if (pages[i] <= 1)
+			continue;
+
+		if (unlikely(!pte_none(pte[i]))) {
+			free_page(pages[i]);
+			continue;
+		}
+
+		entry = lego_vfn_pte(((signed long)pages[i] >> PAGE_SHIFT),
+				     vma->vm_page_prot);
+		if (!vma->vm_ops && (vma->vm_flags & VM_WRITE))
+			entry = pte_mkwrite(pte_mkdirty(entry));
+		pte_set(pte + i, pte_mkold(entry));
+		nr_mapped++;
+	}
+	lego_pte_unlock(pte, ptl);
+
+	vma->fa_mapped += nr_mapped;
+}
+
+static inline void fault_around_hit(struct vm_area_struct *vma, pte_t *pte,
+				    pte_t entry)
+{
+	if (unlikely(!pte_young(entry))) {
+		pte_set(pte, pte_mkyoung(entry));
+		vma->fa_hit++;
+	}
+}
+#else
+static inline void do_fault_around(struct vm_area_struct *vma,
+				   unsigned long address, pmd_t *pmd) { }
+static inline void fault_around_hit(struct vm_area_struct *vma, pte_t *pte,
+				    pte_t entry) { }
+#endif /* CONFIG_MEM_FAULT_AROUND */
+
+#ifdef CONFIG_MEM_CHECKPOINT
+/*
+ * Processors only come here on pcache miss. Checkpoint records young
+ * ptes as the hot set, and clears them. Caller holds the pte lock.
+ */
+static inline void mark_pte_young(pte_t *pte)
+{
+	if (unlikely(!pte_young(*pte)))
+		pte_set(pte, pte_mkyoung(*pte));
+}
+#else
+static inline void mark_pte_young(pte_t *pte) { }
+#endif
+
 static int handle_pte_fault(struct vm_area_struct *vma, unsigned long address,
 			    unsigned int flags, pte_t *pte, pmd_t *pmd,
 			    unsigned long *mapping_flags)
@@ -141,19 +341,33 @@ static int handle_pte_fault(struct vm_area_struct *vma, unsigned long address,
 	entry = *pte;
 	if (likely(!pte_present(entry))) {
 		if (pte_none(entry)) {
+			/*
+			 * Pages of a restored process are read from its images.
+			 * Fault-around must not fill their neighbours, which
+			 * may be in the images too.
+			 */
+			if (unlikely(checkpoint_restoring(mm))) {
+				ret = checkpoint_restore_fault(vma, address, pmd,
+							       mapping_flags);
+				if (ret)
+					return ret & VM_FAULT_ERROR;
+			}
+
 			if (vma->vm_ops && vma->vm_ops->fault) {
 				PROFILE_START(file_fault);
 				ret = do_linear_fault(vma, address, flags,
 						      pte, pmd, entry, mapping_flags);
 				PROFILE_LEAVE(file_fault);
-				return ret;
 			} else {
 				PROFILE_START(anon_fault);
 				ret = do_anonymous_page(vma, address, flags,
 							pte, pmd, mapping_flags);
 				PROFILE_LEAVE(anon_fault);
-				return ret;
 			}
+
+			if (likely(!ret) && !checkpoint_restoring(mm))
+				do_fault_around(vma, address, pmd);
+			return ret;
 		}
 
 		/*
@@ -171,6 +385,12 @@ static int handle_pte_fault(struct vm_area_struct *vma, unsigned long address,
 	if (unlikely(!pte_same(*pte, entry)))
 		goto unlock;
 
+	fault_around_hit(vma, pte, entry);
+	mark_pte_young(pte);
+
+	/* Both may have set the young bit, do_wp_page() rechecks against it */
+	entry = *pte;
+
 	/*
 	 * If someone use faultin_page against an already valid/mapped user
 	 * virtual address, then we will walk here. People should use
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * File mmap cache
+ *
+ * Pages of file-backed private mappings are cached by (filename, pgoff),
+ * and mapped into all lego_mm_structs that fault on them. Thus the text of
+ * a binary that is executed again and again is only read from storage once.
+ *
+ * Reference counting:
+ * The cache holds one reference of each cached page, and each pte that
+ * maps it holds one more (taken here, or by fork). zap_pte_range() drops
+ * the pte's reference, invalidation drops the cache's reference.
+ *
+ * Copy-on-write:
+ * Processors never write memory directly. All writes land here through
+ * get_user_pages(FOLL_WRITE), e.g., pcache flush and lego_copy_to_user().
+ * PG_filemap marks a page that may be shared, and get_user_pages() calls
+ * filemap_break_cow() to give the writer a private copy first.
+ *
+ * The page lives on after being dropped from the cache if it is still
+ * mapped, and PG_filemap stays with it until it is freed.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/string.h>
+#include <lego/spinlock.h>
+#include <lego/hashtable.h>
+
+#include <memory/vm.h>
+#include <memory/stat.h>
+#include <memory/filemap.h>
+#include <memory/file_ops.h>
+#include <memory/vm-pgtable.h>
+
+#define FILEMAP_FILE_HASH_BITS	6
+#define FILEMAP_PAGE_HASH_BITS	12
+
+struct filemap_file {
+	char			filename[MAX_FILENAME_LENGTH];
+	unsigned int		key;
+	struct hlist_node	hlink;
+	struct list_head	pages;
+};
+
+struct filemap_page {
+	struct filemap_file	*file;
+	pgoff_t			pgoff;
+	unsigned long		page;		/* kernel virtual address */
+	struct hlist_node	hlink;
+	struct list_head	next;		/* linked to file->pages */
+};
+
+static DEFINE_SPINLOCK(filemap_lock);
+static DEFINE_HASHTABLE(filemap_files, FILEMAP_FILE_HASH_BITS);
+static DEFINE_HASHTABLE(filemap_pages, FILEMAP_PAGE_HASH_BITS);
+static unsigned long nr_filemap_pages;
+
+static unsigned int filemap_file_key(const char *str)
+{
+	unsigned int seed = 131;
+	unsigned int hash = 0;
+
+	while (*str)
+		hash = hash * seed + (*str++);
+
+	return hash & 0x7fffffff;
+}
+
+static inline unsigned long
+filemap_page_key(struct filemap_file *file, pgoff_t pgoff)
+{
+	return (unsigned long)file ^ pgoff;
+}
+
+/* Caller must hold filemap_lock */
+static struct filemap_file *__filemap_find_file(const char *filename)
+{
+	struct filemap_file *file;
+	unsigned int key = filemap_file_key(filename);
+
+	hash_for_each_possible(filemap_files, file, hlink, key) {
+		if (file->key == key &&
+		    !strncmp(file->filename, filename, MAX_FILENAME_LENGTH))
+			return file;
+	}
+	return NULL;
+}
+
+/* Caller must hold filemap_lock */
+static struct filemap_page *
+__filemap_find_page(struct filemap_file *file, pgoff_t pgoff)
+{
+	struct filemap_page *fp;
+
+	hash_for_each_possible(filemap_pages, fp, hlink,
+			       filemap_page_key(file, pgoff)) {
+		if (fp->file == file && fp->pgoff == pgoff)
+			return fp;
+	}
+	return NULL;
+}
+
+/* Drop the cache's reference. Caller must hold filemap_lock */
+static void __filemap_remove_page(struct filemap_page *fp)
+{
+	hash_del(&fp->hlink);
+	list_del(&fp->next);
+	nr_filemap_pages--;
+
+	free_page(fp->page);
+	kfree(fp);
+}
+
+/*
+ * Look up the cached page, with one extra reference for the caller.
+ * Return 0 if not cached.
+ */
+unsigned long filemap_find_page(const char *filename, pgoff_t pgoff)
+{
+	struct filemap_file *file;
+	struct filemap_page *fp;
+	unsigned long page = 0;
+
+	spin_lock(&filemap_lock);
+	file = __filemap_find_file(filename);
+	if (file) {
+		fp = __filemap_find_page(file, pgoff);
+		if (fp) {
+			page = fp->page;
+			get_page(virt_to_page(page));
+		}
+	}
+	spin_unlock(&filemap_lock);
+	return page;
+}
+
+/*
+ * Insert a freshly read @page. If someone else has inserted the same one
+ * while we were reading from storage, @page is freed and theirs is used.
+ * Return the cached page, with one extra reference for the caller.
+ * Return 0 if it can not be cached, and @page is left untouched.
+ */
+unsigned long
+filemap_add_page(const char *filename, pgoff_t pgoff, unsigned long page)
+{
+	struct filemap_file *file, *new_file;
+	struct filemap_page *fp, *new_fp;
+	unsigned long ret;
+
+	/* Do allocations outside the lock */
+	new_fp = kmalloc(sizeof(*new_fp), GFP_KERNEL);
+	if (!new_fp)
+		return 0;
+	new_file = kmalloc(sizeof(*new_file), GFP_KERNEL);
+	if (!new_file) {
+		kfree(new_fp);
+		return 0;
+	}
+
+	spin_lock(&filemap_lock);
+	file = __filemap_find_file(filename);
+	if (file) {
+		fp = __filemap_find_page(file, pgoff);
+		if (fp) {
+			/* Lost the race */
+			ret = fp->page;
+			get_page(virt_to_page(ret));
+			spin_unlock(&filemap_lock);
+
+			free_page(page);
+			goto free;
+		}
+	}
+
+	if (nr_filemap_pages >= CONFIG_MEM_FILEMAP_NR_PAGES) {
+		spin_unlock(&filemap_lock);
+		ret = 0;
+		goto free;
+	}
+
+	if (!file) {
+		file = new_file;
+		new_file = NULL;
+
+		strncpy(file->filename, filename, MAX_FILENAME_LENGTH);
+		file->key = filemap_file_key(filename);
+		INIT_LIST_HEAD(&file->pages);
+		hash_add(filemap_files, &file->hlink, file->key);
+	}
+
+	fp = new_fp;
+	new_fp = NULL;
+
+	fp->file = file;
+	fp->pgoff = pgoff;
+	fp->page = page;
+	list_add(&fp->next, &file->pages);
+	hash_add(filemap_pages, &fp->hlink, filemap_page_key(file, pgoff));
+	nr_filemap_pages++;
+
+	/*
+	 * The reference from allocation becomes the cache's one,
+	 * and the caller gets a new one.
+	 */
+	SetPageFilemap(virt_to_page(page));
+	get_page(virt_to_page(page));
+	ret = page;
+	spin_unlock(&filemap_lock);
+
+free:
+	kfree(new_fp);
+	kfree(new_file);
+	return ret;
+}
+
+/*
+ * ->fault for file-backed private mappings.
+ * Map the cached page if there is one. Otherwise read it from storage,
+ * and try to cache it.
+ */
+int filemap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct lego_task_struct *tsk = vma->vm_mm->task;
+	struct lego_file *file = vma->vm_file;
+	unsigned long page, cached;
+	ssize_t ret;
+	loff_t pos;
+
+	page = filemap_find_page(file->filename, vmf->pgoff);
+	if (page) {
+		inc_mm_stat(NR_FILEMAP_HIT);
+		vmf->page = page;
+		return 0;
+	}
+
+	inc_mm_stat(NR_FILEMAP_MISS);
+
+	page = __get_free_page(GFP_KERNEL);
+	if (unlikely(!page))
+		return VM_FAULT_OOM;
+
+	pos = vmf->pgoff << PAGE_SHIFT;
+	ret = storage_read(tsk, file, (char *)page, PAGE_SIZE, &pos);
+	if (unlikely(ret < 0)) {
+		free_page(page);
+		return VM_FAULT_SIGBUS;
+	}
+
+	/* Never let a partial page into the cache with stale bytes */
+	if (ret < PAGE_SIZE)
+		memset((void *)page + ret, 0, PAGE_SIZE - ret);
+
+	/* Use it privately if the cache is full */
+	cached = filemap_add_page(file->filename, vmf->pgoff, page);
+	if (cached)
+		page = cached;
+
+	vmf->page = page;
+	return 0;
+}
+
+/*
+ * Called before memory manager writes into @*page, which is a shared
+ * file page mapped at @address of @vma. Replace the mapping with a
+ * private copy, and return the copy in @*page.
+ *
+ * Caller must hold mmap_sem, thus page tables will not go away.
+ */
+int filemap_break_cow(struct vm_area_struct *vma, unsigned long address,
+		      unsigned long *page)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	unsigned long old_page = *page, new_page;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte, entry;
+	spinlock_t *ptl;
+
+	new_page = __get_free_page(GFP_KERNEL);
+	if (unlikely(!new_page))
+		return -ENOMEM;
+
+	pgd = lego_pgd_offset(mm, address);
+	pud = lego_pud_offset(pgd, address);
+	pmd = lego_pmd_offset(pud, address);
+	if (unlikely(lego_pmd_shared(*pmd)) &&
+	    __lego_pte_unshare(mm, pmd, address)) {
+		free_page(new_page);
+		return -ENOMEM;
+	}
+	pte = lego_pte_offset_lock(mm, pmd, address, &ptl);
+
+	/* Other threads of this mm may have broken it already */
+	if (unlikely(lego_pte_to_virt(*pte) != old_page)) {
+		*page = lego_pte_to_virt(*pte);
+		lego_pte_unlock(pte, ptl);
+		free_page(new_page);
+		return 0;
+	}
+
+	/* The pte's reference keeps old_page alive */
+	memcpy((void *)new_page, (void *)old_page, PAGE_SIZE);
+
+	entry = lego_vfn_pte(((signed long)new_page >> PAGE_SHIFT),
+			     vma->vm_page_prot);
+	entry = pte_mkwrite(pte_mkdirty(entry));
+	pte_set(pte, entry);
+	lego_pte_unlock(pte, ptl);
+
+	/* Drop the pte's reference */
+	free_page(old_page);
+
+	inc_mm_stat(NR_FILEMAP_COW);
+	*page = new_page;
+	return 0;
+}
+
+/*
+ * Drop cached pages of @filename within [pos, pos + count).
+ * Called whenever a file is written through this memory component.
+ * Processes that already mapped the old pages keep them, which is
+ * the same as before this cache exists.
+ */
+void filemap_invalidate(const char *filename, loff_t pos, size_t count)
+{
+	struct filemap_file *file;
+	struct filemap_page *fp, *tmp;
+	pgoff_t start, end;
+
+	if (!count)
+		return;
+
+	start = pos >> PAGE_SHIFT;
+	end = (pos + count - 1) >> PAGE_SHIFT;
+
+	spin_lock(&filemap_lock);
+	file = __filemap_find_file(filename);
+	if (!file)
+		goto unlock;
+
+	list_for_each_entry_safe(fp, tmp, &file->pages, next) {
+		if (fp->pgoff >= start && fp->pgoff <= end)
+			__filemap_remove_page(fp);
+	}
+
+	if (list_empty(&file->pages)) {
+		hash_del(&file->hlink);
+		kfree(file);
+	}
+unlock:
+	spin_unlock(&filemap_lock);
+}
+
+void filemap_drop_all(void)
+{
+	struct filemap_file *file;
+	struct filemap_page *fp, *tmp;
+	struct hlist_node *n;
+	int bkt;
+
+	spin_lock(&filemap_lock);
+	hash_for_each_safe(filemap_files, bkt, n, file, hlink) {
+		list_for_each_entry_safe(fp, tmp, &file->pages, next)
+			__filemap_remove_page(fp);
+
+		hash_del(&file->hlink);
+		kfree(file);
+	}
+	spin_unlock(&filemap_lock);
+}
+
+/*
+ * Map the cached pages of @vma, which is a read-only private file mapping
+ * just set up by execve(). Pages not cached are left to page fault.
+ * The ptes are old, same as the ones populated by fault-around.
+ */
+void filemap_map_cached(struct vm_area_struct *vma)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	struct lego_file *file = vma->vm_file;
+	unsigned long address, page;
+	pgoff_t pgoff = vma->vm_pgoff;
+	spinlock_t *ptl;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	for (address = vma->vm_start; address < vma->vm_end;
+	     address += PAGE_SIZE, pgoff++) {
+		page = filemap_find_page(file->filename, pgoff);
+		if (!page)
+			continue;
+
+		pgd = lego_pgd_offset(mm, address);
+		pud = lego_pud_alloc(mm, pgd, address);
+		if (!pud)
+			goto oom;
+		pmd = lego_pmd_alloc(mm, pud, address);
+		if (!pmd)
+			goto oom;
+		if (!lego_pte_alloc(mm, pmd, address))
+			goto oom;
+
+		pte = lego_pte_offset_lock(mm, pmd, address, &ptl);
+		if (pte_none(*pte)) {
+			pte_set(pte, pte_mkold(lego_vfn_pte(((signed long)page >> PAGE_SHIFT),
+							    vma->vm_page_prot)));
+			page = 0;
+		}
+		lego_pte_unlock(pte, ptl);
+
+		if (page)
+			free_page(page);
+		else
+			inc_mm_stat(NR_FILEMAP_PREMAP);
+	}
+	return;
+
+oom:
+	/* Faults will try again */
+	free_page(page);
+}
@@ -11,6 +11,8 @@
 #include <lego/rwsem.h>
 #include <lego/kernel.h>
 #include <memory/vm.h>
+#include <memory/filemap.h>
+#include <memory/vm-pgtable.h>
 
 int faultin_page(struct vm_area_struct *vma, unsigned long start,
 		 unsigned long flags, unsigned long *kvaddr)
@@ -28,41 +30,79 @@ int faultin_page(struct vm_area_struct *vma, unsigned long start,
 	return 0;
 }
 
-/*
- * Find the VFN of a given user virtual address.
- *
- * Return:
- *	positive VFN number if found
- *	0 if pgtable is not established yet
- */
-unsigned long find_page(struct vm_area_struct *vma, unsigned long address)
+static pte_t *find_pte(struct vm_area_struct *vma, unsigned long address,
+		       pmd_t **pmdp)
 {
 	pgd_t *pgd;
 	pud_t *pud;
 	pmd_t *pmd;
-	pte_t *pte;
-	unsigned long page;
 	struct lego_mm_struct *mm = vma->vm_mm;
 
 	pgd = lego_pgd_offset(mm, address);
 	if (pgd_none(*pgd))
-		return 0;
+		return NULL;
 
 	pud = lego_pud_offset(pgd, address);
 	if (pud_none(*pud))
-		return 0;
+		return NULL;
 
 	pmd = lego_pmd_offset(pud, address);
 	if (pmd_none(*pmd))
-		return 0;
+		return NULL;
+
+	if (pmdp)
+		*pmdp = pmd;
+	return lego_pte_offset(pmd, address);
+}
 
-	pte = lego_pte_offset(pmd, address);
-	if (pte_none(*pte))
+/*
+ * Find the VFN of a given user virtual address.
+ *
+ * Return:
+ *	positive VFN number if found
+ *	0 if pgtable is not established yet
+ */
+unsigned long find_page(struct vm_area_struct *vma, unsigned long address)
+{
+	pte_t *pte;
+
+	pte = find_pte(vma, address, NULL);
+	if (!pte || pte_none(*pte))
 		return 0;
 
 	/* extract vfn from pte */
-	page = pte_val(*pte) & PTE_VFN_MASK;
-	return page;
+	return pte_val(*pte) & PTE_VFN_MASK;
+}
+
+/*
+ * Same as find_page(), but return 0 if the caller is going to write
+ * and the pte is write-protected, or lives in a pte table shared by
+ * fork(). Either way, the page may be shared with others.
+ * Otherwise a writer marks the pte dirty and young.
+ */
+static unsigned long
+follow_page(struct vm_area_struct *vma, unsigned long address,
+	    unsigned int gup_flags)
+{
+	pmd_t *pmd;
+	pte_t *pte;
+
+	pte = find_pte(vma, address, &pmd);
+	if (!pte || pte_none(*pte))
+		return 0;
+
+	if (gup_flags & FOLL_WRITE) {
+		if (!pte_write(*pte) || lego_pmd_shared(*pmd))
+			return 0;
+
+		/* Checkpoint relies on the dirty and accessed bits */
+		if (!pte_dirty(*pte))
+			set_bit(_PAGE_BIT_DIRTY, (unsigned long *)&pte->pte);
+		if (!pte_young(*pte))
+			set_bit(_PAGE_BIT_ACCESSED, (unsigned long *)&pte->pte);
+	}
+
+	return pte_val(*pte) & PTE_VFN_MASK;
 }
 
 static __always_inline long
@@ -87,16 +127,26 @@ __get_user_pages(struct lego_task_struct *tsk, struct lego_mm_struct *mm,
 				return i ? : -EFAULT;
 		}
 
-retry:
-		page = find_page(vma, start);
+		page = follow_page(vma, start, gup_flags);
 		if (!page) {
 			int ret;
 			unsigned long flags = FAULT_FLAG_WRITE;
 
+			/*
+			 * Establish the mapping, or break COW.
+			 * The page is returned in @page.
+			 */
 			ret = faultin_page(vma, start, flags, &page);
-			if (likely(!ret))
-				goto retry;
-			else
+			if (unlikely(ret))
+				return i ? i : ret;
+		}
+
+		/* Caller is going to write, do not touch shared file pages */
+		if ((gup_flags & FOLL_WRITE) && filemap_page_need_cow(page)) {
+			int ret;
+
+			ret = filemap_break_cow(vma, start, &page);
+			if (unlikely(ret))
 				return i ? i : ret;
 		}
 
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * madvise() at memory component
+ *
+ * Processor checks the arguments and forwards the advice via P2M_MADVISE.
+ * MADV_DONTNEED and MADV_FREE take two rounds, see p2m_madvise_struct.
+ */
+
+#include <lego/mm.h>
+#include <lego/rwsem.h>
+#include <lego/kernel.h>
+#include <lego/comp_common.h>
+#include <memory/vm.h>
+#include <memory/vm-pgtable.h>
+#include <memory/checkpoint.h>
+
+/*
+ * Update the read hint of [@start, @end), which lies in @vma.
+ * The hint decides the fault-around window, see vm/fault.c.
+ */
+static int madvise_behavior(struct vm_area_struct *vma, unsigned long start,
+			    unsigned long end, int behavior)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	unsigned long new_flags = vma->vm_flags & ~VM_READHINTMASK;
+	int error;
+
+	if (behavior == MADV_SEQUENTIAL)
+		new_flags |= VM_SEQ_READ;
+	else if (behavior == MADV_RANDOM)
+		new_flags |= VM_RAND_READ;
+
+	if (new_flags == vma->vm_flags)
+		return 0;
+
+	if (start != vma->vm_start) {
+		error = split_vma(mm, vma, start, 1);
+		if (error)
+			return error;
+	}
+
+	if (end != vma->vm_end) {
+		error = split_vma(mm, vma, end, 0);
+		if (error)
+			return error;
+	}
+
+	vma->vm_flags = new_flags;
+	return 0;
+}
+
+/*
+ * Read the file pages of [@start, @end) from storage, so that the
+ * pcache misses that follow do not wait for storage. Anonymous pages
+ * are zero anyway. This is best effort, errors are left to the fault.
+ */
+static void madvise_willneed(struct vm_area_struct *vma,
+			     unsigned long start, unsigned long end)
+{
+	unsigned long addr;
+
+	if (!vma->vm_file)
+		return;
+
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		if (find_page(vma, addr))
+			continue;
+		if (faultin_page(vma, addr, 0, NULL))
+			break;
+	}
+}
+
+/*
+ * The first round reports the kind of mappings in @flags, and the
+ * second one frees the private pages. MAP_SHARED pages are the only
+ * copy of the data, they are kept, same as the page cache in Linux.
+ *
+ * MADV_FREE is treated as MADV_DONTNEED. There is no memory pressure
+ * that would reclaim the pages later, thus they are freed right away.
+ */
+static int madvise_dontneed(struct vm_area_struct *vma, unsigned long start,
+			    unsigned long end, int behavior, bool zap,
+			    unsigned int *flags)
+{
+	if (vma->vm_flags & (VM_LOCKED | VM_HUGETLB | VM_PFNMAP))
+		return -EINVAL;
+
+	if (behavior == MADV_FREE &&
+	    (vma->vm_file || (vma->vm_flags & VM_SHARED)))
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_SHARED) {
+		*flags |= P2M_MADVISE_SHARED;
+		return 0;
+	}
+
+	if (!zap)
+		return 0;
+
+	/* Pages of the range in old checkpoint images become stale */
+	checkpoint_reset_base(vma->vm_mm);
+	checkpoint_restore_unmap(vma->vm_mm, start, end);
+
+	lego_unmap_page_range(vma, start, end);
+	return 0;
+}
+
+static int madvise_vma(struct vm_area_struct *vma, unsigned long start,
+		       unsigned long end, int behavior, bool zap,
+		       unsigned int *flags)
+{
+	switch (behavior) {
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		return madvise_dontneed(vma, start, end, behavior, zap, flags);
+	case MADV_WILLNEED:
+		madvise_willneed(vma, start, end);
+		return 0;
+	default:
+		return madvise_behavior(vma, start, end, behavior);
+	}
+}
+
+/**
+ * do_madvise - Apply @behavior to [@start, @start + @len) of @mm
+ * @zap: second round of MADV_DONTNEED and MADV_FREE
+ * @flags: P2M_MADVISE_XXX, describes the mappings of the range
+ *
+ * Same as Linux, the advice is applied to the mapped parts of the
+ * range, and -ENOMEM is returned if there are holes.
+ */
+int do_madvise(struct lego_mm_struct *mm, unsigned long start, size_t len,
+	       int behavior, bool zap, unsigned int *flags)
+{
+	struct vm_area_struct *vma;
+	unsigned long end, tmp;
+	int unmapped_error = 0;
+	int error = 0;
+	bool write;
+
+	switch (behavior) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (offset_in_page(start) || len > TASK_SIZE - start)
+		return -EINVAL;
+
+	end = start + PAGE_ALIGN(len);
+	if (end == start)
+		return 0;
+
+	*flags = 0;
+
+	/* Only the read hints and the zap change the vmas or ptes */
+	write = behavior != MADV_WILLNEED;
+	if (write) {
+		if (down_write_killable(&mm->mmap_sem))
+			return -EINTR;
+	} else
+		down_read(&mm->mmap_sem);
+
+	vma = find_vma(mm, start);
+	while (start < end) {
+		if (!vma || vma->vm_start >= end) {
+			unmapped_error = -ENOMEM;
+			break;
+		}
+
+		/* Hole between start and the vma */
+		if (start < vma->vm_start) {
+			unmapped_error = -ENOMEM;
+			start = vma->vm_start;
+		}
+
+		tmp = min(vma->vm_end, end);
+		error = madvise_vma(vma, start, tmp, behavior, zap, flags);
+		if (error)
+			break;
+
+		start = tmp;
+		vma = vma->vm_next;
+	}
+
+	if (write)
+		up_write(&mm->mmap_sem);
+	else
+		up_read(&mm->mmap_sem);
+
+	return error ? error : unmapped_error;
+}
@@ -25,6 +25,7 @@
 #include <memory/pid.h>
 #include <memory/vm-pgtable.h>
 #include <memory/distvm.h>
+#include <memory/checkpoint.h>
 #include <memory/file_types.h>
 
 int sysctl_max_map_count __read_mostly = DEFAULT_MAX_MAP_COUNT;
@@ -1084,6 +1085,19 @@ static int __split_vma(struct lego_mm_struct *mm, struct vm_area_struct *vma,
 	return err;
 }
 
+/*
+ * Split a vma into two pieces at address 'addr', a new vma is allocated
+ * either for the first part or the tail.
+ */
+int split_vma(struct lego_mm_struct *mm, struct vm_area_struct *vma,
+	      unsigned long addr, int new_below)
+{
+	if (mm->map_count >= sysctl_max_map_count)
+		return -ENOMEM;
+
+	return __split_vma(mm, vma, addr, new_below);
+}
+
 /*
  * Get rid of page table information in the indicated region.
  *
@@ -1218,6 +1232,10 @@ int do_munmap(struct lego_mm_struct *mm, unsigned long start, size_t len)
 	}
 	vma = prev ? prev->vm_next : mm->mmap;
 
+	/* Pages of the range in old checkpoint images become stale */
+	checkpoint_reset_base(mm);
+	checkpoint_restore_unmap(mm, start, end);
+
 	/*
 	 * Remove the vma's, and unmap the actual pages
 	 */
@@ -1381,6 +1399,10 @@ unsigned long move_vma(struct lego_task_struct *tsk, struct vm_area_struct *vma,
 	vma_trace("%s, old_addr: %lx, old_len: %lx, new_addr: %lx, new_len: %lx\n",
 			__func__, old_addr, old_len, new_addr, new_len);
 
+	/* Pages left in checkpoint images are keyed by the old address */
+	if (checkpoint_restore_populate(vma->vm_mm))
+		return -ENOMEM;
+
 	new_pgoff = vma->vm_pgoff + ((old_addr - vma->vm_start) >> PAGE_SHIFT);
 	new_vma = copy_vma(&vma, new_addr, new_len, new_pgoff);
 	if (!new_vma)
@@ -2009,6 +2031,7 @@ lego_mm_init(struct lego_mm_struct *mm, struct lego_task_struct *p)
 	atomic_set(&mm->mm_count, 1);
 	init_rwsem(&mm->mmap_sem);
 	spin_lock_init(&mm->lego_page_table_lock);
+	checkpoint_init_mm(mm);
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 	if (is_homenode(p))
 		distvm_init_homenode(mm, false);
@@ -2053,6 +2076,7 @@ void __lego_mmput(struct lego_mm_struct *mm)
 {
 	BUG_ON(atomic_read(&mm->mm_users));
 	exit_lego_mmap(mm);
+	checkpoint_restore_exit(mm);
 	lego_mmdrop(mm);
 }
 
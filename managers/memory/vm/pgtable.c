@@ -376,6 +376,157 @@ pte_set:
 	return 0;
 }
 
+#ifdef CONFIG_MEM_ONDEMAND_FORK
+/*
+ * On-demand fork
+ *
+ * Instead of copying ptes, fork() lets parent and child share a pte table
+ * if the vma covers all of it. Both pmds point to the same table, with
+ * _PAGE_RW cleared as the mark. The refcount of the table page counts the
+ * sharers, and the ptes keep one reference of each mapped page, no matter
+ * how many sharers there are.
+ *
+ * Whoever is going to change a shared table unshares it first: the ptes
+ * are copied as fork() would have done, or the table is taken back if
+ * the others have gone already.
+ */
+
+static inline bool lego_pte_shareable(unsigned long addr, unsigned long end)
+{
+	return end - addr == PMD_SIZE;
+}
+
+/*
+ * Drop a reference of a shared pte table.
+ * The last one also drops the references held by its ptes.
+ */
+static void lego_pte_table_put(struct page *table)
+{
+	pte_t *pte = page_address(table);
+	int i;
+
+	if (!put_page_testzero(table))
+		return;
+
+	for (i = 0; i < PTRS_PER_PTE; i++, pte++) {
+		if (pte_present(*pte))
+			free_page(lego_pte_to_virt(*pte));
+	}
+
+	set_page_refcounted(table);
+	lego_pte_free(page_address(table));
+}
+
+static void lego_share_pte_range(struct lego_mm_struct *src_mm,
+				 pmd_t *dst_pmd, pmd_t *src_pmd)
+{
+	spinlock_t *ptl;
+	pmd_t pmd;
+
+	ptl = lego_pmd_lock(src_mm, src_pmd);
+	pmd = __pmd(pmd_val(*src_pmd) & ~_PAGE_RW);
+	get_page(lego_pmd_page(pmd));
+	pmd_set(src_pmd, pmd);
+	pmd_set(dst_pmd, pmd);
+	spin_unlock(ptl);
+}
+
+/*
+ * @pmd is going away, and all of its pte table is covered by the zapped
+ * range. Other sharers may still use the table.
+ */
+static void zap_shared_pte_range(struct lego_mm_struct *mm, pmd_t *pmd)
+{
+	struct page *table;
+	spinlock_t *ptl;
+
+	ptl = lego_pmd_lock(mm, pmd);
+	table = lego_pmd_page(*pmd);
+	pmd_clear(pmd);
+	spin_unlock(ptl);
+
+	lego_pte_table_put(table);
+}
+
+/*
+ * Give @mm a private copy of the shared pte table that covers @address.
+ * Caller must hold mmap_sem.
+ */
+int __lego_pte_unshare(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long address)
+{
+	struct vm_area_struct *vma = NULL;
+	struct page *table = NULL;
+	pte_t *new, *src_pte, *dst_pte;
+	spinlock_t *pmd_ptl, *ptl;
+	unsigned long addr, end;
+
+	new = lego_pte_alloc_one();
+	if (!new)
+		return -ENOMEM;
+
+	pmd_ptl = lego_pmd_lock(mm, pmd);
+
+	/* Another thread has done it */
+	if (unlikely(!lego_pmd_shared(*pmd)))
+		goto unlock;
+
+	/* Other sharers have gone, take it back */
+	if (page_ref_count(lego_pmd_page(*pmd)) == 1) {
+		pmd_set(pmd, __pmd(pmd_val(*pmd) | _PAGE_RW));
+		goto unlock;
+	}
+
+	ptl = lego_pte_lockptr(mm, pmd);
+	if (ptl != pmd_ptl)
+		spin_lock(ptl);
+
+	addr = address & PMD_MASK;
+	end = addr + PMD_SIZE;
+	src_pte = lego_pte_offset(pmd, addr);
+	dst_pte = new;
+	do {
+		if (pte_none(*src_pte))
+			continue;
+
+		/* vmas may have been split since fork */
+		if (!vma || addr >= vma->vm_end)
+			vma = find_vma(mm, addr);
+		if (WARN_ON_ONCE(!vma || addr < vma->vm_start))
+			continue;
+
+		lego_copy_one_pte(mm, mm, dst_pte, src_pte, vma, addr);
+
+		/* The copy stays in @mm, keep what checkpoint has not seen */
+		if (pte_present(*src_pte) && pte_dirty(*src_pte))
+			pte_set(dst_pte, pte_mkdirty(*dst_pte));
+	} while (dst_pte++, src_pte++, addr += PAGE_SIZE, addr != end);
+
+	if (ptl != pmd_ptl)
+		spin_unlock(ptl);
+
+	table = lego_pmd_page(*pmd);
+	lego_pmd_populate(pmd, new);
+	new = NULL;
+
+unlock:
+	spin_unlock(pmd_ptl);
+	if (new)
+		lego_pte_free(new);
+	if (table)
+		lego_pte_table_put(table);
+	return 0;
+}
+#else
+static inline bool lego_pte_shareable(unsigned long addr, unsigned long end)
+{
+	return false;
+}
+
+static inline void lego_share_pte_range(struct lego_mm_struct *src_mm,
+					pmd_t *dst_pmd, pmd_t *src_pmd) { }
+static inline void zap_shared_pte_range(struct lego_mm_struct *mm, pmd_t *pmd) { }
+#endif /* CONFIG_MEM_ONDEMAND_FORK */
+
 static int lego_copy_pte_range(struct lego_mm_struct *dst_mm,
 			  struct lego_mm_struct *src_mm,
 		   	  pmd_t *dst_pmd, pmd_t *src_pmd,
@@ -436,6 +587,10 @@ static inline int lego_copy_pmd_range(struct lego_mm_struct *dst_mm,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(*src_pmd))
 			continue;
+		if (lego_pte_shareable(addr, next)) {
+			lego_share_pte_range(src_mm, dst_pmd, src_pmd);
+			continue;
+		}
 		if (lego_copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
 						vma, addr, next))
 			return -ENOMEM;
@@ -471,6 +626,7 @@ static inline int lego_copy_pud_range(struct lego_mm_struct *dst_mm,
  * This function is called during fork() time.
  * It will copy the vma page table mapping from source mm to destination mm.
  * It will make writable && non-shared pages RO for both mm (for COW).
+ * With CONFIG_MEM_ONDEMAND_FORK, fully covered pte tables are shared instead.
  */
 int lego_copy_page_range(struct lego_mm_struct *dst, struct lego_mm_struct *src,
 			 struct vm_area_struct *vma)
@@ -552,6 +708,14 @@ zap_pmd_range(struct vm_area_struct *vma, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(*pmd))
 			continue;
+		if (unlikely(lego_pmd_shared(*pmd))) {
+			if (next - addr == PMD_SIZE) {
+				zap_shared_pte_range(vma->vm_mm, pmd);
+				continue;
+			}
+			if (WARN_ON_ONCE(__lego_pte_unshare(vma->vm_mm, pmd, addr)))
+				continue;
+		}
 		next = zap_pte_range(vma, pmd, addr, next);
 	} while (pmd++, addr = next, addr != end);
 
@@ -613,6 +777,53 @@ static pmd_t *get_old_pmd(struct lego_mm_struct *mm, unsigned long addr)
 	return pmd;
 }
 
+/*
+ * Count the pages mapped by @mm into mm->rss_private and mm->rss_shared.
+ * A page is shared if others hold it as well, e.g., mms forked from the
+ * same parent, or the file mmap cache, or if its pte table is shared.
+ *
+ * Caller must hold mmap_sem. ptes are read without pte locks,
+ * the result is a snapshot anyway.
+ */
+void lego_mm_update_rss(struct lego_mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr, next, page;
+	unsigned long rss_private = 0, rss_shared = 0;
+	bool table_shared;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		for (addr = vma->vm_start; addr < vma->vm_end; addr = next) {
+			next = pmd_addr_end(addr, vma->vm_end);
+
+			pmd = get_old_pmd(mm, addr);
+			if (!pmd)
+				continue;
+
+			table_shared = lego_pmd_shared(*pmd) &&
+				       page_ref_count(lego_pmd_page(*pmd)) > 1;
+
+			pte = lego_pte_offset(pmd, addr);
+			for (; addr < next; addr += PAGE_SIZE, pte++) {
+				if (!pte_present(*pte))
+					continue;
+
+				page = lego_pte_to_virt(*pte);
+				if (table_shared ||
+				    page_ref_count(virt_to_page(page)) > 1)
+					rss_shared++;
+				else
+					rss_private++;
+			}
+		}
+	}
+
+	mm->rss_private = rss_private;
+	mm->rss_shared = rss_shared;
+}
+
 static pmd_t *alloc_new_pmd(struct lego_mm_struct *mm, struct vm_area_struct *vma,
 			    unsigned long addr)
 {
@@ -689,6 +900,10 @@ unsigned long lego_move_page_tables(struct vm_area_struct *vma,
 		if (!old_pmd)
 			continue;
 
+		if (unlikely(lego_pmd_shared(*old_pmd)) &&
+		    __lego_pte_unshare(vma->vm_mm, old_pmd, old_addr))
+			break;
+
 		new_pmd = alloc_new_pmd(vma->vm_mm, vma, new_addr);
 		if (!new_pmd)
 			break;
@@ -18,7 +18,12 @@
 #include <lego/syscalls.h>
 #include <lego/spinlock.h>
 #include <lego/checkpoint.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
 #include <lego/timekeeping.h>
+#include <processor/node.h>
+#include <processor/pcache.h>
+#include <processor/pgtable.h>
 
 #include "internal.h"
 
@@ -144,11 +149,6 @@ static int __do_checkpoint_process(struct task_struct *leader)
 	dump_process_snapshot(pss, "Saver", 0);
 #endif
 
-	/*
-	 * TODO:
-	 * Send to memory
-	 */
-
 	enqueue_pss(pss);
 	return 0;
 
@@ -160,15 +160,86 @@ out:
 	return ret;
 }
 
+/*
+ * Ship @pss to the home memory node of @leader.
+ *
+ * Dirty pcache lines are written back first, so that memory has the
+ * latest user memory. Memory node then captures pages dirtied since
+ * its last image, replies, and writes the image to storage in background.
+ * Thus the cost here is proportional to the dirty set, not the footprint.
+ */
+static int checkpoint_to_memory(struct task_struct *leader,
+				struct process_snapshot *pss)
+{
+	struct p2m_checkpoint_msg *payload;
+	struct p2m_checkpoint_reply reply;
+	struct common_header *hdr;
+	size_t len_ss, len_msg;
+	long nr_flushed;
+	void *msg;
+	int ret;
+
+	len_ss = process_snapshot_size(pss);
+	len_msg = sizeof(*hdr) + sizeof(*payload) + len_ss;
+	if (unlikely(len_msg > P2M_CHECKPOINT_MAX_SIZE)) {
+		pr_err("Snapshot too large: %zu bytes, nr_tasks: %u nr_files: %u\n",
+			len_ss, pss->nr_tasks, pss->nr_files);
+		return -E2BIG;
+	}
+
+	msg = kmalloc(len_msg, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	nr_flushed = pcache_flush_dirty_range(leader, 0, TASK_SIZE);
+	if (unlikely(nr_flushed < 0)) {
+		ret = nr_flushed;
+		goto out;
+	}
+	victim_flush_sync();
+
+	hdr = msg;
+	fill_common_header(hdr, P2M_CHECKPOINT);
+
+	payload = to_payload(msg);
+	payload->pid = leader->tgid;
+	payload->len = len_ss;
+	pack_process_snapshot(pss, (void *)payload + sizeof(*payload));
+
+	ret = ibapi_send_reply_timeout(get_memory_home_node(leader), msg, len_msg,
+				       &reply, sizeof(reply), false, DEF_NET_TIMEOUT);
+	if (unlikely(ret != sizeof(reply))) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = reply.ret;
+	chk_debug("tgid: %d seq: %u ret: %d flushed lines: %ld",
+		leader->tgid, reply.seq, ret, nr_flushed);
+out:
+	kfree(msg);
+	return ret;
+}
+
 static int do_checkpoint_process(struct task_struct *leader)
 {
+	struct process_snapshot *pss;
 	int ret;
 
 	preempt_disable();
 	ret = __do_checkpoint_process(leader);
 	preempt_enable_no_resched();
 
-	restore_process_snapshot(dequeue_pss());
+	if (ret)
+		return ret;
+
+	pss = dequeue_pss();
+	ret = checkpoint_to_memory(leader, pss);
+	if (ret)
+		pr_err("Fail to ship snapshot of %d-%s: %d\n",
+			leader->tgid, leader->comm, ret);
+
+	free_process_snapshot(pss);
 	return ret;
 }
 
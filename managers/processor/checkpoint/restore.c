@@ -12,32 +12,19 @@
 #include <lego/ktime.h>
 #include <lego/sched.h>
 #include <lego/kernel.h>
-#include <lego/kthread.h>
-#include <lego/spinlock.h>
-#include <lego/completion.h>
+#include <lego/syscalls.h>
 #include <lego/checkpoint.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
 #include <processor/fs.h>
+#include <processor/node.h>
+#include <processor/processor.h>
 
 #include <asm/prctl.h>
 #include <asm/fpu/internal.h>
 
 #include "internal.h"
 
-static LIST_HEAD(restorer_work_list);
-static DEFINE_SPINLOCK(restorer_work_lock);
-static struct task_struct *restorer_worker;
-
-struct restorer_work_info {
-	/* Info passed to restorer from restore_process_snapshot() */
-	struct process_snapshot	*pss;
-
-	/* Results passed back to restore_process_snapshot() from restorer */
-	struct task_struct	*result;
-	struct completion	*done;
-
-	struct list_head	list;
-};
-
 /* It is really just a copy of sys_open() */
 static int restore_sys_open(struct ss_files *ss_f)
 {
@@ -45,23 +32,24 @@ static int restore_sys_open(struct ss_files *ss_f)
 	int fd, ret;
 	char *f_name = ss_f->f_name;
 
-	fd = alloc_fd(current->files, f_name);
-	if (unlikely(fd != ss_f->fd)) {
-		pr_err("Unmactched fd: %d:%s\n",
+	fd = alloc_fd_at(current->files, ss_f->fd, f_name);
+	if (unlikely(fd < 0)) {
+		pr_err("Fail to allocate fd: %d:%s\n",
 			ss_f->fd, ss_f->f_name);
-		return -EBADF;
+		return fd;
 	}
 
 	f = fdget(fd);
 	f->f_flags = ss_f->f_flags;
 	f->f_mode = ss_f->f_mode;
+	f->f_pos = ss_f->f_pos;
 
 	if (unlikely(proc_file(f_name)))
 		ret = proc_file_open(f, f_name);
 	else if (unlikely(sys_file(f_name)))
 		ret = sys_file_open(f, f_name);
 	else
-		ret = normal_file_open(f, f_name);
+		ret = default_file_open(f, f_name);
 
 	if (ret) {
 		free_fd(current->files, fd);
@@ -78,44 +66,40 @@ put:
 	return ret;
 }
 
+/*
+ * Files opened by the caller are closed, except stdio ones that are
+ * the same as the snapshot. Others are opened with their saved fd.
+ */
 static int restore_open_files(struct process_snapshot *pss)
 {
-	unsigned int nr_files = pss->nr_files;
 	struct files_struct *files = current->files;
-	int fd, ret;
-	struct file *f;
 	struct ss_files *ss_f;
+	struct file *f;
+	unsigned int fd;
+	int i, ret;
+
+	for_each_set_bit(fd, files->fd_bitmap, NR_OPEN_DEFAULT) {
+		if (fd >= 3)
+			sys_close(fd);
+	}
+
+	for (i = 0; i < pss->nr_files; i++) {
+		ss_f = &pss->files[i];
 
-	for (fd = 0; fd < nr_files; fd++) {
-		ss_f = &pss->files[fd];
-
-		/*
-		 * TODO
-		 * Currently, Lego always open the 3 default
-		 * STDIN, STDOUT, STDERR for newly created
-		 * processes. But it may close the fd during
-		 * runtime.. If so, we need to handle this.
-		 */
-		if (fd < 3 && test_bit(fd, files->fd_bitmap)) {
-			f = files->fd_array[fd];
+		if (ss_f->fd < 3 && test_bit(ss_f->fd, files->fd_bitmap)) {
+			f = files->fd_array[ss_f->fd];
 			BUG_ON(!f);
 
-			if (strncmp(ss_f->f_name, f->f_name,
-				FILENAME_LEN_DEFAULT)) {
-				WARN(1, "Pacth needed here!");
-				ret = -EBADF;
-				goto out;
-			}
-			continue;
+			if (f_name_equal(ss_f->f_name, f->f_name))
+				continue;
+			sys_close(ss_f->fd);
 		}
 
 		ret = restore_sys_open(ss_f);
 		if (ret)
-			goto out;
+			return ret;
 	}
-
-out:
-	return ret;
+	return 0;
 }
 
 static void restore_signals(struct process_snapshot *pss)
@@ -175,218 +159,173 @@ static void restore_thread_state(struct task_struct *p,
 	RESTORE_REG(ss);
 #undef RESTORE_REG
 
-	if (src->fs_base)
-		do_arch_prctl(p, ARCH_SET_FS, src->fs_base);
-	if (src->gs_base)
-		do_arch_prctl(p, ARCH_SET_GS, src->gs_base);
+	/* The caller's own ones are stale */
+	do_arch_prctl(p, ARCH_SET_FS, src->fs_base);
+	do_arch_prctl(p, ARCH_SET_GS, src->gs_base);
 }
 
-struct wait_info {
-	struct ss_task_struct	*ss_task;
-	struct completion	done;
-};
-
-static int restorer_for_other_threads(void *_wait)
-{
-	struct wait_info *wait = _wait;
-	struct ss_task_struct *ss_task = wait->ss_task;
-
-	restore_thread_state(current, ss_task);
-
-	chk_debug("%s(): %d-%d waiting\n", FUNC, current->pid, current->tgid);
-	wait_for_completion(&wait->done);
-
-	/* Return to user-space */
-	return 0;
-}
-
-static void restore_thread_group(struct restorer_work_info *info)
+/*
+ * Threads other than the leader are created and resumed one by one,
+ * thus a thread runs while later ones are still being created.
+ * They start from ret_from_fork() with the restored pt_regs.
+ */
+static int restore_thread_group(struct process_snapshot *pss)
 {
-	struct process_snapshot *pss = info->pss;
-	struct ss_task_struct *ss_task, *ss_tasks = pss->tasks;
-	struct task_struct *t;
-	struct wait_info *wait;
 	unsigned long clone_flags;
-	int nr_threads = pss->nr_tasks;
+	struct task_struct *t;
 	int i;
 
-	ss_task = &ss_tasks[0];
-	restore_thread_state(current, ss_task);
-
-	if (nr_threads == 1)
-		goto done;
-
-	wait = kmalloc(nr_threads * sizeof(*wait), GFP_KERNEL);
-	if (!wait) {
-		info->result = ERR_PTR(-ENOMEM);
-		return;
-	}
-
 	clone_flags = CLONE_THREAD | CLONE_SIGHAND |
 		      CLONE_VM | CLONE_FILES | CLONE_PARENT;
 
-	/* Restore other threads in group */
-	for (i = 1; i < nr_threads; i++) {
-		ss_task = &ss_tasks[i];
-		wait[i].ss_task = ss_task;
-		init_completion(&wait[i].done);
-
-		t = copy_process(clone_flags,
-				(unsigned long)restorer_for_other_threads,
-				(unsigned long)&wait[i], NULL, 0, NUMA_NO_NODE);
+	for (i = 1; i < pss->nr_tasks; i++) {
+		t = copy_process(clone_flags, 0, 0, NULL, 0, NUMA_NO_NODE);
 		if (IS_ERR(t)) {
-			WARN_ON(1);
-			info->result = t;
-			return;
+			WARN_ON_ONCE(1);
+			return PTR_ERR(t);
 		}
 
+		restore_thread_state(t, &pss->tasks[i]);
 		wake_up_new_task(t);
 	}
 
-	kfree(wait);
-done:
-	/* Return leader's task struct back to caller */
-	info->result = current;
+	restore_thread_state(current, &pss->tasks[0]);
+	return 0;
 }
 
-static int restorer_for_group_leader(void *_info)
+/**
+ * restore_process_snapshot	-	Restore a process from snapshot
+ * @pss: the snapshot
+ *
+ * Like execve(), the caller becomes the group leader of the restored
+ * process. Its address space must have been replaced by P2M_RESTORE.
+ * Other threads are created right here, no worker thread is involved.
+ *
+ * Once this returns 0, the caller returns to user-space with
+ * the saved registers of the leader.
+ */
+int restore_process_snapshot(struct process_snapshot *pss)
 {
-	struct restorer_work_info *info = _info;
-	struct process_snapshot *pss = info->pss;
+	int ret;
 
 #ifdef CONFIG_DEBUG_CHECKPOINT
-	dump_task_struct(current, 0);
 	dump_process_snapshot(pss, "Restorer", 0);
 #endif
 
-	/* Fisrt, restore thread group shared data */
-	memcpy(current->comm, pss->comm, TASK_COMM_LEN);
-	restore_open_files(pss);
+	ret = flush_old_exec();
+	if (ret)
+		return ret;
+
+	set_task_comm(current, pss->comm);
+
+	ret = restore_open_files(pss);
+	if (ret)
+		return ret;
+
 	restore_signals(pss);
 
-	/* Create other threads in group */
-	restore_thread_group(info);
-	if (IS_ERR(info->result))
-		goto err;
+	ret = restore_thread_group(pss);
+	if (ret)
+		return ret;
 
 #ifdef CONFIG_DEBUG_CHECKPOINT
 	dump_task_struct(current, 0);
 #endif
-
-	/* Release restore_process_snapshot() */
-	complete(info->done);
-
-	/* Return to user-space */
 	return 0;
-
-err:
-	complete(info->done);
-	do_exit(-1);
-	BUG();
-	return 0;
-}
-
-static void create_restorer(struct restorer_work_info *info)
-{
-	int pid;
-
-	/*
-	 * Use do_fork() instead of kernel_thread() because
-	 * we need a private mm:
-	 */
-	pid = do_fork(SIGCHLD, (unsigned long)restorer_for_group_leader,
-			(unsigned long)info, NULL, NULL, 0);
-	if (pid < 0) {
-		WARN_ON_ONCE(1);
-		info->result = ERR_PTR(pid);
-
-		/* Release restore_process_snapshot() */
-		complete(info->done);
-	}
 }
 
 /*
- * It dequeue work from work_list, and creates a restorer to construct
- * a new process from snapshot. Any error is reported by restorer in
- * the info->result field.
+ * Ask memory to replace our address space with the one in images,
+ * and get back the process snapshot. No page is transferred here,
+ * memory reads pages from images on demand.
  */
-int restorer_worker_thread(void *unused)
+static struct process_snapshot *
+p2m_restore(unsigned int node, pid_t pid, unsigned int seq)
 {
-	set_cpus_allowed_ptr(current, cpu_possible_mask);
-
-	for (;;) {
-		/* Sleep until someone wakes me up before september ends */
-		set_current_state(TASK_UNINTERRUPTIBLE);
-		if (list_empty(&restorer_work_list))
-			schedule();
-		__set_current_state(TASK_RUNNING);
-
-		spin_lock(&restorer_work_lock);
-		while (!list_empty(&restorer_work_list)) {
-			struct restorer_work_info *info;
-
-			info = list_entry(restorer_work_list.next,
-					struct restorer_work_info, list);
-			list_del_init(&info->list);
+	struct p2m_restore_msg *payload;
+	struct p2m_restore_reply *reply;
+	struct process_snapshot *pss;
+	struct common_header *hdr;
+	size_t len_msg;
+	void *msg;
+	int ret;
+
+	len_msg = sizeof(*hdr) + sizeof(*payload);
+	msg = kmalloc(len_msg, GFP_KERNEL);
+	if (!msg)
+		return ERR_PTR(-ENOMEM);
+
+	reply = kmalloc(P2M_CHECKPOINT_MAX_SIZE, GFP_KERNEL);
+	if (!reply) {
+		kfree(msg);
+		return ERR_PTR(-ENOMEM);
+	}
 
-			/*
-			 * Release the lock so others can attach work.
-			 * The real work may take some time.
-			 */
-			spin_unlock(&restorer_work_lock);
+	hdr = msg;
+	fill_common_header(hdr, P2M_RESTORE);
+
+	payload = to_payload(msg);
+	payload->pid = current->tgid;
+	payload->image_node = node;
+	payload->image_pid = pid;
+	payload->seq = seq;
+
+	ret = ibapi_send_reply_timeout(get_memory_home_node(current), msg, len_msg,
+				       reply, P2M_CHECKPOINT_MAX_SIZE, false,
+				       DEF_NET_TIMEOUT);
+	if (unlikely(ret < (int)sizeof(*reply))) {
+		pss = ERR_PTR(-EIO);
+		goto out;
+	}
 
-			create_restorer(info);
+	if (reply->ret) {
+		pss = ERR_PTR(reply->ret);
+		goto out;
+	}
 
-			spin_lock(&restorer_work_lock);
-		}
-		spin_unlock(&restorer_work_lock);
+	if (unlikely(reply->len > ret - sizeof(*reply))) {
+		pss = ERR_PTR(-EIO);
+		goto out;
 	}
+	pss = unpack_process_snapshot((void *)reply + sizeof(*reply), reply->len);
 
-	return 0;
+out:
+	kfree(reply);
+	kfree(msg);
+	return pss;
 }
 
 /**
- * restore_process_snapshot	-	Restore a process from snapshot
- * @pss: the snapshot
- *
- * This function is synchronized. It will wait until the new process
- * is live from the snapshot. The real work of restoring is done by
- * restorer worker thread.
- *
- * Return the task_struct of new thread-group leader.
- * On failure, ERR_PTR is returned.
+ * Restore image <@node>.<@pid>.<@seq> into the calling process.
+ * Like execve(), this does not return on success, but resumes
+ * where the checkpointed process was.
  */
-struct task_struct *restore_process_snapshot(struct process_snapshot *pss)
+SYSCALL_DEFINE3(restore_process, unsigned int, node, pid_t, pid,
+		unsigned int, seq)
 {
-	DEFINE_COMPLETION(done);
-	struct restorer_work_info info;
-	struct task_struct *result;
-
-	/*
-	 * Note:
-	 * If we decide to make this function a-sync later,
-	 * we need to allocate info instead of using stack.
-	 */
-	info.pss = pss;
-	info.done = &done;
-
-	spin_lock(&restorer_work_lock);
-	list_add_tail(&info.list, &restorer_work_list);
-	spin_unlock(&restorer_work_lock);
-
-	wake_up_process(restorer_worker);
-	wait_for_completion(&done);
-
-	result = info.result;
-
-	pr_debug("%s(): restored task: %d comm:%s\n",
-		FUNC, result->pid, result->comm);
-	return result;
-}
+	struct process_snapshot *pss;
+	long ret;
 
-void __init checkpoint_init(void)
-{
-	restorer_worker = kthread_run(restorer_worker_thread, NULL, "krestorerd");
-	if (IS_ERR(restorer_worker))
-		panic("Fail to create checkpointing restore thread!");
+	syscall_enter("node: %u pid: %d seq: %u\n", node, pid, seq);
+
+	pss = p2m_restore(node, pid, seq);
+	if (IS_ERR(pss)) {
+		ret = PTR_ERR(pss);
+		goto out;
+	}
+
+	ret = restore_process_snapshot(pss);
+	free_process_snapshot(pss);
+	if (ret) {
+		/* Past the point of no return, same as a failed execve() */
+		pr_err("Fail to restore %u-%d-%u: %ld\n", node, pid, seq, ret);
+		do_exit(-1);
+		BUG();
+	}
+
+	/* do_syscall_64() writes this back to pt_regs->ax */
+	ret = current_pt_regs()->ax;
+out:
+	syscall_exit(ret);
+	return ret;
 }
@@ -146,3 +146,90 @@ int save_signals(struct task_struct *p, struct process_snapshot *ps)
 
 	return 0;
 }
+
+size_t process_snapshot_size(struct process_snapshot *pss)
+{
+	return sizeof(struct ss_image) +
+	       sizeof(struct ss_task_struct) * pss->nr_tasks +
+	       sizeof(struct ss_files) * pss->nr_files;
+}
+
+/*
+ * Flatten @pss into @buf, which must have
+ * process_snapshot_size() bytes.
+ */
+void pack_process_snapshot(struct process_snapshot *pss, void *buf)
+{
+	struct ss_image *image = buf;
+
+	memcpy(image->comm, pss->comm, TASK_COMM_LEN);
+	image->nr_tasks = pss->nr_tasks;
+	image->nr_files = pss->nr_files;
+	memcpy(image->action, pss->action, sizeof(image->action));
+	memcpy(&image->blocked, &pss->blocked, sizeof(sigset_t));
+	buf += sizeof(*image);
+
+	memcpy(buf, pss->tasks, sizeof(*pss->tasks) * pss->nr_tasks);
+	buf += sizeof(*pss->tasks) * pss->nr_tasks;
+
+	if (pss->nr_files)
+		memcpy(buf, pss->files, sizeof(*pss->files) * pss->nr_files);
+}
+
+/*
+ * Rebuild a process_snapshot from the flattened one in @buf,
+ * which has @len bytes. Free it by free_process_snapshot().
+ */
+struct process_snapshot *unpack_process_snapshot(void *buf, size_t len)
+{
+	struct ss_image *image = buf;
+	struct process_snapshot *pss;
+	size_t len_tasks, len_files;
+
+	if (len < sizeof(*image))
+		return ERR_PTR(-EINVAL);
+
+	len_tasks = sizeof(*pss->tasks) * image->nr_tasks;
+	len_files = sizeof(*pss->files) * image->nr_files;
+	if (!image->nr_tasks || len != sizeof(*image) + len_tasks + len_files)
+		return ERR_PTR(-EINVAL);
+
+	pss = kzalloc(sizeof(*pss), GFP_KERNEL);
+	if (!pss)
+		return ERR_PTR(-ENOMEM);
+
+	pss->tasks = kmalloc(len_tasks, GFP_KERNEL);
+	if (!pss->tasks)
+		goto nomem;
+
+	if (image->nr_files) {
+		pss->files = kmalloc(len_files, GFP_KERNEL);
+		if (!pss->files)
+			goto nomem;
+	}
+
+	memcpy(pss->comm, image->comm, TASK_COMM_LEN);
+	pss->nr_tasks = image->nr_tasks;
+	pss->nr_files = image->nr_files;
+	memcpy(pss->action, image->action, sizeof(pss->action));
+	memcpy(&pss->blocked, &image->blocked, sizeof(sigset_t));
+	buf += sizeof(*image);
+
+	memcpy(pss->tasks, buf, len_tasks);
+	buf += len_tasks;
+
+	if (pss->nr_files)
+		memcpy(pss->files, buf, len_files);
+	return pss;
+
+nomem:
+	free_process_snapshot(pss);
+	return ERR_PTR(-ENOMEM);
+}
+
+void free_process_snapshot(struct process_snapshot *pss)
+{
+	kfree(pss->files);
+	kfree(pss->tasks);
+	kfree(pss);
+}
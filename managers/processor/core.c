@@ -105,12 +105,6 @@ void __init kick_off_user(void)
 		panic("Fail to run the initial user process.");
 }
 
-#ifdef CONFIG_CHECKPOINT
-void __init checkpoint_init(void);
-#else
-static inline void checkpoint_init(void) { }
-#endif
-
 #ifdef CONFIG_GPM_HANDLER
 static inline void init_gpm_handler(void)
 {
@@ -157,9 +151,6 @@ void __init processor_manager_init(void)
 #endif
 	
 	gpm_handler_init();
-
-	/* Create checkpointing restore thread */
-	checkpoint_init();
 }
 
 /*
@@ -177,6 +168,13 @@ SYSCALL_DEFINE1(checkpoint_process, pid_t, pid)
 	printk_once("Checkpoint is not configured!\n");
 	return -ENOSYS;
 }
+
+SYSCALL_DEFINE3(restore_process, unsigned int, node, pid_t, pid,
+		unsigned int, seq)
+{
+	printk_once("Checkpoint is not configured!\n");
+	return -ENOSYS;
+}
 #endif
 
 #ifdef CONFIG_COUNTER_PCACHE
@@ -120,15 +120,19 @@ static int copy_strings(__u32 argc, const char __user * const * __user argv,
 /*
  * Processor-Component
  * Prepare the payload being sent to memory-component
+ *
+ * struct p2m_execve_struct starts at @head bytes of the returned buffer,
+ * the caller fills the leading part.
  */
 static void *prepare_exec_payload(const char __user *filename,
 				  const char __user * const * __user argv,
 				  const char __user * const * __user envp,
-				  __u32 *payload_size)
+				  __u32 head, __u32 *payload_size)
 {
 	__u32 argc, envc, size = 0, array_oft = 0;
 	long copied;
 	struct p2m_execve_struct *payload;
+	void *buf;
 
 	/* Count the total payload size first */
 	argc = count_param(argv, MAX_ARG_STRINGS, &size);
@@ -140,14 +144,15 @@ static void *prepare_exec_payload(const char __user *filename,
 		return ERR_PTR(envc);
 
 	/* then allocate payload */
-	*payload_size = sizeof(*payload) + size - sizeof(char *);
-	payload = kzalloc(*payload_size, GFP_KERNEL);
-	if (!payload)
+	*payload_size = head + sizeof(*payload) + size - sizeof(char *);
+	buf = kzalloc(*payload_size, GFP_KERNEL);
+	if (!buf)
 		return ERR_PTR(-ENOMEM);
+	payload = buf + head;
 
 	/* then copy strings and fill payload */
 	payload->pid = current->tgid;
-	payload->payload_size = *payload_size;
+	payload->payload_size = *payload_size - head;
 	payload->argc = argc;
 	payload->envc = envc;
 
@@ -162,10 +167,10 @@ static void *prepare_exec_payload(const char __user *filename,
 	if (copy_strings(envc, envp, payload, &array_oft))
 		goto out;
 
-	return payload;
+	return buf;
 
 out:
-	kfree(payload);
+	kfree(buf);
 	return ERR_PTR(-EFAULT);
 }
 
@@ -175,14 +180,14 @@ static void *prepare_exec_reply(__u32 *reply_size)
 	return kmalloc(sizeof(struct m2p_execve_struct), GFP_KERNEL);
 }
 
-static int p2m_execve(struct p2m_execve_struct *payload,
+static int p2m_execve(int nid, __u32 opcode, void *payload,
 		      struct m2p_execve_struct *reply,
 		      __u32 payload_size, __u32 reply_size,
 		      unsigned long *new_ip, unsigned long *new_sp)
 {
 	int ret;
 
-	ret = net_send_reply_timeout(current_memory_home_node(), P2M_EXECVE, payload,
+	ret = net_send_reply_timeout(nid, opcode, payload,
 			payload_size, reply, reply_size, false, FIT_MAX_TIMEOUT_SEC);
 
 	if (likely(ret > 0)) {
@@ -362,7 +367,7 @@ killed:
 	return -EAGAIN;
 }
 
-static int flush_old_exec(void)
+int flush_old_exec(void)
 {
 	int ret;
 
@@ -404,19 +409,19 @@ out:
 	return ret;
 }
 
-static void setup_new_exec(const char *filename)
+static void setup_new_exec(struct task_struct *tsk, const char *filename)
 {
 	/* This is the point of no return */
-	current->sas_ss_sp = current->sas_ss_size = 0;
+	tsk->sas_ss_sp = tsk->sas_ss_size = 0;
 
-	set_task_comm(current, kbasename(filename));
+	set_task_comm(tsk, kbasename(filename));
 
 	/*
 	 * An exec changes our domain.
 	 * We are no longer part of the thread group:
 	 */
-	current->self_exec_id++;
-	flush_signal_handlers(current, 0);
+	tsk->self_exec_id++;
+	flush_signal_handlers(tsk, 0);
 }
 
 int do_execve(const char __user *filename,
@@ -429,7 +434,7 @@ int do_execve(const char __user *filename,
 	struct pt_regs *regs = current_pt_regs();
 	void *payload, *reply;
 
-	payload = prepare_exec_payload(filename, argv, envp, &payload_size);
+	payload = prepare_exec_payload(filename, argv, envp, 0, &payload_size);
 	if (IS_ERR(payload))
 		return PTR_ERR(payload);
 
@@ -439,7 +444,8 @@ int do_execve(const char __user *filename,
 		return -ENOMEM;
 	}
 
-	ret = p2m_execve(payload, reply, payload_size, reply_size,
+	ret = p2m_execve(current_memory_home_node(), P2M_EXECVE,
+			 payload, reply, payload_size, reply_size,
 			 &new_ip, &new_sp);
 	if (ret)
 		goto out;
@@ -457,7 +463,7 @@ int do_execve(const char __user *filename,
 	 * Use the f_name saved in payload
 	 * to save one extra strncpy_from_user
 	 */
-	setup_new_exec(((struct p2m_execve_struct *)payload)->filename);
+	setup_new_exec(current, ((struct p2m_execve_struct *)payload)->filename);
 
 #ifdef ELF_PLAT_INIT
 	/*
@@ -499,3 +505,90 @@ SYSCALL_DEFINE3(execve,
 {
 	return do_execve(filename, argv, envp);
 }
+
+/*
+ * posix_spawn() without fork(): create a new process and load @filename
+ * into it with one P2M_SPAWN. The child never runs as a copy of the
+ * caller, thus neither pcache lines nor the address space at memory
+ * are duplicated, which fork() has to do even if execve() follows.
+ *
+ * The child starts at the entry of the new program, with everything
+ * else inherited the same way as fork() + execve().
+ */
+static pid_t do_spawn(const char __user *filename,
+		      const char __user * const * __user argv,
+		      const char __user * const * __user envp)
+{
+	unsigned long clone_flags = CLONE_GLOBAL_THREAD | SIGCHLD;
+	struct p2m_spawn_struct *payload;
+	struct m2p_execve_struct *reply;
+	unsigned long new_ip, new_sp;
+	__u32 payload_size, reply_size;
+	struct task_struct *p;
+	pid_t pid;
+	int ret;
+
+	payload = prepare_exec_payload(filename, argv, envp,
+				       offsetof(struct p2m_spawn_struct, execve),
+				       &payload_size);
+	if (IS_ERR(payload))
+		return PTR_ERR(payload);
+
+	reply = prepare_exec_reply(&reply_size);
+	if (!reply) {
+		ret = -ENOMEM;
+		goto free_payload;
+	}
+
+	/* An empty pgtable at processor, there is no pcache to copy */
+	p = copy_process(clone_flags, 0, 0, NULL, 0, NUMA_NO_NODE);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto free_reply;
+	}
+	pid = p->pid;
+
+	fill_p2m_fork_struct(&payload->fork, p, clone_flags);
+	payload->execve.pid = p->tgid;
+
+	ret = p2m_execve(get_memory_home_node(p), P2M_SPAWN,
+			 payload, reply, payload_size, reply_size,
+			 &new_ip, &new_sp);
+	if (ret) {
+		/*
+		 * The child has nothing to run. It exits before reaching
+		 * user-space, and is reaped here, so that the caller never
+		 * learns about it.
+		 */
+		force_sig(SIGKILL, p);
+		wake_up_new_task(p);
+		sys_wait4(pid, NULL, 0, NULL);
+		goto free_reply;
+	}
+
+#ifdef CONFIG_DISTRIBUTED_VMA_PROCESSOR
+	map_mnode_from_reply(p->mm, &reply->map);
+#endif
+
+	/* Same as flush_old_exec() and setup_new_exec() */
+	do_close_on_exec(p->files);
+	setup_new_exec(p, payload->execve.filename);
+	start_new_thread(p, new_ip, new_sp);
+
+	wake_up_new_task(p);
+	ret = pid;
+
+free_reply:
+	kfree(reply);
+free_payload:
+	kfree(payload);
+	return ret;
+}
+
+SYSCALL_DEFINE3(spawn,
+		const char __user *, filename,
+		const char __user *const __user *, argv,
+		const char __user *const __user *, envp)
+{
+	return do_spawn(filename, argv, envp);
+}
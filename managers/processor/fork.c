@@ -30,6 +30,16 @@ static inline void fork_debug(const char *fmt, ...) { }
 static inline void fork_reply_dump(struct fork_reply_struct *reply) { }
 #endif
 
+void fill_p2m_fork_struct(struct p2m_fork_struct *payload,
+			  struct task_struct *p, unsigned long clone_flags)
+{
+	payload->pid = p->pid;
+	payload->tgid = p->tgid;
+	payload->parent_tgid = p->real_parent->tgid;
+	payload->clone_flags = clone_flags;
+	memcpy(payload->comm, p->comm, TASK_COMM_LEN);
+}
+
 /*
  * Return 0 on success, -ENOMEM on failure.
  * fork() syscall does not have too many errno options.
@@ -49,11 +59,7 @@ void *p2m_fork(struct task_struct *p, unsigned long clone_flags)
 	if (!reply)
 		return ERR_PTR(-ENOMEM);
 
-	payload.pid = p->pid;
-	payload.tgid = p->tgid;
-	payload.parent_tgid = p->real_parent->tgid;
-	payload.clone_flags = clone_flags;
-	memcpy(payload.comm, p->comm, TASK_COMM_LEN);
+	fill_p2m_fork_struct(&payload, p, clone_flags);
 
 	retlen = net_send_reply_timeout(get_memory_home_node(p), P2M_FORK, &payload,
 				sizeof(payload), reply, sizeof(*reply), false,
@@ -67,7 +73,9 @@ void *p2m_fork(struct task_struct *p, unsigned long clone_flags)
 		pr_warn("%s():. ret %d:%s cur:%d-%s new:%d\n",
 			FUNC, reply->ret, perror(reply->ret),
 			current->pid, current->comm, p->pid);
-		return ERR_PTR(reply->ret);
+		retlen = reply->ret;
+		kfree(reply);
+		return ERR_PTR(retlen);
 	}
 
 	fork_reply_dump(reply);
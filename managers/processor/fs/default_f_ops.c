@@ -97,8 +97,7 @@ static ssize_t p2m_read(struct file *f, char __user *buf, size_t count,
 
 	/* Construct payload */
 	hdr = msg;
-	hdr->opcode = P2M_READ;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2M_READ);
 
 	payload = msg + sizeof(*hdr);
 	payload->pid = current->pid;
@@ -170,8 +169,7 @@ static ssize_t __p2m_write(struct file *f, const char __user *buf,
 
 	/* Construct payload */
 	hdr = (struct common_header *)msg;
-	hdr->opcode = P2M_WRITE;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2M_WRITE);
 
 	payload = (struct p2m_read_write_payload *)(msg + sizeof(*hdr));
 	payload->pid = current->pid;
@@ -22,8 +22,7 @@ static int do_drop_page_cache(void)
 	struct common_header hdr;
 	int mem_node = current_pgcache_home_node();
 
-	hdr.opcode = P2M_DROP_CACHE;
-	hdr.src_nid = LEGO_LOCAL_NID;
+	fill_common_header(&hdr, P2M_DROP_CACHE);
 
 	retlen = ibapi_send_reply_imm(mem_node, &hdr, sizeof(hdr),
 				      &retval, sizeof(retval), false);
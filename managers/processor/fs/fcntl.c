@@ -55,6 +55,10 @@ static long do_fcntl(int fd, unsigned int cmd, unsigned long arg, struct file *f
 	case F_SETFL:
 		err = setfl(fp, arg);
 		break;
+	case F_SETPIPE_SZ:
+	case F_GETPIPE_SZ:
+		err = pipe_fcntl(fp, cmd, arg);
+		break;
 	case F_DUPFD:
 	case F_DUPFD_CLOEXEC:
 	case F_GETLK:
@@ -70,8 +74,6 @@ static long do_fcntl(int fd, unsigned int cmd, unsigned long arg, struct file *f
 	case F_GETLEASE:
 	case F_SETLEASE:
 	case F_NOTIFY:
-	case F_SETPIPE_SZ:
-	case F_GETPIPE_SZ:
 		WARN(1, "Cmd not implemented: %u\n", cmd);
 		err = 0;
 		break;
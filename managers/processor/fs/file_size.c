@@ -40,8 +40,7 @@ ssize_t get_file_size(const char *pathname)
 	}
 
 	hdr = msg;
-	hdr->opcode = P2M_LSEEK;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2M_LSEEK);
 	hdr->length = len_msg;
 
 	payload = msg + sizeof(*hdr);
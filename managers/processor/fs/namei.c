@@ -419,8 +419,7 @@ static long do_rename(const char __user *oldname, const char __user *newname)
 	}
 
 	hdr = msg;
-	hdr->opcode = P2S_RENAME;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2S_RENAME);
 	hdr->length = len_msg;
 
 	payload = msg + sizeof(*hdr);
@@ -485,8 +484,7 @@ SYSCALL_DEFINE1(fsync, unsigned int, fd)
 	}
 
 	hdr = msg;
-	hdr->opcode = P2M_FSYNC;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2M_FSYNC);
 	hdr->length = len_msg;
 
 	payload = msg + sizeof(*hdr);
@@ -81,6 +81,35 @@ int alloc_fd(struct files_struct *files, char *filename)
 	return -EMFILE;
 }
 
+/*
+ * Same as alloc_fd(), but use exactly @fd.
+ * This is used by checkpoint restore, which has to keep the fd numbers.
+ */
+int alloc_fd_at(struct files_struct *files, int fd, char *filename)
+{
+	struct file *filp;
+
+	if (fd < 0 || fd >= NR_OPEN_DEFAULT)
+		return -EBADF;
+
+	filp = alloc_file(filename);
+	if (unlikely(!filp))
+		return -ENOMEM;
+
+	spin_lock(&files->file_lock);
+	if (test_bit(fd, files->fd_bitmap)) {
+		spin_unlock(&files->file_lock);
+		put_file(filp);
+		return -EBUSY;
+	}
+	filp->fd = fd;
+	__set_bit(fd, files->fd_bitmap);
+	files->fd_array[fd] = filp;
+	spin_unlock(&files->file_lock);
+
+	return fd;
+}
+
 void free_fd(struct files_struct *files, int fd)
 {
 	struct file *f;
@@ -190,6 +219,7 @@ static long do_sys_open(int dfd, const char __user *pathname, int flags, umode_t
 	 * poll and epoll init
 	 * XXX: should be done inside socket_file_open()
 	 */
+	spin_lock_init(&f->f_ep_lock);
 #ifdef CONFIG_EPOLL
 	INIT_LIST_HEAD(&f->f_epi_links);
 #endif
@@ -7,12 +7,15 @@
  * (at your option) any later version.
  */
 
+#include <lego/mm.h>
+#include <lego/log2.h>
 #include <lego/slab.h>
 #include <lego/files.h>
+#include <lego/mutex.h>
+#include <lego/uaccess.h>
 #include <lego/syscalls.h>
 #include <lego/spinlock.h>
 #include <lego/sched.h>
-#include <lego/files.h>
 #include <processor/processor.h>
 #include <processor/pcache.h>
 #include <processor/fs.h>
@@ -26,54 +29,95 @@
 #define pipe_debug(fmt, ...)	do { } while (0)
 #endif
 
-#define PIPE_MAX_ORDER	(8)
-#define PIPE_MAX_SIZE	((1 << PIPE_MAX_ORDER) * PAGE_SIZE)
+#define PIPE_DEF_BUFFERS	256	/* 1MB */
+#define PIPE_MIN_BUFFERS	2
+#define PIPE_MAX_BUFFERS	4096	/* 16MB, limit of F_SETPIPE_SZ */
 
 /*
- * We implement pipe by a 32-pages kernel memory ring buffer
- * pipe_info is the metadata to manage a pipe, readers/writers are counters
- * of active readers/writers processes, and would initialized as 1 while
- * sys_pipe() or sys_pipe2() is called to create a new pipe.
+ * We implement pipe by a ring of kernel pages. Pages are not part of
+ * pcache, they are allocated once data is written, and recycled once
+ * data is read. pipe_info is the metadata to manage a pipe,
+ * readers/writers are counters of active readers/writers processes, and
+ * would initialized as 1 while sys_pipe() or sys_pipe2() is called to
+ * create a new pipe.
  *
  * pipe_open() would increment a counter (depends on the file is
  * a pipe reader or writer), and filo_open() is called by copy_files(), which is
  * a fork()'s rountine.
  *
- * HEAD is the pointer for consumers to dequeue from ring buffer
- * TAIL is the pointer for producers to enqueue into ring buffer
+ * The ring is single-producer single-consumer:
+ *
+ *   |--------|--------|--------|--------|--------|
+ *            ^ tail                     ^ head
+ *            Reader                     Writer
+ *
+ * The writer fills the page of slot head, then publishes it by advancing
+ * head. Small writes are appended to the last published slot, and made
+ * visible by advancing its end. The reader consumes from slot tail by
+ * advancing its start, and retires a slot by advancing tail. The last
+ * slot is never retired, thus the writer can keep appending to it.
+ * Neither side takes a lock of the other: concurrent writers serialize
+ * on wr_mutex, concurrent readers on rd_mutex. Both are dropped while
+ * sleeping, waiting for the other side.
  *
- * pipe_read() reads n bytes from ring buffer and advances pipe->HEAD, and while buffer
- * has enough room (currently 4-pages), wakes up all waiters (including readers/writers)
- * in order to make consumers work. And pipe_read() sleeps on the ring buffer is completely
- * empty. (It means pipe_read() is not necessary to read same nrbytes as it required).
+ * Writes of no more than PIPE_BUF bytes are not interleaved with other
+ * writers. pipe_write() writes everything unless interrupted, while
+ * pipe_read() returns once something is read.
  *
- * pipe_write() writes n bytes into ring buffer and advances pipe->TAIL. It first checks if
- * there are still active readers, if not, pipe is broken and SIGPIPE needs to send to current
- * process. Unlike pipe_read(), pipe_write() would wait on ring buffer until it has more than
- * n bytes space. And it wakes up all waiters before each time it goes to sleep to make
- * consumers make more room on ring buffer.
+ * splice() between a pipe and a file reads or writes the file straight
+ * from the pipe pages, and between two pipes hands whole pages over.
  *
  * pipe buffer and pipe_info would free on pipe->readers = pipe->writers = 0; pipe_release
  * would decrease a readers or writers counter, which is called when file is closed.
  */
 
+struct pipe_buffer {
+	struct page		*page;
+	unsigned int		start;		/* first unread byte, by reader */
+	unsigned int		end;		/* last written byte + 1, by writer */
+	unsigned int		flags;
+};
+
+/* Writer may append to the page */
+#define PIPE_BUF_FLAG_CAN_MERGE	0x01
+
 struct pipe_info {
-	spinlock_t		lock;
-	wait_queue_head_t	wait;
+	/* Producer side */
+	struct mutex		wr_mutex;
+	wait_queue_head_t	wr_wait;	/* writers wait for room */
+	unsigned long		head;		/* slots published */
+	unsigned long		nr_written;	/* bytes published */
+	unsigned int		w_room;		/* free bytes in the last slot */
+
+	/* Consumer side */
+	struct mutex		rd_mutex ____cacheline_aligned;
+	wait_queue_head_t	rd_wait;	/* readers wait for data */
+	unsigned long		tail;		/* slots retired */
+	unsigned long		nr_read;	/* bytes consumed */
+
+	/* Changed with both mutexes held */
+	struct pipe_buffer	*bufs ____cacheline_aligned;
+	unsigned int		nr_bufs;	/* power of 2 */
+
+	struct page		*spare;		/* one recycled page */
+
+	spinlock_t		lock;		/* protects readers/writers */
 	unsigned int		readers;
 	unsigned int		writers;
-	unsigned long		HEAD;		/* consumers pointer */
-	unsigned long		TAIL;		/* producers pointer */
-	unsigned long		buffer;
-	unsigned long		END;
-	int			len;		/* nbytes in use */
 
 	/*
 	 * How many references are there to this structure?
 	 * Basically, means how many filp->private_data are there.
 	 */
 	atomic_t		_ref;
-} ____cacheline_aligned;
+};
+
+/*
+ * Fill @len bytes at @dst, or drain @len bytes at @src.
+ * Return the number of bytes done, 0 if nothing more, or error.
+ */
+typedef ssize_t (*pipe_fill_actor)(void *dst, size_t len, void *data);
+typedef ssize_t (*pipe_drain_actor)(void *src, size_t len, void *data);
 
 static inline void get_pipe(struct pipe_info *p)
 {
@@ -83,13 +127,20 @@ static inline void get_pipe(struct pipe_info *p)
 
 static inline void __put_pipe(struct pipe_info *pipe)
 {
-	pipe_debug("pipe: %p buffer: %#lx", pipe, pipe->buffer);
+	unsigned long i;
+
+	pipe_debug("pipe: %p head: %lu tail: %lu", pipe, pipe->head, pipe->tail);
 
 	BUG_ON(!pipe);
-	BUG_ON(!pipe->buffer);
+	BUG_ON(!pipe->bufs);
+
+	for (i = pipe->tail; i != pipe->head; i++)
+		__free_page(pipe->bufs[i & (pipe->nr_bufs - 1)].page);
+	if (pipe->spare)
+		__free_page(pipe->spare);
 
-	kfree((void *)pipe->buffer);
-	pipe->buffer = 0;
+	kfree(pipe->bufs);
+	pipe->bufs = NULL;
 	kfree(pipe);
 }
 
@@ -101,160 +152,319 @@ static inline void put_pipe(struct pipe_info *p)
 
 struct pipe_info *alloc_pipe_info(void)
 {
-	void *buffer;
 	struct pipe_info *pipe;
 
-	buffer = kzalloc(PIPE_MAX_SIZE, GFP_KERNEL);
-	if (!buffer)
+	pipe = kzalloc(sizeof(*pipe), GFP_KERNEL);
+	if (!pipe)
 		return NULL;
 
-	pipe = kzalloc(sizeof(*pipe), GFP_KERNEL);
-	if (!pipe) {
-		kfree(buffer);
+	pipe->bufs = kzalloc(PIPE_DEF_BUFFERS * sizeof(struct pipe_buffer), GFP_KERNEL);
+	if (!pipe->bufs) {
+		kfree(pipe);
 		return NULL;
 	}
 
-	pipe->buffer = pipe->HEAD = pipe->TAIL = (unsigned long)buffer;
-	pipe->END = pipe->buffer + PIPE_MAX_SIZE;
+	pipe->nr_bufs = PIPE_DEF_BUFFERS;
 	pipe->readers = 1;
 	pipe->writers = 1;
-	pipe->len = 0;
-	init_waitqueue_head(&pipe->wait);
+	mutex_init(&pipe->wr_mutex);
+	mutex_init(&pipe->rd_mutex);
+	init_waitqueue_head(&pipe->wr_wait);
+	init_waitqueue_head(&pipe->rd_wait);
 	spin_lock_init(&pipe->lock);
 	atomic_set(&pipe->_ref, 1);
 
-	pipe_debug("pipe: %p  buffer: %#lx", pipe, pipe->buffer);
+	pipe_debug("pipe: %p  nr_bufs: %u", pipe, pipe->nr_bufs);
 	return pipe;
 }
 
-static inline void pipe_lock(struct pipe_info *pipe)
+static inline struct pipe_buffer *pipe_buf(struct pipe_info *pipe, unsigned long slot)
 {
-	spin_lock(&pipe->lock);
+	return &pipe->bufs[slot & (pipe->nr_bufs - 1)];
 }
 
-static inline void pipe_unlock(struct pipe_info *pipe)
+static struct page *pipe_get_page(struct pipe_info *pipe)
 {
-	spin_unlock(&pipe->lock);
+	struct page *page;
+
+	page = xchg(&pipe->spare, NULL);
+	if (!page)
+		page = alloc_page();
+	return page;
 }
 
-/*
- * caller must hold pipe->lock
- */
-static inline void pipe_wait(struct pipe_info *pipe)
+static void pipe_put_page(struct pipe_info *pipe, struct page *page)
 {
-	DEFINE_WAIT(wait);
+	if (cmpxchg(&pipe->spare, NULL, page))
+		__free_page(page);
+}
 
-	/*
-	 * We must relase the pipe lock before go into sleep
-	 */
-	pipe_unlock(pipe);
-	prepare_to_wait(&pipe->wait, &wait, TASK_INTERRUPTIBLE);
-	schedule();
-	finish_wait(&pipe->wait, &wait);
-	pipe_lock(pipe);
+static inline bool pipe_readable(struct pipe_info *pipe)
+{
+	return smp_load_acquire(&pipe->nr_written) != pipe->nr_read;
 }
 
-static ssize_t pipe_read(struct file *filp, char __user *user_buf,
-			 size_t count, loff_t *off)
+static inline bool pipe_has_slot(struct pipe_info *pipe)
 {
-	ssize_t ret = 0;
-	int do_wakeup = 0;
-	struct pipe_info *pipe = filp->private_data;
+	return pipe->head - smp_load_acquire(&pipe->tail) < READ_ONCE(pipe->nr_bufs);
+}
 
-	BUG_ON(!pipe);
+/* Pairs with set_current_state() of the waiter */
+static inline void pipe_wake(wait_queue_head_t *wq)
+{
+	smp_mb();
+	if (waitqueue_active(wq))
+		wake_up_interruptible(wq);
+}
 
-	if (!count)
-		return 0;
+static inline void pipe_produced(struct pipe_info *pipe, size_t n)
+{
+	smp_store_release(&pipe->nr_written, pipe->nr_written + n);
+}
 
-	pipe_lock(pipe);
-	for (;;) {
-		if (pipe->len) {
-			ret = count;
+/* Publish a filled slot. Caller holds wr_mutex */
+static void pipe_push_buf(struct pipe_info *pipe, struct page *page,
+			  unsigned int len, unsigned int flags)
+{
+	struct pipe_buffer *buf = pipe_buf(pipe, pipe->head);
 
-			/* Limit to the maximum we have now */
-			if (count > pipe->len)
-				count = pipe->len;
+	buf->page = page;
+	buf->start = 0;
+	buf->end = len;
+	buf->flags = flags;
+	pipe->w_room = (flags & PIPE_BUF_FLAG_CAN_MERGE) ? PAGE_SIZE - len : 0;
 
-			if (pipe->HEAD + count > pipe->END) {
-				unsigned long rear, front;
+	smp_store_release(&pipe->head, pipe->head + 1);
+	pipe_produced(pipe, len);
+}
 
-				rear = pipe->END - pipe->HEAD;
-				front = count - rear;
-				BUG_ON(front > count);
+/*
+ * Producer side, called with wr_mutex held.
+ * If @wait_all, keep waiting for room until @count bytes are filled,
+ * otherwise return once something is filled.
+ *
+ * Return the number of bytes filled, or error if nothing is filled.
+ */
+static ssize_t pipe_fill(struct pipe_info *pipe, size_t count, bool nonblock,
+			 bool wait_all, pipe_fill_actor actor, void *data)
+{
+	struct pipe_buffer *buf;
+	struct page *page;
+	size_t chunk;
+	ssize_t ret = 0, n;
+	bool has_slot;
+
+	while (count) {
+		/* Send SIGPIPE if there is no more reader */
+		if (!READ_ONCE(pipe->readers)) {
+			kill_pid_info(SIGPIPE, (struct siginfo *) 0, current->pid);
+			if (!ret)
+				ret = -EPIPE;
+			break;
+		}
 
-				if (rear) {
+		has_slot = pipe_has_slot(pipe);
 
-					pipe_debug("buffer: [%#lx-%#lx] HEAD: %#lx rear: %#lx",
-						pipe->buffer, pipe->END, pipe->HEAD, rear);
-					if (copy_to_user(user_buf, (void *)pipe->HEAD, rear)) {
-						ret = -EFAULT;
-						break;
-					}
-				}
+		/*
+		 * Append to the last slot, unless a small write would be
+		 * split and then wait for room in between.
+		 */
+		if (pipe->w_room &&
+		    (ret || has_slot || count > PIPE_BUF || count <= pipe->w_room)) {
+			buf = pipe_buf(pipe, pipe->head - 1);
+			chunk = min_t(size_t, count, pipe->w_room);
 
-				pipe_debug("buffer: [%#lx-%#lx] front: %#lx",
-					pipe->buffer, pipe->END, front);
-				if (copy_to_user(user_buf + rear, (void *)pipe->buffer, front)) {
-					ret = -EFAULT;
-					break;
-				}
+			n = actor(page_address(buf->page) + buf->end, chunk, data);
+			if (n <= 0) {
+				if (!ret)
+					ret = n;
+				break;
+			}
 
-				pipe->HEAD = pipe->buffer + front;
-				pipe->len -= count;
-			} else {
-				pipe_debug("buffer: [%#lx-%#lx] HEAD: %#lx count: %#lx",
-					pipe->buffer, pipe->END, pipe->HEAD, count);
-				if (copy_to_user(user_buf, (void *)pipe->HEAD, count)) {
-					ret = -EFAULT;
-					break;
-				}
-				pipe->HEAD += count;
-				pipe->len -= count;
+			smp_store_release(&buf->end, buf->end + n);
+			pipe->w_room -= n;
+			pipe_produced(pipe, n);
+		} else if (has_slot) {
+			page = pipe_get_page(pipe);
+			if (!page) {
+				if (!ret)
+					ret = -ENOMEM;
+				break;
 			}
 
-			/*
-			 * I do_wakeup to wakeup writers when more than 4 page left
-			 */
-			if (PIPE_MAX_SIZE - pipe->len >= 4 * PAGE_SIZE)
-				do_wakeup = 1;
+			chunk = min_t(size_t, count, PAGE_SIZE);
+			n = actor(page_address(page), chunk, data);
+			if (n <= 0) {
+				pipe_put_page(pipe, page);
+				if (!ret)
+					ret = n;
+				break;
+			}
+
+			pipe_push_buf(pipe, page, n, PIPE_BUF_FLAG_CAN_MERGE);
+		} else {
+			/* Full */
+			if (ret && !wait_all)
+				break;
+			if (nonblock) {
+				if (!ret)
+					ret = -EAGAIN;
+				break;
+			}
 
-			if (signal_pending(current)) {
+			pipe_wake(&pipe->rd_wait);
+			pipe_debug("sleep nr_readers:%u, nr_writers:%u",
+				   pipe->readers, pipe->writers);
+
+			mutex_unlock(&pipe->wr_mutex);
+			n = wait_event_interruptible(pipe->wr_wait,
+				pipe_has_slot(pipe) || !READ_ONCE(pipe->readers));
+			mutex_lock(&pipe->wr_mutex);
+			if (n) {
 				if (!ret)
 					ret = -ERESTARTSYS;
 				break;
 			}
+			continue;
+		}
 
+		ret += n;
+		count -= n;
+
+		/* Input is drained */
+		if (n < chunk)
 			break;
-		}
+	}
+
+	if (ret > 0)
+		pipe_wake(&pipe->rd_wait);
+	return ret;
+}
+
+/*
+ * Retire fully consumed slots, except the last one which may still
+ * be appended to. Caller holds rd_mutex.
+ */
+static void pipe_retire_bufs(struct pipe_info *pipe, bool *retired)
+{
+	struct pipe_buffer *buf;
+
+	while (pipe->tail + 1 < smp_load_acquire(&pipe->head)) {
+		buf = pipe_buf(pipe, pipe->tail);
 
-		if (!pipe->writers)
+		/* Now that a later slot is published, end is final */
+		if (buf->start != smp_load_acquire(&buf->end))
 			break;
 
-		/*
-		 * if buffer is already empty, wakeup writers before sleep
-		 */
-		wake_up_interruptible(&pipe->wait);
-		pipe_debug("sleep fd: %d nr_readers:%u, nr_writers:%u",
-				filp->fd,
-				pipe->readers, pipe->writers);
-		pipe_wait(pipe);
-		pipe_debug("woken up fd: %d nr_readers:%u, nr_writers:%u",
-				filp->fd,
-				pipe->readers, pipe->writers);
+		pipe_put_page(pipe, buf->page);
+		buf->page = NULL;
+		smp_store_release(&pipe->tail, pipe->tail + 1);
+		*retired = true;
+	}
+}
+
+/*
+ * Wait until there is something to read. Called with rd_mutex held.
+ * Return 1 if readable, 0 on end of file, or error.
+ */
+static int pipe_wait_readable(struct pipe_info *pipe, bool nonblock)
+{
+	int err;
+
+	while (!pipe_readable(pipe)) {
+		if (!READ_ONCE(pipe->writers))
+			return 0;
+		if (nonblock)
+			return -EAGAIN;
+
+		pipe_debug("sleep nr_readers:%u, nr_writers:%u",
+			   pipe->readers, pipe->writers);
+
+		mutex_unlock(&pipe->rd_mutex);
+		err = wait_event_interruptible(pipe->rd_wait,
+			pipe_readable(pipe) || !READ_ONCE(pipe->writers));
+		mutex_lock(&pipe->rd_mutex);
+		if (err)
+			return -ERESTARTSYS;
 	}
-	pipe_unlock(pipe);
+	return 1;
+}
+
+/*
+ * Consumer side, called with rd_mutex held.
+ * Drain what is there now, up to @count bytes, without waiting.
+ *
+ * Return the number of bytes drained, or error if nothing is drained.
+ */
+static ssize_t pipe_drain(struct pipe_info *pipe, size_t count,
+			  pipe_drain_actor actor, void *data)
+{
+	struct pipe_buffer *buf;
+	unsigned int end;
+	size_t chunk;
+	ssize_t ret = 0, n;
+	bool retired = false;
+
+	for (;;) {
+		pipe_retire_bufs(pipe, &retired);
+		if (!count || pipe->tail == smp_load_acquire(&pipe->head))
+			break;
 
-	if (do_wakeup)
-		wake_up_interruptible(&pipe->wait);
+		buf = pipe_buf(pipe, pipe->tail);
+		end = smp_load_acquire(&buf->end);
+		if (buf->start == end) {
+			/* No longer the last one, retire it */
+			if (pipe->tail + 1 < smp_load_acquire(&pipe->head))
+				continue;
+			break;
+		}
+
+		chunk = min_t(size_t, count, end - buf->start);
+		n = actor(page_address(buf->page) + buf->start, chunk, data);
+		if (n <= 0) {
+			if (!ret)
+				ret = n;
+			break;
+		}
 
+		buf->start += n;
+		pipe->nr_read += n;
+		ret += n;
+		count -= n;
+
+		if (n < chunk)
+			break;
+	}
+
+	if (retired)
+		pipe_wake(&pipe->wr_wait);
 	return ret;
 }
 
-static ssize_t pipe_write(struct file *filp, const char __user *user_buf,
-			  size_t count, loff_t *off)
+static ssize_t pipe_fill_user(void *dst, size_t len, void *data)
 {
-	ssize_t ret = 0;
-	int do_wakeup = 0;
+	const char __user **ubuf = data;
+
+	if (copy_from_user(dst, *ubuf, len))
+		return -EFAULT;
+	*ubuf += len;
+	return len;
+}
+
+static ssize_t pipe_drain_user(void *src, size_t len, void *data)
+{
+	char __user **ubuf = data;
+
+	if (copy_to_user(*ubuf, src, len))
+		return -EFAULT;
+	*ubuf += len;
+	return len;
+}
+
+static ssize_t pipe_read(struct file *filp, char __user *user_buf,
+			 size_t count, loff_t *off)
+{
+	ssize_t ret;
 	struct pipe_info *pipe = filp->private_data;
 
 	BUG_ON(!pipe);
@@ -262,101 +472,31 @@ static ssize_t pipe_write(struct file *filp, const char __user *user_buf,
 	if (!count)
 		return 0;
 
-	/* Send SIGPIPE if there is no more reader */
-	if (!pipe->readers) {
-		kill_pid_info(SIGPIPE, (struct siginfo *) 0, current->pid);
-		ret = -EPIPE;
-		goto out;
-	}
-
-	pipe_lock(pipe);
-	for (;;) {
-		if (pipe->len + count <= PIPE_MAX_SIZE) {
-			ret = count;
-
-			/*
-			 *
-			 *   |------------------------------|
-			 *   |           |---------|        |
-			 *   ^  (front)  ^  (len)  ^ (rear) ^
-			 *   ^           ^         ^        ^
-			 * Buffer       HEAD       TAIL     END
-			 *              Reader     Writer
-			 *
-			 * TAIL points to the first writable byte.
-			 * HEAD points to the first readable byte
-			 * END points to (Buffer + PIPE_MAX_SIZE)
-			 */
-			if (pipe->TAIL + count > pipe->END) {
-				unsigned long rear, front;
-
-				/*
-				 * Rear is not enough to hold the new buf
-				 * Divide it into two copy_from_user: rear, front.
-				 */
-				rear = pipe->END - pipe->TAIL;
-				front = count - rear;
-				BUG_ON(front > count);
-
-				/* Rear if it is not zero */
-				if (rear) {
-					pipe_debug("buffer: [%#lx-%#lx] TAIL: %#lx rear: %#lx",
-						pipe->buffer, pipe->END, pipe->TAIL, rear);
-					if (copy_from_user((void *)pipe->TAIL, user_buf, rear)) {
-						ret = -EFAULT;
-						break;
-					}
-				}
+	mutex_lock(&pipe->rd_mutex);
+	ret = pipe_wait_readable(pipe, filp->f_flags & O_NONBLOCK);
+	if (ret > 0)
+		ret = pipe_drain(pipe, count, pipe_drain_user, &user_buf);
+	mutex_unlock(&pipe->rd_mutex);
 
-				/* Front */
-				pipe_debug("buffer: [%#lx-%#lx] TAIL: %#lx front: %#lx",
-					pipe->buffer, pipe->END, pipe->TAIL, front);
-				if (copy_from_user((void *)pipe->buffer, user_buf + rear, front)) {
-					ret = -EFAULT;
-					break;
-				}
+	return ret;
+}
 
-				pipe->TAIL = pipe->buffer + front;
-				pipe->len += count;
-			} else {
-				pipe_debug("buffer: [%#lx-%#lx] TAIL: %#lx count: %#lx",
-					pipe->buffer, pipe->END, pipe->TAIL, count);
-				if (copy_from_user((void *)pipe->TAIL, user_buf, count)) {
-					ret = -EFAULT;
-					break;
-				}
-				pipe->TAIL += count;
-				pipe->len += count;
-			}
+static ssize_t pipe_write(struct file *filp, const char __user *user_buf,
+			  size_t count, loff_t *off)
+{
+	ssize_t ret;
+	struct pipe_info *pipe = filp->private_data;
 
-			/* anyway wakeup readers if write success */
-			do_wakeup = 1;
-			if (signal_pending(current)) {
-				if (!ret)
-					ret = -ERESTARTSYS;
-				break;
-			}
+	BUG_ON(!pipe);
 
-			break;
-		}
+	if (!count)
+		return 0;
 
-		/*
-		 * if buffer is almost full, wakeup readers before sleep
-		 */
-		wake_up_interruptible(&pipe->wait);
-		pipe_debug("sleep fd: %d nr_readers:%u, nr_writers:%u",
-				filp->fd,
-				pipe->readers, pipe->writers);
-		pipe_wait(pipe);
-		pipe_debug("woken up fd: %d nr_readers:%u, nr_writers:%u",
-				filp->fd,
-				pipe->readers, pipe->writers);
-	}
-	pipe_unlock(pipe);
+	mutex_lock(&pipe->wr_mutex);
+	ret = pipe_fill(pipe, count, filp->f_flags & O_NONBLOCK, true,
+			pipe_fill_user, &user_buf);
+	mutex_unlock(&pipe->wr_mutex);
 
-out:
-	if (do_wakeup)
-		wake_up_interruptible(&pipe->wait);
 	return ret;
 }
 
@@ -369,7 +509,7 @@ static int pipe_open(struct file *f)
 
 	BUG_ON(!pipe);
 
-	pipe_lock(pipe);
+	spin_lock(&pipe->lock);
 	if (f->f_mode & FMODE_READ) {
 		pipe->readers++;
 		get_pipe(pipe);
@@ -378,13 +518,11 @@ static int pipe_open(struct file *f)
 		get_pipe(pipe);
 	} else
 		BUG();
-	if (pipe->readers == 1 || pipe->writers == 1)
-		wake_up_interruptible(&pipe->wait);
 
 	pipe_debug("pipe: %p _ref: %d fd: %d nr_readers:%u, nr_writers:%u",
 		pipe, atomic_read(&pipe->_ref), f->fd, pipe->readers, pipe->writers);
 
-	pipe_unlock(pipe);
+	spin_unlock(&pipe->lock);
 	return 0;
 }
 
@@ -394,20 +532,21 @@ static int pipe_release(struct file *filp)
 
 	BUG_ON(!pipe);
 
-	pipe_lock(pipe);
+	spin_lock(&pipe->lock);
 	if ((filp->f_mode & FMODE_READ) && (pipe->readers > 0))
 		pipe->readers--;
 
 	if ((filp->f_mode & FMODE_WRITE) && (pipe->writers > 0))
 		pipe->writers--;
 
-	if (pipe->readers || pipe->writers)
-		wake_up_interruptible(&pipe->wait);
-
 	pipe_debug("pipe: %p _ref: %d fd:%d, nr_readers:%u, nr_writers:%u",
 		pipe, atomic_read(&pipe->_ref), filp->fd, pipe->readers, pipe->writers);
 
-	pipe_unlock(pipe);
+	spin_unlock(&pipe->lock);
+
+	/* Either side may be waiting for the other one */
+	pipe_wake(&pipe->rd_wait);
+	pipe_wake(&pipe->wr_wait);
 
 	/* May lead to a eventual free */
 	put_pipe(pipe);
@@ -422,6 +561,73 @@ const struct file_operations pipefifo_fops = {
 	.release	= pipe_release,
 };
 
+static inline struct pipe_info *get_pipe_info(struct file *file)
+{
+	return file->f_op == &pipefifo_fops ? file->private_data : NULL;
+}
+
+/*
+ * Resize the ring to hold @size bytes. Fail if what is in it now
+ * does not fit in the new one.
+ */
+static long pipe_set_size(struct pipe_info *pipe, unsigned long size)
+{
+	struct pipe_buffer *bufs;
+	unsigned long i, nr_bufs;
+	long ret;
+
+	nr_bufs = DIV_ROUND_UP(size, PAGE_SIZE);
+	if (nr_bufs > PIPE_MAX_BUFFERS)
+		return -EPERM;
+	nr_bufs = max_t(unsigned long, roundup_pow_of_two(nr_bufs ? : 1),
+			PIPE_MIN_BUFFERS);
+
+	bufs = kzalloc(nr_bufs * sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	mutex_lock(&pipe->rd_mutex);
+	mutex_lock(&pipe->wr_mutex);
+
+	if (pipe->head - pipe->tail > nr_bufs) {
+		ret = -EBUSY;
+		kfree(bufs);
+		goto unlock;
+	}
+
+	for (i = pipe->tail; i != pipe->head; i++)
+		bufs[i & (nr_bufs - 1)] = *pipe_buf(pipe, i);
+
+	kfree(pipe->bufs);
+	pipe->bufs = bufs;
+	WRITE_ONCE(pipe->nr_bufs, nr_bufs);
+	ret = nr_bufs * PAGE_SIZE;
+
+unlock:
+	mutex_unlock(&pipe->wr_mutex);
+	mutex_unlock(&pipe->rd_mutex);
+
+	pipe_wake(&pipe->wr_wait);
+	return ret;
+}
+
+/* F_SETPIPE_SZ and F_GETPIPE_SZ */
+long pipe_fcntl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pipe_info *pipe = get_pipe_info(file);
+
+	if (!pipe)
+		return -EBADF;
+
+	switch (cmd) {
+	case F_SETPIPE_SZ:
+		return pipe_set_size(pipe, arg);
+	case F_GETPIPE_SZ:
+		return READ_ONCE(pipe->nr_bufs) * PAGE_SIZE;
+	}
+	return -EINVAL;
+}
+
 /*
  * callers must guarantee flides[0], fildes[1] are valid address
  */
@@ -513,3 +719,354 @@ SYSCALL_DEFINE1(pipe, int __user *, flides)
 {
 	return sys_pipe2(flides, 0);
 }
+
+/*
+ * splice
+ *
+ * Files are read into, or written from, the pipe pages directly by the
+ * file's own read/write, which take a kernel buffer under KERNEL_DS.
+ * Compared with read() plus write(), the data never goes through user
+ * pages, which may fault and go remote. Processor has no page cache,
+ * thus file pages can not be moved into the pipe: the copy done by file
+ * read/write is all there is.
+ */
+struct splice_file {
+	struct file	*file;
+	loff_t		*pos;
+};
+
+static ssize_t pipe_fill_file(void *dst, size_t len, void *data)
+{
+	struct splice_file *sf = data;
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	set_fs(KERNEL_DS);
+	ret = sf->file->f_op->read(sf->file, (char __user *)dst, len, sf->pos);
+	set_fs(old_fs);
+	return ret;
+}
+
+static ssize_t pipe_drain_file(void *src, size_t len, void *data)
+{
+	struct splice_file *sf = data;
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	set_fs(KERNEL_DS);
+	ret = sf->file->f_op->write(sf->file, (const char __user *)src, len, sf->pos);
+	set_fs(old_fs);
+	return ret;
+}
+
+static ssize_t pipe_fill_kernel(void *dst, size_t len, void *data)
+{
+	char **kbuf = data;
+
+	memcpy(dst, *kbuf, len);
+	*kbuf += len;
+	return len;
+}
+
+struct splice_pipe {
+	struct pipe_info	*pipe;
+	bool			nonblock;
+};
+
+/* Fill the output pipe with what the input one drains */
+static ssize_t pipe_drain_pipe(void *src, size_t len, void *data)
+{
+	struct splice_pipe *sp = data;
+
+	return pipe_fill(sp->pipe, len, sp->nonblock, false, pipe_fill_kernel, &src);
+}
+
+/*
+ * Hand whole slots of @ipipe over to @opipe, no data is copied.
+ * Stop at the first one that is partially read, larger than @len,
+ * or still being appended to. Return the number of bytes moved.
+ */
+static ssize_t pipe_move_bufs(struct pipe_info *ipipe, struct pipe_info *opipe,
+			      size_t len)
+{
+	struct pipe_buffer *ibuf;
+	ssize_t ret = 0;
+
+	while (ipipe->tail + 1 < smp_load_acquire(&ipipe->head) &&
+	       pipe_has_slot(opipe)) {
+		ibuf = pipe_buf(ipipe, ipipe->tail);
+		if (ibuf->start || smp_load_acquire(&ibuf->end) > len)
+			break;
+
+		pipe_push_buf(opipe, ibuf->page, ibuf->end, ibuf->flags);
+
+		ipipe->nr_read += ibuf->end;
+		ret += ibuf->end;
+		len -= ibuf->end;
+		ibuf->page = NULL;
+		smp_store_release(&ipipe->tail, ipipe->tail + 1);
+	}
+
+	if (ret) {
+		pipe_wake(&ipipe->wr_wait);
+		pipe_wake(&opipe->rd_wait);
+	}
+	return ret;
+}
+
+static long splice_pipe_to_pipe(struct pipe_info *ipipe, struct pipe_info *opipe,
+				size_t len, bool nonblock)
+{
+	struct splice_pipe sp = { .pipe = opipe, .nonblock = nonblock };
+	long ret, n;
+
+	if (ipipe == opipe)
+		return -EINVAL;
+
+	mutex_lock(&ipipe->rd_mutex);
+	ret = pipe_wait_readable(ipipe, nonblock);
+	if (ret <= 0)
+		goto unlock_rd;
+
+	mutex_lock(&opipe->wr_mutex);
+	ret = pipe_move_bufs(ipipe, opipe, len);
+	if (ret < len && pipe_readable(ipipe)) {
+		n = pipe_drain(ipipe, len - ret, pipe_drain_pipe, &sp);
+		if (n > 0)
+			ret += n;
+		else if (!ret)
+			ret = n;
+	}
+	mutex_unlock(&opipe->wr_mutex);
+
+unlock_rd:
+	mutex_unlock(&ipipe->rd_mutex);
+	return ret;
+}
+
+static long splice_file_to_pipe(struct file *in, loff_t *pos, struct pipe_info *opipe,
+				size_t len, bool nonblock)
+{
+	struct splice_file sf = { .file = in, .pos = pos };
+	long ret;
+
+	if (!(in->f_mode & FMODE_READ) || !in->f_op->read)
+		return -EBADF;
+
+	mutex_lock(&opipe->wr_mutex);
+	ret = pipe_fill(opipe, len, nonblock, false, pipe_fill_file, &sf);
+	mutex_unlock(&opipe->wr_mutex);
+
+	return ret;
+}
+
+static long splice_pipe_to_file(struct pipe_info *ipipe, struct file *out, loff_t *pos,
+				size_t len, bool nonblock)
+{
+	struct splice_file sf = { .file = out, .pos = pos };
+	long ret;
+
+	if (!(out->f_mode & FMODE_WRITE) || !out->f_op->write)
+		return -EBADF;
+
+	mutex_lock(&ipipe->rd_mutex);
+	ret = pipe_wait_readable(ipipe, nonblock);
+	if (ret > 0)
+		ret = pipe_drain(ipipe, len, pipe_drain_file, &sf);
+	mutex_unlock(&ipipe->rd_mutex);
+
+	return ret;
+}
+
+/*
+ * Use the user offset if given, otherwise f_pos, same as pread/read.
+ * Pipes do not have offset.
+ */
+static int splice_get_pos(struct file *file, struct pipe_info *pipe,
+			  loff_t __user *upos, loff_t *pos)
+{
+	if (pipe)
+		return upos ? -ESPIPE : 0;
+
+	if (!upos) {
+		*pos = file->f_pos;
+		return 0;
+	}
+
+	if (copy_from_user(pos, upos, sizeof(*pos)))
+		return -EFAULT;
+	return *pos < 0 ? -EINVAL : 0;
+}
+
+static void splice_put_pos(struct file *file, struct pipe_info *pipe,
+			   loff_t __user *upos, loff_t pos)
+{
+	if (pipe)
+		return;
+
+	if (!upos)
+		file->f_pos = pos;
+	else if (copy_to_user(upos, &pos, sizeof(pos)))
+		WARN_ON_ONCE(1);
+}
+
+SYSCALL_DEFINE6(splice, int, fd_in, loff_t __user *, off_in,
+		int, fd_out, loff_t __user *, off_out,
+		size_t, len, unsigned int, flags)
+{
+	struct file *in, *out;
+	struct pipe_info *ipipe, *opipe;
+	loff_t pos_in = 0, pos_out = 0;
+	bool nonblock;
+	long ret;
+
+	syscall_enter("fd_in: %d, fd_out: %d, len: %zu, flags: %#x\n",
+		fd_in, fd_out, len, flags);
+
+	if (unlikely(!len))
+		return 0;
+
+	if (flags & ~SPLICE_F_ALL)
+		return -EINVAL;
+
+	ret = -EBADF;
+	in = fdget(fd_in);
+	if (!in)
+		goto out;
+	out = fdget(fd_out);
+	if (!out)
+		goto put_in;
+
+	ipipe = get_pipe_info(in);
+	opipe = get_pipe_info(out);
+
+	ret = splice_get_pos(in, ipipe, off_in, &pos_in);
+	if (ret)
+		goto put_out;
+	ret = splice_get_pos(out, opipe, off_out, &pos_out);
+	if (ret)
+		goto put_out;
+
+	nonblock = flags & SPLICE_F_NONBLOCK;
+
+	if (ipipe && opipe) {
+		nonblock |= (in->f_flags | out->f_flags) & O_NONBLOCK;
+		ret = splice_pipe_to_pipe(ipipe, opipe, len, nonblock);
+	} else if (ipipe) {
+		nonblock |= in->f_flags & O_NONBLOCK;
+		ret = splice_pipe_to_file(ipipe, out, &pos_out, len, nonblock);
+	} else if (opipe) {
+		nonblock |= out->f_flags & O_NONBLOCK;
+		ret = splice_file_to_pipe(in, &pos_in, opipe, len, nonblock);
+	} else
+		ret = -EINVAL;
+
+	if (ret > 0) {
+		splice_put_pos(in, ipipe, off_in, pos_in);
+		splice_put_pos(out, opipe, off_out, pos_out);
+	}
+
+put_out:
+	put_file(out);
+put_in:
+	put_file(in);
+out:
+	syscall_exit(ret);
+	return ret;
+}
+
+/*
+ * User pages are pcache lines, which can not be given to a pipe.
+ * vmsplice() thus copies, but gathers all segments in one call.
+ */
+SYSCALL_DEFINE4(vmsplice, int, fd, const struct iovec __user *, uiov,
+		unsigned long, nr_segs, unsigned int, flags)
+{
+	struct file *file;
+	struct pipe_info *pipe;
+	struct iovec *iov;
+	unsigned long i;
+	bool nonblock;
+	long ret = 0, n;
+
+	syscall_enter("fd: %d, nr_segs: %lu, flags: %#x\n", fd, nr_segs, flags);
+
+	if (flags & ~SPLICE_F_ALL)
+		return -EINVAL;
+	if (!nr_segs)
+		return 0;
+	if (nr_segs > UIO_MAXIOV)
+		return -EINVAL;
+
+	iov = kmalloc(nr_segs * sizeof(*iov), GFP_KERNEL);
+	if (!iov)
+		return -ENOMEM;
+	if (copy_from_user(iov, uiov, nr_segs * sizeof(*iov))) {
+		ret = -EFAULT;
+		goto free;
+	}
+
+	file = fdget(fd);
+	if (!file) {
+		ret = -EBADF;
+		goto free;
+	}
+
+	pipe = get_pipe_info(file);
+	if (!pipe) {
+		ret = -EBADF;
+		goto put;
+	}
+	nonblock = (flags & SPLICE_F_NONBLOCK) || (file->f_flags & O_NONBLOCK);
+
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&pipe->wr_mutex);
+		for (i = 0; i < nr_segs; i++) {
+			const char __user *ubuf = iov[i].iov_base;
+
+			if (!iov[i].iov_len)
+				continue;
+			n = pipe_fill(pipe, iov[i].iov_len, nonblock, false,
+				      pipe_fill_user, &ubuf);
+			if (n <= 0) {
+				if (!ret)
+					ret = n;
+				break;
+			}
+			ret += n;
+			if (n < iov[i].iov_len)
+				break;
+		}
+		mutex_unlock(&pipe->wr_mutex);
+	} else {
+		mutex_lock(&pipe->rd_mutex);
+		ret = pipe_wait_readable(pipe, nonblock);
+		if (ret > 0) {
+			ret = 0;
+			for (i = 0; i < nr_segs; i++) {
+				char __user *ubuf = iov[i].iov_base;
+
+				if (!iov[i].iov_len)
+					continue;
+				n = pipe_drain(pipe, iov[i].iov_len,
+					       pipe_drain_user, &ubuf);
+				if (n <= 0) {
+					if (!ret)
+						ret = n;
+					break;
+				}
+				ret += n;
+				if (n < iov[i].iov_len)
+					break;
+			}
+		}
+		mutex_unlock(&pipe->rd_mutex);
+	}
+
+put:
+	put_file(file);
+free:
+	kfree(iov);
+	syscall_exit(ret);
+	return ret;
+}
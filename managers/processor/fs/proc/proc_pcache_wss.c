@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <lego/files.h>
+#include <lego/seq_file.h>
+#include <processor/pcache.h>
+
+static int pcache_wss_proc_show(struct seq_file *m, void *v)
+{
+	return pcache_wss_show(m);
+}
+
+static int pcache_wss_open(struct file *file)
+{
+	return single_open(file, pcache_wss_proc_show, NULL);
+}
+
+static ssize_t pcache_wss_write(struct file *f, const char __user *buf,
+				size_t count, loff_t *off)
+{
+	return -EFAULT;
+}
+
+struct file_operations proc_pcache_wss_ops = {
+	.open		= pcache_wss_open,
+	.read		= seq_read,
+	.write		= pcache_wss_write,
+	.release	= single_release,
+};
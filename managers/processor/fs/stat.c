@@ -206,8 +206,7 @@ static int get_kstat_from_memory(char *filepath, struct kstat *stat, int flag)
 		return -ENOMEM;
 
 	hdr = msg;
-	hdr->opcode = P2M_STAT;
-	hdr->src_nid = LEGO_LOCAL_NID;
+	fill_common_header(hdr, P2M_STAT);
 	hdr->length = len_msg;
 
 	payload = msg + sizeof(*hdr);
@@ -94,6 +94,23 @@ static void piggyback_fallback(struct pcache_meta *pcm)
 	inc_pcache_event(PCACHE_CLFLUSH_PIGGYBACK_FB);
 }
 
+#ifdef CONFIG_PCACHE_FILL_YIELD
+/*
+ * Remote fills that are not piggybacked sleep while waiting for reply,
+ * see __pcache_do_fill_page(). Piggybacked ones use per-cpu buffers,
+ * and the line to be flushed is only owned by us, they keep spinning.
+ */
+static inline bool fill_may_sleep(struct pcache_meta *pcm, enum rmap_caller caller)
+{
+	return caller == RMAP_FILL_PAGE_REMOTE && !PcachePiggyback(pcm);
+}
+#else
+static inline bool fill_may_sleep(struct pcache_meta *pcm, enum rmap_caller caller)
+{
+	return false;
+}
+#endif
+
 /*
  * This is a shared common function to setup PTE.
  * The pcache line allocation and post-setup are standard.
@@ -146,7 +163,26 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 	 * 2) victim cache
 	 * 3) zerofill
 	 */
-	ret = fill_func(address, flags, pcm, arg);
+	if (fill_may_sleep(pcm, caller)) {
+		/*
+		 * The fill may sleep, and others running on this CPU may
+		 * fault on the same pte page. Drop the lock meanwhile.
+		 * Concurrent faults to this pte may fill their own lines,
+		 * the first one to retake the lock wins. This is the same
+		 * unlocked window as the one before pte_offset_lock(),
+		 * processor does not take mmap_sem for faults anyway.
+		 */
+		spin_unlock(ptl);
+		ret = fill_func(address, flags, pcm, arg);
+		spin_lock(ptl);
+
+		if (unlikely(!ret && !pte_same(*page_table, orig_pte))) {
+			inc_pcache_event(PCACHE_FAULT_CONCUR_FILL);
+			ret = 0;
+			goto out;
+		}
+	} else
+		ret = fill_func(address, flags, pcm, arg);
 	if (unlikely(ret)) {
 		ret = VM_FAULT_SIGSEGV;
 		goto out;
@@ -160,7 +196,7 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 
 	/* which will also mark PcacheValid */
 	ret = pcache_add_rmap(pcm, page_table, address,
-			      mm, current->group_leader, caller);
+			      mm, pcache_owner(mm), caller);
 	if (unlikely(ret)) {
 		pte_clear(page_table);
 		ret = VM_FAULT_OOM;
@@ -190,12 +226,18 @@ __pcache_do_fill_page(unsigned long address, unsigned long flags,
 		      struct pcache_meta *pcm, void *unused)
 {
 	int ret, len, dst_nid;
+	bool may_sleep;
 	struct pcache_set *pset;
 	void *va_cache = pcache_meta_to_kva(pcm);
 	struct p2m_pcache_miss_msg msg;
 	PROFILE_POINT_TIME(__pcache_fill_remote_net)
 	PROFILE_POINT_TIME(__pcache_fill_remote_piggyback_net)
 
+	/*
+	 * Piggyback fallback below clears the flag, but the pte lock
+	 * is still held for it. Decide before that.
+	 */
+	may_sleep = fill_may_sleep(pcm, RMAP_FILL_PAGE_REMOTE);
 	pset = pcache_meta_to_pcache_set(pcm);
 	dst_nid = get_memory_node(current, address);
 
@@ -273,9 +315,14 @@ fallback:
 		msg.missing_vaddr = address;
 
 		PROFILE_START(__pcache_fill_remote_net);
-		len = ibapi_send_reply_timeout(dst_nid, &msg, sizeof(msg),
-					       va_cache, PCACHE_LINE_SIZE, false,
-					       DEF_NET_TIMEOUT);
+		if (may_sleep)
+			len = ibapi_send_reply_timeout_sleep(dst_nid, &msg, sizeof(msg),
+							     va_cache, PCACHE_LINE_SIZE, false,
+							     DEF_NET_TIMEOUT);
+		else
+			len = ibapi_send_reply_timeout(dst_nid, &msg, sizeof(msg),
+						       va_cache, PCACHE_LINE_SIZE, false,
+						       DEF_NET_TIMEOUT);
 		PROFILE_LEAVE(__pcache_fill_remote_net);
 	}
 
@@ -497,7 +544,8 @@ static int pcache_do_wp_page(struct mm_struct *mm, unsigned long address,
 
 		/* which will also mark new_pcm PcacheValid */
 		ret = pcache_add_rmap(new_pcm, page_table, address,
-				      current->mm, current->group_leader, RMAP_COW);
+				      current->mm, pcache_owner(current->mm),
+				      RMAP_COW);
 		if (unlikely(ret)) {
 			put_pcache(new_pcm);
 			pte_clear(page_table);
@@ -511,7 +559,7 @@ static int pcache_do_wp_page(struct mm_struct *mm, unsigned long address,
 		 * other processes mapped to it.
 		 */
 		pcache_remove_rmap(old_pcm, page_table, address,
-				   current->mm, current->group_leader);
+				   current->mm, pcache_owner(current->mm));
 		put_pcache(old_pcm);
 
 		inc_pcache_event(PCACHE_FAULT_WP_COW);
@@ -549,7 +597,7 @@ static int pcache_handle_pte_fault(struct mm_struct *mm, unsigned long address,
 			 * Wait until cache line is fully flushed
 			 * back to memory.
 			 */
-			while (pset_find_eviction(address, current)) {
+			while (pset_find_eviction(address, pcache_owner(mm))) {
 				cpu_relax();
 				inc_pcache_event(PCACHE_PSET_LIST_LOOKUP);
 			}
@@ -143,6 +143,7 @@ void __init pcache_early_init(void)
 	alloc_pcache_set_map();
 	alloc_pcache_rmap_map();
 	alloc_pcache_perset_map();
+	alloc_pcache_wss_map();
 	victim_cache_early_init();
 }
 
@@ -163,7 +164,7 @@ static void __init init_pcache_set_free_list(void)
 static void __init init_pcache_set_map(void)
 {
 	struct pcache_set *pset;
-	int setidx, j;
+	int setidx;
 
 	pcache_for_each_set(pset, setidx) {
 		/* Head of free pcache line */
@@ -186,8 +187,9 @@ static void __init init_pcache_set_map(void)
 		atomic_set(&pset->nr_eviction_entries, 0);
 #endif
 
-		for (j = 0; j < NR_PSET_STAT_ITEMS; j++)
-			atomic_set(&pset->stat[j], 0);
+#ifdef CONFIG_COUNTER_PCACHE
+		memset(pset->stat, 0, sizeof(pset->stat));
+#endif
 	}
 }
 
@@ -259,6 +261,11 @@ void __init pcache_post_init(void)
 	if (ret)
 		panic("Pcache: fail to create evict sweep threads!");
 
+	/* Create working set sampling thread if configured */
+	ret = pcache_wss_init();
+	if (ret)
+		panic("Pcache: fail to create wss thread!");
+
 	pcache_print_info();
 }
 
@@ -23,3 +23,62 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
+
+/* Return true if the line of @address is neither cached nor zerofill */
+static bool pcache_line_missing(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd))
+		return true;
+
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud))
+		return true;
+
+	pmd = pmd_offset(pud, address);
+	if (pmd_none(*pmd))
+		return true;
+
+	return pte_none(*pte_offset(pmd, address));
+}
+
+/**
+ * pcache_prefetch_range - Fill missing lines of [@start, @end) of current
+ *
+ * Used by madvise(MADV_WILLNEED). The fill path takes tgid and memory node
+ * from current, and the address space must not go away underneath, thus
+ * lines are filled by the caller the same way as read faults, instead of
+ * by a background thread.
+ *
+ * At most one line per set is filled, more would only evict the lines
+ * prefetched just now. Failures are left to the real fault.
+ *
+ * Return the number of filled lines.
+ */
+unsigned long pcache_prefetch_range(unsigned long start, unsigned long end)
+{
+	struct mm_struct *mm = current->mm;
+	unsigned long addr, nr = 0;
+
+	start &= PCACHE_LINE_MASK;
+	end = min_t(unsigned long, end, start + nr_cachesets * PCACHE_LINE_SIZE);
+
+	for (addr = start; addr < end; addr += PCACHE_LINE_SIZE) {
+		if (fatal_signal_pending(current))
+			break;
+
+		if (!pcache_line_missing(mm, addr))
+			continue;
+
+		if (pcache_handle_fault(mm, addr, 0))
+			break;
+
+		inc_pcache_event(PCACHE_PREFETCH);
+		nr++;
+	}
+	return nr;
+}
@@ -59,7 +59,8 @@ static inline struct pcache_rmap *index_to_pcache_rmap(unsigned long index)
 	return &rmap_map[index];
 }
 
-static struct pcache_rmap *alloc_pcache_rmap(struct pcache_meta *pcm)
+static struct pcache_rmap *
+alloc_pcache_rmap(struct pcache_meta *pcm, struct pcache_rmap_batch *batch)
 {
 	struct pcache_rmap *rmap;
 	unsigned long index;
@@ -69,12 +70,16 @@ static struct pcache_rmap *alloc_pcache_rmap(struct pcache_meta *pcm)
 
 	/* Atomic test-and-set is a sync point */
 	if (unlikely(TestSetRmapUsed(rmap))) {
-		rmap = kzalloc(sizeof(*rmap), GFP_KERNEL);
-		if (unlikely(!rmap))
-			goto out;
-
-		SetRmapKmalloced(rmap);
-		inc_pcache_event(PCACHE_RMAP_ALLOC_KMALLOC);
+		if (batch && batch->nr)
+			rmap = batch->rmaps[--batch->nr];
+		else {
+			rmap = kzalloc(sizeof(*rmap), GFP_KERNEL);
+			if (unlikely(!rmap))
+				goto out;
+
+			SetRmapKmalloced(rmap);
+			inc_pcache_event(PCACHE_RMAP_ALLOC_KMALLOC);
+		}
 	}
 
 	/*
@@ -397,10 +402,10 @@ out:
  * @page_table is locked when called.
  * @pcm must NOT be locked on entry.
  */
-int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
-		    unsigned long address, struct mm_struct *owner_mm,
-		    struct task_struct *owner_process,
-		    enum rmap_caller caller)
+static int __pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
+			     unsigned long address, struct mm_struct *owner_mm,
+			     struct task_struct *owner_process,
+			     enum rmap_caller caller, struct pcache_rmap_batch *batch)
 {
 	struct pcache_rmap *rmap, *pos;
 	int ret;
@@ -410,7 +415,7 @@ int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 
 	lock_pcache(pcm);
 
-	rmap = alloc_pcache_rmap(pcm);
+	rmap = alloc_pcache_rmap(pcm, batch);
 	if (!rmap) {
 		ret = -ENOMEM;
 		goto out;
@@ -453,6 +458,59 @@ out:
 	return ret;
 }
 
+int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
+		    unsigned long address, struct mm_struct *owner_mm,
+		    struct task_struct *owner_process,
+		    enum rmap_caller caller)
+{
+	return __pcache_add_rmap(pcm, page_table, address, owner_mm,
+				 owner_process, caller, NULL);
+}
+
+/*
+ * Same as pcache_add_rmap(), but take a kmalloc'ed rmap from @batch
+ * if the pre-allocated one of @pcm is in use.
+ */
+int pcache_add_rmap_batch(struct pcache_meta *pcm, pte_t *page_table,
+			  unsigned long address, struct mm_struct *owner_mm,
+			  struct task_struct *owner_process,
+			  enum rmap_caller caller, struct pcache_rmap_batch *batch)
+{
+	return __pcache_add_rmap(pcm, page_table, address, owner_mm,
+				 owner_process, caller, batch);
+}
+
+/*
+ * fork() maps lines that are already mapped by the parent, thus the
+ * pre-allocated rmap of each pcm is in use, and every new rmap comes
+ * from kmalloc, with pte locks held. Allocate them upfront instead,
+ * so that @batch has at least @nr rmaps. Best effort.
+ */
+void pcache_rmap_batch_refill(struct pcache_rmap_batch *batch, int nr)
+{
+	struct pcache_rmap *rmap;
+
+	nr = min(nr, (int)ARRAY_SIZE(batch->rmaps));
+	while (batch->nr < nr) {
+		rmap = kzalloc(sizeof(*rmap), GFP_KERNEL);
+		if (unlikely(!rmap))
+			break;
+
+		SetRmapKmalloced(rmap);
+		inc_pcache_event(PCACHE_RMAP_ALLOC_KMALLOC);
+		batch->rmaps[batch->nr++] = rmap;
+	}
+}
+
+/* Free rmaps that were not used */
+void pcache_rmap_batch_release(struct pcache_rmap_batch *batch)
+{
+	while (batch->nr) {
+		kfree(batch->rmaps[--batch->nr]);
+		inc_pcache_event(PCACHE_RMAP_FREE_KMALLOC);
+	}
+}
+
 /*
  * Internal function to remove one rmap from pcm
  * @pcm is locked upon entry.
@@ -691,7 +749,7 @@ static int __pcache_move_pte_slowpath(struct pcache_meta *old_pcm,
 	 * Thus can be selected as an eviction candidate.
 	 */
 	ret = pcache_add_rmap(new_pcm, new_pte, mpi->new_addr,
-			      current->mm, current->group_leader, RMAP_MREMAP_SLOWPATH);
+			      current->mm, pcache_owner(current->mm), RMAP_MREMAP_SLOWPATH);
 	if (ret) {
 		WARN_ON(1);
 		return PCACHE_RMAP_AGAIN;
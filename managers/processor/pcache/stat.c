@@ -11,7 +11,7 @@
 #include <lego/fit_ibapi.h>
 #include <processor/pcache.h>
 
-struct pcache_event_stat pcache_event_stats;
+DEFINE_PER_CPU(struct pcache_event_stat, pcache_event_stats);
 
 static const char *const pcache_event_text[] = {
 	"nr_pgfault",
@@ -28,6 +28,7 @@ static const char *const pcache_event_text[] = {
 	"nr_pgfault_wp_reuse",
 
 	"nr_pgfault_due_to_concurrent_eviction",	/* perset list specific */
+	"nr_pgfault_concurrent_fill",			/* fill yield specific */
 
 	"nr_pcache_fill_zerofill",
 	"nr_pcache_fill_from_memory",
@@ -71,6 +72,8 @@ static const char *const pcache_event_text[] = {
 	"nr_mremap_pset_same",
 	"nr_mremap_pset_diff",
 
+	"nr_pcache_prefetch",
+
 	"nr_pcache_rmap_alloc",
 	"nr_pcache_rmap_alloc_kmalloc",
 	"nr_pcache_rmap_free",
@@ -82,14 +85,28 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_pee_free_kmalloc",
 };
 
+#ifdef CONFIG_COUNTER_PCACHE
+/*
+ * Fold the per-cpu counters. Not a snapshot, CPUs keep counting
+ * while we walk, which is fine for statistics.
+ */
+unsigned long pcache_event(enum pcache_event_item item)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(pcache_event_stats, cpu).event[item];
+	return sum;
+}
+#endif
+
 void print_pcache_events(void)
 {
 	int i;
 
 	BUILD_BUG_ON(NR_PCACHE_EVENT_ITEMS != ARRAY_SIZE(pcache_event_text));
 
-	for (i = 0; i < NR_PCACHE_EVENT_ITEMS; i++) {
-		pr_info("%s: %lu\n", pcache_event_text[i],
-			atomic_long_read(&pcache_event_stats.event[i]));
-	}
+	for (i = 0; i < NR_PCACHE_EVENT_ITEMS; i++)
+		pr_info("%s: %lu\n", pcache_event_text[i], pcache_event(i));
 }
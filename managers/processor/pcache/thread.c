@@ -41,8 +41,14 @@ int fork_dup_pcache(struct task_struct *dst_task,
 {
 	struct fork_reply_struct *fork_reply = _vmainfo;
 	struct fork_vmainfo *vma, *vmas = fork_reply->vmainfos;
-	int ret, i, nr_vmas = fork_reply->vma_count;
+	int ret = 0, i, nr_vmas = fork_reply->vma_count;
 	unsigned long start, end, flags;
+	struct pcache_copy_batch *batch;
+
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+	pcache_copy_batch_init(batch);
 
 	/*
 	 * We walk through pgtable based on vma range and flags.
@@ -58,11 +64,14 @@ int fork_dup_pcache(struct task_struct *dst_task,
 			i, start, end, flags, (flags & (VM_SHARED | VM_WRITE)),
 			is_cow_mapping(flags));
 		ret = pcache_copy_page_range(dst_mm, src_mm,
-					     start, end, flags, dst_task);
+					     start, end, flags, dst_task, batch);
 		if (ret)
-			return ret;
+			break;
 	}
-	return 0;
+
+	pcache_copy_batch_finish(src_mm, batch);
+	kfree(batch);
+	return ret;
 }
 
 /*
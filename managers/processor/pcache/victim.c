@@ -420,7 +420,8 @@ static void check_victim_starving(struct pcache_set *pset, unsigned long address
 
 	spin_lock(&usable_victims_lock);
 	list_for_each_entry_safe(v, safer, &usable_victims, next) {
-		result = victim_check_hit_entry(v, address, current, true);
+		result = victim_check_hit_entry(v, address,
+						pcache_owner(current->mm), true);
 		if (result != VICTIM_HIT)
 			continue;
 
@@ -825,7 +826,7 @@ int victim_try_fill_pcache(struct mm_struct *mm, unsigned long address,
 		if (unlikely(!get_victim_unless_zero(v)))
 			continue;
 
-		result = victim_check_hit_entry(v, address, current, true);
+		result = victim_check_hit_entry(v, address, pcache_owner(mm), true);
 		if (result == VICTIM_HIT) {
 			/*
 			 * victim_fill_pcache will call back to pcache fill code,
@@ -920,6 +921,42 @@ out:
 	return ret;
 }
 
+/*
+ * Forget victim lines of [@start, @end) of @tsk, whose pcache lines
+ * are dropped by madvise(MADV_DONTNEED). Otherwise a later fault would
+ * be filled with the old data from victim cache.
+ *
+ * Victims being flushed are skipped, flush walks the hit list without
+ * lock. Caller must run victim_flush_sync() first, after which none of
+ * them belongs to this range.
+ */
+void victim_invalidate_range(struct task_struct *tsk,
+			     unsigned long start, unsigned long end)
+{
+	struct pcache_victim_hit_entry *entry, *tmp;
+	struct pcache_victim_meta *v;
+
+	spin_lock(&usable_victims_lock);
+	list_for_each_entry(v, &usable_victims, next) {
+		if (VictimWaitflush(v))
+			continue;
+
+		spin_lock(&v->lock);
+		list_for_each_entry_safe(entry, tmp, &v->hits, next) {
+			if (entry->tgid != tsk->tgid ||
+			    entry->address < start || entry->address >= end)
+				continue;
+
+			victim_debug("v%d [%#lx %d]", victim_index(v),
+				entry->address, entry->tgid);
+			list_del(&entry->next);
+			free_victim_hit_entry(entry);
+		}
+		spin_unlock(&v->lock);
+	}
+	spin_unlock(&usable_victims_lock);
+}
+
 static void __init victim_cache_init_meta_map(void)
 {
 	int i;
@@ -185,6 +185,34 @@ struct victim_flush_job *__steal_victim_flush_job(void)
 	return job;
 }
 
+/*
+ * Wait until all submitted victim flush jobs are finished.
+ * Pending jobs are run by the caller, instead of waiting for
+ * the async flush thread to pick them up.
+ *
+ * Return the number of jobs run by the caller.
+ */
+int victim_flush_sync(void)
+{
+	struct pcache_victim_meta *victim;
+	struct victim_flush_job *job;
+	int index, nr = 0;
+
+	inc_pcache_event(PCACHE_VICTIM_FLUSH_SYNC);
+
+	while ((job = steal_victim_flush_job())) {
+		__victim_flush_func(job);
+		nr++;
+	}
+
+	/* Jobs stolen by others may still be in flight */
+	for_each_victim(victim, index) {
+		while (VictimWaitflush(victim))
+			cpu_relax();
+	}
+	return nr;
+}
+
 static int victim_flush_async(void *unused)
 {
 	if (pin_current_thread())
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Working set sampling
+ *
+ * Once started, a background thread checks the PTE young bits of every
+ * pcache line each round, and shifts the result into a per-line history
+ * word. Bit 0 is the latest round. From the history we derive:
+ *
+ *  - working set size curve: lines referenced within the last N rounds
+ *  - access frequency of each 2MB region: referenced rounds of its lines
+ *
+ * Processor has no vma, thus regions are the finest unit we report.
+ * Only lines present in pcache are seen, a curve that flattens out at
+ * nr_cachelines means pcache is too small for the workload.
+ *
+ * The young bits are cleared by sampling, same as the LRU sweep does.
+ * Each of them may see fewer references, thus sampling is off by default.
+ */
+
+#include <lego/mm.h>
+#include <lego/hash.h>
+#include <lego/log2.h>
+#include <lego/slab.h>
+#include <lego/sched.h>
+#include <lego/timer.h>
+#include <lego/mutex.h>
+#include <lego/kernel.h>
+#include <lego/kthread.h>
+#include <lego/memblock.h>
+#include <lego/seq_file.h>
+#include <lego/syscalls.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+/*
+ * History of the line, valid for the mapping of @tgid at @address.
+ * It is restarted once the line is filled with something else.
+ */
+struct pcache_wss_line {
+	unsigned long	address;
+	pid_t		tgid;
+	u32		history;
+};
+
+static struct pcache_wss_line *wss_map;
+
+static DEFINE_MUTEX(wss_mutex);
+static bool wss_enabled;
+static unsigned int wss_interval_msec = CONFIG_PCACHE_WSS_INTERVAL_MSEC;
+static unsigned long wss_nr_rounds;
+
+/*
+ * Access frequency classes of a region,
+ * by the number of rounds its lines are referenced in.
+ */
+enum {
+	WSS_FREQ_IDLE,		/* 0 */
+	WSS_FREQ_RARE,		/* 1 - 2 */
+	WSS_FREQ_COLD,		/* 3 - 8 */
+	WSS_FREQ_WARM,		/* 9 - 16 */
+	WSS_FREQ_HOT,		/* 17 - 32 */
+
+	NR_WSS_FREQ,
+};
+
+static const char *const wss_freq_text[NR_WSS_FREQ] = {
+	"idle", "rare", "cold", "warm", "hot",
+};
+
+static int wss_freq(u32 history)
+{
+	unsigned int nr = hweight32(history);
+
+	if (!nr)
+		return WSS_FREQ_IDLE;
+	if (nr <= 2)
+		return WSS_FREQ_RARE;
+	if (nr <= 8)
+		return WSS_FREQ_COLD;
+	if (nr <= 16)
+		return WSS_FREQ_WARM;
+	return WSS_FREQ_HOT;
+}
+
+void __init alloc_pcache_wss_map(void)
+{
+	size_t total = sizeof(struct pcache_wss_line) * nr_cachelines;
+
+	wss_map = memblock_virt_alloc(total, PAGE_SIZE);
+	if (!wss_map)
+		panic("Unable to allocate pcache wss map!");
+}
+
+static void wss_sample_line(struct pcache_meta *pcm, struct pcache_wss_line *line)
+{
+	struct pcache_rmap *rmap;
+	int pte_referenced, pte_contention;
+	pid_t tgid;
+
+	if (!get_pcache_unless_zero(pcm))
+		goto clear;
+
+	/* Within common_do_fill_page(), or being freed */
+	if (!PcacheValid(pcm))
+		goto put;
+
+	/* Keep the history, we just do not know this round */
+	if (!trylock_pcache(pcm)) {
+		line->history = line->history << 1 | (line->history & 1);
+		goto put;
+	}
+
+	if (!pcache_mapped(pcm)) {
+		unlock_pcache(pcm);
+		put_pcache(pcm);
+		goto clear;
+	}
+
+	pcache_referenced_trylock(pcm, &pte_referenced, &pte_contention);
+	if (pte_contention)
+		pte_referenced = line->history & 1;
+
+	/* Shared ones go to the latest mapping */
+	rmap = list_first_entry(&pcm->rmap, struct pcache_rmap, next);
+	tgid = rmap->owner_process->tgid;
+	if (line->tgid != tgid || line->address != rmap->address) {
+		line->tgid = tgid;
+		line->address = rmap->address;
+		line->history = 0;
+	}
+	line->history = line->history << 1 | !!pte_referenced;
+
+	unlock_pcache(pcm);
+put:
+	put_pcache(pcm);
+	return;
+
+clear:
+	line->tgid = 0;
+	line->history = 0;
+}
+
+static void wss_sample(void)
+{
+	struct pcache_meta *pcm;
+	unsigned long nr;
+
+	mutex_lock(&wss_mutex);
+	pcache_for_each_way(pcm, nr) {
+		wss_sample_line(pcm, &wss_map[nr]);
+		if (!(nr % PCACHE_ASSOCIATIVITY))
+			cond_resched();
+	}
+	wss_nr_rounds++;
+	mutex_unlock(&wss_mutex);
+}
+
+static int kpcache_wssd(void *unused)
+{
+	while (1) {
+		msleep(READ_ONCE(wss_interval_msec));
+		if (READ_ONCE(wss_enabled))
+			wss_sample();
+	}
+	return 0;
+}
+
+int __init pcache_wss_init(void)
+{
+	struct task_struct *p;
+
+	p = kthread_run(kpcache_wssd, NULL, "kpcache_wssd");
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+	return 0;
+}
+
+static void wss_reset(void)
+{
+	mutex_lock(&wss_mutex);
+	memset(wss_map, 0, sizeof(struct pcache_wss_line) * nr_cachelines);
+	wss_nr_rounds = 0;
+	mutex_unlock(&wss_mutex);
+}
+
+/* Lines of @tgid, all if 0. Caller holds wss_mutex */
+static void wss_fill_stat(struct pcache_wss_stat *stat, pid_t tgid)
+{
+	struct pcache_wss_line *line;
+	unsigned long nr;
+	int i;
+
+	memset(stat, 0, sizeof(*stat));
+	stat->nr_rounds = wss_nr_rounds;
+	stat->interval_msec = wss_interval_msec;
+
+	for (nr = 0, line = wss_map; nr < nr_cachelines; nr++, line++) {
+		if (!line->tgid || (tgid && line->tgid != tgid))
+			continue;
+
+		stat->nr_resident++;
+		if (line->history)
+			stat->wss[__ffs(line->history)]++;
+	}
+
+	/* Turn the last-referenced distribution into a curve */
+	for (i = 1; i < PCACHE_WSS_NR_ROUNDS; i++)
+		stat->wss[i] += stat->wss[i - 1];
+}
+
+/*
+ * @cmd: PCACHE_WSS_XXX
+ * @arg: interval for START, tgid for GET
+ * @statbuf: filled by GET
+ */
+SYSCALL_DEFINE3(pcache_wss, int, cmd, unsigned long, arg,
+		struct pcache_wss_stat __user *, statbuf)
+{
+	struct pcache_wss_stat *kstat;
+	int ret = 0;
+
+	switch (cmd) {
+	case PCACHE_WSS_START:
+		if (arg)
+			WRITE_ONCE(wss_interval_msec, arg);
+		WRITE_ONCE(wss_enabled, true);
+		break;
+	case PCACHE_WSS_STOP:
+		WRITE_ONCE(wss_enabled, false);
+		break;
+	case PCACHE_WSS_RESET:
+		wss_reset();
+		break;
+	case PCACHE_WSS_GET:
+		kstat = kmalloc(sizeof(*kstat), GFP_KERNEL);
+		if (!kstat)
+			return -ENOMEM;
+
+		mutex_lock(&wss_mutex);
+		wss_fill_stat(kstat, arg);
+		mutex_unlock(&wss_mutex);
+
+		if (copy_to_user(statbuf, kstat, sizeof(*kstat)))
+			ret = -EFAULT;
+		kfree(kstat);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret;
+}
+
+/*
+ * Regions are counted in a fixed hash table, lines of regions that
+ * do not fit within a few probes are reported as "others".
+ */
+#define WSS_NR_REGIONS		4096
+#define WSS_NR_PROBES		32
+#define WSS_REGION_SHIFT	PMD_SHIFT
+
+struct wss_region {
+	pid_t		tgid;
+	unsigned long	start;
+	unsigned int	nr[NR_WSS_FREQ];
+};
+
+static struct wss_region *
+wss_find_region(struct wss_region *regions, pid_t tgid, unsigned long start)
+{
+	struct wss_region *r;
+	unsigned int idx, i;
+
+	idx = hash_long(start ^ tgid, ilog2(WSS_NR_REGIONS));
+	for (i = 0; i < WSS_NR_PROBES; i++) {
+		r = &regions[(idx + i) & (WSS_NR_REGIONS - 1)];
+		if (!r->tgid) {
+			r->tgid = tgid;
+			r->start = start;
+			return r;
+		}
+		if (r->tgid == tgid && r->start == start)
+			return r;
+	}
+	return NULL;
+}
+
+static int wss_region_cmp(const void *a, const void *b)
+{
+	const struct wss_region *ra = a, *rb = b;
+
+	if (ra->tgid != rb->tgid)
+		return ra->tgid < rb->tgid ? -1 : 1;
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/* /proc/pcache_wss */
+int pcache_wss_show(struct seq_file *m)
+{
+	struct pcache_wss_stat *stat;
+	struct pcache_wss_line *line;
+	struct wss_region *regions, *r;
+	unsigned int others[NR_WSS_FREQ] = { 0 };
+	unsigned long nr;
+	int i, j, nr_regions;
+
+	stat = kmalloc(sizeof(*stat), GFP_KERNEL);
+	regions = kzalloc(WSS_NR_REGIONS * sizeof(*regions), GFP_KERNEL);
+	if (!stat || !regions) {
+		kfree(stat);
+		kfree(regions);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&wss_mutex);
+	wss_fill_stat(stat, 0);
+	for (nr = 0, line = wss_map; nr < nr_cachelines; nr++, line++) {
+		if (!line->tgid)
+			continue;
+
+		r = wss_find_region(regions, line->tgid,
+				    line->address & ~((1UL << WSS_REGION_SHIFT) - 1));
+		if (r)
+			r->nr[wss_freq(line->history)]++;
+		else
+			others[wss_freq(line->history)]++;
+	}
+	mutex_unlock(&wss_mutex);
+
+	seq_printf(m, "enabled: %d rounds: %lu interval_msec: %lu resident: %lu\n",
+		   READ_ONCE(wss_enabled), stat->nr_rounds,
+		   stat->interval_msec, stat->nr_resident);
+
+	seq_puts(m, "wss_lines:");
+	for (i = 0; i < PCACHE_WSS_NR_ROUNDS; i++)
+		seq_printf(m, " %lu", stat->wss[i]);
+	seq_putc(m, '\n');
+
+	/* Compact and sort */
+	for (i = 0, nr_regions = 0; i < WSS_NR_REGIONS; i++) {
+		if (regions[i].tgid)
+			regions[nr_regions++] = regions[i];
+	}
+	sort(regions, nr_regions, sizeof(*regions), wss_region_cmp, NULL);
+
+	seq_printf(m, "%8s %18s", "tgid", "region");
+	for (j = 0; j < NR_WSS_FREQ; j++)
+		seq_printf(m, " %8s", wss_freq_text[j]);
+	seq_putc(m, '\n');
+
+	for (i = 0; i < nr_regions; i++) {
+		r = &regions[i];
+		seq_printf(m, "%8d %#18lx", r->tgid, r->start);
+		for (j = 0; j < NR_WSS_FREQ; j++)
+			seq_printf(m, " %8u", r->nr[j]);
+		seq_putc(m, '\n');
+	}
+
+	seq_printf(m, "%8s %18s", "-", "others");
+	for (j = 0; j < NR_WSS_FREQ; j++)
+		seq_printf(m, " %8u", others[j]);
+	seq_putc(m, '\n');
+
+	kfree(stat);
+	kfree(regions);
+	return 0;
+}
@@ -15,9 +15,11 @@
  *	- zap		pcache_zap_pte
  *	- copy		pcache_copy_one_pte
  *	- move		pcache_move_pte
+ *	- flush		flush_dirty_pte_range
  */
 
 #include <lego/mm.h>
+#include <lego/slab.h>
 #include <lego/sched.h>
 #include <lego/string.h>
 #include <lego/kernel.h>
@@ -116,12 +118,65 @@ void free_pgd_range(struct mm_struct *mm,
 }
 
 /*
- * TODO:
- * Flush *file-backed* dirty pages!
+ * Write back the line mapped by @pte before it is zapped, the same way
+ * PCACHE_EVICTION_WRITE_PROTECT does: the line is write-protected and
+ * flushed with pcache locked, thus writers fault and wait for us.
+ * Afterwards they find the pte gone, and fetch the new data from memory.
+ *
+ * We enter with @ptl locked, return with @ptl still locked.
+ * The caller should read @pte again.
+ */
+static void zap_writeback_pte(struct task_struct *tsk, unsigned long addr,
+			      pte_t *pte, spinlock_t *ptl)
+{
+	struct pcache_meta *pcm;
+	pte_t ptent = *pte;
+
+	pcm = pte_to_pcache_meta(ptent);
+	if (unlikely(!pcm)) {
+		dump_pte(pte, "corrupted");
+		WARN_ON_ONCE(1);
+		return;
+	}
+
+	/* Lock ordering: pcache, then pte. See pcache_zap_pte() */
+	if (unlikely(!trylock_pcache(pcm))) {
+		get_pcache(pcm);
+		spin_unlock(ptl);
+
+		lock_pcache(pcm);
+		spin_lock(ptl);
+
+		/* Evicted in the middle, the evictor flushed it */
+		if (!pte_same(*pte, ptent)) {
+			unlock_pcache(pcm);
+			put_pcache(pcm);
+			return;
+		}
+		put_pcache(pcm);
+	}
+
+	ptent = ptep_get_and_clear(addr, pte);
+	pte_set(pte, pte_mkclean(pte_wrprotect(ptent)));
+	spin_unlock(ptl);
+
+	flush_tlb_mm_range(tsk->mm, addr, addr + PAGE_SIZE);
+	if (pte_dirty(ptent))
+		clflush_one(tsk, addr, pcache_meta_to_kva(pcm));
+	unlock_pcache(pcm);
+
+	spin_lock(ptl);
+}
+
+/*
+ * Lines are dropped without being written back, unless @wb_tsk is set.
+ * Then the dirty ones are written back on the fly, for mappings whose
+ * pages memory keeps, e.g. MAP_SHARED.
  */
 static unsigned long
 zap_pte_range(struct mm_struct *mm, pmd_t *pmd,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct task_struct *wb_tsk)
 {
 	spinlock_t *ptl;
 	pte_t *start_pte;
@@ -140,6 +195,12 @@ retry:
 		if (pte_present(ptent)) {
 			int ret;
 
+			/* Only a clean read-only pte can be zapped safely */
+			if (wb_tsk && (pte_dirty(ptent) || pte_write(ptent))) {
+				zap_writeback_pte(wb_tsk, addr, pte, ptl);
+				goto retry;
+			}
+
 			pgtable_debug("addr: %#lx, pte: %p", addr, pte);
 			/*
 			 * If we remove rmap first, there is a small
@@ -176,7 +237,8 @@ retry:
 
 static inline unsigned long
 zap_pmd_range(struct mm_struct *mm, pud_t *pud,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct task_struct *wb_tsk)
 {
 	pmd_t *pmd;
 	unsigned long next;
@@ -186,7 +248,7 @@ zap_pmd_range(struct mm_struct *mm, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none_or_clear_bad(pmd))
 			continue;
-		next = zap_pte_range(mm, pmd, addr, next);
+		next = zap_pte_range(mm, pmd, addr, next, wb_tsk);
 	} while (pmd++, addr = next, addr != end);
 
 	return addr;
@@ -194,7 +256,8 @@ zap_pmd_range(struct mm_struct *mm, pud_t *pud,
 
 static inline unsigned long
 zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct task_struct *wb_tsk)
 {
 	pud_t *pud;
 	unsigned long next;
@@ -204,7 +267,7 @@ zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
 		next = pud_addr_end(addr, end);
 		if (pud_none_or_clear_bad(pud))
 			continue;
-		next = zap_pmd_range(mm, pud, addr, next);
+		next = zap_pmd_range(mm, pud, addr, next, wb_tsk);
 	} while (pud++, addr = next, addr != end);
 
 	return addr;
@@ -219,8 +282,9 @@ zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
  *
  * PTEs are cleared, but not PGD, PUD, and PMD.
  */
-void unmap_page_range(struct mm_struct *mm,
-		      unsigned long __user addr, unsigned long __user end)
+static void __unmap_page_range(struct mm_struct *mm,
+			       unsigned long __user addr, unsigned long __user end,
+			       struct task_struct *wb_tsk)
 {
 	pgd_t *pgd;
 	unsigned long next;
@@ -233,10 +297,26 @@ void unmap_page_range(struct mm_struct *mm,
 		next = pgd_addr_end(addr, end);
 		if (pgd_none_or_clear_bad(pgd))
 			continue;
-		next = zap_pud_range(mm, pgd, addr, next);
+		next = zap_pud_range(mm, pgd, addr, next, wb_tsk);
 	} while (pgd++, addr = next, addr != end);
 }
 
+void unmap_page_range(struct mm_struct *mm,
+		      unsigned long __user addr, unsigned long __user end)
+{
+	__unmap_page_range(mm, addr, end, NULL);
+}
+
+/*
+ * Same as unmap_page_range(), but dirty lines are written back right
+ * before they are zapped. Other threads of @tsk may keep running.
+ */
+void unmap_page_range_writeback(struct task_struct *tsk,
+				unsigned long __user addr, unsigned long __user end)
+{
+	__unmap_page_range(tsk->mm, addr, end, tsk);
+}
+
 /*
  * Release both pgtable pages and the actual pages.
  * Dirty cachelines will be flushed back to memory,
@@ -268,23 +348,19 @@ void release_pgtable(struct task_struct *tsk,
 static inline int
 pcache_copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		pte_t *dst_pte, pte_t *src_pte, unsigned long addr,
-		unsigned long vm_flags, struct task_struct *dst_task)
+		unsigned long vm_flags, struct task_struct *dst_task,
+		struct pcache_copy_batch *batch)
 {
 	pte_t pte = *src_pte;
 	struct pcache_meta *pcm;
 
 	/*
 	 * If it's a COW mapping, write protect it both
-	 * in the parent and the child
+	 * in the parent and the child. TLB of the parent
+	 * is flushed by pcache_copy_batch_finish().
 	 */
 	if (is_cow_mapping(vm_flags)) {
 		ptep_set_wrprotect(src_pte);
-		/*
-		 * TODO:
-		 * Should be batched
-		 * Doing this one by one make fork() very slow.
-		 */
-		flush_tlb_mm_range(src_mm, addr, addr + PAGE_SIZE);
 		pte = pte_wrprotect(pte);
 	}
 
@@ -312,7 +388,8 @@ pcache_copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		 * another thread which is doing eviction, already locked
 		 * this pcm and tried to acquire pte lock to do unmap.
 		 */
-		pcache_add_rmap(pcm, dst_pte, addr, dst_mm, dst_task, RMAP_FORK);
+		pcache_add_rmap_batch(pcm, dst_pte, addr, dst_mm, dst_task,
+				      RMAP_FORK, &batch->rmaps);
 	}
 	return 0;
 }
@@ -321,16 +398,32 @@ static inline int
 pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pmd_t *dst_pmd, pmd_t *src_pmd,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct pcache_copy_batch *batch)
 {
 	pte_t *orig_src_pte, *orig_dst_pte;
 	pte_t *src_pte, *dst_pte;
 	spinlock_t *src_ptl, *dst_ptl;
-	int ret;
+	unsigned long start = addr;
+	int ret, nr_present = 0;
 
 	dst_pte = pte_alloc(dst_mm, dst_pmd, addr);
 	if (!dst_pte)
 		return -ENOMEM;
+
+	/*
+	 * Allocate rmaps for this pte table before taking locks.
+	 * A racy count is fine, pcache_add_rmap_batch() falls back
+	 * to kmalloc if it runs out.
+	 */
+	src_pte = pte_offset(src_pmd, addr);
+	do {
+		if (pte_present(*src_pte))
+			nr_present++;
+	} while (src_pte++, addr += PAGE_SIZE, addr != end);
+	pcache_rmap_batch_refill(&batch->rmaps, nr_present);
+	addr = start;
+
 	dst_ptl = pte_lockptr(dst_mm, dst_pmd);
 	spin_lock(dst_ptl);
 
@@ -379,7 +472,8 @@ pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 #endif
 		}
 
-		if (pcache_copy_one_pte(dst_mm, src_mm, dst_pte, src_pte, addr, vm_flags, dst_task)) {
+		if (pcache_copy_one_pte(dst_mm, src_mm, dst_pte, src_pte, addr,
+					vm_flags, dst_task, batch)) {
 			ret = -ENOMEM;
 			break;
 		}
@@ -389,6 +483,11 @@ pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		spin_unlock(src_ptl);
 	spin_unlock(dst_ptl);
 
+	if (is_cow_mapping(vm_flags) && nr_present) {
+		batch->flush_start = min(batch->flush_start, start);
+		batch->flush_end = max(batch->flush_end, end);
+	}
+
 	return 0;
 }
 
@@ -396,7 +495,8 @@ static inline int
 pcache_copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pud_t *dst_pud, pud_t *src_pud,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct pcache_copy_batch *batch)
 {
 	pmd_t *src_pmd, *dst_pmd;
 	unsigned long next;
@@ -410,7 +510,7 @@ pcache_copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		if (pmd_none_or_clear_bad(src_pmd))
 			continue;
 		if (pcache_copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
-						addr, next, vm_flags, dst_task))
+					  addr, next, vm_flags, dst_task, batch))
 			return -ENOMEM;
 	} while (dst_pmd++, src_pmd++, addr = next, addr != end);
 	return 0;
@@ -420,7 +520,8 @@ static inline int
 pcache_copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pgd_t *dst_pgd, pgd_t *src_pgd,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct pcache_copy_batch *batch)
 {
 	pud_t *src_pud, *dst_pud;
 	unsigned long next;
@@ -434,19 +535,39 @@ pcache_copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		if (pud_none_or_clear_bad(src_pud))
 			continue;
 		if (pcache_copy_pmd_range(dst_mm, src_mm, dst_pud, src_pud,
-						addr, next, vm_flags, dst_task))
+					  addr, next, vm_flags, dst_task, batch))
 			return -ENOMEM;
 	} while (dst_pud++, src_pud++, addr = next, addr != end);
 	return 0;
 }
 
+void pcache_copy_batch_init(struct pcache_copy_batch *batch)
+{
+	batch->flush_start = TASK_SIZE;
+	batch->flush_end = 0;
+	batch->rmaps.nr = 0;
+}
+
+/*
+ * Flush the write-protected range of @src with one shootdown,
+ * and free rmaps that were allocated but not used.
+ */
+void pcache_copy_batch_finish(struct mm_struct *src, struct pcache_copy_batch *batch)
+{
+	if (batch->flush_start < batch->flush_end)
+		flush_tlb_mm_range(src, batch->flush_start, batch->flush_end);
+	pcache_rmap_batch_release(&batch->rmaps);
+}
+
 /*
  * Duplicate the pgtable used to emulate pcache.
  * Write-protect both ends if it is COW mapping.
+ * Caller must call pcache_copy_batch_finish() once all ranges are copied.
  */
 int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 			   unsigned long addr, unsigned long end,
-			   unsigned long vm_flags, struct task_struct *dst_task)
+			   unsigned long vm_flags, struct task_struct *dst_task,
+			   struct pcache_copy_batch *batch)
 {
 	pgd_t *src_pgd, *dst_pgd;
 	unsigned long next;
@@ -460,7 +581,7 @@ int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 		if (pgd_none_or_clear_bad(src_pgd))
 			continue;
 		if (unlikely(pcache_copy_pud_range(dst, src, dst_pgd, src_pgd,
-					    addr, next, vm_flags, dst_task))) {
+					    addr, next, vm_flags, dst_task, batch))) {
 			ret = -ENOMEM;
 			break;
 		}
@@ -752,3 +873,166 @@ int zerofill_clear_range(struct task_struct *p,
 	return 0;
 }
 #endif
+
+/*
+ * Dirty pcache lines found in one pte table. They are locked and
+ * marked clean under the pte lock, and flushed after it is released.
+ */
+struct pcache_flush_batch {
+	unsigned long		nr_flushed;
+	unsigned int		nr;
+	struct pcache_meta	*pcm[PTRS_PER_PTE];
+	unsigned long		address[PTRS_PER_PTE];
+};
+
+static void pcache_flush_batch_finish(struct task_struct *tsk,
+				      struct pcache_flush_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->nr; i++) {
+		clflush_one(tsk, batch->address[i],
+			    pcache_meta_to_kva(batch->pcm[i]));
+		unlock_pcache(batch->pcm[i]);
+	}
+	batch->nr_flushed += batch->nr;
+	batch->nr = 0;
+}
+
+static unsigned long
+flush_dirty_pte_range(struct task_struct *tsk, pmd_t *pmd,
+		      unsigned long addr, unsigned long end,
+		      struct pcache_flush_batch *batch)
+{
+	struct mm_struct *mm = tsk->mm;
+	unsigned long start = addr;
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	pte = pte_offset_lock(mm, pmd, addr, &ptl);
+	do {
+		struct pcache_meta *pcm;
+		pte_t ptent;
+
+retry:
+		ptent = *pte;
+		if (!pte_present(ptent) || !pte_dirty(ptent))
+			continue;
+
+		pcm = pte_to_pcache_meta(ptent);
+		if (unlikely(!pcm)) {
+			dump_pte(pte, "corrupted");
+			WARN_ON_ONCE(1);
+			continue;
+		}
+
+		/* Lock ordering: pcache, then pte. See pcache_zap_pte() */
+		if (unlikely(!trylock_pcache(pcm))) {
+			get_pcache(pcm);
+			spin_unlock(ptl);
+
+			lock_pcache(pcm);
+			spin_lock(ptl);
+
+			/* Evicted in the middle, the evictor flushed it */
+			if (!pte_same(*pte, ptent)) {
+				unlock_pcache(pcm);
+				put_pcache(pcm);
+				goto retry;
+			}
+			put_pcache(pcm);
+		}
+
+		pte_set(pte, pte_mkclean(ptent));
+		batch->pcm[batch->nr] = pcm;
+		batch->address[batch->nr] = addr;
+		batch->nr++;
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+	spin_unlock(ptl);
+
+	if (batch->nr) {
+		/* Stale TLB entries would not set the dirty bit again */
+		flush_tlb_mm_range(mm, start, end);
+		pcache_flush_batch_finish(tsk, batch);
+	}
+	return addr;
+}
+
+static inline unsigned long
+flush_dirty_pmd_range(struct task_struct *tsk, pud_t *pud,
+		      unsigned long addr, unsigned long end,
+		      struct pcache_flush_batch *batch)
+{
+	pmd_t *pmd;
+	unsigned long next;
+
+	pmd = pmd_offset(pud, addr);
+	do {
+		next = pmd_addr_end(addr, end);
+		if (pmd_none_or_clear_bad(pmd))
+			continue;
+		next = flush_dirty_pte_range(tsk, pmd, addr, next, batch);
+	} while (pmd++, addr = next, addr != end);
+
+	return addr;
+}
+
+static inline unsigned long
+flush_dirty_pud_range(struct task_struct *tsk, pgd_t *pgd,
+		      unsigned long addr, unsigned long end,
+		      struct pcache_flush_batch *batch)
+{
+	pud_t *pud;
+	unsigned long next;
+
+	pud = pud_offset(pgd, addr);
+	do {
+		next = pud_addr_end(addr, end);
+		if (pud_none_or_clear_bad(pud))
+			continue;
+		next = flush_dirty_pmd_range(tsk, pud, addr, next, batch);
+	} while (pud++, addr = next, addr != end);
+
+	return addr;
+}
+
+/*
+ * Write back dirty pcache lines of @tsk within [@start, @end),
+ * and mark them clean. Used by checkpoint, where all threads of
+ * @tsk are parked, thus lines can not be dirtied behind our back.
+ *
+ * Lines that are being evicted are written back by the evictor,
+ * callers should wait for victim flush as well.
+ *
+ * Return the number of flushed lines, or -ENOMEM.
+ */
+long pcache_flush_dirty_range(struct task_struct *tsk,
+			      unsigned long __user start, unsigned long __user end)
+{
+	struct pcache_flush_batch *batch;
+	unsigned long next;
+	long nr_flushed;
+	pgd_t *pgd;
+
+	BUG_ON(start >= end);
+
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+	batch->nr = 0;
+	batch->nr_flushed = 0;
+
+	pgd = pgd_offset(tsk->mm, start);
+	do {
+		next = pgd_addr_end(start, end);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+		next = flush_dirty_pud_range(tsk, pgd, start, next, batch);
+	} while (pgd++, start = next, start != end);
+
+	nr_flushed = batch->nr_flushed;
+	kfree(batch);
+
+	pgtable_debug("%s[%d] flushed %ld lines", tsk->comm, tsk->tgid, nr_flushed);
+	return nr_flushed;
+}
@@ -21,7 +21,8 @@
 	{1UL << PG_private,		"private"	},	\
 	{1UL << PG_unevictable,		"unevictable"	},	\
 	{1UL << PG_slab,		"slab"		},	\
-	{1UL << PG_slob_free,		"slob_free"	}
+	{1UL << PG_slob_free,		"slob_free"	},	\
+	{1UL << PG_filemap,		"filemap"	}
 
 const struct trace_print_flags pageflag_names[] = {
 	__def_pageflag_names,
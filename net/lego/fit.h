@@ -90,10 +90,12 @@
 #define IMM_SEND_REPLY_RECV	0x40000000
 #define IMM_ACK			0x20000000
 #define IMM_REPLY_W_EXTRA_BITS	0x10000000
+#define IMM_SEND_REPLY_BATCH	0x40000000	/* only valid with IMM_SEND_REPLY_SEND */
 #define IMM_PORT_PUSH_BIT	24
 #define IMM_GET_PORT_NUMBER(imm) (imm<<2)>>26
 #define IMM_GET_OFFSET		0x00ffffff
-#define IMM_GET_REPLY_INDICATOR_INDEX	0x000fffff
+#define IMM_REPLY_ACK		0x00080000	/* reply also ACKs the request's ring offset */
+#define IMM_GET_REPLY_INDICATOR_INDEX	0x0007ffff
 #define IMM_SET_PRIVATE_BITS(bits)	(bits << 20)
 #define IMM_GET_PRIVATE_BITS(imm)	((imm >> 20) & 0xff)
 #define REPLY_PRIVATE_BITS_CNT	8
@@ -105,7 +107,12 @@
 #define IMM_NUM_OF_SEMAPHORE 64
 #define IMM_MAX_PORT 64
 #define IMM_RING_SIZE 1024*1024*4
+#ifdef CONFIG_FIT_LOCKFREE_RING
+/* Must fit in the credits of a sub-ring, see fit_reserve_remote_ring() */
+#define IMM_MAX_SIZE (RDMA_RING_SIZE / CONFIG_FIT_NR_SUBRINGS / 8)
+#else
 #define IMM_MAX_SIZE IMM_RING_SIZE/NUM_OF_CORES
+#endif
 #define IMM_SEND_SLEEP_SIZE_THRESHOLD 40960
 #define IMM_SEND_SLEEP_TIME_THRESHOLD 20
 //#define IMM_PORT_CACHE_SIZE 128
@@ -448,6 +455,14 @@ struct lego_context {
 	spinlock_t *local_last_ack_index_lock;
 	struct fit_ibv_mr *remote_rdma_ring_mrs;
 
+#ifdef CONFIG_FIT_LOCKFREE_RING
+	struct fit_remote_ring *remote_rings;
+#endif
+
+#ifdef CONFIG_FIT_COALESCE
+	struct fit_coalesce_queue *coalesce_queues;
+#endif
+
 #ifdef CONFIG_SOCKET_O_IB
 	void **local_sock_rdma_recv_rings;
 	int *remote_sock_rdma_ring_mrs_offset;
@@ -494,6 +509,11 @@ struct lego_context {
 	spinlock_t	indicators_lock;
 	void		*reply_ready_indicators[IMM_NUM_OF_SEMAPHORE];
 	DECLARE_BITMAP(reply_ready_indicators_bitmap, IMM_NUM_OF_SEMAPHORE);
+	int		reply_ack_offsets[IMM_NUM_OF_SEMAPHORE];
+#ifdef CONFIG_FIT_REPLY_SLEEP
+	/* Senders that may sleep, woken by polling thread on reply */
+	struct task_struct *reply_waiters[IMM_NUM_OF_SEMAPHORE];
+#endif
 
 	CTX_PADDING(_pad3_)
 
@@ -14,6 +14,7 @@
 #include <lego/fit_ibapi.h>
 #include <lego/completion.h>
 #include <lego/profile.h>
+#include <lego/rpc_trace.h>
 #include "fit.h"
 #include "fit_internal.h"
 
@@ -37,6 +38,7 @@ int curr_node;
 struct ib_device *ibapi_dev;
 struct ib_pd *ctx_pd;
 
+#ifndef CONFIG_FIT_LOOPBACK
 static void ibv_add_one(struct ib_device *device)
 {
 	FIT_ctx = kmalloc(sizeof(struct lego_context), GFP_KERNEL);
@@ -54,6 +56,7 @@ static void ibv_remove_one(struct ib_device *device)
 {
 	return;
 }
+#endif
 
 #ifdef CONFIG_FIT_SEQUENTIAL_IBAPI
 static DEFINE_SPINLOCK(ibapi_send_reply_lock);
@@ -71,11 +74,40 @@ static inline void unlock_ib(void) { }
 #endif
 
 unsigned long	nr_recvcq_cqes[NUM_POLLING_THREADS];
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+struct fit_recvcq_poll recvcq_polls[NUM_POLLING_THREADS];
+#endif
+
 #ifdef CONFIG_COUNTER_FIT_IB
 atomic_long_t	nr_ib_send_reply;
 atomic_long_t	nr_ib_send;
 atomic_long_t	nr_bytes_tx;
 atomic_long_t	nr_bytes_rx;
+#ifdef CONFIG_FIT_COALESCE
+atomic_long_t	nr_ib_coalesced_batches;
+atomic_long_t	nr_ib_coalesced_msgs;
+#endif
+
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+static void dump_recvcq_poll_stats(int i)
+{
+	struct fit_recvcq_poll *p = &recvcq_polls[i];
+	unsigned long total_ns, busy_ns;
+
+	total_ns = sched_clock() - p->start_ns;
+	busy_ns = total_ns - p->total_sleep_ns;
+
+	pr_info("      recvcq[%d] sleeps: %15lu avg_wakeup_ns: %lu max_wakeup_ns: %lu\n",
+		i, p->nr_sleeps,
+		p->nr_sleeps ? p->total_wakeup_ns / p->nr_sleeps : 0,
+		p->max_wakeup_ns);
+	pr_info("      recvcq[%d] busy_ns: %lu sleep_ns: %lu cpu: %lu%%\n",
+		i, busy_ns, p->total_sleep_ns,
+		total_ns ? busy_ns * 100 / total_ns : 0);
+}
+#else
+static inline void dump_recvcq_poll_stats(int i) { }
+#endif
 
 void dump_ib_stats(void)
 {
@@ -84,10 +116,16 @@ void dump_ib_stats(void)
 	pr_info("IB Stats:\n");
 	pr_info("    nr_ib_send_reply: %15ld\n", COUNTER_nr_ib_send_reply());
 	pr_info("    nr_ib_send:       %15ld\n", COUNTER_nr_ib_send());
-	for (i = 0; i < NUM_POLLING_THREADS; i++)
-		pr_info("      recvcq[0] CQEs: %15lu\n", nr_recvcq_cqes[i]);
+	for (i = 0; i < NUM_POLLING_THREADS; i++) {
+		pr_info("      recvcq[%d] CQEs: %15lu\n", i, nr_recvcq_cqes[i]);
+		dump_recvcq_poll_stats(i);
+	}
 	pr_info("    nr_bytes_tx:      %15ld\n", COUNTER_nr_bytes_tx());
 	pr_info("    nr_bytes_rx:      %15ld\n", COUNTER_nr_bytes_rx());
+#ifdef CONFIG_FIT_COALESCE
+	pr_info("    nr_coalesced_batches: %11ld\n", atomic_long_read(&nr_ib_coalesced_batches));
+	pr_info("    nr_coalesced_msgs:    %11ld\n", atomic_long_read(&nr_ib_coalesced_msgs));
+#endif
 }
 #endif
 
@@ -96,13 +134,15 @@ DEFINE_PROFILE_POINT(ibapi_send_reply)
 static inline int
 __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr,
 			   int max_ret_size, int if_use_ret_phys_addr,
-			   unsigned long timeout_sec, void *caller)
+			   unsigned long timeout_sec, bool sleep, void *caller)
 {
 	ppc *ctx = FIT_ctx;
+	unsigned int trace_id;
 	int ret;
         PROFILE_POINT_TIME(ibapi_send_reply)
 
         PROFILE_START(ibapi_send_reply);
+	trace_id = rpc_trace_send(addr, target_node, false);
 
 	if (unlikely(target_node >= CONFIG_FIT_NR_NODES)) {
 		pr_info("target_node: %d\n", target_node);
@@ -110,9 +150,14 @@ __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr
 	}
 
 	lock_ib();
+#ifdef CONFIG_FIT_LOOPBACK
+	ret = fit_loopback_send_reply(ctx, target_node, addr, size, ret_addr,
+			max_ret_size, NULL, if_use_ret_phys_addr, timeout_sec, caller);
+#else
 	ret = fit_send_reply_with_rdma_write_with_imm(ctx, target_node, addr,
 			size, ret_addr, max_ret_size, 0, if_use_ret_phys_addr,
-			timeout_sec, caller);
+			timeout_sec, sleep, caller);
+#endif
 
 	if (unlikely(ret > max_ret_size)) {
 		pr_info("ret: %d, max_ret_size: %d\n", ret, max_ret_size);
@@ -126,6 +171,7 @@ __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr
 	atomic_long_add(ret, &nr_bytes_rx);
 #endif
 
+	rpc_trace_recv_reply(trace_id, addr, target_node);
         PROFILE_LEAVE(ibapi_send_reply);
 	return ret;
 }
@@ -136,7 +182,7 @@ int ibapi_send_reply_imm(int target_node, void *addr, int size, void *ret_addr,
 {
 	return __ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
 			max_ret_size, if_use_ret_phys_addr, FIT_MAX_TIMEOUT_SEC,
-			__builtin_return_address(0));
+			false, __builtin_return_address(0));
 }
 
 /**
@@ -159,9 +205,26 @@ int ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_ad
 {
 	return __ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
 			max_ret_size, if_use_ret_phys_addr, timeout_sec,
-			__builtin_return_address(0));
+			false, __builtin_return_address(0));
 }
 
+#ifdef CONFIG_FIT_REPLY_SLEEP
+/*
+ * Same as ibapi_send_reply_timeout(), but the caller sleeps while
+ * waiting for the reply if other tasks are runnable on this CPU.
+ * Must be called from a context that can sleep.
+ */
+int ibapi_send_reply_timeout_sleep(int target_node, void *addr, int size, void *ret_addr,
+				   int max_ret_size, int if_use_ret_phys_addr,
+				   unsigned long timeout_sec)
+{
+	might_sleep();
+	return __ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
+			max_ret_size, if_use_ret_phys_addr, timeout_sec,
+			true, __builtin_return_address(0));
+}
+#endif
+
 static inline int
 __ibapi_send_reply_timeout_w_private_bits(int target_node, void *addr, int size, void *ret_addr,
 			   int max_ret_size, int *private_bits, int if_use_ret_phys_addr,
@@ -170,9 +233,14 @@ __ibapi_send_reply_timeout_w_private_bits(int target_node, void *addr, int size,
 	ppc *ctx = FIT_ctx;
 	int ret;
 
+#ifdef CONFIG_FIT_LOOPBACK
+	ret = fit_loopback_send_reply(ctx, target_node, addr, size, ret_addr,
+			max_ret_size, private_bits, if_use_ret_phys_addr, timeout_sec, caller);
+#else
 	ret = fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ctx, target_node, addr,
 			size, ret_addr, max_ret_size, private_bits, 0, if_use_ret_phys_addr,
 			timeout_sec, caller);
+#endif
 
 	return ret;
 }
@@ -190,7 +258,12 @@ int ibapi_send(int target_node, void *addr, int size)
 #endif
 
 	PROFILE_START(ibapi_send);
+	rpc_trace_send(addr, target_node, true);
+#ifdef CONFIG_FIT_LOOPBACK
+	ret = fit_loopback_send(FIT_ctx, target_node, addr, size);
+#else
 	ret = fit_send_with_rdma_write_with_imm(FIT_ctx, target_node, addr, size, 0);
+#endif
 	PROFILE_LEAVE(ibapi_send);
 	return ret;
 }
@@ -211,9 +284,15 @@ int ibapi_multicast_send_reply_timeout(int num_nodes, int *target_node,
 	ppc *ctx = FIT_ctx;
 	int ret;
 
+#ifdef CONFIG_FIT_LOOPBACK
+	ret = fit_loopback_multicast_send_reply(ctx, num_nodes, target_node, sglist,
+			output_msg, max_ret_size, if_use_ret_phys_addr,
+			timeout_sec, __builtin_return_address(0));
+#else
 	ret = fit_multicast_send_reply(ctx, num_nodes, target_node, sglist,
 			output_msg, max_ret_size, 0, if_use_ret_phys_addr,
 			timeout_sec, __builtin_return_address(0));
+#endif
 	return ret;
 }
 
@@ -221,38 +300,62 @@ inline int ibapi_receive_message(unsigned int designed_port,
 		void *ret_addr, int receive_size, uintptr_t *descriptor)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_receive_message(ctx, designed_port, ret_addr, receive_size, descriptor);
+#else
 	return fit_receive_message(ctx, designed_port, ret_addr, receive_size, descriptor, 0);
+#endif
 }
 
 int ibapi_receive_message_no_reply(unsigned int designed_port,
 		void *ret_addr, int receive_size)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_receive_message(ctx, designed_port, ret_addr, receive_size, NULL);
+#else
 	return fit_receive_message_no_reply(ctx, designed_port, ret_addr, receive_size, 0);
+#endif
 }
 
 inline int ibapi_reply_message(void *addr, int size, uintptr_t descriptor)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_reply_message(ctx, addr, size, -1, descriptor);
+#else
 	return fit_reply_message(ctx, addr, size, descriptor, 0, 1);
+#endif
 }
 
 inline int ibapi_reply_message_w_extra_bits(void *addr, int size, int bits, uintptr_t descriptor)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_reply_message(ctx, addr, size, bits, descriptor);
+#else
 	return fit_reply_message_w_extra_bits(ctx, addr, size, bits, descriptor, 0, 1);
+#endif
 }
 
 inline int ibapi_reply_message_nowait(void *addr, int size, uintptr_t descriptor)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_reply_message(ctx, addr, size, -1, descriptor);
+#else
 	return fit_reply_message(ctx, addr, size, descriptor, 0, 0);
+#endif
 }
 
 inline int ibapi_reply_message_w_extra_bits_no_wait(void *addr, int size, int bits, uintptr_t descriptor)
 {
 	ppc *ctx = FIT_ctx;
+#ifdef CONFIG_FIT_LOOPBACK
+	return fit_loopback_reply_message(ctx, addr, size, bits, descriptor);
+#else
 	return fit_reply_message_w_extra_bits(ctx, addr, size, bits, descriptor, 0, 0);
+#endif
 }
 
 #ifdef CONFIG_SOCKET_O_IB
@@ -273,6 +376,32 @@ int ibapi_sock_receive_message(int *target_node, int port, uintptr_t *ret_addr,
 	ppc *ctx = FIT_ctx;
 	return sock_receive_message(ctx, target_node, port, ret_addr, receive_size, if_userspace, if_nonblock);
 }
+
+/*
+ * Gather @iov into as few RDMA writes as possible.
+ * Return the number of bytes sent, or negative values on failures.
+ */
+int ibapi_sock_send_message_iov(int target_node, int dest_port, int if_internal_port,
+				const struct iovec *iov, int nr_iov, int if_userspace)
+{
+	ppc *ctx = FIT_ctx;
+
+	if (target_node == MY_NODE_ID || target_node > MAX_NODE) {
+		pr_crit("%s: wrong target node %d\n", __func__, target_node);
+		return -EINVAL;
+	}
+
+	return sock_send_message_iov(ctx, target_node, dest_port, if_internal_port,
+				     iov, nr_iov, if_userspace);
+}
+
+int ibapi_sock_receive_message_iov(int *target_node, int port, const struct iovec *iov,
+				   int nr_iov, int if_userspace, int sock_type)
+{
+	ppc *ctx = FIT_ctx;
+	return sock_receive_message_iov(ctx, target_node, port, iov, nr_iov,
+					if_userspace, sock_type);
+}
 #endif
 
 #if 0
@@ -352,11 +481,13 @@ int ibapi_get_node_id(void)
 	return 0;
 }
 
+#ifndef CONFIG_FIT_LOOPBACK
 static struct ib_client ibv_client = {
 	.name   = "ibv_server",
 	.add    = ibv_add_one,
 	.remove = ibv_remove_one
 };
+#endif
 
 //#define FIT_TESTING
 
@@ -420,6 +551,26 @@ static void lego_ib_test(void)
 
 __initdata DEFINE_COMPLETION(ib_init_done);
 
+#ifdef CONFIG_FIT_LOOPBACK
+int lego_ib_init(void *unused)
+{
+	atomic_set(&global_reqid, 0);
+
+	/*
+	 * No NIC is involved. All nodes are emulated
+	 * by local rings, see fit_loopback.c
+	 */
+	FIT_ctx = fit_loopback_establish_conn(MY_NODE_ID);
+	BUG_ON(!FIT_ctx);
+	pr_info("FIT loopback transport ready to go!\n");
+
+	lego_ib_test();
+
+	/* notify init that ib has done initialization */
+	complete(&ib_init_done);
+	return 0;
+}
+#else
 int lego_ib_init(void *unused)
 {
 	int ret;
@@ -461,3 +612,4 @@ int lego_ib_init(void *unused)
 	complete(&ib_init_done);
 	return 0;
 }
+#endif /* CONFIG_FIT_LOOPBACK */
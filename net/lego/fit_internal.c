@@ -22,6 +22,7 @@
 #include <lego/time.h>
 #include <lego/timer.h>
 #include <lego/kernel.h>
+#include <lego/kernel_stat.h>
 #include <lego/fit_ibapi.h>
 #include <lego/comp_common.h>
 #include <lego/profile.h>
@@ -32,17 +33,6 @@
 
 #include "fit_internal.h"
 
-#ifdef CONFIG_FIT_DEBUG
-#define fit_debug(fmt, ...) \
-	pr_debug("%s():%d " fmt, __func__, __LINE__, __VA_ARGS__)
-#else
-static inline void fit_debug(const char *fmt, ...) { }
-#endif
-
-#define fit_err(fmt, ...)						\
-	pr_debug("%s()-%d CPU%2d " fmt "\n",				\
-		__func__, __LINE__, smp_processor_id(), __VA_ARGS__)
-
 static int ib_port = 1;
 enum ib_mtu mtu;
 static int sl;
@@ -146,82 +136,6 @@ __used static int fit_check_page_continuous(void *local_addr,
 	return 1;
 }
 
-static inline void *get_reply_ready_ptr(ppc *ctx, unsigned int index)
-{
-	void *ptr;
-	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
-
-	if (unlikely(index >= IMM_NUM_OF_SEMAPHORE)) {
-		fit_err("array_size: %d index: %d",
-			IMM_NUM_OF_SEMAPHORE, index);
-		BUG();
-	}
-
-	ptr = ctx->reply_ready_indicators[index];
-
-	if (unlikely(!test_bit(index, bitmap))) {
-		fit_err("index: %d ptr: %p", index, ptr);
-		dump_stack();
-		hlt();
-	}
-
-	if (unlikely(!virt_addr_valid((unsigned long)ptr))) {
-		fit_err("index: %d ptr: %p", index, ptr);
-		BUG();
-	}
-	return ptr;
-}
-
-static inline void free_reply_indicator(ppc *ctx, unsigned int idx)
-{
-	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
-
-	if (unlikely(idx >= IMM_NUM_OF_SEMAPHORE)) {
-		fit_err("array_size: %d index: %d",
-			IMM_NUM_OF_SEMAPHORE, idx);
-		BUG();
-	}
-
-	spin_lock(&ctx->indicators_lock);
-	if (likely(test_and_clear_bit(idx, bitmap)))
-		ctx->reply_ready_indicators[idx] = NULL;
-	else {
-		fit_err("index: %d", idx);
-		BUG();
-	}
-	spin_unlock(&ctx->indicators_lock);
-}
-
-/*
- * @addr: must be a valid kernel virtual address
- */
-static inline unsigned int alloc_index_and_set_reply_indicator(ppc *ctx, void *addr)
-{
-	int idx;
-	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
-
-retry:
-	spin_lock(&ctx->indicators_lock);
-	for_each_clear_bit(idx, bitmap, IMM_NUM_OF_SEMAPHORE) {
-		set_bit(idx, bitmap);
-		ctx->reply_ready_indicators[idx] = addr;
-		spin_unlock(&ctx->indicators_lock);
-		return idx;
-	}
-	spin_unlock(&ctx->indicators_lock);
-
-	/*
-	 * All full? Given the fact that we are using sync RPC,
-	 * the maximum outstanding requests will equal to nr_cpus.
-	 * Show correct warnings here.
-	 */
-	if (likely(IMM_NUM_OF_SEMAPHORE <= nr_cpus)) {
-		WARN_ONCE(1, "Please set a larger IMM_NUM_OF_SEMAPHORE.");
-		goto retry;
-	}
-	BUG();
-}
-
 #ifdef CONFIG_SOCKET_O_IB
 int init_socket_over_ib(struct lego_context *ctx, int port, int rx_depth, int i)
 {
@@ -321,6 +235,17 @@ next:
 		goto next;
 }
 
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+/*
+ * Completion interrupt of recv_cq.
+ * Only fires after fit_recvcq_idle() armed the CQ.
+ */
+static void fit_recvcq_comp_handler(struct ib_cq *cq, void *cq_context)
+{
+	fit_recvcq_notify((long)cq_context);
+}
+#endif
+
 struct lego_context *fit_init_ctx(ppc *ctx, int size, int rx_depth, int port,
 				  struct ib_device *ib_dev, int mynodeid)
 {
@@ -395,7 +320,12 @@ struct lego_context *fit_init_ctx(ppc *ctx, int size, int rx_depth, int port,
 		 * XXX
 		 * why choose rx_depth*4+1 this maginc number? Reason???
 		 */
-		ctx->cq[i] = ib_create_cq((struct ib_device *)ctx->context, NULL, NULL, NULL,
+		ctx->cq[i] = ib_create_cq((struct ib_device *)ctx->context,
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+					  fit_recvcq_comp_handler, NULL, (void *)(long)i,
+#else
+					  NULL, NULL, NULL,
+#endif
 					  rx_depth*4+1, 0);
 		if (IS_ERR_OR_NULL(ctx->cq[i])) {
 			fit_err("Fail to create recv_cq %d. Error: %d",
@@ -1205,6 +1135,27 @@ int fit_send_message_with_rdma_write_with_imm_request(ppc *ctx, int connection_i
 	return 0;
 }
 
+#ifdef CONFIG_FIT_QP_AFFINITY
+/*
+ * Each CPU sticks to its own QP of @target_node, no shared counter.
+ * Callers may get preempted and migrated after this, which is fine:
+ * QPs are still safe to share, we just lose the locality.
+ */
+inline int fit_get_connection_by_atomic_number(ppc *ctx, int target_node, int priority)
+{
+	int qp;
+
+	preempt_disable();
+	qp = smp_processor_id() % atomic_read(&ctx->num_alive_connection[target_node]);
+	preempt_enable();
+
+#ifdef CONFIG_SOCKET_O_IB
+	return qp + (NUM_PARALLEL_CONNECTION + 1) * target_node;
+#else
+	return qp + NUM_PARALLEL_CONNECTION * target_node;
+#endif
+}
+#else
 inline int fit_get_connection_by_atomic_number(ppc *ctx, int target_node, int priority)
 {
 #ifdef CONFIG_SOCKET_O_IB
@@ -1215,6 +1166,7 @@ inline int fit_get_connection_by_atomic_number(ppc *ctx, int target_node, int pr
 			+ NUM_PARALLEL_CONNECTION * target_node;
 #endif
 }
+#endif /* CONFIG_FIT_QP_AFFINITY */
 
 int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, int receive_size, int userspace_flag)
 {
@@ -1224,8 +1176,7 @@ int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, in
 	int offset;
 	int node_id;
 	struct imm_header_from_cq_to_port *new_request;
-	int last_ack;
-	int ack_flag=0;
+	int ack_flag;
 
 	/*
 	 * Busy polling incoming message
@@ -1247,7 +1198,7 @@ int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, in
 	//printk(KERN_CRIT "%s got new req offset %d sourcenode %d\n", __func__, offset, node_id);
 	//free list
 	// XXX kmem_cache_free(imm_header_from_cq_to_port_cache, new_request);
-	kfree(new_request);
+	kfree(new_request);	/* NULL if partially consumed */
 
 	//get buffer from hash table based on node and port
 
@@ -1263,17 +1214,8 @@ int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, in
 	memcpy(ret_addr, ((void *)tmp) + sizeof(struct imm_message_metadata), get_size);
 	//printk(KERN_CRIT "%s: hash-%p offset-%x tmp-%p recv %s testport-%d testnodeid-%d\n", __func__, current_hash_ptr->addr, offset, tmp, ret_addr, tmp->designed_port, tmp->source_node_id);
 
-	//do ack based on the last_ack_index, submit a request to waiting_queue_handler
-	//printk(KERN_CRIT "%s last_ack %d offset %d\n", __func__, last_ack, offset);
-	spin_lock(&ctx->local_last_ack_index_lock[node_id]);
-	last_ack = ctx->local_last_ack_index[node_id];
-	if( (offset>= last_ack && offset - last_ack >= IMM_ACK_FREQ) ||
-	    (offset< last_ack && offset + IMM_PORT_CACHE_SIZE - last_ack >= IMM_ACK_FREQ))
-	{
-		ack_flag = 1;
-		ctx->local_last_ack_index[node_id] = offset;
-	}
-	spin_unlock(&ctx->local_last_ack_index_lock[node_id]);
+	/* do ack based on the last_ack_index, submit a request to waiting_queue_handler */
+	ack_flag = fit_update_local_last_ack(ctx, node_id, offset);
 
 	if(ack_flag)
 	{
@@ -1293,13 +1235,13 @@ int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, in
 	return get_size;
 }
 
-#ifdef CONFIG_COMP_MEMORY
+#if defined(CONFIG_COMP_MEMORY) && !defined(CONFIG_FIT_LOOPBACK)
 /*
  * Callback for thread pool
  */
 void fit_ack_reply_callback(struct thpool_buffer *b)
 {
-	int last_ack, ack_flag = 0;
+	int ack_flag;
 	int reply_size, node_id, offset;
 	int reply_connection_id;
 	void *reply_data;
@@ -1319,18 +1261,12 @@ void fit_ack_reply_callback(struct thpool_buffer *b)
 
 	/*
 	 * Step II
-	 * FIT internal ACK
+	 * FIT internal ACK. Piggyback it on the reply if there is one,
+	 * otherwise send a standalone ACK from waiting_queue_handler.
 	 */
-	spin_lock(&ctx->local_last_ack_index_lock[node_id]);
-	last_ack = ctx->local_last_ack_index[node_id];
-	if ((offset>= last_ack && offset - last_ack >= IMM_ACK_FREQ) ||
-	    (offset< last_ack && offset + IMM_PORT_CACHE_SIZE - last_ack >= IMM_ACK_FREQ)) {
-		ack_flag = 1;
-		ctx->local_last_ack_index[node_id] = offset;
-	}
-	spin_unlock(&ctx->local_last_ack_index_lock[node_id]);
+	ack_flag = fit_update_local_last_ack(ctx, node_id, offset);
 
-        if (ack_flag) {
+        if (ack_flag && ThpoolBufferNoreply(b)) {
                 struct send_and_reply_format *pass;
 
                 pass = kmalloc(sizeof(*pass), GFP_KERNEL);
@@ -1361,7 +1297,8 @@ void fit_ack_reply_callback(struct thpool_buffer *b)
 			request_metadata->reply_rkey,
                         request_metadata->reply_addr,
 			reply_data, reply_size, 0,
-			request_metadata->reply_indicator_index | IMM_SEND_REPLY_RECV,
+			request_metadata->reply_indicator_index | IMM_SEND_REPLY_RECV |
+			(ack_flag ? IMM_REPLY_ACK : 0),
                         FIT_SEND_MESSAGE_IMM_ONLY, NULL, 1);
 }
 #endif
@@ -1375,8 +1312,7 @@ int fit_receive_message(ppc *ctx, unsigned int port, void *ret_addr, int receive
 	int node_id;
 	struct imm_message_metadata *descriptor;
 	struct imm_header_from_cq_to_port *new_request;
-	int last_ack;
-	int ack_flag=0;
+	int ack_flag;
 
 	/*
 	 * Busy polling incoming message
@@ -1398,7 +1334,7 @@ int fit_receive_message(ppc *ctx, unsigned int port, void *ret_addr, int receive
 	//printk(KERN_CRIT "%s got new req offset %d sourcenode %d\n", __func__, offset, node_id);
 	//free list
 	// XXX kmem_cache_free(imm_header_from_cq_to_port_cache, new_request);
-	kfree(new_request);
+	kfree(new_request);	/* NULL if partially consumed */
 
 	//get buffer from hash table based on node and port
 
@@ -1430,17 +1366,8 @@ int fit_receive_message(ppc *ctx, unsigned int port, void *ret_addr, int receive
 	*reply_descriptor = (uintptr_t)descriptor;
 	fit_debug("descriptor: %#lx, *reply_descriptor: %#lx\n", descriptor, *reply_descriptor);
 
-	//do ack based on the last_ack_index, submit a request to waiting_queue_handler
-	//printk(KERN_CRIT "%s last_ack %d offset %d\n", __func__, last_ack, offset);
-	spin_lock(&ctx->local_last_ack_index_lock[node_id]);
-	last_ack = ctx->local_last_ack_index[node_id];
-	if( (offset>= last_ack && offset - last_ack >= IMM_ACK_FREQ) ||
-	    (offset< last_ack && offset + IMM_PORT_CACHE_SIZE - last_ack >= IMM_ACK_FREQ))
-	{
-		ack_flag = 1;
-		ctx->local_last_ack_index[node_id] = offset;
-	}
-	spin_unlock(&ctx->local_last_ack_index_lock[node_id]);
+	/* do ack based on the last_ack_index, submit a request to waiting_queue_handler */
+	ack_flag = fit_update_local_last_ack(ctx, node_id, offset);
 
 	if(ack_flag)
 	{
@@ -1499,7 +1426,41 @@ int fit_reply_message_w_extra_bits(ppc *ctx, void *addr, int size, int private_b
 
 #ifdef CONFIG_SOCKET_SYSCALL
 
-int sock_receive_message(ppc *ctx, int *target_node, int port, void *ret_addr, int receive_size, int if_userspace, int sock_type)
+/*
+ * Scatter @len bytes at @src into the iovec, from the cursor on.
+ * Ring data goes straight into the user buffers, no bounce buffer.
+ */
+static int sock_copy_to_iov(const struct iovec *iov, int *iov_idx, unsigned long *iov_off,
+			    void *src, int len, int if_userspace)
+{
+	int n;
+
+	while (len > 0) {
+		n = min_t(unsigned long, iov[*iov_idx].iov_len - *iov_off, len);
+		if (if_userspace) {
+			if (copy_to_user(iov[*iov_idx].iov_base + *iov_off, src, n))
+				return -EFAULT;
+		} else
+			memcpy(iov[*iov_idx].iov_base + *iov_off, src, n);
+
+		src += n;
+		len -= n;
+		*iov_off += n;
+		if (*iov_off == iov[*iov_idx].iov_len) {
+			(*iov_idx)++;
+			*iov_off = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Receive into @iov, one ring entry may be scattered across
+ * several buffers. Blocking sockets wait until all buffers are full,
+ * nonblocking ones return what has arrived.
+ */
+int sock_receive_message_iov(ppc *ctx, int *target_node, int port, const struct iovec *iov,
+			     int nr_iov, int if_userspace, int sock_type)
 {
 	int get_size = 0;
 	int offset;
@@ -1508,7 +1469,15 @@ int sock_receive_message(ppc *ctx, int *target_node, int port, void *ret_addr, i
 	int last_ack;
 	int ack_flag=0;
 	int total_received_size = 0;
-	int already_copied_size = 0;
+	int receive_size = 0, remain_size;
+	int iov_idx = 0;
+	unsigned long iov_off = 0;
+	int i;
+
+	for (i = 0; i < nr_iov; i++)
+		receive_size += iov[i].iov_len;
+	if (!receive_size)
+		return 0;
 
 	fit_debug("port %d sock_type %x if_userspace %d\n", port, sock_type, if_userspace);
 
@@ -1528,11 +1497,14 @@ get_next_request:
 			offset = new_request->offset;
 			fit_debug("got new req offset %d sourcenode %d size %d\n",
 					offset, node_id, get_size);
-			if (get_size > receive_size) {
-				new_request->size -= receive_size;
-				new_request->offset += receive_size;
-				get_size = receive_size;
-				sock_unset_read_ready(node_id, port, receive_size);
+			/* Take only what is left of the buffers, keep the rest queued */
+			remain_size = receive_size - total_received_size;
+			if (get_size > remain_size) {
+				new_request->size -= remain_size;
+				new_request->offset += remain_size;
+				get_size = remain_size;
+				sock_unset_read_ready(node_id, port, remain_size);
+				new_request = NULL;
 			} else {
 				list_del(&new_request->list);
 				sock_unset_read_ready(node_id, port, get_size);
@@ -1567,21 +1539,16 @@ get_next_request:
 			offset, node_id, get_size);
 	//free list
 	// XXX kmem_cache_free(imm_header_from_cq_to_port_cache, new_request);
-	kfree(new_request);
+	kfree(new_request);	/* NULL if partially consumed */
 
 	/*
 	* copy incoming data to user buffer
 	* size of int is for the internal port header
 	*/
-	if (if_userspace) {
-		int cp_ret;
-
-		cp_ret = copy_to_user(ret_addr + already_copied_size, ctx->local_sock_rdma_recv_rings[node_id] + offset, get_size);
-		WARN_ON(cp_ret);
-	} else
-		memcpy(ret_addr + already_copied_size, ctx->local_sock_rdma_recv_rings[node_id] + offset, get_size);
-	already_copied_size += get_size;
-	fit_debug("offset-%d recv %s srcnodeid-%d\n", offset, ret_addr, node_id);
+	WARN_ON(sock_copy_to_iov(iov, &iov_idx, &iov_off,
+				 ctx->local_sock_rdma_recv_rings[node_id] + offset,
+				 get_size, if_userspace));
+	fit_debug("offset-%d srcnodeid-%d\n", offset, node_id);
 
 	//do ack based on the last_ack_index, submit a request to waiting_queue_handler
 	//printk(KERN_CRIT "%s last_ack %d offset %d\n", __func__, last_ack, offset);
@@ -1619,16 +1586,69 @@ get_next_request:
 	return total_received_size;
 }
 
+int sock_receive_message(ppc *ctx, int *target_node, int port, void *ret_addr, int receive_size, int if_userspace, int sock_type)
+{
+	struct iovec iov = {
+		.iov_base	= ret_addr,
+		.iov_len	= receive_size,
+	};
+
+	return sock_receive_message_iov(ctx, target_node, port, &iov, 1,
+					if_userspace, sock_type);
+}
+
+/*
+ * All senders to one node share its sock_qp and sock_send_cq. Each WR
+ * carries the sock_send_comp of its sender in wr_id, and whoever polls
+ * a completion retires it into that sender's counter. Completions of one
+ * sender come back in order on RC, so @done counts its oldest WRs.
+ */
+struct sock_send_comp {
+	atomic_t		done;
+	int			error;
+};
+
+/* Wait until @want WRs of @comp are completed */
+static int sock_poll_send(ppc *ctx, int target_node,
+			  struct sock_send_comp *comp, int want)
+{
+	struct sock_send_comp *owner;
+	struct ib_wc wc;
+	int ne;
+
+	while (atomic_read(&comp->done) < want) {
+		ne = ib_poll_cq(ctx->sock_send_cq[target_node], 1, &wc);
+		if (ne < 0) {
+			fit_err("poll send_cq of node %d failed %d", target_node, ne);
+			return -EIO;
+		}
+		if (!ne)
+			continue;
+
+		owner = (struct sock_send_comp *)wc.wr_id;
+		if (wc.status != IB_WC_SUCCESS) {
+			fit_err("send failed at sock-qp as %d", wc.status);
+			owner->error = 1;
+		}
+
+		/* @owner may go away once it sees its last completion */
+		smp_mb__before_atomic();
+		atomic_inc(&owner->done);
+	}
+
+	smp_rmb();
+	return comp->error ? -EIO : 0;
+}
+
 int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr_rkey,
 		uintptr_t input_mr_addr, void *addr, int size, int offset, uint32_t imm_data,
 		void* header, int header_size, enum mode s_mode, int if_use_phys_addr_reg)
 {
 	struct ib_send_wr wr, *bad_wr = NULL;
 	struct ib_sge sge[2];
-	int ret, i, ne;
+	int ret;
 	uintptr_t temp_addr, header_addr;
-	int poll_status = SEND_REPLY_WAIT;
-	struct ib_wc wc[1];
+	struct sock_send_comp comp = { .done = ATOMIC_INIT(0) };
 
 	fit_debug("%s target_node %d rkey %d mraddr %lx addr %p size %d offset %d imm-0x%x mode %d\n",
 			__func__, target_node, input_mr_rkey, input_mr_addr, addr, size, offset, imm_data, s_mode);
@@ -1644,7 +1664,7 @@ int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr
 
 	if(s_mode == FIT_SEND_MESSAGE_HEADER_AND_IMM)
 	{
-		wr.wr_id = (uint64_t)&poll_status;
+		wr.wr_id = (uint64_t)&comp;
 		wr.send_flags = IB_SEND_SIGNALED;
 		wr.num_sge = 2;
 		wr.opcode = IB_WR_RDMA_WRITE_WITH_IMM;
@@ -1665,7 +1685,7 @@ int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr
 	}
 	else if(s_mode == FIT_SEND_MESSAGE_IMM_ONLY)
 	{
-		wr.wr_id = (uint64_t)&poll_status;
+		wr.wr_id = (uint64_t)&comp;
 		wr.send_flags = IB_SEND_SIGNALED;
 
 		wr.num_sge = 1;
@@ -1682,7 +1702,7 @@ int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr
 	}
 	else if(s_mode == FIT_SEND_ACK_IMM_ONLY)
 	{
-		wr.wr_id = (uint64_t)&poll_status;
+		wr.wr_id = (uint64_t)&comp;
 		wr.send_flags = IB_SEND_SIGNALED;
 
 		wr.num_sge = 0;
@@ -1700,22 +1720,8 @@ int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr
 
 	if(!ret)
 	{
-		do{
-			ne = ib_poll_cq(ctx->sock_send_cq[target_node], 1, wc);
-			if(ne < 0)
-			{
-				printk(KERN_ALERT "poll send_cq failed at send-qp\n");
-				return 1;
-			}
-		}while(ne<1);
-		for(i=0;i<ne;i++)
-		{
-			if(wc[i].status!=IB_WC_SUCCESS)
-			{
-				printk(KERN_ALERT "send failed at send-qp as %d\n", wc[i].status);
-				return 2;
-			}
-		}
+		if (sock_poll_send(ctx, target_node, &comp, 1))
+			return 2;
 	}
 	else
 	{
@@ -1726,36 +1732,37 @@ int sock_send_message_with_rdma_imm(ppc *ctx, int target_node, uint32_t input_mr
 }
 
 /*
- * Return:
- * Negative values on failues
- * Positive values indicate the reply message length
+ * Socket data is gathered into RDMA-WRITE-IMMs of at most one segment
+ * each. sge[0] carries the port header, user buffers that are physically
+ * contiguous are sent in place, the rest is copied into a staging buffer.
+ * Up to SOCK_SEND_WINDOW segments are in flight, each has its own staging
+ * buffer, which is reused only after its completion is polled.
  */
-int sock_send_message(ppc *ctx, int target_node, int dest_port, int if_internal_port,
-				void *addr, int size, unsigned long timeout_sec, int if_userspace)
-{
-	int tar_offset_start;
-	int imm_data;
-	int real_size = size + sizeof(int);
-	void *remote_addr;
-	uint32_t remote_rkey;
-	struct fit_ibv_mr *remote_mr;
-	int last_ack;
-	int ret;
-	int dest_port_data;
-	unsigned long phys_addr;
-	void *kbuf;
+#define SOCK_SEND_SEGMENT_SIZE	((int)(IMM_MAX_SIZE - sizeof(int)))
+#define SOCK_SEND_MAX_DATA_SGE	15	/* max_send_sge of sock_qp, minus header */
+#define SOCK_SEND_WINDOW	4
+
+struct sock_send_state {
+	const struct iovec	*iov;
+	int			nr_iov;
+	int			iov_idx;
+	unsigned long		iov_off;
+	int			if_userspace;
+	int			header;
+
+	void			*staging[SOCK_SEND_WINDOW];
+	int			staging_size;
+	int			nr_posted;
+	struct sock_send_comp	comp;
+};
 
-	if(size + sizeof(int) > IMM_MAX_SIZE)
-	{
-		printk(KERN_CRIT "%s: message size %d + header is larger than max size %d\n",
-				__func__, size, IMM_MAX_SIZE);
-		return -1;
-	}
-	if(!addr)
-	{
-		printk(KERN_CRIT "%s: null input addr\n", __func__);
-		return -2;
-	}
+/*
+ * Reserve @real_size bytes in the remote socket ring of @target_node,
+ * and wait until the receiver has acked the range.
+ */
+static int sock_reserve_remote_ring(ppc *ctx, int target_node, int real_size)
+{
+	int tar_offset_start, last_ack;
 
 	spin_lock(&ctx->remote_sock_imm_offset_lock[target_node]);
 	if(ctx->remote_sock_rdma_ring_mrs_offset[target_node] + real_size >= RDMA_RING_SIZE)//If hits the end of ring, write start from 0 directly
@@ -1765,8 +1772,6 @@ int sock_send_message(ppc *ctx, int target_node, int dest_port, int if_internal_
 	tar_offset_start = ctx->remote_sock_rdma_ring_mrs_offset[target_node] - real_size;//Trace back to the real starting point
 	spin_unlock(&ctx->remote_sock_imm_offset_lock[target_node]);
 
-	//printk(KERN_CRIT "%s tar_offset_start %d real_size %d last_ack_index %d\n",
-	//		__func__, tar_offset_start, real_size, ctx->remote_last_ack_index[target_node]);
 	//make sure does not over write than lastack
 	while(1)
 	{
@@ -1776,46 +1781,209 @@ int sock_send_message(ppc *ctx, int target_node, int dest_port, int if_internal_
 		else
 			break;
 	}
+	return tar_offset_start;
+}
 
-	remote_mr = &(ctx->remote_sock_rdma_ring_mrs[target_node]);
+/*
+ * Fill the data sges of one segment, up to @seg_size bytes from the iovec
+ * cursor. A user buffer is sent in place only if a free sge is left after
+ * it, the staging sge that whatever follows is gathered into.
+ * Return the number of sges, and the bytes taken in @seg_size.
+ */
+static int sock_build_segment(ppc *ctx, struct sock_send_state *s,
+			      struct ib_sge *sge, int *seg_size, void *staging)
+{
+	int nr_sge = 0, staging_off = 0, size = 0;
+	bool last_is_staging = false;
+	unsigned long phys_addr;
 
-	imm_data = SOCK_IMM_SEND | tar_offset_start;
+	while (size < *seg_size && s->iov_idx < s->nr_iov) {
+		const struct iovec *iov = &s->iov[s->iov_idx];
+		void *base = iov->iov_base + s->iov_off;
+		int len = min_t(unsigned long, iov->iov_len - s->iov_off, *seg_size - size);
 
-	remote_addr = remote_mr->addr;
-	remote_rkey = remote_mr->rkey;
+		if (!len) {
+			s->iov_idx++;
+			s->iov_off = 0;
+			continue;
+		}
+
+		if (!s->if_userspace) {
+			/* Kernel buffers are sent in place, end segment once out of sges */
+			if (nr_sge == SOCK_SEND_MAX_DATA_SGE)
+				break;
+			sge[nr_sge].addr = fit_ib_reg_mr_addr(ctx, base, len);
+			sge[nr_sge].length = len;
+			sge[nr_sge].lkey = ctx->proc->lkey;
+			nr_sge++;
+		} else if (nr_sge < SOCK_SEND_MAX_DATA_SGE - 1 &&
+			   fit_check_page_continuous(base, len, &phys_addr) == 1) {
+			sge[nr_sge].addr = fit_ib_reg_mr_addr_phys(ctx, (void *)phys_addr, len);
+			sge[nr_sge].length = len;
+			sge[nr_sge].lkey = ctx->proc->lkey;
+			nr_sge++;
+			last_is_staging = false;
+		} else {
+			if (copy_from_user(staging + staging_off, base, len))
+				return -EFAULT;
+
+			if (last_is_staging)
+				sge[nr_sge - 1].length += len;
+			else {
+				sge[nr_sge].addr = fit_ib_reg_mr_addr(ctx, staging + staging_off, len);
+				sge[nr_sge].length = len;
+				sge[nr_sge].lkey = ctx->proc->lkey;
+				nr_sge++;
+				last_is_staging = true;
+			}
+			staging_off += len;
+		}
 
-	dest_port_data = dest_port | (if_internal_port << SOCK_IF_PORT_INTERNAL_BITS);
-	fit_debug("send imm-0x%x addr-0x%x rkey-%x, tar offset %d dest port %d 0x%x\n",
-		imm_data, remote_addr, remote_rkey, tar_offset_start, dest_port, dest_port_data);
-
-	if (if_userspace) {
-		ret = fit_check_page_continuous(addr, size, &phys_addr);
-		if (ret == 1) {
-			ret = sock_send_message_with_rdma_imm(ctx, target_node, remote_rkey,
-					(uintptr_t)remote_addr, (void *)phys_addr, size, tar_offset_start, imm_data,
-					&dest_port_data, sizeof(int),
-					FIT_SEND_MESSAGE_HEADER_AND_IMM, 1);
+		size += len;
+		s->iov_off += len;
+		if (s->iov_off == iov->iov_len) {
+			s->iov_idx++;
+			s->iov_off = 0;
 		}
-		else {
-			kbuf = kmalloc(size, GFP_KERNEL);
+	}
 
-			ret = copy_from_user(kbuf, addr, size);
-			WARN_ON(ret);
+	*seg_size = size;
+	return nr_sge;
+}
+
+static int sock_send_segment(ppc *ctx, int target_node, struct sock_send_state *s,
+			     int *seg_size, unsigned int seq)
+{
+	struct ib_send_wr wr, *bad_wr = NULL;
+	struct ib_sge sge[SOCK_SEND_MAX_DATA_SGE + 1];
+	struct fit_ibv_mr *remote_mr;
+	void *staging = NULL;
+	int tar_offset_start, nr_sge, ret;
+
+	/* Reuse of a staging buffer waits for the segment that used it */
+	ret = sock_poll_send(ctx, target_node, &s->comp,
+			     s->nr_posted - SOCK_SEND_WINDOW + 1);
+	if (ret)
+		return ret;
 
-			ret = sock_send_message_with_rdma_imm(ctx, target_node, remote_rkey,
-					(uintptr_t)remote_addr, kbuf, size, tar_offset_start, imm_data,
-					&dest_port_data, sizeof(int),
-					FIT_SEND_MESSAGE_HEADER_AND_IMM, 0);
+	if (s->if_userspace) {
+		staging = s->staging[seq % SOCK_SEND_WINDOW];
+		if (!staging) {
+			staging = kmalloc(s->staging_size, GFP_KERNEL);
+			if (!staging)
+				return -ENOMEM;
+			s->staging[seq % SOCK_SEND_WINDOW] = staging;
 		}
 	}
-	else {
-		ret = sock_send_message_with_rdma_imm(ctx, target_node, remote_rkey,
-				(uintptr_t)remote_addr, addr, size, tar_offset_start, imm_data,
-				&dest_port_data, sizeof(int),
-				FIT_SEND_MESSAGE_HEADER_AND_IMM, 0);
+
+	/* Same header for all segments, lives until the last completion */
+	sge[0].addr = fit_ib_reg_mr_addr(ctx, &s->header, sizeof(int));
+	sge[0].length = sizeof(int);
+	sge[0].lkey = ctx->proc->lkey;
+
+	nr_sge = sock_build_segment(ctx, s, sge + 1, seg_size, staging);
+	if (nr_sge < 0)
+		return nr_sge;
+
+	tar_offset_start = sock_reserve_remote_ring(ctx, target_node,
+						    *seg_size + sizeof(int));
+	remote_mr = &ctx->remote_sock_rdma_ring_mrs[target_node];
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = (uint64_t)&s->comp;
+	wr.opcode = IB_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = IB_SEND_SIGNALED;
+	wr.ex.imm_data = SOCK_IMM_SEND | tar_offset_start;
+	wr.wr.rdma.remote_addr = (uintptr_t)remote_mr->addr + tar_offset_start;
+	wr.wr.rdma.rkey = remote_mr->rkey;
+	wr.sg_list = sge;
+	wr.num_sge = nr_sge + 1;
+
+	fit_debug("node %d header %#x seg %u size %d sges %d offset %d\n",
+		target_node, s->header, seq, *seg_size, nr_sge, tar_offset_start);
+
+	ret = ib_post_send(ctx->sock_qp[target_node], &wr, &bad_wr);
+	if (ret) {
+		fit_err("post send to node %d failed %d", target_node, ret);
+		return -EIO;
 	}
+	s->nr_posted++;
+	return 0;
+}
 
-	return ret;
+/*
+ * Send the data of @iov as one stream to @dest_port of @target_node.
+ * Large ones are cut into segments and pipelined, the receiver sees a
+ * byte stream anyway, see sock_receive_message_iov().
+ *
+ * Return:
+ * Negative values on failures
+ * Otherwise the number of bytes sent
+ */
+int sock_send_message_iov(ppc *ctx, int target_node, int dest_port, int if_internal_port,
+			  const struct iovec *iov, int nr_iov, int if_userspace)
+{
+	struct sock_send_state s = {
+		.iov		= iov,
+		.nr_iov		= nr_iov,
+		.if_userspace	= if_userspace,
+		.header		= dest_port | (if_internal_port << SOCK_IF_PORT_INTERNAL_BITS),
+		.comp		= { .done = ATOMIC_INIT(0) },
+	};
+	long total = 0, sent = 0;
+	unsigned int seq;
+	int i, seg_size, ret = 0;
+
+	for (i = 0; i < nr_iov; i++)
+		total += iov[i].iov_len;
+	if (!total)
+		return 0;
+	if (total > INT_MAX)
+		return -EINVAL;
+
+	s.staging_size = min_t(long, total, SOCK_SEND_SEGMENT_SIZE);
+
+	for (seq = 0; sent < total; seq++) {
+		seg_size = s.staging_size;
+		ret = sock_send_segment(ctx, target_node, &s, &seg_size, seq);
+		if (ret)
+			break;
+		sent += seg_size;
+	}
+
+	/* Staging buffers and the header are in use until all are retired */
+	if (sock_poll_send(ctx, target_node, &s.comp, s.nr_posted) && !ret)
+		ret = -EIO;
+
+	for (i = 0; i < SOCK_SEND_WINDOW; i++)
+		kfree(s.staging[i]);
+
+	return ret ? ret : sent;
+}
+
+/*
+ * Return:
+ * Negative values on failues
+ * 0 on success
+ */
+int sock_send_message(ppc *ctx, int target_node, int dest_port, int if_internal_port,
+				void *addr, int size, unsigned long timeout_sec, int if_userspace)
+{
+	struct iovec iov = {
+		.iov_base	= addr,
+		.iov_len	= size,
+	};
+	int ret;
+
+	if(!addr)
+	{
+		printk(KERN_CRIT "%s: null input addr\n", __func__);
+		return -2;
+	}
+
+	ret = sock_send_message_iov(ctx, target_node, dest_port, if_internal_port,
+				    &iov, 1, if_userspace);
+	return ret < 0 ? ret : 0;
 }
 #endif
 
@@ -1831,33 +1999,167 @@ void *fit_alloc_memory_for_mr(unsigned int length)
 extern unsigned long	nr_recvcq_cqes[NUM_POLLING_THREADS];
 
 /*
- * HACK!!!
- *
- * This function or thread, will poll the only recv_cq Lego has.
- * This recv_cq includes all incoming messages.
- * This thread is pinned to a cpu core and keep running.
+ * An incoming request, i.e., the send part of ibapi_send_reply()
+ * sits in our ring at @offset. Memory hands it to thpool directly,
+ * others queue it to the port and wait for ibapi_receive_message().
  */
-static int fit_poll_recv_cq(void *_info)
+static void fit_handle_request(ppc *ctx, int node_id, int port, int offset)
 {
-	ppc *ctx;
-	char *addr;
-	int recvcq_id;
-	int ne, i, connection_id;
-	int node_id, port, offset;
-	int reply_indicator_index, length;
-	struct ib_wc *wc;
-	struct ib_cq *target_cq;
-	struct thread_pass_struct *info = _info;
+#ifdef CONFIG_COMP_MEMORY
+	struct imm_message_metadata *tmp1;
+	tmp1 = (struct imm_message_metadata *)(ctx->local_rdma_recv_rings[node_id] + offset);
 
-	/* Info passedd down by creater */
-	ctx = info->ctx;
-	target_cq = info->target_cq;
-	recvcq_id = info->recvcq_id;
+	/* Enqueue this request to thpool */
+	thpool_callback(ctx, tmp1,
+			(void *)tmp1 + sizeof(struct imm_message_metadata),
+			tmp1->size, node_id, offset);
+#else
+	struct imm_header_from_cq_to_port *tmp;
+	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+	tmp->source_node_id = node_id;
+	tmp->offset = offset;
+	spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
+	list_add_tail(&(tmp->list), &ctx->imm_waitqueue_perport[port].list);
+	spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
+#endif
+}
 
-	wc = kmalloc(sizeof(*wc) * NUM_PARALLEL_CONNECTION, GFP_KERNEL);
-	BUG_ON(!wc);
+/*
+ * Demultiplex a coalesced RDMA-WRITE-IMM, which carries
+ * @len bytes of framed requests starting at @offset.
+ */
+static void fit_handle_request_batch(ppc *ctx, int node_id, int port,
+				     int offset, int len)
+{
+	struct imm_message_metadata *tmp;
+	int end = offset + len;
+	int frame_size;
 
-	if (pin_current_thread())
+	while (offset < end) {
+		tmp = ctx->local_rdma_recv_rings[node_id] + offset;
+
+		/* Read before handing it out */
+		frame_size = FIT_COALESCE_FRAME_SIZE(tmp->size);
+		if (unlikely(offset + frame_size > end)) {
+			fit_err("Corrupted batch: offset %d frame %d end %d",
+				offset, frame_size, end);
+			WARN_ON_ONCE(1);
+			return;
+		}
+
+		fit_handle_request(ctx, node_id, port, offset);
+		offset += frame_size;
+	}
+}
+
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+void fit_recvcq_poll_init(int recvcq_id)
+{
+	struct fit_recvcq_poll *p = &recvcq_polls[recvcq_id];
+
+	init_waitqueue_head(&p->wq);
+	p->armed = 0;
+	p->start_ns = sched_clock();
+}
+
+/*
+ * Wake up the polling thread of @recvcq_id if it is sleeping.
+ * Called from the recv_cq interrupt, or by the loopback transport.
+ */
+void fit_recvcq_notify(int recvcq_id)
+{
+	struct fit_recvcq_poll *p = &recvcq_polls[recvcq_id];
+
+	/* Pairs with smp_mb() in fit_recvcq_idle() */
+	smp_mb();
+	if (!READ_ONCE(p->armed))
+		return;
+
+	p->notify_ns = sched_clock();
+	WRITE_ONCE(p->armed, 0);
+	wake_up(&p->wq);
+}
+
+/*
+ * Called by polling thread whenever the CQ is found empty.
+ *
+ * Keep spinning within the idle budget. Once the budget is used up,
+ * arm the CQ and return, so that the caller polls one more time:
+ * a completion that landed before the arm is caught by that poll, and
+ * one that lands after the arm will raise the interrupt.
+ * If that last poll is also empty, we come back here and sleep.
+ *
+ * @cq is NULL for the loopback transport, which calls
+ * fit_recvcq_notify() itself on every posted completion.
+ */
+void fit_recvcq_idle(int recvcq_id, struct ib_cq *cq, unsigned long *idle_start_ns)
+{
+	struct fit_recvcq_poll *p = &recvcq_polls[recvcq_id];
+	unsigned long now, latency;
+
+	now = sched_clock();
+	if (!*idle_start_ns) {
+		*idle_start_ns = now;
+		return;
+	}
+
+	if (!READ_ONCE(p->armed)) {
+		if (now - *idle_start_ns < FIT_POLL_IDLE_BUDGET_NS) {
+			cpu_relax();
+			return;
+		}
+
+		WRITE_ONCE(p->armed, 1);
+		smp_mb();
+		if (cq)
+			ib_req_notify_cq(cq, IB_CQ_NEXT_COMP);
+		return;
+	}
+
+	wait_event(p->wq, !READ_ONCE(p->armed));
+
+	now = sched_clock();
+	latency = now - p->notify_ns;
+
+	p->nr_sleeps++;
+	p->total_sleep_ns += now - *idle_start_ns;
+	p->total_wakeup_ns += latency;
+	if (latency > p->max_wakeup_ns)
+		p->max_wakeup_ns = latency;
+
+	*idle_start_ns = 0;
+}
+#endif
+
+/*
+ * HACK!!!
+ *
+ * This function or thread, will poll the only recv_cq Lego has.
+ * This recv_cq includes all incoming messages.
+ * This thread is pinned to a cpu core and keep running.
+ */
+static int fit_poll_recv_cq(void *_info)
+{
+	ppc *ctx;
+	char *addr;
+	int recvcq_id;
+	int ne, i, connection_id;
+	int node_id, port, offset;
+	int reply_indicator_index, length;
+	struct ib_wc *wc;
+	struct ib_cq *target_cq;
+	struct thread_pass_struct *info = _info;
+	unsigned long idle_start_ns = 0;
+
+	/* Info passedd down by creater */
+	ctx = info->ctx;
+	target_cq = info->target_cq;
+	recvcq_id = info->recvcq_id;
+
+	wc = kmalloc(sizeof(*wc) * NUM_PARALLEL_CONNECTION, GFP_KERNEL);
+	BUG_ON(!wc);
+
+	if (pin_current_thread())
 		panic("Fail to pin poll_cq");
 
 	while(1) {
@@ -1868,7 +2170,10 @@ static int fit_poll_recv_cq(void *_info)
 				fit_err("poll_cq error: %d", ne);
 				return ne;
 			}
+			if (!ne)
+				fit_recvcq_idle(recvcq_id, target_cq, &idle_start_ns);
 		} while (ne < 1);
+		fit_recvcq_busy(recvcq_id, &idle_start_ns);
 
 		/* Update stats */
 		nr_recvcq_cqes[recvcq_id] += ne;
@@ -1924,27 +2229,11 @@ static int fit_poll_recv_cq(void *_info)
 					offset = wc[i].ex.imm_data & IMM_GET_OFFSET;
 					port = IMM_GET_PORT_NUMBER(wc[i].ex.imm_data);
 
-#ifdef CONFIG_COMP_MEMORY
-					{
-					struct imm_message_metadata *tmp1;
-                                        tmp1 = (struct imm_message_metadata *)(ctx->local_rdma_recv_rings[node_id] + offset);
-
-					/* Enqueue this request to thpool */
-                                        thpool_callback(ctx, tmp1,
-							(void *)tmp1 + sizeof(struct imm_message_metadata),
-                                                        tmp1->size, node_id, offset);
-					}
-#else
-					{
-					struct imm_header_from_cq_to_port *tmp;
-					tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
-					tmp->source_node_id = node_id;
-					tmp->offset = offset;
-					spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
-					list_add_tail(&(tmp->list), &ctx->imm_waitqueue_perport[port].list);
-					spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
-					}
-#endif
+					if (wc[i].ex.imm_data & IMM_SEND_REPLY_BATCH)
+						fit_handle_request_batch(ctx, node_id, port,
+									 offset, wc[i].byte_len);
+					else
+						fit_handle_request(ctx, node_id, port, offset);
 				} else if (wc[i].ex.imm_data & IMM_SEND_REPLY_RECV) {
 					/*
 					 * This is the sender's handling reply part.
@@ -1961,12 +2250,18 @@ static int fit_poll_recv_cq(void *_info)
 						continue;
 					}
 
+					/* Receiver ACKed our request along with the reply */
+					if (wc[i].ex.imm_data & IMM_REPLY_ACK)
+						fit_remote_ring_ack(ctx, node_id,
+							ctx->reply_ack_offsets[reply_indicator_index]);
+
 					/*
 					 * The thread who did ibapi_send_reply() is busy polling
 					 * this shared memory. This memcpy will release it.
 					 */
 					dst_ptr = get_reply_ready_ptr(ctx, reply_indicator_index);
 					memcpy(dst_ptr, &length, sizeof(int));
+					fit_wake_reply_waiter(ctx, reply_indicator_index);
 				} else if (wc[i].ex.imm_data & IMM_ACK || wc[i].byte_len == 0) {
 					struct send_and_reply_format *recv;
 
@@ -2112,14 +2407,8 @@ int sock_poll_cq(void *in)
 						spin_lock(&ctx->sock_imm_waitqueue_perport_lock[tmp_sock->port]);
 						list_add_tail(&(tmp_sock->list), &ctx->sock_imm_waitqueue_perport[tmp_sock->port].list);
 						spin_unlock(&ctx->sock_imm_waitqueue_perport_lock[tmp_sock->port]);
-#if (CONFIG_EPOLL || CONFIG_POLL)
-						sock_set_read_ready(node_id, tmp_sock->port, tmp_sock->size);
-#endif
-#ifdef CONFIG_EPOLL
-						sock_epoll_callback(node_id, tmp_sock->port);
-#endif
-#ifdef CONFIG_POLL
-						sock_poll_callback(node_id, tmp_sock->port);
+#ifdef CONFIG_SOCKET_SYSCALL
+						sock_notify_read_ready(node_id, tmp_sock->port, tmp_sock->size);
 #endif
 					}
 					else if(wc[i].ex.imm_data & SOCK_IMM_ACK || wc[i].byte_len == 0) // ack socket metadata
@@ -2146,6 +2435,7 @@ int sock_poll_cq(void *in)
 
 						dst_ptr = get_reply_ready_ptr(ctx, reply_indicator_index);
 						memcpy(dst_ptr, &length, sizeof(int));
+						fit_wake_reply_waiter(ctx, reply_indicator_index);
 					}
 				}
 
@@ -2218,7 +2508,7 @@ static int waiting_queue_handler(void *_ctx)
 		}
 		case MSG_DO_ACK_REMOTE:
 			last_ack = (int)(long)new_request->msg;
-			ctx->remote_last_ack_index[new_request->src_id] = last_ack;
+			fit_remote_ring_ack(ctx, new_request->src_id, last_ack);
 			break;
 #ifdef CONFIG_SOCKET_SYSCALL
 		case MSG_SOCK_DO_ACK_INTERNAL:
@@ -2307,35 +2597,81 @@ int fit_send_request(ppc *ctx, int connection_id, enum mode s_mode,
 	return 0;
 }
 
+#ifdef CONFIG_FIT_LOCKFREE_RING
 /*
- * Return:
- * Negative values on failues
- * zero for succeed
+ * Carve @real_size bytes out of the remote RDMA ring of @target_node.
+ * Each QP owns the sub-ring (@connection_id % FIT_NR_SUBRINGS), space is
+ * reserved by a fetch-add on its virtual tail. If the reservation hits
+ * the end of the sub-ring, the rest is left as padding and we try again.
+ *
+ * Once reserved, wait until we have enough credits: we never write more
+ * than FIT_SUBRING_CREDITS beyond the last ACKed offset.
+ *
+ * Return: the starting offset within the remote ring
  */
-int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
-				      int size, int userspace_flag)
+int fit_reserve_remote_ring(ppc *ctx, int target_node, int connection_id, int real_size)
 {
-	int tar_offset_start;
-	int connection_id;
-	int imm_data;
-	int real_size;
-	void *remote_addr;
-	uint32_t remote_rkey;
-	struct fit_ibv_mr *remote_mr;
-	struct imm_message_metadata msg_header;
-	int last_ack;
-	int ret;
+	struct fit_remote_ring *r;
+	int subring;
+	long v;
 
-	BUG_ON(!addr);
+	subring = connection_id % FIT_NR_SUBRINGS;
+	r = &ctx->remote_rings[target_node * FIT_NR_SUBRINGS + subring];
 
-	real_size = size + sizeof(struct imm_message_metadata);
-	if (unlikely(real_size > IMM_MAX_SIZE)) {
-		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
-		return -EINVAL;
+	while (1) {
+		v = atomic_long_add_return(real_size, &r->tail) - real_size;
+		if (v % FIT_SUBRING_SIZE + real_size <= FIT_SUBRING_SIZE)
+			break;
 	}
 
+	while (v + real_size - atomic_long_read(&r->acked) > FIT_SUBRING_CREDITS)
+		schedule();
+
+	return subring * FIT_SUBRING_SIZE + v % FIT_SUBRING_SIZE;
+}
+
+/*
+ * @node has consumed its sub-ring up to @offset. ACKs may come in
+ * out of order (thpool workers, replies), so only move forward.
+ * A new ACK is always within FIT_SUBRING_CREDITS, a stale one is not.
+ */
+void fit_remote_ring_ack(ppc *ctx, int node, int offset)
+{
+	struct fit_remote_ring *r;
+	long acked, delta;
+
+	r = &ctx->remote_rings[node * FIT_NR_SUBRINGS + offset / FIT_SUBRING_SIZE];
+	do {
+		acked = atomic_long_read(&r->acked);
+		delta = offset % FIT_SUBRING_SIZE - acked % FIT_SUBRING_SIZE;
+		if (delta < 0)
+			delta += FIT_SUBRING_SIZE;
+
+		if (!delta || delta > FIT_SUBRING_CREDITS ||
+		    acked + delta > atomic_long_read(&r->tail))
+			return;
+	} while (atomic_long_cmpxchg(&r->acked, acked, acked + delta) != acked);
+}
+
+void fit_remote_rings_init(ppc *ctx)
+{
+	ctx->remote_rings = kzalloc(MAX_NODE * FIT_NR_SUBRINGS *
+				    sizeof(struct fit_remote_ring), GFP_KERNEL);
+	BUG_ON(!ctx->remote_rings);
+}
+#else
+/*
+ * Carve @real_size bytes out of the remote RDMA ring of @target_node.
+ * If the request hits the end of ring, it starts from 0 directly.
+ * We also make sure we do not write beyond the last ACKed offset.
+ *
+ * Return: the starting offset within the remote ring
+ */
+int fit_reserve_remote_ring(ppc *ctx, int target_node, int connection_id, int real_size)
+{
+	int tar_offset_start, last_ack;
+
 	spin_lock(&ctx->remote_imm_offset_lock[target_node]);
-	/* If hits the end of ring, write start from 0 directly */
 	if (ctx->remote_rdma_ring_mrs_offset[target_node] + real_size >= RDMA_RING_SIZE)
 		/* Record the last point */
 		ctx->remote_rdma_ring_mrs_offset[target_node] = real_size;
@@ -2346,7 +2682,6 @@ int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 	tar_offset_start = ctx->remote_rdma_ring_mrs_offset[target_node] - real_size;
 	spin_unlock(&ctx->remote_imm_offset_lock[target_node]);
 
-	/* Make sure we do not write beyond lastack */
 	while (1) {
 		last_ack = ctx->remote_last_ack_index[target_node];
 		if (tar_offset_start < last_ack && tar_offset_start + real_size > last_ack)
@@ -2354,10 +2689,212 @@ int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 		else
 			break;
 	}
+	return tar_offset_start;
+}
+
+void fit_remote_ring_ack(ppc *ctx, int node, int offset)
+{
+	ctx->remote_last_ack_index[node] = offset;
+}
+#endif /* CONFIG_FIT_LOCKFREE_RING */
+
+#ifdef CONFIG_FIT_COALESCE
+/*
+ * Small request coalescing
+ *
+ * send_reply requests no larger than FIT_COALESCE_MAX_SIZE are framed
+ * (metadata + payload, see FIT_COALESCE_FRAME_SIZE) into a staging buffer
+ * of the destination. The sender who finds the buffer empty becomes the
+ * leader: it waits up to CONFIG_FIT_COALESCE_WINDOW_NS for others to join,
+ * then ships the whole buffer with one RDMA-WRITE-IMM. Others return
+ * right after the copy and start waiting for their own replies.
+ *
+ * Receiver walks the frames and handles each of them as if it was sent
+ * alone at its own ring offset, thus ACKs work as usual.
+ */
+static void fit_coalesce_flush(ppc *ctx, int target_node,
+			       struct fit_coalesce_queue *q)
+{
+	struct fit_ibv_mr *remote_mr = &ctx->remote_rdma_ring_mrs[target_node];
+	int tar_offset_start, connection_id, size, offset;
+	struct imm_message_metadata *m;
+	void *batch;
+#ifdef CONFIG_COUNTER_FIT_IB
+	int nr_msgs;
+#endif
+
+	/* The spare buffer is free once we own flush_lock */
+	mutex_lock(&q->flush_lock);
+
+	spin_lock(&q->lock);
+	batch = q->buf;
+	size = q->size;
+#ifdef CONFIG_COUNTER_FIT_IB
+	nr_msgs = q->nr_msgs;
+#endif
+	q->buf = q->spare;
+	q->size = 0;
+	q->nr_msgs = 0;
+	spin_unlock(&q->lock);
+
+	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node, connection_id, size);
+
+	for (offset = 0; offset < size; offset += FIT_COALESCE_FRAME_SIZE(m->size)) {
+		m = batch + offset;
+		fit_set_reply_ack_offset(ctx, m->reply_indicator_index,
+					 tar_offset_start + offset);
+	}
+
+	/*
+	 * Poll now: @batch is reused by the next flush,
+	 * we have to make sure NIC is done with it.
+	 */
+	fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id,
+			remote_mr->rkey, (uintptr_t)remote_mr->addr, batch, size,
+			tar_offset_start,
+			IMM_SEND_REPLY_SEND | IMM_SEND_REPLY_BATCH | tar_offset_start,
+			FIT_SEND_MESSAGE_IMM_ONLY, NULL, 1);
+
+	q->spare = batch;
+	mutex_unlock(&q->flush_lock);
+
+#ifdef CONFIG_COUNTER_FIT_IB
+	atomic_long_inc(&nr_ib_coalesced_batches);
+	atomic_long_add(nr_msgs, &nr_ib_coalesced_msgs);
+#endif
+}
+
+/*
+ * Return 1 if the request is queued and will be shipped by a leader,
+ * 0 if caller should send it by itself.
+ */
+static int fit_coalesce_send(ppc *ctx, int target_node, void *addr, int size,
+			     struct imm_message_metadata *msg_header)
+{
+	struct fit_coalesce_queue *q = &ctx->coalesce_queues[target_node];
+	int frame_size = FIT_COALESCE_FRAME_SIZE(size);
+	unsigned long start_ns;
+	void *frame;
+	int leader;
+
+	if (size > FIT_COALESCE_MAX_SIZE)
+		return 0;
+
+	spin_lock(&q->lock);
+	if (q->size + frame_size > FIT_COALESCE_BUF_SIZE) {
+		spin_unlock(&q->lock);
+		return 0;
+	}
+	frame = q->buf + q->size;
+	memcpy(frame, msg_header, sizeof(*msg_header));
+	memcpy(frame + sizeof(*msg_header), addr, size);
+	q->size += frame_size;
+	leader = (q->nr_msgs++ == 0);
+	spin_unlock(&q->lock);
+
+	if (!leader)
+		return 1;
+
+	start_ns = sched_clock();
+	while (READ_ONCE(q->size) < FIT_COALESCE_BUF_SIZE - FIT_COALESCE_MAX_FRAME_SIZE &&
+	       sched_clock() - start_ns < CONFIG_FIT_COALESCE_WINDOW_NS)
+		cpu_relax();
+
+	fit_coalesce_flush(ctx, target_node, q);
+	return 1;
+}
+
+static void fit_coalesce_init(ppc *ctx)
+{
+	struct fit_coalesce_queue *q;
+	int i;
+
+	ctx->coalesce_queues = kzalloc(MAX_NODE * sizeof(*q), GFP_KERNEL);
+	BUG_ON(!ctx->coalesce_queues);
+
+	for (i = 0; i < MAX_NODE; i++) {
+		q = &ctx->coalesce_queues[i];
+		spin_lock_init(&q->lock);
+		mutex_init(&q->flush_lock);
+		q->buf = kmalloc(FIT_COALESCE_BUF_SIZE, GFP_KERNEL);
+		q->spare = kmalloc(FIT_COALESCE_BUF_SIZE, GFP_KERNEL);
+		BUG_ON(!q->buf || !q->spare);
+	}
+}
+#else
+static inline int fit_coalesce_send(ppc *ctx, int target_node, void *addr, int size,
+				    struct imm_message_metadata *msg_header)
+{
+	return 0;
+}
+static inline void fit_coalesce_init(ppc *ctx) { }
+#endif /* CONFIG_FIT_COALESCE */
+
+/*
+ * Ship the send part of ibapi_send_reply(), either coalesced
+ * with others or alone with its own RDMA-WRITE-IMM.
+ *
+ * Return the connection used, or -1 if coalesced.
+ */
+static int fit_send_reply_request(ppc *ctx, int target_node, void *addr, int size,
+				  struct imm_message_metadata *msg_header)
+{
+	int tar_offset_start, connection_id, imm_data, real_size;
+	struct fit_ibv_mr *remote_mr;
+
+	if (fit_coalesce_send(ctx, target_node, addr, size, msg_header))
+		return -1;
+
+	real_size = size + sizeof(struct imm_message_metadata);
+	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node, connection_id, real_size);
+	fit_set_reply_ack_offset(ctx, msg_header->reply_indicator_index, tar_offset_start);
 
 	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
+	imm_data = IMM_SEND_REPLY_SEND | tar_offset_start;
+
+	fit_debug("send imm-%x addr-%x rkey-%x oaddr-%x orkey-%x\n",
+		imm_data, remote_mr->addr, remote_mr->rkey,
+		msg_header->reply_addr, msg_header->reply_rkey);
+
+	/* for send reply, no need to poll the send now, since we have reply already */
+	fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id, remote_mr->rkey,
+			(uintptr_t)remote_mr->addr, addr, size, tar_offset_start, imm_data,
+			FIT_SEND_MESSAGE_HEADER_AND_IMM, msg_header, 0);
+	return connection_id;
+}
+
+/*
+ * Return:
+ * Negative values on failues
+ * zero for succeed
+ */
+int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
+				      int size, int userspace_flag)
+{
+	int tar_offset_start;
+	int connection_id;
+	int imm_data;
+	int real_size;
+	void *remote_addr;
+	uint32_t remote_rkey;
+	struct fit_ibv_mr *remote_mr;
+	struct imm_message_metadata msg_header;
+	int ret;
+
+	BUG_ON(!addr);
+
+	real_size = size + sizeof(struct imm_message_metadata);
+	if (unlikely(real_size > IMM_MAX_SIZE)) {
+		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
+		return -EINVAL;
+	}
 
 	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node, connection_id, real_size);
+
+	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
 
 	imm_data = IMM_SEND_REPLY_SEND | tar_offset_start;
 
@@ -2388,21 +2925,36 @@ int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
  * Negative values on failues
  * Positive values indicate the reply message length
  */
+#ifdef CONFIG_FIT_REPLY_SLEEP
+/*
+ * Sleep until the polling thread writes @checker, or a second passed.
+ * The timeout is checked by caller.
+ */
+static inline void fit_reply_sleep(int *checker)
+{
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	if (READ_ONCE(*checker) == SEND_REPLY_WAIT)
+		schedule_timeout(HZ);
+	__set_current_state(TASK_RUNNING);
+}
+#else
+static inline void fit_reply_sleep(int *checker) { BUG(); }
+#endif
+
+/*
+ * @sleep: give up the CPU while waiting for reply, if there are other
+ * runnable tasks on this CPU. Otherwise polling has lower latency.
+ */
 int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 					       int size, void *ret_addr, int max_ret_size,
 					       int userspace_flag, int if_use_ret_phys_addr,
-					       unsigned long timeout_sec, void *caller)
+					       unsigned long timeout_sec, bool sleep,
+					       void *caller)
 {
-	int tar_offset_start;
 	int connection_id;
 	int reply_indicator_index;
-	int imm_data;
 	int real_size;
-	void *remote_addr;
-	uint32_t remote_rkey;
-	struct fit_ibv_mr *remote_mr;
 	struct imm_message_metadata msg_header;
-	int last_ack;
 	unsigned long start_time;
 	int reply_length;
 
@@ -2419,35 +2971,8 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 		return -EINVAL;
 	}
 
-	spin_lock(&ctx->remote_imm_offset_lock[target_node]);
-	/* If hits the end of ring, write start from 0 directly */
-	if (ctx->remote_rdma_ring_mrs_offset[target_node] + real_size >= RDMA_RING_SIZE)
-		/* Record the last point */
-		ctx->remote_rdma_ring_mrs_offset[target_node] = real_size;
-	else
-		ctx->remote_rdma_ring_mrs_offset[target_node] += real_size;
-
-	/* Trace back to the real starting point */
-	tar_offset_start = ctx->remote_rdma_ring_mrs_offset[target_node] - real_size;
-	spin_unlock(&ctx->remote_imm_offset_lock[target_node]);
-
-	/* Make sure we do not write beyond lastack */
-	while (1) {
-		last_ack = ctx->remote_last_ack_index[target_node];
-		if (tar_offset_start < last_ack && tar_offset_start + real_size > last_ack)
-			schedule();
-		else
-			break;
-	}
-
-	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
-
-	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
-
 	reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &local_reply_ready_checker);
 
-	imm_data = IMM_SEND_REPLY_SEND | tar_offset_start;
-
 	if (if_use_ret_phys_addr == 1)
 		msg_header.reply_addr = fit_ib_reg_mr_addr_phys(ctx, ret_addr, max_ret_size);
 	else
@@ -2457,16 +2982,12 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 	msg_header.reply_indicator_index = reply_indicator_index;
 	msg_header.source_node_id = ctx->node_id;
 	msg_header.size = size;
-	remote_addr = remote_mr->addr;
-	remote_rkey = remote_mr->rkey;
 
-	fit_debug("send imm-%x addr-%x rkey-%x oaddr-%x orkey-%x\n",
-		imm_data, remote_addr, remote_rkey, msg_header.reply_addr, msg_header.reply_rkey);
+	/* Must be visible before the reply can arrive */
+	if (sleep)
+		fit_set_reply_waiter(ctx, reply_indicator_index);
 
-	/* for send reply, no need to poll the send now, since we have reply already */
-	fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id, remote_rkey,
-			(uintptr_t)remote_addr, addr, size, tar_offset_start, imm_data,
-			FIT_SEND_MESSAGE_HEADER_AND_IMM, &msg_header, 0);
+	connection_id = fit_send_reply_request(ctx, target_node, addr, size, &msg_header);
 
 	/*
 	 * Default model
@@ -2491,8 +3012,12 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 	 * The local_reply_ready_checker will be set by
 	 * recv_cq polling thread, when it gets the reply.
 	 */
-	while (local_reply_ready_checker == SEND_REPLY_WAIT) {
-		cpu_relax();
+	while (READ_ONCE(local_reply_ready_checker) == SEND_REPLY_WAIT) {
+		if (sleep && !single_task_running())
+			fit_reply_sleep(&local_reply_ready_checker);
+		else
+			cpu_relax();
+
 		if (unlikely(time_after(jiffies, start_time + timeout_sec * HZ))) {
 			pr_warn("ibapi_send_reply() CPU:%d PID:%d timeout (%u ms), caller: %pS\n",
 				smp_processor_id(), current->pid,
@@ -2500,9 +3025,13 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 			print_pcache_events();
 			print_profile_points();
 			dump_ib_stats();
+			if (sleep)
+				fit_put_reply_waiter(ctx, reply_indicator_index);
 			return -ETIMEDOUT;
 		}
 	}
+	if (sleep)
+		fit_put_reply_waiter(ctx, reply_indicator_index);
 	free_reply_indicator(ctx, reply_indicator_index);
 	reply_length = local_reply_ready_checker;
 
@@ -2524,17 +3053,11 @@ int fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ppc *ctx, int targe
 					       int userspace_flag, int if_use_ret_phys_addr,
 					       unsigned long timeout_sec, void *caller)
 {
-	int tar_offset_start;
 	int connection_id;
 	int reply_indicator_index;
-	int imm_data;
 	int local_reply_ready_checker = SEND_REPLY_WAIT;
 	int real_size;
-	void *remote_addr;
-	uint32_t remote_rkey;
-	struct fit_ibv_mr *remote_mr;
 	struct imm_message_metadata msg_header;
-	int last_ack;
 	unsigned long start_time;
 	int reply_length;
 
@@ -2545,35 +3068,8 @@ int fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ppc *ctx, int targe
 		return -1;
 	}
 
-	spin_lock(&ctx->remote_imm_offset_lock[target_node]);
-	if(ctx->remote_rdma_ring_mrs_offset[target_node] + real_size >= RDMA_RING_SIZE)//If hits the end of ring, write start from 0 directly
-		ctx->remote_rdma_ring_mrs_offset[target_node] = real_size;//Record the last point
-	else
-		ctx->remote_rdma_ring_mrs_offset[target_node] += real_size;
-	tar_offset_start = ctx->remote_rdma_ring_mrs_offset[target_node] - real_size;//Trace back to the real starting point
-	spin_unlock(&ctx->remote_imm_offset_lock[target_node]);
-
-	//printk(KERN_CRIT "%s tar_offset_start %d real_size %d last_ack_index %d\n",
-	//		__func__, tar_offset_start, real_size, ctx->remote_last_ack_index[target_node]);
-
-	/* make sure we do not write beyond lastack */
-	while(1)
-	{
-		last_ack = ctx->remote_last_ack_index[target_node];
-		if(tar_offset_start < last_ack && tar_offset_start + real_size > last_ack)
-			schedule();
-		else
-			break;
-	}
-
-	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
-
-	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
-
 	reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &local_reply_ready_checker);
 
-	imm_data = IMM_SEND_REPLY_SEND | tar_offset_start;
-
 	if (if_use_ret_phys_addr == 1)
 		msg_header.reply_addr = fit_ib_reg_mr_addr_phys(ctx, ret_addr, max_ret_size);
 	else
@@ -2583,20 +3079,12 @@ int fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ppc *ctx, int targe
 	msg_header.reply_indicator_index = reply_indicator_index;
 	msg_header.source_node_id = ctx->node_id;
 	msg_header.size = size;
-	remote_addr = remote_mr->addr;
-	remote_rkey = remote_mr->rkey;
-
-	fit_debug("send imm-%x addr-%x rkey-%x oaddr-%x orkey-%x\n",
-		imm_data, remote_addr, remote_rkey, msg_header.reply_addr, msg_header.reply_rkey);
 
 #ifdef SCHEDULE_MODEL
 	ctx->thread_waiting_for_reply[reply_indicator_index] = get_current();
 	set_current_state(TASK_INTERRUPTIBLE);
 #endif
-	/* for send reply, no need to poll the send now, since we have reply already */
-	fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id, remote_rkey,
-			(uintptr_t)remote_addr, addr, size, tar_offset_start, imm_data,
-			FIT_SEND_MESSAGE_HEADER_AND_IMM, &msg_header, 0);
+	connection_id = fit_send_reply_request(ctx, target_node, addr, size, &msg_header);
 
 #ifdef SCHEDULE_MODEL
 	schedule();
@@ -2693,7 +3181,6 @@ int fit_multicast_send_reply(ppc *ctx, int num_nodes, int *target_node,
 	uint32_t remote_rkey;
 	struct fit_ibv_mr *remote_mr;
 	struct imm_message_metadata *msg_header;
-	int last_ack;
 	unsigned long start_time;
         int ret = 0;
 
@@ -2728,27 +3215,12 @@ int fit_multicast_send_reply(ppc *ctx, int num_nodes, int *target_node,
 			goto out;
 		}
 
-		spin_lock(&ctx->remote_imm_offset_lock[target_node[i]]);
-		if(ctx->remote_rdma_ring_mrs_offset[target_node[i]] + real_size >= RDMA_RING_SIZE)//If hits the end of ring, write start from 0 directly
-			ctx->remote_rdma_ring_mrs_offset[target_node[i]] = real_size;//Record the last point
-		else
-			ctx->remote_rdma_ring_mrs_offset[target_node[i]] += real_size;
-		tar_offset_start = ctx->remote_rdma_ring_mrs_offset[target_node[i]] - real_size;//Trace back to the real starting point
-		spin_unlock(&ctx->remote_imm_offset_lock[target_node[i]]);
-
-		/* make sure we do not write beyond lastack */
-		while(1)
-		{
-			last_ack = ctx->remote_last_ack_index[target_node[i]];
-			if(tar_offset_start < last_ack && tar_offset_start + real_size > last_ack)
-				schedule();
-			else
-				break;
-		}
+		connection_id = fit_get_connection_by_atomic_number(ctx, target_node[i], LOW_PRIORITY);
+		tar_offset_start = fit_reserve_remote_ring(ctx, target_node[i], connection_id, real_size);
 
 		remote_mr = &(ctx->remote_rdma_ring_mrs[target_node[i]]);
-		connection_id = fit_get_connection_by_atomic_number(ctx, target_node[i], LOW_PRIORITY);
 		reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &local_reply_ready_checker[i]);
+		fit_set_reply_ack_offset(ctx, reply_indicator_index, tar_offset_start);
                 imm_data = IMM_SEND_REPLY_SEND | tar_offset_start;
 
 		if (if_use_ret_phys_addr == 1)
@@ -3010,6 +3482,7 @@ retry:
 		info[i].recvcq_id = i;
 		info[i].ctx = ctx;
 		info[i].target_cq = ctx->cq[i];
+		fit_recvcq_poll_init(i);
 		kthread_run(fit_poll_recv_cq, &info[i], "FIT_RecvCQ-%d", i);
 	}
 
@@ -3042,13 +3515,15 @@ retry:
 	ctx->remote_rdma_ring_mrs = (struct fit_ibv_mr *)kmalloc(MAX_NODE * sizeof(struct fit_ibv_mr), GFP_KERNEL);
 	ctx->remote_rdma_ring_mrs_offset = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
 	ctx->remote_last_ack_index = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
-	ctx->local_last_ack_index = (int *)kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
-	ctx->local_last_ack_index_lock = (spinlock_t *)kmalloc(MAX_NODE * sizeof(spinlock_t), GFP_KERNEL);
+	ctx->local_last_ack_index = (int *)kzalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(int), GFP_KERNEL);
+	ctx->local_last_ack_index_lock = (spinlock_t *)kmalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(spinlock_t), GFP_KERNEL);
 	ctx->remote_imm_offset_lock = (spinlock_t *)kmalloc(MAX_NODE * sizeof(spinlock_t), GFP_KERNEL);
-	for(i=0; i<MAX_NODE; i++) {
+	for(i=0; i<MAX_NODE; i++)
 		spin_lock_init(&ctx->remote_imm_offset_lock[i]);
+	for(i=0; i<MAX_NODE * FIT_NR_SUBRINGS; i++)
 		spin_lock_init(&ctx->local_last_ack_index_lock[i]);
-	}
+	fit_remote_rings_init(ctx);
+	fit_coalesce_init(ctx);
 
 #ifdef CONFIG_SOCKET_O_IB
 	/*
@@ -13,8 +13,21 @@
 #undef pr_fmt
 #define pr_fmt(fmt) "fit: " fmt
 
+#include <lego/wait.h>
+#include <lego/mutex.h>
 #include "fit.h"
 
+#ifdef CONFIG_FIT_DEBUG
+#define fit_debug(fmt, ...) \
+	pr_debug("%s():%d " fmt, __func__, __LINE__, __VA_ARGS__)
+#else
+static inline void fit_debug(const char *fmt, ...) { }
+#endif
+
+#define fit_err(fmt, ...)						\
+	pr_debug("%s()-%d CPU%2d " fmt "\n",				\
+		__func__, __LINE__, smp_processor_id(), __VA_ARGS__)
+
 /*
  * Number of recv_cq
  * Each recv_cq has its dedicated polling thread.
@@ -53,7 +66,8 @@ struct fit_sglist;
 
 int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 				int size, void *ret_addr, int max_ret_size, int userspace_flag,
-				int if_use_ret_phys_addr, unsigned long timeout_sec, void *caller);
+				int if_use_ret_phys_addr, unsigned long timeout_sec, bool sleep,
+				void *caller);
 int fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ppc *ctx, int target_node, void *addr,
 					       int size, void *ret_addr, int max_ret_size, int *ret_private_bits,
 					       int userspace_flag, int if_use_ret_phys_addr,
@@ -86,4 +100,295 @@ extern unsigned int first_qpn[];
 
 int sock_send_message(ppc *ctx, int targe_node, int port, int if_internal_port, void *buf, int size, unsigned long timeout_sec, int if_userspace);
 int sock_receive_message(ppc *ctx, int *target_node, int port, void *ret_addr, int receive_size, int if_userspace, int sock_type);
+
+struct iovec;
+int sock_send_message_iov(ppc *ctx, int target_node, int dest_port, int if_internal_port,
+			  const struct iovec *iov, int nr_iov, int if_userspace);
+int sock_receive_message_iov(ppc *ctx, int *target_node, int port, const struct iovec *iov,
+			     int nr_iov, int if_userspace, int sock_type);
+
+int fit_reserve_remote_ring(ppc *ctx, int target_node, int connection_id, int real_size);
+void fit_remote_ring_ack(ppc *ctx, int node, int offset);
+void *fit_alloc_memory_for_mr(unsigned int length);
+
+/*
+ * The RDMA ring of each node pair is split into FIT_NR_SUBRINGS slices.
+ * Receiver tracks and ACKs each slice on its own, every 1/8 of a slice.
+ * With one slice, this is the classic IMM_ACK_FREQ.
+ */
+#ifdef CONFIG_FIT_LOCKFREE_RING
+#define FIT_NR_SUBRINGS		(CONFIG_FIT_NR_SUBRINGS)
+#else
+#define FIT_NR_SUBRINGS		(1)
+#endif
+#define FIT_SUBRING_SIZE	(RDMA_RING_SIZE / FIT_NR_SUBRINGS)
+#define FIT_SUBRING_ACK_FREQ	(FIT_SUBRING_SIZE / 8)
+
+#ifdef CONFIG_FIT_LOCKFREE_RING
+/*
+ * Never run more than this far ahead of the last ACK. Being half
+ * a slice, a stale ACK can always be told apart from a new one.
+ */
+#define FIT_SUBRING_CREDITS	(FIT_SUBRING_SIZE / 2)
+
+/*
+ * Sender side view of one sub-ring at remote.
+ * Both are virtual offsets that never wrap,
+ * (x % FIT_SUBRING_SIZE) is the offset within the sub-ring.
+ */
+struct fit_remote_ring {
+	atomic_long_t		tail;
+	atomic_long_t		acked;
+} ____cacheline_aligned;
+
+void fit_remote_rings_init(ppc *ctx);
+#else
+static inline void fit_remote_rings_init(ppc *ctx) { }
+#endif
+
+/*
+ * Each request inside a coalesced RDMA-WRITE-IMM is framed as
+ * metadata + payload, padded to 8 bytes. Receiver always knows
+ * how to walk the frames, no matter coalescing is enabled or not.
+ */
+#define FIT_COALESCE_FRAME_SIZE(size)	\
+	ALIGN(sizeof(struct imm_message_metadata) + (size), 8)
+
+#ifdef CONFIG_FIT_COALESCE
+#define FIT_COALESCE_MAX_SIZE		(256)
+#define FIT_COALESCE_MAX_FRAME_SIZE	FIT_COALESCE_FRAME_SIZE(FIT_COALESCE_MAX_SIZE)
+#define FIT_COALESCE_BUF_SIZE		(PAGE_SIZE)
+
+/* Per destination node staging buffer */
+struct fit_coalesce_queue {
+	spinlock_t		lock;
+	void			*buf;
+	int			size;
+	int			nr_msgs;
+
+	/* Held while a batch is being posted, which may sleep */
+	struct mutex		flush_lock;
+	void			*spare;
+} ____cacheline_aligned;
+
+#ifdef CONFIG_COUNTER_FIT_IB
+extern atomic_long_t nr_ib_coalesced_batches;
+extern atomic_long_t nr_ib_coalesced_msgs;
+#endif
+#endif /* CONFIG_FIT_COALESCE */
+
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+#define FIT_POLL_IDLE_BUDGET_NS	(CONFIG_FIT_ADAPTIVE_POLL_IDLE_US * NSEC_PER_USEC)
+
+/*
+ * Per recv_cq sleep/wakeup state.
+ * @armed is set by the polling thread right before it sleeps,
+ * and cleared by whoever delivers the next completion.
+ */
+struct fit_recvcq_poll {
+	wait_queue_head_t	wq;
+	int			armed;
+	unsigned long		notify_ns;
+
+	/* stats */
+	unsigned long		start_ns;
+	unsigned long		nr_sleeps;
+	unsigned long		total_sleep_ns;
+	unsigned long		total_wakeup_ns;
+	unsigned long		max_wakeup_ns;
+} ____cacheline_aligned;
+
+extern struct fit_recvcq_poll recvcq_polls[NUM_POLLING_THREADS];
+
+void fit_recvcq_poll_init(int recvcq_id);
+void fit_recvcq_notify(int recvcq_id);
+void fit_recvcq_idle(int recvcq_id, struct ib_cq *cq, unsigned long *idle_start_ns);
+
+/* Called once a completion is found */
+static inline void fit_recvcq_busy(int recvcq_id, unsigned long *idle_start_ns)
+{
+	*idle_start_ns = 0;
+	WRITE_ONCE(recvcq_polls[recvcq_id].armed, 0);
+}
+#else
+static inline void fit_recvcq_poll_init(int recvcq_id) { }
+static inline void fit_recvcq_notify(int recvcq_id) { }
+static inline void
+fit_recvcq_idle(int recvcq_id, struct ib_cq *cq, unsigned long *idle_start_ns) { }
+static inline void fit_recvcq_busy(int recvcq_id, unsigned long *idle_start_ns) { }
+#endif
+
+#ifdef CONFIG_FIT_LOOPBACK
+/* fit_loopback.c */
+ppc *fit_loopback_establish_conn(int mynodeid);
+int fit_loopback_send_reply(ppc *ctx, int target_node, void *addr, int size,
+			    void *ret_addr, int max_ret_size, int *ret_private_bits,
+			    int if_use_ret_phys_addr, unsigned long timeout_sec,
+			    void *caller);
+int fit_loopback_send(ppc *ctx, int target_node, void *addr, int size);
+int fit_loopback_multicast_send_reply(ppc *ctx, int num_nodes, int *target_node,
+				      struct fit_sglist *sglist, struct fit_sglist *output_msg,
+				      int max_ret_size, int if_use_ret_phys_addr,
+				      unsigned long timeout_sec, void *caller);
+int fit_loopback_receive_message(ppc *ctx, unsigned int port, void *ret_addr,
+				 int receive_size, uintptr_t *reply_descriptor);
+int fit_loopback_reply_message(ppc *ctx, void *addr, int size, int private_bits,
+			       uintptr_t descriptor);
+#endif
+
+/*
+ * Reply indicators
+ *
+ * The thread who did ibapi_send_reply() busy polls its on-stack
+ * reply checker. Its address is published here, and the receiving
+ * side uses the index carried in imm_data to find and release it.
+ */
+static inline void *get_reply_ready_ptr(ppc *ctx, unsigned int index)
+{
+	void *ptr;
+	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
+
+	if (unlikely(index >= IMM_NUM_OF_SEMAPHORE)) {
+		fit_err("array_size: %d index: %d",
+			IMM_NUM_OF_SEMAPHORE, index);
+		BUG();
+	}
+
+	ptr = ctx->reply_ready_indicators[index];
+
+	if (unlikely(!test_bit(index, bitmap))) {
+		fit_err("index: %d ptr: %p", index, ptr);
+		dump_stack();
+		hlt();
+	}
+
+	if (unlikely(!virt_addr_valid((unsigned long)ptr))) {
+		fit_err("index: %d ptr: %p", index, ptr);
+		BUG();
+	}
+	return ptr;
+}
+
+static inline void free_reply_indicator(ppc *ctx, unsigned int idx)
+{
+	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
+
+	if (unlikely(idx >= IMM_NUM_OF_SEMAPHORE)) {
+		fit_err("array_size: %d index: %d",
+			IMM_NUM_OF_SEMAPHORE, idx);
+		BUG();
+	}
+
+	spin_lock(&ctx->indicators_lock);
+	if (likely(test_and_clear_bit(idx, bitmap)))
+		ctx->reply_ready_indicators[idx] = NULL;
+	else {
+		fit_err("index: %d", idx);
+		BUG();
+	}
+	spin_unlock(&ctx->indicators_lock);
+}
+
+#ifdef CONFIG_FIT_REPLY_SLEEP
+/*
+ * Whoever takes the waiter out of the slot drops the reference,
+ * thus the polling thread never wakes up a freed task.
+ */
+static inline void fit_set_reply_waiter(ppc *ctx, unsigned int idx)
+{
+	get_task_struct(current);
+	WRITE_ONCE(ctx->reply_waiters[idx], current);
+}
+
+static inline void fit_put_reply_waiter(ppc *ctx, unsigned int idx)
+{
+	struct task_struct *p;
+
+	p = xchg(&ctx->reply_waiters[idx], NULL);
+	if (p)
+		put_task_struct(p);
+}
+
+/* Called by polling thread, after the reply length is written */
+static inline void fit_wake_reply_waiter(ppc *ctx, unsigned int idx)
+{
+	struct task_struct *p;
+
+	/* xchg implies a full barrier, pairs with fit_reply_sleep() */
+	p = xchg(&ctx->reply_waiters[idx], NULL);
+	if (p) {
+		wake_up_process(p);
+		put_task_struct(p);
+	}
+}
+#else
+static inline void fit_set_reply_waiter(ppc *ctx, unsigned int idx) { }
+static inline void fit_put_reply_waiter(ppc *ctx, unsigned int idx) { }
+static inline void fit_wake_reply_waiter(ppc *ctx, unsigned int idx) { }
+#endif
+
+/*
+ * @addr: must be a valid kernel virtual address
+ */
+static inline unsigned int alloc_index_and_set_reply_indicator(ppc *ctx, void *addr)
+{
+	int idx;
+	unsigned long *bitmap = ctx->reply_ready_indicators_bitmap;
+
+retry:
+	spin_lock(&ctx->indicators_lock);
+	for_each_clear_bit(idx, bitmap, IMM_NUM_OF_SEMAPHORE) {
+		set_bit(idx, bitmap);
+		ctx->reply_ready_indicators[idx] = addr;
+		spin_unlock(&ctx->indicators_lock);
+		return idx;
+	}
+	spin_unlock(&ctx->indicators_lock);
+
+	/*
+	 * All full? Given the fact that we are using sync RPC,
+	 * the maximum outstanding requests will equal to nr_cpus.
+	 * Show correct warnings here.
+	 */
+	if (likely(IMM_NUM_OF_SEMAPHORE <= nr_cpus)) {
+		WARN_ONCE(1, "Please set a larger IMM_NUM_OF_SEMAPHORE.");
+		goto retry;
+	}
+	BUG();
+}
+
+/*
+ * Remember where the request waiting on reply indicator @index sits
+ * in the remote ring. Its reply may carry an ACK, see IMM_REPLY_ACK.
+ */
+static inline void fit_set_reply_ack_offset(ppc *ctx, unsigned int index, int offset)
+{
+	if (likely(index < IMM_NUM_OF_SEMAPHORE))
+		ctx->reply_ack_offsets[index] = offset;
+}
+
+/*
+ * Check if the receiver has consumed enough of the sub-ring from @node_id
+ * since last ACK. If so, record the new position and return 1, the
+ * caller should send an ACK back to the sender.
+ */
+static inline int fit_update_local_last_ack(ppc *ctx, int node_id, int offset)
+{
+	int idx, delta, ack_flag = 0;
+
+	idx = node_id * FIT_NR_SUBRINGS + offset / FIT_SUBRING_SIZE;
+
+	spin_lock(&ctx->local_last_ack_index_lock[idx]);
+	delta = offset % FIT_SUBRING_SIZE -
+		ctx->local_last_ack_index[idx] % FIT_SUBRING_SIZE;
+	if (delta < 0)
+		delta += FIT_SUBRING_SIZE;
+	if (delta >= FIT_SUBRING_ACK_FREQ) {
+		ack_flag = 1;
+		ctx->local_last_ack_index[idx] = offset;
+	}
+	spin_unlock(&ctx->local_last_ack_index_lock[idx]);
+
+	return ack_flag;
+}
 #endif /* _INCLUDE_FIT_INTERNAL_H */
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * FIT shared-memory loopback transport
+ *
+ * This backend keeps the ibapi_* surface, but replaces QPs and CQs with
+ * in-memory rings. All nodes this kernel talks to are emulated locally:
+ *
+ * - SEND is a memcpy of imm_message_metadata plus payload into the ring
+ *   of the target node, at the offset carved by fit_reserve_remote_ring().
+ *   This is exactly where RDMA-WRITE-IMM would have put the data.
+ * - REPLY is a memcpy into the reply buffer recorded in the metadata.
+ * - Both post a work completion carrying the same imm_data as IB does.
+ *   The loopback polling thread decodes it the same way fit_poll_recv_cq()
+ *   does, and releases the reply indicator of the waiting sender.
+ *
+ * At memory component, incoming requests are fed into the thpool, so real
+ * handlers run. At other components, requests go to the per-port queues
+ * used by ibapi_receive_message(), except P2M_TEST which is answered
+ * here so that rpc_profile.c can measure the RPC path without any NIC.
+ */
+
+#include <lego/sched.h>
+#include <lego/init.h>
+#include <lego/mm.h>
+#include <lego/net.h>
+#include <lego/kthread.h>
+#include <lego/list.h>
+#include <lego/string.h>
+#include <lego/jiffies.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <lego/profile.h>
+#include <rdma/ib_verbs.h>
+
+#include <processor/pcache.h>
+#include <memory/thread_pool.h>
+
+#include "fit_internal.h"
+
+#define FIT_LB_CQ_DEPTH		(RECV_DEPTH * 4)
+
+extern unsigned long	nr_recvcq_cqes[NUM_POLLING_THREADS];
+
+struct fit_lb_wc {
+	int		node_id;
+	uint32_t	imm_data;
+	uint32_t	byte_len;
+};
+
+/*
+ * The emulated recv_cq.
+ * Producers are senders and repliers, the only consumer is
+ * the loopback polling thread.
+ */
+struct fit_lb_cq {
+	spinlock_t		lock;
+	unsigned int		head;
+	unsigned int		tail;
+	struct fit_lb_wc	wc[FIT_LB_CQ_DEPTH];
+} ____cacheline_aligned;
+
+static struct fit_lb_cq lb_recv_cq;
+
+static void fit_lb_post_wc(int node_id, uint32_t imm_data, uint32_t byte_len)
+{
+	struct fit_lb_cq *cq = &lb_recv_cq;
+	struct fit_lb_wc *wc;
+
+retry:
+	spin_lock(&cq->lock);
+	if (unlikely(cq->tail - cq->head >= FIT_LB_CQ_DEPTH)) {
+		spin_unlock(&cq->lock);
+		cpu_relax();
+		goto retry;
+	}
+
+	wc = &cq->wc[cq->tail % FIT_LB_CQ_DEPTH];
+	wc->node_id = node_id;
+	wc->imm_data = imm_data;
+	wc->byte_len = byte_len;
+	cq->tail++;
+	spin_unlock(&cq->lock);
+
+	fit_recvcq_notify(0);
+}
+
+static int fit_lb_poll_cq(struct fit_lb_wc *wc, int nr)
+{
+	struct fit_lb_cq *cq = &lb_recv_cq;
+	int ne = 0;
+
+	if (cq->head == READ_ONCE(cq->tail))
+		return 0;
+
+	spin_lock(&cq->lock);
+	while (ne < nr && cq->head != cq->tail) {
+		wc[ne++] = cq->wc[cq->head % FIT_LB_CQ_DEPTH];
+		cq->head++;
+	}
+	spin_unlock(&cq->lock);
+
+	return ne;
+}
+
+/* The loopback version of sending IMM_ACK back to sender */
+static inline void fit_lb_ack(ppc *ctx, int node_id, int offset)
+{
+	if (fit_update_local_last_ack(ctx, node_id, offset))
+		fit_lb_post_wc(node_id, IMM_ACK | offset, 0);
+}
+
+/*
+ * Write the reply into the buffer described by @desc, then notify
+ * the sender with @imm_data, just like RDMA-WRITE-IMM does.
+ */
+static void fit_lb_write_reply(ppc *ctx, struct imm_message_metadata *desc,
+			       void *addr, int size, uint32_t imm_data)
+{
+	memcpy((void *)desc->reply_addr, addr, size);
+	fit_lb_post_wc(ctx->node_id, imm_data, size);
+}
+
+#ifdef CONFIG_COMP_MEMORY
+/*
+ * Callback for thread pool
+ * Loopback counterpart of fit_ack_reply_callback() over IB.
+ */
+void fit_ack_reply_callback(struct thpool_buffer *b)
+{
+	ppc *ctx = b->fit_ctx;
+	struct imm_message_metadata *request_metadata = b->fit_imm;
+	void *reply_data;
+	int ack_flag;
+
+	if (ThpoolBufferPrivateTX(b))
+		reply_data = b->private_tx;
+	else
+		reply_data = b->tx;
+
+	ack_flag = fit_update_local_last_ack(ctx, b->fit_node_id, b->fit_offset);
+
+	/* Comes from ibapi_send() */
+	if (ThpoolBufferNoreply(b)) {
+		if (ack_flag)
+			fit_lb_post_wc(b->fit_node_id, IMM_ACK | b->fit_offset, 0);
+		return;
+	}
+
+	/* Piggyback the ACK on reply */
+	fit_lb_write_reply(ctx, request_metadata, reply_data, b->tx_size,
+			   request_metadata->reply_indicator_index | IMM_SEND_REPLY_RECV |
+			   (ack_flag ? IMM_REPLY_ACK : 0));
+}
+
+static void fit_lb_handle_request(ppc *ctx, int node_id, int port, int offset)
+{
+	struct imm_message_metadata *tmp;
+
+	tmp = ctx->local_rdma_recv_rings[node_id] + offset;
+	thpool_callback(ctx, tmp, (void *)tmp + sizeof(*tmp),
+			tmp->size, node_id, offset);
+}
+#else
+static char lb_test_reply[PAGE_SIZE * 4];
+
+/*
+ * There is no thpool at this component. Answer P2M_TEST here so that
+ * rpc_profile.c works against any emulated node. Everything else is
+ * queued to the port, same as fit_poll_recv_cq().
+ */
+static void fit_lb_handle_request(ppc *ctx, int node_id, int port, int offset)
+{
+	struct imm_message_metadata *tmp;
+	struct imm_header_from_cq_to_port *new_request;
+	struct p2m_test_msg *msg;
+
+	tmp = ctx->local_rdma_recv_rings[node_id] + offset;
+	msg = (void *)tmp + sizeof(*tmp);
+
+	if (msg->header.opcode == P2M_TEST ||
+	    msg->header.opcode == P2M_TEST_NOREPLY) {
+		int reply_len = min_t(int, msg->reply_len, sizeof(lb_test_reply));
+
+		fit_lb_ack(ctx, node_id, offset);
+		if (tmp->reply_indicator_index == -1)
+			return;
+		fit_lb_write_reply(ctx, tmp, lb_test_reply, reply_len,
+				   tmp->reply_indicator_index | IMM_SEND_REPLY_RECV);
+		return;
+	}
+
+	new_request = kmalloc(sizeof(*new_request), GFP_KERNEL);
+	if (!new_request) {
+		WARN_ON_ONCE(1);
+		return;
+	}
+	new_request->source_node_id = node_id;
+	new_request->offset = offset;
+
+	spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
+	list_add_tail(&new_request->list, &ctx->imm_waitqueue_perport[port].list);
+	spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
+}
+#endif /* CONFIG_COMP_MEMORY */
+
+/*
+ * Loopback counterpart of fit_poll_recv_cq().
+ * Pinned to a core and keep running.
+ */
+static int fit_lb_poll_recv_cq(void *_ctx)
+{
+	ppc *ctx = _ctx;
+	struct fit_lb_wc wc[NUM_PARALLEL_CONNECTION];
+	int ne, i, node_id, offset, port;
+	int reply_indicator_index, reply_data;
+	unsigned long idle_start_ns = 0;
+	void *dst_ptr;
+
+	if (pin_current_thread())
+		panic("Fail to pin loopback poll_cq");
+
+	while (1) {
+		ne = fit_lb_poll_cq(wc, NUM_PARALLEL_CONNECTION);
+		if (!ne) {
+#ifdef CONFIG_FIT_ADAPTIVE_POLL
+			fit_recvcq_idle(0, NULL, &idle_start_ns);
+#else
+			cpu_relax();
+#endif
+			continue;
+		}
+		fit_recvcq_busy(0, &idle_start_ns);
+
+		/* Update stats */
+		nr_recvcq_cqes[0] += ne;
+
+		for (i = 0; i < ne; i++) {
+			node_id = wc[i].node_id;
+
+			if (wc[i].imm_data & IMM_SEND_REPLY_SEND) {
+				offset = wc[i].imm_data & IMM_GET_OFFSET;
+				port = IMM_GET_PORT_NUMBER(wc[i].imm_data);
+				fit_lb_handle_request(ctx, node_id, port, offset);
+			} else if (wc[i].imm_data & IMM_SEND_REPLY_RECV) {
+				reply_indicator_index = wc[i].imm_data & IMM_GET_REPLY_INDICATOR_INDEX;
+				reply_data = wc[i].byte_len;
+
+				if (wc[i].imm_data & IMM_REPLY_ACK)
+					fit_remote_ring_ack(ctx, node_id,
+						ctx->reply_ack_offsets[reply_indicator_index]);
+
+				dst_ptr = get_reply_ready_ptr(ctx, reply_indicator_index);
+				memcpy(dst_ptr, &reply_data, sizeof(int));
+			} else if (wc[i].imm_data & IMM_ACK) {
+				offset = wc[i].imm_data & IMM_GET_OFFSET;
+				fit_remote_ring_ack(ctx, node_id, offset);
+			} else if (wc[i].imm_data & IMM_REPLY_W_EXTRA_BITS) {
+				reply_indicator_index = wc[i].imm_data & IMM_GET_REPLY_INDICATOR_INDEX;
+				reply_data = wc[i].byte_len << REPLY_PRIVATE_BITS_CNT |
+					     IMM_GET_PRIVATE_BITS(wc[i].imm_data);
+
+				dst_ptr = get_reply_ready_ptr(ctx, reply_indicator_index);
+				memcpy(dst_ptr, &reply_data, sizeof(int));
+			} else {
+				fit_err("Unknown imm_data: %#x", wc[i].imm_data);
+				WARN_ON_ONCE(1);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill the metadata and payload into the ring of @target_node,
+ * then post the completion to the polling thread.
+ */
+static void fit_lb_send(ppc *ctx, int target_node, void *addr, int size,
+			struct imm_message_metadata *msg_header)
+{
+	struct imm_message_metadata *dst;
+	int tar_offset_start, real_size;
+
+	real_size = size + sizeof(struct imm_message_metadata);
+	/* No QP here, spread sub-rings by CPU */
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node,
+						   smp_processor_id(), real_size);
+	fit_set_reply_ack_offset(ctx, msg_header->reply_indicator_index, tar_offset_start);
+
+	dst = ctx->local_rdma_recv_rings[target_node] + tar_offset_start;
+	memcpy(dst, msg_header, sizeof(*dst));
+	memcpy((void *)dst + sizeof(*dst), addr, size);
+
+	fit_lb_post_wc(target_node, IMM_SEND_REPLY_SEND | tar_offset_start, real_size);
+}
+
+/*
+ * Loopback version of fit_send_reply_with_rdma_write_with_imm().
+ * If @ret_private_bits is not NULL, the reply is expected to carry
+ * private bits, see fit_reply_message_w_extra_bits().
+ */
+int fit_loopback_send_reply(ppc *ctx, int target_node, void *addr, int size,
+			    void *ret_addr, int max_ret_size, int *ret_private_bits,
+			    int if_use_ret_phys_addr, unsigned long timeout_sec,
+			    void *caller)
+{
+	struct imm_message_metadata msg_header;
+	int reply_indicator_index;
+	unsigned long start_time;
+	int reply_length;
+	int local_reply_ready_checker = SEND_REPLY_WAIT;
+
+	if (unlikely(!addr)) {
+		fit_err("BUG: NULL addr. Caller: %pS", caller);
+		return -EINVAL;
+	}
+
+	if (unlikely(size + sizeof(struct imm_message_metadata) > IMM_MAX_SIZE)) {
+		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
+		return -EINVAL;
+	}
+
+	reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &local_reply_ready_checker);
+
+	/* There is no DMA involved, record the kernel virtual address */
+	if (if_use_ret_phys_addr == 1)
+		msg_header.reply_addr = (uintptr_t)phys_to_virt((unsigned long)ret_addr);
+	else
+		msg_header.reply_addr = (uintptr_t)ret_addr;
+
+	msg_header.reply_rkey = 0;
+	msg_header.reply_indicator_index = reply_indicator_index;
+	msg_header.source_node_id = ctx->node_id;
+	msg_header.size = size;
+
+	fit_lb_send(ctx, target_node, addr, size, &msg_header);
+
+	if (timeout_sec == 0 || timeout_sec > FIT_MAX_TIMEOUT_SEC)
+		timeout_sec = FIT_MAX_TIMEOUT_SEC;
+
+	start_time = jiffies;
+	while (local_reply_ready_checker == SEND_REPLY_WAIT) {
+		cpu_relax();
+		if (unlikely(time_after(jiffies, start_time + timeout_sec * HZ))) {
+			pr_warn("ibapi_send_reply() CPU:%d PID:%d loopback timeout (%u ms), caller: %pS\n",
+				smp_processor_id(), current->pid,
+				jiffies_to_msecs(jiffies - start_time), caller);
+			return -ETIMEDOUT;
+		}
+	}
+	free_reply_indicator(ctx, reply_indicator_index);
+
+	if (ret_private_bits) {
+		reply_length = local_reply_ready_checker >> REPLY_PRIVATE_BITS_CNT;
+		*ret_private_bits = local_reply_ready_checker & 0xff;
+	} else
+		reply_length = local_reply_ready_checker;
+
+	return reply_length;
+}
+
+/* Loopback version of fit_send_with_rdma_write_with_imm() */
+int fit_loopback_send(ppc *ctx, int target_node, void *addr, int size)
+{
+	struct imm_message_metadata msg_header;
+
+	BUG_ON(!addr);
+
+	if (unlikely(size + sizeof(struct imm_message_metadata) > IMM_MAX_SIZE)) {
+		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
+		return -EINVAL;
+	}
+
+	msg_header.reply_addr = 0;
+	msg_header.reply_rkey = 0;
+	msg_header.reply_indicator_index = -1;
+	msg_header.source_node_id = ctx->node_id;
+	msg_header.size = size;
+
+	fit_lb_send(ctx, target_node, addr, size, &msg_header);
+	return 0;
+}
+
+int fit_loopback_multicast_send_reply(ppc *ctx, int num_nodes, int *target_node,
+				      struct fit_sglist *sglist, struct fit_sglist *output_msg,
+				      int max_ret_size, int if_use_ret_phys_addr,
+				      unsigned long timeout_sec, void *caller)
+{
+	int i, ret = 0;
+
+	if (!sglist || !target_node || !output_msg || !num_nodes)
+		return -EINVAL;
+
+	for (i = 0; i < num_nodes; i++) {
+		output_msg[i].len = fit_loopback_send_reply(ctx, target_node[i],
+				sglist[i].addr, sglist[i].len, output_msg[i].addr,
+				max_ret_size, NULL, if_use_ret_phys_addr,
+				timeout_sec, caller);
+		if (output_msg[i].len >= 0)
+			ret++;
+	}
+	return ret;
+}
+
+/*
+ * Loopback version of fit_receive_message().
+ * If @reply_descriptor is NULL, this behaves as fit_receive_message_no_reply().
+ */
+int fit_loopback_receive_message(ppc *ctx, unsigned int port, void *ret_addr,
+				 int receive_size, uintptr_t *reply_descriptor)
+{
+	struct imm_message_metadata *tmp, *descriptor;
+	struct imm_header_from_cq_to_port *new_request;
+	int get_size, offset, node_id;
+
+	while (1) {
+		spin_lock(&ctx->imm_waitqueue_perport_lock[port]);
+		if (likely(!list_empty(&ctx->imm_waitqueue_perport[port].list))) {
+			new_request = list_entry(ctx->imm_waitqueue_perport[port].list.next,
+						 struct imm_header_from_cq_to_port, list);
+			list_del(&new_request->list);
+			spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
+			break;
+		}
+		spin_unlock(&ctx->imm_waitqueue_perport_lock[port]);
+		cpu_relax();
+	}
+
+	offset = new_request->offset;
+	node_id = new_request->source_node_id;
+	kfree(new_request);
+
+	tmp = ctx->local_rdma_recv_rings[node_id] + offset;
+	get_size = tmp->size;
+	if (get_size > receive_size)
+		return SEND_REPLY_SIZE_TOO_BIG;
+
+	memcpy(ret_addr, (void *)tmp + sizeof(*tmp), get_size);
+
+	if (reply_descriptor) {
+		descriptor = kmalloc(sizeof(*descriptor), GFP_KERNEL);
+		BUG_ON(!descriptor);
+		memcpy(descriptor, tmp, sizeof(*descriptor));
+		*reply_descriptor = (uintptr_t)descriptor;
+	}
+
+	fit_lb_ack(ctx, node_id, offset);
+	return get_size;
+}
+
+/*
+ * Loopback version of fit_reply_message(), and fit_reply_message_w_extra_bits()
+ * if @private_bits is not negative.
+ */
+int fit_loopback_reply_message(ppc *ctx, void *addr, int size, int private_bits,
+			       uintptr_t descriptor)
+{
+	struct imm_message_metadata *tmp = (struct imm_message_metadata *)descriptor;
+	uint32_t imm_data;
+
+	if (private_bits < 0)
+		imm_data = tmp->reply_indicator_index | IMM_SEND_REPLY_RECV;
+	else
+		imm_data = tmp->reply_indicator_index |
+			   IMM_SET_PRIVATE_BITS(private_bits) | IMM_REPLY_W_EXTRA_BITS;
+
+	fit_lb_write_reply(ctx, tmp, addr, size, imm_data);
+	kfree(tmp);
+	return 0;
+}
+
+ppc *fit_loopback_establish_conn(int mynodeid)
+{
+	ppc *ctx;
+	int i;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+
+	ctx->node_id = mynodeid;
+	ctx->num_node = MAX_NODE;
+	atomic_set(&ctx->num_alive_nodes, MAX_NODE);
+	spin_lock_init(&ctx->indicators_lock);
+
+	for (i = 0; i < IMM_MAX_PORT; i++) {
+		spin_lock_init(&ctx->imm_waitqueue_perport_lock[i]);
+		INIT_LIST_HEAD(&ctx->imm_waitqueue_perport[i].list);
+	}
+
+	/*
+	 * Each emulated node has one ring. It serves as both
+	 * the remote ring of sender and local ring of receiver.
+	 */
+	ctx->local_rdma_recv_rings = kmalloc(MAX_NODE * sizeof(void *), GFP_KERNEL);
+	ctx->remote_rdma_ring_mrs_offset = kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
+	ctx->remote_last_ack_index = kzalloc(MAX_NODE * sizeof(int), GFP_KERNEL);
+	ctx->local_last_ack_index = kzalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(int), GFP_KERNEL);
+	ctx->local_last_ack_index_lock = kmalloc(MAX_NODE * FIT_NR_SUBRINGS * sizeof(spinlock_t), GFP_KERNEL);
+	ctx->remote_imm_offset_lock = kmalloc(MAX_NODE * sizeof(spinlock_t), GFP_KERNEL);
+	if (!ctx->local_rdma_recv_rings || !ctx->remote_rdma_ring_mrs_offset ||
+	    !ctx->remote_last_ack_index || !ctx->local_last_ack_index ||
+	    !ctx->local_last_ack_index_lock || !ctx->remote_imm_offset_lock)
+		return NULL;
+
+	for (i = 0; i < MAX_NODE; i++) {
+		ctx->local_rdma_recv_rings[i] = fit_alloc_memory_for_mr(IMM_PORT_CACHE_SIZE);
+		if (!ctx->local_rdma_recv_rings[i])
+			return NULL;
+		spin_lock_init(&ctx->remote_imm_offset_lock[i]);
+	}
+	for (i = 0; i < MAX_NODE * FIT_NR_SUBRINGS; i++)
+		spin_lock_init(&ctx->local_last_ack_index_lock[i]);
+	fit_remote_rings_init(ctx);
+
+	spin_lock_init(&lb_recv_cq.lock);
+	fit_recvcq_poll_init(0);
+	lb_recv_cq.head = 0;
+	lb_recv_cq.tail = 0;
+
+	if (IS_ERR(kthread_run(fit_lb_poll_recv_cq, ctx, "FIT_LoopbackCQ")))
+		return NULL;
+
+	return ctx;
+}
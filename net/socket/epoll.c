@@ -18,6 +18,7 @@
 #include <lego/syscalls.h>
 #include <lego/socket.h>
 #include <lego/atomic.h>
+#include <lego/llist.h>
 #include <processor/processor.h>
 #include <lego/net.h>
 #include <lego/fit_ibapi.h>
@@ -40,8 +41,6 @@ static inline void epoll_debug(const char *fmt, ...) { }
 
 #define EP_MAX_EVENTS (INT_MAX / sizeof(struct epoll_event))
 
-#define EP_UNACTIVE_PTR ((void *) -1L)
-
 /* Epoll private bits inside the event mask */
 #define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET)
 
@@ -66,11 +65,11 @@ struct epitem {
 	/* List header used to link this structure to the lego_eventpoll ready list */
 	struct list_head rdllink;
 
-	/*
-	 * Works together "struct lego_eventpoll"->ovflist in keeping the
-	 * single linked chain of items.
-	 */
-	struct epitem *next;
+	/* Node of the lock-less "rdlq" of the lego_eventpoll */
+	struct llist_node rdlnode;
+
+	/* EPI_QUEUED, EPI_DEAD */
+	unsigned long flags;
 
 	/* The file descriptor information this item refers to */
 	struct epoll_filefd ffd;
@@ -91,15 +90,16 @@ struct epitem {
 	struct epoll_event event;
 };
 
+/* epitem->flags */
+#define EPI_QUEUED	0	/* on ep->rdlq */
+#define EPI_DEAD	1	/* removed while on ep->rdlq, freed when drained */
+
 /*
  * This structure is stored inside the "private_data" member of the file
  * structure and represents the main data structure for the lego_eventpoll
  * interface.
  */
 struct lego_eventpoll {
-	/* Protect the access to this structure */
-	spinlock_t lock;
-
 	/*
 	 * This mutex is used to ensure that files are not removed
 	 * while epoll is using them. This is held during the event
@@ -114,19 +114,19 @@ struct lego_eventpoll {
 	/* Wait queue used by file->poll() */
 //	wait_queue_head_t poll_wait;
 
-	/* List of ready file descriptors */
+	/*
+	 * Items reported by ep_poll_callback(). It is fed by the FIT polling
+	 * thread without taking any lock, and taken as a whole by
+	 * epoll_wait(), which moves them to rdllist.
+	 */
+	struct llist_head rdlq;
+
+	/* List of ready file descriptors, protected by "mtx" */
 	struct list_head rdllist;
 
 	/* RB tree root used to store monitored fd structs */
 	struct rb_root rbr;
 
-	/*
-	 * This is a single linked list that chains all the "struct epitem" that
-	 * happened while transferring ready events to userspace w/out
-	 * holding ->lock.
-	 */
-	struct epitem *ovflist;
-
 	struct file *file;
 
 	/* used to optimize loop detection check */
@@ -211,14 +211,29 @@ static void ep_rbtree_insert(struct lego_eventpoll *ep, struct epitem *epi)
 	rb_insert_color(&epi->rbn, &ep->rbr);
 }
 
+/*
+ * Queue @epi to be reported by the next epoll_wait(), and wake up a waiter.
+ * It can be called concurrently, an item is only queued once until drained.
+ */
+static void ep_queue(struct lego_eventpoll *ep, struct epitem *epi)
+{
+	if (test_and_set_bit(EPI_QUEUED, &epi->flags))
+		return;
+
+	llist_add(&epi->rdlnode, &ep->rdlq);
+
+	/* Pairs with set_current_state() in ep_poll() */
+	smp_mb__after_atomic();
+	if (waitqueue_active(&ep->wq))
+		wake_up(&ep->wq);
+}
+
 /*
  * Must be called with "mtx" held.
  */
 static int ep_insert(struct lego_eventpoll *ep, struct epoll_event *event,
 		     struct file *tfile, int fd)
 {
-	int error = 0, revents, pwake = 0;
-	unsigned long flags;
 	struct epitem *epi;
 
 	//if (!(epi = kmem_cache_alloc(epi_cache, GFP_KERNEL)))
@@ -230,17 +245,11 @@ static int ep_insert(struct lego_eventpoll *ep, struct epoll_event *event,
 	/* Item initialization follow here ... */
 	INIT_LIST_HEAD(&epi->rdllink);
 	INIT_LIST_HEAD(&epi->fllink);
+	epi->flags = 0;
 	epi->ep = ep;
 	ep_set_ffd(&epi->ffd, tfile, fd);
 	epi->event = *event;
 	epi->nwait = 0;
-	epi->next = EP_UNACTIVE_PTR;
-
-	/* Add the current item to the list of active epoll hook for this file */
-	/* XXX add lock back if seeing multithreaded epoll */
-	//spin_lock(&tfile->f_lock);
-	list_add_tail(&epi->fllink, &tfile->f_epi_links);
-	//spin_unlock(&tfile->f_lock);
 
 	/*
 	 * Add the current item to the RB tree. All RB tree operations are
@@ -248,51 +257,69 @@ static int ep_insert(struct lego_eventpoll *ep, struct epoll_event *event,
 	 */
 	ep_rbtree_insert(ep, epi);
 
-	/* We have to drop the new item inside our item list to keep track of it */
-	spin_lock_irqsave(&ep->lock, flags);
+	/* Add the current item to the list of active epoll hook for this file */
+	spin_lock(&tfile->f_ep_lock);
+	list_add_tail(&epi->fllink, &tfile->f_epi_links);
+	spin_unlock(&tfile->f_ep_lock);
 
 	/* If the file is already "ready" we drop it inside the ready list */
-	revents = tfile->ready_state;
-	if ((revents & event->events) && !ep_is_linked(&epi->rdllink)) {
-		list_add_tail(&epi->rdllink, &ep->rdllist);
-
-		/* Notify waiting tasks that events are available */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
-	}
-
-	spin_unlock_irqrestore(&ep->lock, flags);
-
-	/* We have to call this outside the lock */
-	//if (pwake)
-	//	ep_poll_safewake(&ep->poll_wait);
+	if (tfile->ready_state & event->events)
+		ep_queue(ep, epi);
 
 	return 0;
+}
 
-error_remove_epi:
-	rb_erase(&epi->rbn, &ep->rbr);
+/*
+ * Removes a "struct epitem" from the lego_eventpoll RB tree and deallocates
+ * all the associated resources. Must be called with "mtx" held.
+ */
+static int ep_remove(struct lego_eventpoll *ep, struct epitem *epi)
+{
+	struct file *file = epi->ffd.file;
 
-error_unregister:
-//	ep_unregister_pollwait(ep, epi);
+	/* No ep_poll_callback() can see it after this */
+	spin_lock(&file->f_ep_lock);
+	list_del(&epi->fllink);
+	spin_unlock(&file->f_ep_lock);
 
-	/*
-	 * We need to do this because an event could have been arrived on some
-	 * allocated wait queue. Note that we don't care about the ep->ovflist
-	 * list, since that is used/cleaned only inside a section bound by "mtx".
-	 * And ep_insert() is called with "mtx" held.
-	 */
-	spin_lock_irqsave(&ep->lock, flags);
+	rb_erase(&epi->rbn, &ep->rbr);
 	if (ep_is_linked(&epi->rdllink))
 		list_del_init(&epi->rdllink);
-	spin_unlock_irqrestore(&ep->lock, flags);
 
-//	wakeup_source_unregister(ep_wakeup_source(epi));
+	/*
+	 * Nothing can be unlinked from the middle of ep->rdlq,
+	 * an item still there is freed by the next ep_drain_queue().
+	 */
+	if (test_and_set_bit(EPI_QUEUED, &epi->flags)) {
+		set_bit(EPI_DEAD, &epi->flags);
+		return 0;
+	}
 
-error_create_wakeup_source:
 	//kmem_cache_free(epi_cache, epi);
 	kfree(epi);
+	return 0;
+}
 
-	return error;
+/*
+ * Modify the interest event mask by dropping an event if the new mask
+ * has a match in the current file status. Must be called with "mtx" held.
+ */
+static int ep_modify(struct lego_eventpoll *ep, struct epitem *epi,
+		     struct epoll_event *event)
+{
+	epi->event.data = event->data;
+	epi->event.events = event->events;
+
+	/*
+	 * Pairs with the lock taken by lego_epoll_callback() after
+	 * ready_state is set: either it sees the new mask, or we
+	 * see the new state.
+	 */
+	smp_mb();
+	if (epi->ffd.file->ready_state & event->events)
+		ep_queue(ep, epi);
+
+	return 0;
 }
 
 /*
@@ -329,171 +356,90 @@ static inline unsigned int ep_item_poll(struct epitem *epi)
 	return epi->ffd.file->f_op->poll(epi->ffd.file) & epi->event.events;
 }
 
-/**
- * ep_scan_ready_list - Scans the ready list in a way that makes possible for
- *                      the scan code, to call f_op->poll(). Also allows for
- *                      O(NumReady) performance.
- *
- * @ep: Pointer to the epoll private data structure.
- * @sproc: Pointer to the scan callback.
- * @priv: Private opaque data passed to the @sproc callback.
- * @depth: The current depth of recursive f_op->poll calls.
- *
- * Returns: The same integer error code returned by the @sproc callback.
+/*
+ * Move the items queued by ep_poll_callback() to the ready list, in the
+ * order they were queued. Must be called with "mtx" held.
  */
-static int ep_scan_ready_list(struct lego_eventpoll *ep,
-			      int (*sproc)(struct lego_eventpoll *,
-					   struct list_head *, void *),
-			      void *priv,
-			      int depth)
+static void ep_drain_queue(struct lego_eventpoll *ep)
 {
-	int error, pwake = 0;
-	unsigned long flags;
-	struct epitem *epi, *nepi;
-	LIST_HEAD(txlist);
+	struct llist_node *node;
+	struct epitem *epi, *n;
 
-	epoll_debug("%s\n", __func__);
-
-	/*
-	 * We need to lock this because we could be hit by
-	 * eventpoll_release_file() and epoll_ctl().
-	 */
-	mutex_lock(&ep->mtx);
-
-	/*
-	 * Steal the ready list, and re-init the original one to the
-	 * empty list. Also, set ep->ovflist to NULL so that events
-	 * happening while looping w/out locks, are not lost. We cannot
-	 * have the poll callback to queue directly on ep->rdllist,
-	 * because we want the "sproc" callback to be able to do it
-	 * in a lockless way.
-	 */
-	spin_lock_irqsave(&ep->lock, flags);
-	list_splice_init(&ep->rdllist, &txlist);
-	ep->ovflist = NULL;
-	spin_unlock_irqrestore(&ep->lock, flags);
-
-	/*
-	 * Now call the callback function.
-	 */
-	error = (*sproc)(ep, &txlist, priv);
+	node = llist_del_all(&ep->rdlq);
+	if (!node)
+		return;
+	node = llist_reverse_order(node);
 
-	spin_lock_irqsave(&ep->lock, flags);
-	/*
-	 * During the time we spent inside the "sproc" callback, some
-	 * other events might have been queued by the poll callback.
-	 * We re-insert them inside the main ready-list here.
-	 */
-	for (nepi = ep->ovflist; (epi = nepi) != NULL;
-	     nepi = epi->next, epi->next = EP_UNACTIVE_PTR) {
-		/*
-		 * We need to check if the item is already in the list.
-		 * During the "sproc" callback execution time, items are
-		 * queued into ->ovflist but the "txlist" might already
-		 * contain them, and the list_splice() below takes care of them.
-		 */
-		if (!ep_is_linked(&epi->rdllink)) {
-			list_add_tail(&epi->rdllink, &ep->rdllist);
+	llist_for_each_entry_safe(epi, n, node, rdlnode) {
+		if (test_bit(EPI_DEAD, &epi->flags)) {
+			kfree(epi);
+			continue;
 		}
-	}
-	/*
-	 * We need to set back ep->ovflist to EP_UNACTIVE_PTR, so that after
-	 * releasing the lock, events will be queued in the normal way inside
-	 * ep->rdllist.
-	 */
-	ep->ovflist = EP_UNACTIVE_PTR;
 
-	/*
-	 * Quickly re-inject items left on "txlist".
-	 */
-	list_splice(&txlist, &ep->rdllist);
-
-	if (!list_empty(&ep->rdllist)) {
-		/*
-		 * Wake up (if active) both the lego_eventpoll wait list and
-		 * the ->poll() wait list (delayed after we release the lock).
-		 */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
+		/* From now on it can be queued again */
+		clear_bit(EPI_QUEUED, &epi->flags);
+		if (!ep_is_linked(&epi->rdllink))
+			list_add_tail(&epi->rdllink, &ep->rdllist);
 	}
-	spin_unlock_irqrestore(&ep->lock, flags);
-
-	mutex_unlock(&ep->mtx);
-
-	return error;
 }
 
-static int ep_send_events_proc(struct lego_eventpoll *ep, struct list_head *head,
-			       void *priv)
+/*
+ * Deliver up to @maxevents ready events to userspace in one go.
+ * Only items on the ready list are looked at, never the whole set.
+ */
+static int ep_send_events(struct lego_eventpoll *ep,
+			  struct epoll_event __user *events, int maxevents)
 {
-	struct ep_send_events_data *esed = priv;
-	int eventcnt;
+	int eventcnt = 0;
 	unsigned int revents;
 	struct epitem *epi;
-	struct epoll_event __user *uevent;
+	LIST_HEAD(ltlist);
 
 	epoll_debug("%s\n", __func__);
 
 	/*
-	 * We can loop without lock because we are passed a task private list.
-	 * Items cannot vanish during the loop because ep_scan_ready_list() is
-	 * holding "mtx" during this call.
+	 * We need to lock this because we could be hit by
+	 * eventpoll_release_file() and epoll_ctl().
 	 */
-	for (eventcnt = 0, uevent = esed->events;
-	     !list_empty(head) && eventcnt < esed->maxevents;) {
-		epi = list_first_entry(head, struct epitem, rdllink);
+	mutex_lock(&ep->mtx);
+	ep_drain_queue(ep);
+
+	while (!list_empty(&ep->rdllist) && eventcnt < maxevents) {
+		epi = list_first_entry(&ep->rdllist, struct epitem, rdllink);
 
 		list_del_init(&epi->rdllink);
 		epoll_debug("%s: got ready epi %p\n", __func__, epi);
 
 		revents = ep_item_poll(epi);
+		if (!revents)
+			continue;
 
-		/*
-		 * If the event mask intersect the caller-requested one,
-		 * deliver the event to userspace. Again, ep_scan_ready_list()
-		 * is holding "mtx", so no operations coming from userspace
-		 * can change the item.
-		 */
-		if (revents) {
-			if (__put_user(revents, &uevent->events) ||
-			    __put_user(epi->event.data, &uevent->data)) {
-				list_add(&epi->rdllink, head);
-				return eventcnt ? eventcnt : -EFAULT;
-			}
-			eventcnt++;
-			uevent++;
-			if (epi->event.events & EPOLLONESHOT)
-				epi->event.events &= EP_PRIVATE_BITS;
-			else if (!(epi->event.events & EPOLLET)) {
-				/*
-				 * If this file has been added with Level
-				 * Trigger mode, we need to insert back inside
-				 * the ready list, so that the next call to
-				 * epoll_wait() will check again the events
-				 * availability. At this point, no one can insert
-				 * into ep->rdllist besides us. The epoll_ctl()
-				 * callers are locked out by
-				 * ep_scan_ready_list() holding "mtx" and the
-				 * poll callback will queue them in ep->ovflist.
-				 */
-				epoll_debug("%s: EPOLLET mode inserting ready epi back %p\n", __func__, epi);
-				list_add_tail(&epi->rdllink, &ep->rdllist);
-			}
+		if (__put_user(revents, &events[eventcnt].events) ||
+		    __put_user(epi->event.data, &events[eventcnt].data)) {
+			list_add(&epi->rdllink, &ep->rdllist);
+			if (!eventcnt)
+				eventcnt = -EFAULT;
+			break;
 		}
-	}
-
-	return eventcnt;
-}
+		eventcnt++;
 
-static int ep_send_events(struct lego_eventpoll *ep,
-			  struct epoll_event __user *events, int maxevents)
-{
-	struct ep_send_events_data esed;
+		if (epi->event.events & EPOLLONESHOT)
+			epi->event.events &= EP_PRIVATE_BITS;
+		else if (!(epi->event.events & EPOLLET)) {
+			/*
+			 * If this file has been added with Level Trigger
+			 * mode, we need to insert back inside the ready
+			 * list, so that the next call to epoll_wait() will
+			 * check again the events availability.
+			 */
+			list_add_tail(&epi->rdllink, &ltlist);
+		}
+	}
+	list_splice_tail(&ltlist, &ep->rdllist);
 
-	esed.maxevents = maxevents;
-	esed.events = events;
+	mutex_unlock(&ep->mtx);
 
-	return ep_scan_ready_list(ep, ep_send_events_proc, &esed, 0);
+	return eventcnt;
 }
 
 /**
@@ -506,7 +452,7 @@ static int ep_send_events(struct lego_eventpoll *ep,
  */
 static inline int ep_events_available(struct lego_eventpoll *ep)
 {
-	return !list_empty(&ep->rdllist) || ep->ovflist != EP_UNACTIVE_PTR;
+	return !llist_empty(&ep->rdlq) || !list_empty(&ep->rdllist);
 }
 
 /**
@@ -529,9 +475,7 @@ static inline int ep_events_available(struct lego_eventpoll *ep)
 static int ep_poll(struct lego_eventpoll *ep, struct epoll_event __user *events,
 		   int maxevents, long timeout)
 {
-	int res = 0, eavail, timed_out = 0;
-	unsigned long flags;
-	long slack = 0;
+	int res = 0, timed_out = 0;
 	wait_queue_t wait;
 	long jtimeout; 
 
@@ -543,15 +487,12 @@ static int ep_poll(struct lego_eventpoll *ep, struct epoll_event __user *events,
 		 * caller specified a non blocking operation.
 		 */
 		timed_out = 1;
-		spin_lock_irqsave(&ep->lock, flags);
 		goto check_events;
 	}
 
 	epoll_debug("%s timeout %d jiffies %d\n", __func__, timeout, jtimeout);
 
 fetch_events:
-	spin_lock_irqsave(&ep->lock, flags);
-
 	if (!ep_events_available(ep)) {
 		epoll_debug("event unavailable now\n");
 		/*
@@ -560,7 +501,7 @@ fetch_events:
 		 * ep_poll_callback() when events will become available.
 		 */
 		init_waitqueue_entry(&wait, current);
-		__add_wait_queue_exclusive(&ep->wq, &wait);
+		add_wait_queue_exclusive(&ep->wq, &wait);
 
 		for (;;) {
 			/*
@@ -576,26 +517,21 @@ fetch_events:
 				break;
 			}
 
-			spin_unlock_irqrestore(&ep->lock, flags);
 			jtimeout = schedule_timeout(jtimeout);
-			spin_lock_irqsave(&ep->lock, flags);
+			if (!jtimeout)
+				timed_out = 1;
 		}
-		__remove_wait_queue(&ep->wq, &wait);
+		remove_wait_queue(&ep->wq, &wait);
 
-		set_current_state(TASK_RUNNING);
+		__set_current_state(TASK_RUNNING);
 	}
 check_events:
-	/* Is it worth to try to dig for events ? */
-	eavail = ep_events_available(ep);
-
-	spin_unlock_irqrestore(&ep->lock, flags);
-
 	/*
 	 * Try to transfer events to user space. In case we get 0 events and
 	 * there's still timeout left over, we go trying again in search of
 	 * more luck.
 	 */
-	if (!res && eavail &&
+	if (!res && ep_events_available(ep) &&
 	    !(res = ep_send_events(ep, events, maxevents)) && !timed_out)
 		goto fetch_events;
 
@@ -605,20 +541,11 @@ check_events:
 /*
  * This is the callback that is passed to the wait queue wakeup
  * mechanism. It is called by the stored file descriptors when they
- * have events to report.
+ * have events to report. No lock of the lego_eventpoll is taken.
  */
-static int ep_poll_callback(struct epitem *epi, void *key)
+static void ep_poll_callback(struct epitem *epi, unsigned long key)
 {
-	int pwake = 0;
-	unsigned long flags;
-	struct lego_eventpoll *ep;
-
-	BUG_ON(epi == NULL);
-	ep = epi->ep;
-
-	epoll_debug("%s\n", __func__);
-
-	spin_lock_irqsave(&ep->lock, flags);
+	unsigned int events = epi->event.events;
 
 	/*
 	 * If the event mask does not contain any poll(2) event, we consider the
@@ -626,45 +553,19 @@ static int ep_poll_callback(struct epitem *epi, void *key)
 	 * EPOLLONESHOT bit that disables the descriptor when an event is received,
 	 * until the next EPOLL_CTL_MOD will be issued.
 	 */
-	if (!(epi->event.events & ~EP_PRIVATE_BITS))
-		goto out_unlock;
+	if (!(events & ~EP_PRIVATE_BITS))
+		return;
 
 	/*
 	 * Check the events coming with the callback. At this stage, not
 	 * every device reports the events in the "key" parameter of the
 	 * callback. We need to be able to handle both cases here, hence the
-	 * test for "key" != NULL before the event match test.
+	 * test for "key" != 0 before the event match test.
 	 */
-	if (key && !((unsigned long) key & epi->event.events))
-		goto out_unlock;
+	if (key && !(key & events))
+		return;
 
-	/*
-	 * If we are transferring events to userspace, we can hold no locks
-	 * (because we're accessing user memory, and because of linux f_op->poll()
-	 * semantics). All the events that happen during that period of time are
-	 * chained in ep->ovflist and requeued later on.
-	 */
-	if (unlikely(ep->ovflist != EP_UNACTIVE_PTR)) {
-		if (epi->next == EP_UNACTIVE_PTR) {
-			epi->next = ep->ovflist;
-			ep->ovflist = epi;
-		}
-		goto out_unlock;
-	}
-
-	/* If this file is already in the ready list we exit soon */
-	if (!ep_is_linked(&epi->rdllink)) {
-		list_add_tail(&epi->rdllink, &ep->rdllist);
-	}
-
-	/* Wake up ( if active ) both the eventpoll wait list */
-	if (waitqueue_active(&ep->wq))
-		wake_up_locked(&ep->wq);
-
-out_unlock:
-	spin_unlock_irqrestore(&ep->lock, flags);
-
-	return 1;
+	ep_queue(epi->ep, epi);
 }
 
 int lego_epoll_callback(struct file *f, void *key)
@@ -673,11 +574,10 @@ int lego_epoll_callback(struct file *f, void *key)
 
 	epoll_debug("%s\n", __func__);
 
-	list_for_each_entry(epi, &f->f_epi_links, fllink) {
-		if (epi == NULL)
-			continue;
-		ep_poll_callback(epi, key);
-	}
+	spin_lock(&f->f_ep_lock);
+	list_for_each_entry(epi, &f->f_epi_links, fllink)
+		ep_poll_callback(epi, (unsigned long)key);
+	spin_unlock(&f->f_ep_lock);
 
 	return 0;
 }
@@ -692,12 +592,11 @@ static int ep_alloc(struct lego_eventpoll **pep)
 	if (unlikely(!ep))
 		return error;
 
-	spin_lock_init(&ep->lock);
 	mutex_init(&ep->mtx);
 	init_waitqueue_head(&ep->wq);
+	init_llist_head(&ep->rdlq);
 	INIT_LIST_HEAD(&ep->rdllist);
 	ep->rbr = RB_ROOT;
-	ep->ovflist = EP_UNACTIVE_PTR;
 
 	*pep = ep;
 
@@ -826,8 +725,6 @@ SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd,
 		} else
 			error = -EEXIST;
 		break;
-#if 0
-// TODO, not used currently in TensorFlow
 	case EPOLL_CTL_DEL:
 		if (epi)
 			error = ep_remove(ep, epi);
@@ -841,7 +738,6 @@ SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd,
 		} else
 			error = -ENOENT;
 		break;
-#endif
 	default:
 		printk(KERN_CRIT "%s op %d not supported now\n", __func__, op);
 	}
@@ -36,75 +36,53 @@ static inline void poll_debug(const char *fmt, ...) { }
 
 struct poll_struct {
 	wait_queue_head_t wq;
-	struct list_head file_list;
+	int triggered;
 };
 
-static int poll_insert(struct poll_struct *ps, int fd, short events, short *urevent)
+/* One for each polled fd, linked to file->f_poll_links */
+struct poll_entry {
+	struct list_head	link;
+	struct poll_struct	*ps;
+	struct file		*file;
+};
+
+static void poll_insert(struct poll_struct *ps, struct poll_entry *entry,
+			struct file *file)
 {
-	int error = 0, revents, pwake = 0;
-	unsigned long flags;
-	struct file *file;
-
-	/* 
-	 * according to poll syscall description, if fd is neagative,
-	 * it will be ignored and the revents field returns zero.
-	 */
-	if (fd < 0)
-		return 0;
-
-	file = fdget(fd);
-	if (!file)
-		return -ENFILE;
-
-	poll_debug("%s: ps %p fd %d file %p\n", __func__, ps, fd, file);
-
-	/* Add the current item to the list of active epoll hook for this file */
-	/* XXX add lock back if seeing multithreaded poll */
-	//spin_lock(&tfile->f_lock);
-	list_add_tail(&ps->file_list, &file->f_poll_links);
-	//spin_unlock(&tfile->f_lock);
-
-	/* If the file is already "ready" we drop it inside the ready list */
-	revents = file->ready_state;
-	if (revents & events) {
-		*urevent = revents & events;
-		return 1;
-	}
+	poll_debug("%s: ps %p file %p\n", __func__, ps, file);
 
-	return 0;
+	entry->ps = ps;
+	entry->file = file;
+
+	spin_lock(&file->f_ep_lock);
+	list_add_tail(&entry->link, &file->f_poll_links);
+	spin_unlock(&file->f_ep_lock);
 }
 
-static int files_events_available(struct pollfd *poll_fds, int nfds)
+static void poll_remove(struct poll_entry *entry)
 {
-	struct file *file;
-	int i, res = 0;
-
-	for (i = 0; i < nfds; i++) {
-		file = fdget(poll_fds[i].fd);
-		if (!file)
-			return -ENFILE;
-		if (file->ready_state & poll_fds[i].events) {
-			res = 1;
-		}
-	}
+	struct file *file = entry->file;
 
-	return res;
+	spin_lock(&file->f_ep_lock);
+	list_del(&entry->link);
+	spin_unlock(&file->f_ep_lock);
 }
 
-static int poll_send_events(struct pollfd *poll_fds, int nfds)
+/*
+ * Fill revents from the cached files, no fd lookup.
+ * Return the number of fds that have nonzero revents.
+ */
+static int poll_send_events(struct pollfd *poll_fds, struct poll_entry *entries,
+			    int nfds)
 {
-	int i;
-	struct file *file;
-	int cnt = 0;
-
-	poll_debug("%s\n", __func__);
+	int i, cnt = 0;
 
 	for (i = 0; i < nfds; i++) {
-		file = fdget(poll_fds[i].fd);
-		if (!file)
-			return -ENFILE;
-		poll_fds[i].revents |= (poll_fds[i].events & file->ready_state);
-		if (poll_fds[i].events & file->ready_state)
+		/* Ignored or POLLNVAL ones stay as they are */
+		if (entries[i].file)
+			poll_fds[i].revents = poll_fds[i].events &
+					      entries[i].file->ready_state;
+		if (poll_fds[i].revents)
 			cnt++;
 	}
 
@@ -113,78 +91,56 @@ static int poll_send_events(struct pollfd *poll_fds, int nfds)
 
 int lego_poll_callback(struct file *f)
 {
-	struct poll_struct *entry;
+	struct poll_entry *entry;
 
-	list_for_each_entry(entry, &f->f_poll_links, file_list) {
+	spin_lock(&f->f_ep_lock);
+	list_for_each_entry(entry, &f->f_poll_links, link) {
 		poll_debug("%s entry %p file %p\n", __func__, entry, f);
-		wake_up_locked(&entry->wq);
+		entry->ps->triggered = 1;
+		wake_up(&entry->ps->wq);
 	}
+	spin_unlock(&f->f_ep_lock);
 
 	return 0;
 }
 
-static int poll_wait(struct poll_struct *ps, struct pollfd *poll_fds, int nfds, long jtimeout)
+/*
+ * Scan all fds once, then only again after being woken up
+ * by lego_poll_callback() of any of them.
+ */
+static int poll_wait(struct poll_struct *ps, struct pollfd *poll_fds,
+		     struct poll_entry *entries, int nfds, long jtimeout)
 {
-	int res = 0, eavail, timed_out = 0;
-	unsigned long flags;
-	long slack = 0;
+	int res;
 	wait_queue_t wait;
 
-	if (jtimeout == 0) {
-		/*
-		 * Avoid the unnecessary trip to the wait queue loop, if the
-		 * caller specified a non blocking operation.
-		 */
-		timed_out = 1;
-		goto check_events;
-	}
+	poll_debug("%s: nfds %d timeout %ld\n", __func__, nfds, jtimeout);
 
-	poll_debug("%s: nfds %d timeout %d\n", __func__, nfds, jtimeout);
+	init_waitqueue_entry(&wait, current);
+	add_wait_queue(&ps->wq, &wait);
 
-fetch_events:
-	/* TODO: do we need any lock here? */
-	if (!(files_events_available(poll_fds, nfds))) {
-		poll_debug("%s event unavailable now\n", __func__);
+	for (;;) {
 		/*
-		 * We don't have any available event to return to the caller.
-		 * We need to sleep here, and we will be wake up by
-		 * poll_callback() when events will become available.
+		 * We don't want to sleep if the poll_callback() sends us
+		 * a wakeup in between. That's why we set the task state
+		 * to TASK_INTERRUPTIBLE before doing the checks.
 		 */
-		init_waitqueue_entry(&wait, current);
-		__add_wait_queue_exclusive(&ps->wq, &wait);
-
-		for (;;) {
-			/*
-			 * We don't want to sleep if the poll_callback() sends us
-			 * a wakeup in between. That's why we set the task state
-			 * to TASK_INTERRUPTIBLE before doing the checks.
-			 */
-			set_current_state(TASK_INTERRUPTIBLE);
-			if (files_events_available(poll_fds, nfds) || timed_out)
-				break;
-			if (signal_pending(current)) {
-				res = -EINTR;
-				break;
-			}
-
-			jtimeout = schedule_timeout(jtimeout);
+		set_current_state(TASK_INTERRUPTIBLE);
+		ps->triggered = 0;
+		res = poll_send_events(poll_fds, entries, nfds);
+		if (res || !jtimeout)
+			break;
+		if (signal_pending(current)) {
+			res = -EINTR;
+			break;
 		}
-		__remove_wait_queue(&ps->wq, &wait);
 
-		set_current_state(TASK_RUNNING);
+		if (!READ_ONCE(ps->triggered))
+			jtimeout = schedule_timeout(jtimeout);
 	}
-check_events:
-	/* Is it worth to try to dig for events ? */
-	eavail = files_events_available(poll_fds, nfds);
-
-	/*
-	 * Try to transfer events to user space. In case we get 0 events and
-	 * there's still timeout left over, we go trying again in search of
-	 * more luck.
-	 */
-	if (!res && eavail &&
-	    !(res = poll_send_events(poll_fds, nfds)) && !timed_out)
-		goto fetch_events;
+	remove_wait_queue(&ps->wq, &wait);
+
+	__set_current_state(TASK_RUNNING);
 
 	return res;
 }
@@ -193,53 +149,75 @@ check_events:
  * The poll system call implementation
  * On success, return the number of files that have nonzero revents fields.
  * A return value of 0 indicates that the call timed out and no file descriptors were ready.
- * On error, -1 is returned.
  */
 asmlinkage long sys_poll(struct pollfd __user *ufds, unsigned int nfds,
 			long timeout_msecs)
 {
-	s64 timeout_jiffies;
-	int i, ret, result = 0;
-	struct list_head poll_list;
-	short revent;
+	long timeout_jiffies;
+	int i, result;
 	struct pollfd *poll_fds;
-	struct poll_struct *ps;
-
-	if (timeout_msecs > 0) {
-#if HZ > 1000
-		/* We can only overflow if HZ > 1000 */
-		if (timeout_msecs / 1000 > (s64)0x7fffffffffffffffULL / (s64)HZ)
-			timeout_jiffies = -1;
-		else
-#endif
-			timeout_jiffies = msecs_to_jiffies(timeout_msecs);
-	} else {
-		/* Infinite (< 0) or no (0) timeout */
-		timeout_jiffies = timeout_msecs;
+	struct poll_entry *entries;
+	struct poll_struct ps;
+
+	if (nfds > NR_OPEN_DEFAULT)
+		return -EINVAL;
+
+	if (timeout_msecs > 0)
+		timeout_jiffies = msecs_to_jiffies(timeout_msecs);
+	else if (timeout_msecs < 0)
+		timeout_jiffies = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout_jiffies = 0;
+
+	poll_fds = kmalloc(sizeof(struct pollfd) * nfds, GFP_KERNEL);
+	entries = kzalloc(sizeof(struct poll_entry) * nfds, GFP_KERNEL);
+	if (!poll_fds || !entries) {
+		result = -ENOMEM;
+		goto out_free;
 	}
 
-	poll_fds = (struct pollfd *)kmalloc(sizeof(struct pollfd) * nfds, GFP_KERNEL);
-
-	copy_from_user(poll_fds, ufds, sizeof(struct pollfd) * nfds);
+	if (copy_from_user(poll_fds, ufds, sizeof(struct pollfd) * nfds)) {
+		result = -EFAULT;
+		goto out_free;
+	}
 
-	ps = (struct poll_struct *)kmalloc(sizeof(struct poll_struct), GFP_KERNEL);
-	BUG_ON(!ps);
-	init_waitqueue_head(&ps->wq);
+	init_waitqueue_head(&ps.wq);
+	ps.triggered = 0;
 
 	for (i = 0; i < nfds; i++) {
-		ret = poll_insert(ps, poll_fds[i].fd, poll_fds[i].events, &revent);
-		if (ret == 1) {
-			copy_to_user(&poll_fds[i].revents, &revent, sizeof(short));
-			result++;
+		struct file *file;
+
+		/* 
+		 * according to poll syscall description, if fd is neagative,
+		 * it will be ignored and the revents field returns zero.
+		 */
+		poll_fds[i].revents = 0;
+		if (poll_fds[i].fd < 0)
+			continue;
+
+		file = fdget(poll_fds[i].fd);
+		if (!file) {
+			poll_fds[i].revents = POLLNVAL;
+			continue;
 		}
-		if (ret < 0)
-			return -1;
+		poll_insert(&ps, &entries[i], file);
 	}
 
-	if (result == 0) {
-		result = poll_wait(ps, poll_fds, nfds, timeout_jiffies);
+	result = poll_wait(&ps, poll_fds, entries, nfds, timeout_jiffies);
+
+	for (i = 0; i < nfds; i++) {
+		if (!entries[i].file)
+			continue;
+		poll_remove(&entries[i]);
+		put_file(entries[i].file);
 	}
 
+	if (result >= 0 &&
+	    copy_to_user(ufds, poll_fds, sizeof(struct pollfd) * nfds))
+		result = -EFAULT;
+
+out_free:
+	kfree(entries);
+	kfree(poll_fds);
 	return result;
 }
-
@@ -43,8 +43,78 @@ atomic_t global_flow_id;
 u32 ip2saddr[TOTAL_PHYS_NODE];
 int ipid2nodeid[TOTAL_PHYS_NODE];
 
-struct list_head global_socket_list;
-spinlock_t global_sock_list_lock;
+/*
+ * Sockets indexed by (peer node, FIT internal port), which is all the
+ * FIT receive path knows about an incoming message. Bound sockets that
+ * accept from any node are indexed with node -1.
+ */
+#define SOCK_INDEX_BITS		10
+
+struct sock_index_bucket {
+	spinlock_t		lock;
+	struct hlist_head	head;
+};
+
+static struct sock_index_bucket sock_index[1 << SOCK_INDEX_BITS];
+
+static inline struct sock_index_bucket *sock_index_bucket(int node, int port)
+{
+	return &sock_index[hash_32((u32)node << 16 ^ (u32)port, SOCK_INDEX_BITS)];
+}
+
+/* (Re)index @sock once its FIT internal port is known */
+static void sock_index_set(struct lego_socket *sock, int node, int internal_port)
+{
+	struct sock_index_bucket *b;
+
+	if (!hlist_unhashed(&sock->index_node)) {
+		b = sock_index_bucket(sock->peer_node_id, sock->local_internal_port);
+		spin_lock(&b->lock);
+		hlist_del_init(&sock->index_node);
+		spin_unlock(&b->lock);
+	}
+
+	sock->peer_node_id = node;
+	sock->local_internal_port = internal_port;
+
+	b = sock_index_bucket(node, internal_port);
+	spin_lock(&b->lock);
+	hlist_add_head(&sock->index_node, &b->head);
+	spin_unlock(&b->lock);
+}
+
+static struct lego_socket *__find_socket(int node, int port)
+{
+	struct sock_index_bucket *b = sock_index_bucket(node, port);
+	struct lego_socket *sock;
+
+	spin_lock(&b->lock);
+	hlist_for_each_entry(sock, &b->head, index_node) {
+		if (sock->local_internal_port == port && sock->peer_node_id == node)
+			goto out;
+	}
+	sock = NULL;
+out:
+	spin_unlock(&b->lock);
+	return sock;
+}
+
+/*
+ * Find socket using target node ID and FIT internal port number.
+ * Connected sockets are matched first, then INADDR_ANY ones,
+ * for which target_node is not used for any matching.
+ * WARN: still need to take care of socket reuse addr and port
+ */
+struct lego_socket *find_socket_from_node_port(int target_node, int port)
+{
+	struct lego_socket *sock;
+
+	sock = __find_socket(target_node, port);
+	if (!sock)
+		sock = __find_socket(-1, port);
+	return sock;
+}
+
 char *global_buffer_for_no_sock;
 int global_buffer_for_no_sock_size;
 
@@ -267,10 +337,6 @@ SYSCALL_DEFINE3(socket, int, family, int, type, int, protocol)
 	sock->file = f;
 	INIT_LIST_HEAD(&sock->recvd_conn_list.list);
 
-	spin_lock(&global_sock_list_lock);
-	list_add_tail(&sock->list, &global_socket_list);
-	spin_unlock(&global_sock_list_lock);
-
 	sock_debug("%s created sock %p fd %d f %p\n", __func__, sock, fd, f);
 
 	return fd;
@@ -543,9 +609,9 @@ SYSCALL_DEFINE3(bind, int, fd, struct sockaddr __user *, addr, int, addr_len)
 	sock->sa_family = sa_family;
 	sock->local_port = port;
 	sock->status = SOCK_BOUND;
-	sock->peer_node_id = -1; /* -1 for INADDR_ANY */
 
-	sock->local_internal_port = set_internal_port(MY_NODE_ID, port);
+	/* -1 for INADDR_ANY */
+	sock_index_set(sock, -1, set_internal_port(MY_NODE_ID, port));
 
 	sock_debug("bound fd %d sock %p to port %d fit internal port %d\n", 
 			fd, sock, port, sock->local_internal_port);
@@ -655,9 +721,8 @@ SYSCALL_DEFINE3(connect, int, fd, struct sockaddr __user *, uservaddr,
 	sock_debug("%s: connecting to node %d port %d\n", __func__, node_id, sockaddr.sin_port);
 	memcpy(&sock->peer_sockaddr, &sockaddr, addrlen);
 	sock->peer_addr_len = addrlen;
-	sock->peer_node_id = node_id;
 	sock->local_port = get_and_insert_new_local_port(node_id);
-	sock->local_internal_port = get_internal_port(node_id, sock->local_port);
+	sock_index_set(sock, node_id, get_internal_port(node_id, sock->local_port));
 
 	sock_conn = (struct lego_sock_conn *)kmalloc(sizeof(struct lego_sock_conn), GFP_KERNEL);
 	sock_conn->op_code = SOCK_BUILD_CONN;
@@ -795,9 +860,9 @@ SYSCALL_DEFINE4(accept4, int, fd, struct sockaddr __user *, upeer_sockaddr,
 	memcpy(&new_sock->peer_sockaddr, &header->sockaddr, header->sockaddr_len);
 	new_sock->peer_addr_len = header->sockaddr_len;
 	new_sock->peer_internal_port = header->internal_port;
-	new_sock->peer_node_id = header->fit_node_id;
-	new_sock->local_port = get_and_insert_new_local_port(new_sock->peer_node_id);
-	new_sock->local_internal_port = get_internal_port(new_sock->peer_node_id, new_sock->local_port);
+	new_sock->local_port = get_and_insert_new_local_port(header->fit_node_id);
+	sock_index_set(new_sock, header->fit_node_id,
+		       get_internal_port(header->fit_node_id, new_sock->local_port));
 	sock_debug("%s: got connection request fro mnode %d, assigned local port %d internalport %d\n",
 			__func__, new_sock->peer_node_id, new_sock->local_port, new_sock->local_internal_port);
 	
@@ -806,10 +871,6 @@ SYSCALL_DEFINE4(accept4, int, fd, struct sockaddr __user *, upeer_sockaddr,
 		ret = copy_to_user(upeer_addrlen, &header->sockaddr_len, sizeof(int));
 	}
 
-	spin_lock(&global_sock_list_lock);
-	list_add_tail(&new_sock->list, &global_socket_list);
-	spin_unlock(&global_sock_list_lock);
-
 	new_sock->status = SOCK_CONNECT_ACCEPTED;
 
 	/*
@@ -845,31 +906,40 @@ SYSCALL_DEFINE3(accept, int, fd, struct sockaddr __user *, upeer_sockaddr,
 }
 
 /*
+ * Send all buffers of @iov as one stream. FIT gathers them into
+ * one RDMA write, and cuts large ones into pipelined segments.
+ *
  * return:
- * 0 succeed in sending all data
+ * number of bytes sent, negative values on failures
  */
-int socket_send_data(struct lego_socket *sock, void __user *buff, size_t len)
+static int socket_send_iov(struct lego_socket *sock, const struct iovec *iov, int nr_iov)
 {
-	int ret;
-
-	if (len <= 0) {
-		pr_crit("%s: sending size wrong %zu\n", __func__, len);
-		return -1;
-	}
-	if (len > MAX_SOCK_SEND_SIZE) {
-		pr_crit("%s: sending too big %zu. currently only support sending up to %dB\n",
-				__func__, len, MAX_SOCK_SEND_SIZE);
-		return -1;
-	}
-
 	if (!sock) {
 		pr_crit("%s: wrong null socket\n", __func__);
-		return -1;
+		return -EINVAL;
 	}
 
-	ret = ibapi_sock_send_message(sock->peer_node_id, sock->peer_internal_port, 1, buff, len, 30, 1);
+	return ibapi_sock_send_message_iov(sock->peer_node_id, sock->peer_internal_port,
+					   1, iov, nr_iov, 1);
+}
 
-	return ret;
+/*
+ * return:
+ * number of bytes sent, negative values on failures
+ */
+int socket_send_data(struct lego_socket *sock, void __user *buff, size_t len)
+{
+	struct iovec iov = {
+		.iov_base	= buff,
+		.iov_len	= len,
+	};
+
+	if (len <= 0 || len > INT_MAX) {
+		pr_crit("%s: sending size wrong %zu\n", __func__, len);
+		return -EINVAL;
+	}
+
+	return socket_send_iov(sock, &iov, 1);
 }
 
 /*
@@ -912,9 +982,7 @@ SYSCALL_DEFINE3(sendmsg, int, fd, struct user_msghdr __user *, msg,
 {
 	struct file *f;
 	ssize_t err;
-	int i;
 	struct iovec *iov;
-	int total_sent_size = 0;
 
 	if (flags & MSG_CMSG_COMPAT)
 		return -EINVAL;
@@ -938,18 +1006,35 @@ SYSCALL_DEFINE3(sendmsg, int, fd, struct user_msghdr __user *, msg,
 //		msg_sys->msg_flags |= MSG_DONTWAIT;
 
 	iov = (struct iovec *)kmalloc(sizeof(struct iovec) * msg->msg_iovlen, GFP_KERNEL);
+	if (!iov)
+		return -ENOMEM;
 	memcpy(iov, msg->msg_iov, sizeof(struct iovec) * msg->msg_iovlen);
 	// XXX copy_from_user(iov, msg->msg_iov, sizeof(struct iovec) * msg->msg_iovlen);
 
-	for (i = 0; i < msg->msg_iovlen; i++) {
-		err = socket_send_data((struct lego_socket *)f->private_data, iov[i].iov_base, iov[i].iov_len);
-		if (err == 0) {
-			total_sent_size += iov[i].iov_len;
-		}
-	}
+	/* All elements go out together, not one round trip each */
+	err = socket_send_iov((struct lego_socket *)f->private_data, iov, msg->msg_iovlen);
 
 	kfree(iov);
-	return total_sent_size;
+	return err;
+}
+
+static int socket_receive_iov(struct lego_socket *sock, const struct iovec *iov,
+			      int nr_iov, int sock_type)
+{
+	int sender_id;
+
+	if (!sock) {
+		pr_crit("%s: wrong null socket\n", __func__);
+		return -1;
+	}
+
+	if (sock->status != SOCK_CONNECTED) {
+		pr_crit("%s: socket not connected yet status %d\n", __func__, sock->status);
+		return -1;
+	}
+
+	return ibapi_sock_receive_message_iov(&sender_id, sock->local_internal_port,
+					      iov, nr_iov, 1, sock_type);
 }
 
 int socket_receive_data(struct lego_socket *sock, void __user *ubuf, size_t size, int sock_type)
@@ -1012,11 +1097,8 @@ SYSCALL_DEFINE3(recvmsg, int, fd, struct user_msghdr __user *, msg,
 {
 	struct file *f;
 	ssize_t err;
-	int i;
 	struct iovec *iov;
-	int total_received_size = 0;
-	char *buf;
-	int remain_size, ret;
+	int total_received_size;
 	struct lego_socket *sock;
 
 	if (flags & MSG_CMSG_COMPAT)
@@ -1040,26 +1122,14 @@ SYSCALL_DEFINE3(recvmsg, int, fd, struct user_msghdr __user *, msg,
 	sock = (struct lego_socket *)f->private_data;
 
 	iov = (struct iovec *)kmalloc(sizeof(struct iovec) * msg->msg_iovlen, GFP_KERNEL);
+	if (!iov)
+		return -ENOMEM;
 	memcpy(iov, msg->msg_iov, sizeof(struct iovec) * msg->msg_iovlen);
 	// XXX copy_from_user(iov, msg->msg_iov, sizeof(struct iovec) * msg->msg_iovlen);
 
-	for (i = 0; i < msg->msg_iovlen; i++) {
-		remain_size = iov[i].iov_len;
-		buf = (char *)iov[i].iov_base;
-
-		while (remain_size > 0) {
-			ret = socket_receive_data(sock, buf, remain_size, sock->type);
-			if (ret <= 0)
-				goto out_freeiov;
-			total_received_size += ret;
-			remain_size -= ret;
-			buf += ret;
-			sock_debug("%s: received size %d remain_size %d iov %d\n",
-					__func__, ret, remain_size, i);
-		}
-	}
+	/* One ring entry may fill several buffers */
+	total_received_size = socket_receive_iov(sock, iov, msg->msg_iovlen, sock->type);
 
-out_freeiov:
 	kfree(iov);
 
 	sock_debug("%s: exit received size %d\n", __func__, total_received_size);
@@ -1127,34 +1197,15 @@ static const struct file_operations socket_fops = {
 	.poll		= sock_poll,
 };
 
-/* 
- * Find file using target node ID and FIT internal port number
- * For INADDR_ANY, target_node is not used for any matching
- * WARN: still need to take care of socket reuse addr and port
+/*
+ * Called by FIT for each message that arrives at (@target_node, @port).
+ * A single lookup marks the socket readable and wakes up both poll and
+ * epoll waiters of its file.
  */
-struct lego_socket *find_socket_from_node_port(int target_node, int port)
-{
-	struct lego_socket *sock;
-
-	//sock_debug("%s finding target_node %d port %d\n", __func__, target_node, port);
-	spin_lock(&global_sock_list_lock);
-	list_for_each_entry(sock, &global_socket_list, list) {
-		if (sock->local_internal_port == port) {
-			if (sock->peer_node_id == -1 || sock->peer_node_id == target_node) {
-					break;
-			}
-		}
-	}
-	spin_unlock(&global_sock_list_lock);
-
-	//sock_debug("%s: node %d port %d sock %p\n", __func__, target_node, port, sock);
-
-	return sock;
-}
-
-int sock_set_read_ready(int target_node, int port, int size)
+int sock_notify_read_ready(int target_node, int port, int size)
 {
 	struct lego_socket *sock;
+	struct file *f;
 
 	sock = find_socket_from_node_port(target_node, port);
 	if (!sock) {
@@ -1163,12 +1214,18 @@ int sock_set_read_ready(int target_node, int port, int size)
 		return -EINVAL;
 	}
 
-	sock->file->ready_size += size;
+	f = sock->file;
+	f->ready_size += size;
 	sock->ready_state |= POLLIN;
-	sock->file->ready_state |= POLLIN;
+	f->ready_state |= POLLIN;
 
 	sock_debug("%s: node %d port %d sock %p file %p read ready size %d\n", 
-			__func__, target_node, port, sock, sock->file, sock->file->ready_size);
+			__func__, target_node, port, sock, f, f->ready_size);
+
+#ifdef CONFIG_EPOLL
+	lego_epoll_callback(f, (void *)POLLIN);
+#endif
+	lego_poll_callback(f);
 
 	return 0;
 }
@@ -1186,8 +1243,8 @@ int sock_unset_read_ready(int target_node, int port, int size)
 
 	sock->file->ready_size -= size;
 	if (sock->file->ready_size <= 0) {
-		sock->ready_state &= !POLLIN;
-		sock->file->ready_state &= !POLLIN;
+		sock->ready_state &= ~POLLIN;
+		sock->file->ready_state &= ~POLLIN;
 	}
 
 	sock_debug("%s: node %d port %d sock %p file %p read not ready readysize %d\n", 
@@ -1215,52 +1272,6 @@ int sock_set_write_ready(int target_node, int port)
 	return 0;
 }
 
-#ifdef CONFIG_EPOLL
-int sock_epoll_callback(int target_node, int port)
-{
-	struct lego_socket *sock;
-	struct file *f;
-
-	sock = find_socket_from_node_port(target_node, port);
-	if (!sock) {
-		printk(KERN_CRIT "Error: couldn't find socket file for node %d port %d\n",
-				target_node, port);
-		return -EINVAL;
-	}
-
-	f = sock->file;
-
-	sock_debug("%s: node %d port %d file %p sock %p ready state %x\n", 
-			__func__, target_node, port, f, sock, sock->ready_state);
-
-	lego_epoll_callback(f, (void *)sock->ready_state);
-
-	return 0;
-}
-#endif
-
-int sock_poll_callback(int target_node, int port)
-{
-	struct lego_socket *sock;
-	struct file *f;
-
-	sock = find_socket_from_node_port(target_node, port);
-	if (!sock) {
-		printk(KERN_CRIT "Error: couldn't find socket file for node %d port %d\n",
-				target_node, port);
-		return -EINVAL;
-	}
-
-	f = sock->file;
-
-	sock_debug("%s: node %d port %d file %p sock %p ready state %x\n", 
-			__func__, target_node, port, f, sock, sock->ready_state);
-
-	lego_poll_callback(f);
-
-	return 0;
-}
-
 /*
  * Callback for syscall open()
  * Used to install socket-specific file operations
@@ -1492,8 +1503,10 @@ void init_socket(void)
 
 	init_sock_ips();
 	atomic_set(&global_flow_id, 0);
-	INIT_LIST_HEAD(&global_socket_list);
-	spin_lock_init(&global_sock_list_lock);
+	for (i = 0; i < ARRAY_SIZE(sock_index); i++) {
+		spin_lock_init(&sock_index[i].lock);
+		INIT_HLIST_HEAD(&sock_index[i].head);
+	}
 	global_buffer_for_no_sock = (char *)kmalloc(MAX_BUF_SIZE_FOR_NO_SOCK, GFP_KERNEL);
 	global_buffer_for_no_sock_size = 0;
 
@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016-2020 Wuklab, Purdue University. All rights reserved.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Stitch the RPC trace records dumped by processor and memory nodes
+# (CONFIG_PROFILING_RPC_TRACE) into one Chrome trace JSON, which can be
+# opened by chrome://tracing or https://ui.perfetto.dev
+#
+# Usage: scripts/rpc_trace.py processor.log memory.log ... > trace.json
+#
+# Each node has its own sched_clock(). Clocks are aligned per pair of
+# nodes by the RPCs between them: the server handles a request after the
+# client sends it and before the client gets the reply. The median of
+# ((enqueue - send) + (reply - recv)) / 2 is used as the offset.
+#
+# Storage does not record anything, its time shows up as the M2S or P2S
+# calls of memory and processor.
+
+import json
+import os
+import re
+import sys
+from collections import defaultdict
+
+SEND, SEND_NOREPLY, RECV_REPLY, ENQUEUE, DEQUEUE, HANDLER_END, REPLY = range(7)
+
+RECORD = re.compile(r'rpc_trace: (\d+) (\d+) (\d+) (\d+) ([0-9a-f]+) ([0-9a-f]+) (\d+)\s*$')
+
+TOPDIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+
+def load_opcode_names():
+    """Opcode names from opcode.h, syscall names for __NR_ ones."""
+    names = {}
+    try:
+        with open(os.path.join(TOPDIR, 'arch/x86/entry/syscalls/syscall_64.tbl')) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) >= 3 and fields[0].isdigit():
+                    names[int(fields[0])] = fields[2]
+        with open(os.path.join(TOPDIR, 'include/lego/rpc/opcode.h')) as f:
+            for line in f:
+                m = re.match(r'#define\s+(\w+)\s+\(\(__u32\)(0x[0-9a-fA-F]+)\)', line)
+                if m:
+                    names.setdefault(int(m.group(2), 16), m.group(1))
+    except OSError:
+        pass
+    return names
+
+
+def parse(paths):
+    records = []
+    for path in paths:
+        with open(path, errors='replace') as f:
+            for line in f:
+                m = RECORD.search(line)
+                if not m:
+                    continue
+                nid, cpu, ts, ev, tid, op, peer = m.groups()
+                if int(tid, 16) == 0:
+                    continue
+                records.append((int(nid), int(cpu), int(ts), int(ev),
+                                int(tid, 16), int(op, 16), int(peer)))
+    records.sort(key=lambda r: (r[0], r[2]))
+    return records
+
+
+def pair_client(records):
+    """[(nid, cpu, send_ts, recv_ts or None, trace_id, opcode, peer)]"""
+    pending = defaultdict(list)
+    calls = []
+    for nid, cpu, ts, ev, tid, op, peer in records:
+        key = (nid, tid, op, peer)
+        if ev == SEND:
+            pending[key].append([nid, cpu, ts, None, tid, op, peer])
+            calls.append(pending[key][-1])
+        elif ev == SEND_NOREPLY:
+            calls.append([nid, cpu, ts, None, tid, op, peer])
+        elif ev == RECV_REPLY and pending[key]:
+            pending[key].pop(0)[3] = ts
+    return calls
+
+
+def pair_server(records):
+    """[{nid, cpu, src, tid, op, ENQUEUE: ts, DEQUEUE: ts, ...}]"""
+    open_reqs = defaultdict(list)
+    reqs = []
+    for nid, cpu, ts, ev, tid, op, peer in records:
+        if ev < ENQUEUE:
+            continue
+        key = (nid, tid, op, peer)
+        if ev == ENQUEUE:
+            req = {'nid': nid, 'src': peer, 'tid': tid, 'op': op, ENQUEUE: ts}
+            open_reqs[key].append(req)
+            reqs.append(req)
+            continue
+        for req in open_reqs[key]:
+            if ev not in req:
+                req[ev] = ts
+                if ev == DEQUEUE:
+                    req['cpu'] = cpu
+                if ev == REPLY:
+                    open_reqs[key].remove(req)
+                break
+    return reqs
+
+
+def match(calls, reqs):
+    """Link each client call to the server request it caused."""
+    by_key = defaultdict(list)
+    for req in reqs:
+        by_key[(req['src'], req['nid'], req['tid'], req['op'])].append(req)
+    links = []
+    for call in calls:
+        key = (call[0], call[6], call[4], call[5])
+        if by_key[key]:
+            links.append((call, by_key[key].pop(0)))
+    return links
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def clock_offsets(links, nodes):
+    """Offset to add to each node's ts, relative to the lowest client node."""
+    samples = defaultdict(list)
+    for call, req in links:
+        if call[3] is None or REPLY not in req:
+            continue
+        c, s = call[0], req['nid']
+        off = ((req[ENQUEUE] - call[2]) + (req[REPLY] - call[3])) // 2
+        samples[(c, s)].append(off)		# server = client + off
+
+    edges = defaultdict(list)
+    for (c, s), offs in samples.items():
+        off = median(offs)
+        edges[c].append((s, off))
+        edges[s].append((c, -off))
+
+    offsets = {}
+    for root in sorted(nodes):
+        if root in offsets:
+            continue
+        offsets[root] = 0
+        queue = [root]
+        while queue:
+            n = queue.pop(0)
+            for peer, off in edges[n]:
+                if peer not in offsets:
+                    # local ts of peer = ts of n + off
+                    offsets[peer] = offsets[n] - off
+                    queue.append(peer)
+    return offsets
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('Usage: %s <kernel log> ...' % sys.argv[0])
+
+    names = load_opcode_names()
+    records = parse(sys.argv[1:])
+    calls = pair_client(records)
+    reqs = pair_server(records)
+    links = match(calls, reqs)
+    offsets = clock_offsets(links, {r[0] for r in records})
+
+    def us(nid, ts):
+        return (ts + offsets.get(nid, 0)) / 1000.0
+
+    def opname(op):
+        return names.get(op, '%#x' % op)
+
+    events = []
+    for nid in sorted(offsets):
+        events.append({'name': 'process_name', 'ph': 'M', 'pid': nid,
+                       'args': {'name': 'node %d' % nid}})
+
+    for nid, cpu, send, recv, tid, op, peer in calls:
+        ev = {'name': opname(op), 'cat': 'client', 'pid': nid, 'tid': cpu,
+              'ts': us(nid, send), 'args': {'trace_id': '%#x' % tid, 'to': peer}}
+        if recv is None:
+            ev.update({'ph': 'i', 's': 't'})
+        else:
+            ev.update({'ph': 'X', 'dur': (recv - send) / 1000.0})
+        events.append(ev)
+
+    phases = ((ENQUEUE, DEQUEUE, 'queue'), (DEQUEUE, HANDLER_END, None),
+              (HANDLER_END, REPLY, 'reply'))
+    for req in reqs:
+        nid, cpu = req['nid'], req.get('cpu', 0)
+        for start, end, name in phases:
+            if start not in req or end not in req:
+                continue
+            events.append({'name': name or opname(req['op']), 'cat': 'server',
+                           'ph': 'X', 'pid': nid, 'tid': cpu,
+                           'ts': us(nid, req[start]),
+                           'dur': (req[end] - req[start]) / 1000.0,
+                           'args': {'trace_id': '%#x' % req['tid'],
+                                    'from': req['src']}})
+
+    for i, (call, req) in enumerate(links):
+        events.append({'name': 'rpc', 'cat': 'flow', 'ph': 's', 'id': i,
+                       'pid': call[0], 'tid': call[1], 'ts': us(call[0], call[2])})
+        events.append({'name': 'rpc', 'cat': 'flow', 'ph': 'f', 'bp': 'e',
+                       'id': i, 'pid': req['nid'], 'tid': req.get('cpu', 0),
+                       'ts': us(req['nid'], req[ENQUEUE])})
+
+    json.dump({'traceEvents': events, 'displayTimeUnit': 'ns'}, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
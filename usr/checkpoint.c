@@ -4,13 +4,25 @@
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <linux/unistd.h>
 
-#define __NR_CHECKPOINT	666
+#define __NR_CHECKPOINT	600
+#define __NR_RESTORE	602
+
+/*
+ * Image 1 is a full one, the later ones are incremental on top of it.
+ * Page i is dirtied right before image i+1, the last page never.
+ */
+#define NR_IMAGES	3
+static char pages[NR_IMAGES + 1][4096] __attribute__((aligned(4096)));
+static pid_t origin_pid;
 
 static pid_t gettid(void)
 {
@@ -40,6 +52,37 @@ static inline void checkpoint_process(pid_t pid)
 		perror("checkpoint");
 }
 
+/* Like execve(), restore does not return on success */
+static inline void restore_process(unsigned int node, pid_t pid, unsigned int seq)
+{
+	syscall(__NR_RESTORE, node, pid, seq);
+	perror("restore");
+}
+
+/*
+ * Restored from image @seq: all pages dirtied before it
+ * must be there, later changes must not.
+ */
+static int check_restored(int seq)
+{
+	int i, j;
+
+	for (i = 0; i <= NR_IMAGES; i++) {
+		char expected = i < seq ? 'A' + i : 0;
+
+		for (j = 0; j < 4096; j++) {
+			if (pages[i][j] != expected) {
+				fprintf(stderr, "FAIL: page %d byte %d: %#x, expected %#x\n",
+					i, j, pages[i][j], expected);
+				return -1;
+			}
+		}
+	}
+	fprintf(stderr, "Restored from image %d: pid=%d origin=%d\n",
+		seq, getpid(), origin_pid);
+	return 0;
+}
+
 static void create_threads(void)
 {
 	pthread_t tid;
@@ -87,8 +130,55 @@ static void register_signal_handler(void)
 	}
 }
 
-int main(void)
+/*
+ * Take NR_IMAGES images of ourselves, then let a child
+ * restore the last one, which needs the whole chain.
+ */
+static void checkpoint_restore_chain(unsigned int node)
+{
+	pid_t pid;
+	int i, status;
+
+	origin_pid = getpid();
+	for (i = 0; i < NR_IMAGES; i++) {
+		memset(pages[i], 'A' + i, 4096);
+		checkpoint_process(origin_pid);
+
+		/* The restored child resumes here */
+		if (getpid() != origin_pid)
+			exit(check_restored(i + 1) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	/* Not in any image */
+	memset(pages[0], 'Z', 4096);
+
+	/* Images are written to storage in background */
+	sleep(2);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (pid == 0) {
+		restore_process(node, origin_pid, NR_IMAGES);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		exit(-1);
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		fprintf(stderr, "PASS: restore from %d images\n", NR_IMAGES);
+	else
+		fprintf(stderr, "FAIL: restore, status %#x\n", status);
+}
+
+/* Usage: checkpoint [processor node id] */
+int main(int argc, char **argv)
 {
+	unsigned int node = argc > 1 ? atoi(argv[1]) : 0;
 	int fd;
 
 	fprintf(stderr, "main(): pid=%d\n", getpid());
@@ -113,9 +203,9 @@ int main(void)
 	create_threads();
 
 	/*
-	 * Checkpoint
+	 * Checkpoint and restore
 	 */
-	checkpoint_process(getpid());
+	checkpoint_restore_chain(node);
 
 	fprintf(stderr, "Done \n");
 
@@ -9,6 +9,9 @@
 
 #define PORT	12345
 
+/* Fixed size messages of the epoll test, see server.c */
+#define MSG_LEN	5
+
 void error(char *msg)
 {
 	perror(msg);
@@ -58,5 +61,27 @@ int main(int argc, char *argv[])
 
 	printf("%s\n",buffer);
 
+	/* Answer "ping<n>" with "pong<n>" until "done!" */
+	n = write(sockfd, "ready", MSG_LEN);
+	if (n < 0)
+		error("ERROR writing to socket");
+	while (1) {
+		int done = 0;
+
+		while (done < MSG_LEN) {
+			n = read(sockfd, buffer + done, MSG_LEN - done);
+			if (n <= 0)
+				error("ERROR reading from socket");
+			done += n;
+		}
+		if (!strncmp(buffer, "done!", MSG_LEN))
+			break;
+
+		memcpy(buffer, "pong", 4);
+		n = write(sockfd, buffer, MSG_LEN);
+		if (n < 0)
+			error("ERROR writing to socket");
+	}
+
 	return 0;
 }
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <string.h>
 #include <assert.h>
@@ -144,6 +149,254 @@ int test_fast_write_slow_read()
 	return 0;
 }
 
+/* F_GETPIPE_SZ/F_SETPIPE_SZ, and a nonblocking writer fills exactly that */
+int test_pipe_size(void)
+{
+	int pipefd[2];
+	char buf[4096];
+	long size, total = 0;
+	ssize_t ret;
+
+	printf("%s: \n", __func__);
+
+	if (pipe2(pipefd, O_NONBLOCK) == -1) {
+		perror("Pipe: ");
+		exit(EXIT_FAILURE);
+	}
+
+	size = fcntl(pipefd[0], F_GETPIPE_SZ);
+	printf("default size: %ld\n", size);
+	assert(size > 0);
+
+	/* Rounded up to at least one page */
+	size = fcntl(pipefd[1], F_SETPIPE_SZ, 1);
+	assert(size >= 4096);
+	assert(fcntl(pipefd[0], F_GETPIPE_SZ) == size);
+
+	/* Empty nonblocking pipe */
+	ret = read(pipefd[0], buf, sizeof(buf));
+	assert(ret == -1 && errno == EAGAIN);
+
+	memset(buf, 'x', sizeof(buf));
+	while ((ret = write(pipefd[1], buf, sizeof(buf))) > 0)
+		total += ret;
+	assert(ret == -1 && errno == EAGAIN);
+	printf("size: %ld filled: %ld\n", size, total);
+	assert(total == size);
+
+	/* Can not shrink below what is in it */
+	ret = fcntl(pipefd[1], F_SETPIPE_SZ, 4096);
+	assert(ret >= total || (ret == -1 && errno == EBUSY));
+
+	/* Grow keeps the data */
+	assert(fcntl(pipefd[1], F_SETPIPE_SZ, size * 2) >= size * 2);
+	assert(write(pipefd[1], buf, sizeof(buf)) == sizeof(buf));
+	total += sizeof(buf);
+
+	while ((ret = read(pipefd[0], buf, sizeof(buf))) > 0) {
+		assert(buf[0] == 'x' && buf[ret - 1] == 'x');
+		total -= ret;
+	}
+	assert(ret == -1 && errno == EAGAIN);
+	assert(total == 0);
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return 0;
+}
+
+#define NR_ATOMIC_WRITERS	4
+#define NR_ATOMIC_WRITES	256
+
+/* Writes of PIPE_BUF bytes from concurrent writers never interleave */
+int test_pipe_buf_atomic(void)
+{
+	int pipefd[2];
+	static char buf[PIPE_BUF];
+	long total = 0, expected;
+	ssize_t ret;
+	int i, j;
+
+	printf("%s: \n", __func__);
+
+	if (pipe(pipefd) == -1) {
+		perror("Pipe: ");
+		exit(EXIT_FAILURE);
+	}
+
+	/* A small ring, writers have to wait for room */
+	fcntl(pipefd[1], F_SETPIPE_SZ, 4 * PIPE_BUF);
+
+	for (i = 0; i < NR_ATOMIC_WRITERS; i++) {
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			perror("Fork: ");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			close(pipefd[0]);
+			memset(buf, 'a' + i, sizeof(buf));
+			for (j = 0; j < NR_ATOMIC_WRITES; j++)
+				assert(write(pipefd[1], buf, sizeof(buf)) == sizeof(buf));
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	close(pipefd[1]);
+
+	/* Reassemble PIPE_BUF records from reads of any size */
+	while ((ret = read(pipefd[0], buf + total % PIPE_BUF,
+			   PIPE_BUF - total % PIPE_BUF)) > 0) {
+		total += ret;
+		if (total % PIPE_BUF)
+			continue;
+		for (j = 1; j < PIPE_BUF; j++) {
+			if (buf[j] != buf[0]) {
+				printf("record %ld interleaved: %c %c at %d\n",
+					total / PIPE_BUF - 1, buf[0], buf[j], j);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	expected = (long)NR_ATOMIC_WRITERS * NR_ATOMIC_WRITES * PIPE_BUF;
+	printf("read %ld bytes, expected %ld\n", total, expected);
+	assert(total == expected);
+
+	for (i = 0; i < NR_ATOMIC_WRITERS; i++)
+		wait(NULL);
+	close(pipefd[0]);
+	return 0;
+}
+
+#define LARGE_WRITE_SIZE	(4 * 1024 * 1024)
+
+/* One write much larger than the ring, read back in order */
+int test_large_write(void)
+{
+	int pipefd[2];
+	static char buf[LARGE_WRITE_SIZE];
+	long total = 0;
+	ssize_t ret;
+	pid_t pid;
+	int i;
+
+	printf("%s: \n", __func__);
+
+	if (pipe(pipefd) == -1) {
+		perror("Pipe: ");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(pipefd[1], F_SETPIPE_SZ, 64 * 1024);
+
+	for (i = 0; i < LARGE_WRITE_SIZE; i++)
+		buf[i] = i % 251;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("Fork: ");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		close(pipefd[0]);
+		ret = write(pipefd[1], buf, LARGE_WRITE_SIZE);
+		assert(ret == LARGE_WRITE_SIZE);
+		_exit(EXIT_SUCCESS);
+	}
+	close(pipefd[1]);
+
+	memset(buf, 0, sizeof(buf));
+	while ((ret = read(pipefd[0], buf + total, LARGE_WRITE_SIZE - total)) > 0)
+		total += ret;
+	printf("read %ld bytes\n", total);
+	assert(total == LARGE_WRITE_SIZE);
+
+	for (i = 0; i < LARGE_WRITE_SIZE; i++)
+		assert(buf[i] == (char)(i % 251));
+
+	waitid(P_ALL, pid, NULL, 0);
+	close(pipefd[0]);
+	return 0;
+}
+
+#define SPLICE_SIZE	(3 * 4096 + 100)
+
+/* file -> pipe -> pipe -> file, then vmsplice -> read */
+int test_splice(void)
+{
+	static char buf[SPLICE_SIZE], out[SPLICE_SIZE];
+	const char *in_name = "pipe_splice_in", *out_name = "pipe_splice_out";
+	int p1[2], p2[2], in, outfd, i;
+	struct iovec iov[2];
+	loff_t off = 0;
+	ssize_t ret;
+
+	printf("%s: \n", __func__);
+
+	for (i = 0; i < SPLICE_SIZE; i++)
+		buf[i] = 'A' + i % 26;
+
+	in = open(in_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	outfd = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (in < 0 || outfd < 0) {
+		perror("open: ");
+		exit(EXIT_FAILURE);
+	}
+	assert(write(in, buf, SPLICE_SIZE) == SPLICE_SIZE);
+
+	if (pipe(p1) == -1 || pipe(p2) == -1) {
+		perror("Pipe: ");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Explicit offset, file position is not touched */
+	ret = splice(in, &off, p1[1], NULL, SPLICE_SIZE, 0);
+	printf("file -> pipe: %ld, off: %ld\n", ret, (long)off);
+	assert(ret == SPLICE_SIZE && off == SPLICE_SIZE);
+	assert(lseek(in, 0, SEEK_CUR) == SPLICE_SIZE);
+
+	ret = splice(p1[0], NULL, p2[1], NULL, SPLICE_SIZE, SPLICE_F_MOVE);
+	printf("pipe -> pipe: %ld\n", ret);
+	assert(ret == SPLICE_SIZE);
+
+	/* Both ends of one pipe is not allowed */
+	assert(splice(p2[0], NULL, p2[1], NULL, 1, 0) == -1 && errno == EINVAL);
+
+	ret = splice(p2[0], NULL, outfd, NULL, SPLICE_SIZE, 0);
+	printf("pipe -> file: %ld\n", ret);
+	assert(ret == SPLICE_SIZE);
+
+	assert(pread(outfd, out, SPLICE_SIZE, 0) == SPLICE_SIZE);
+	assert(!memcmp(buf, out, SPLICE_SIZE));
+
+	/* Nothing left, nonblocking splice does not wait */
+	assert(splice(p1[0], NULL, outfd, NULL, 1, SPLICE_F_NONBLOCK) == -1 &&
+	       errno == EAGAIN);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 100;
+	iov[1].iov_base = buf + 4096;
+	iov[1].iov_len = 2 * 4096;
+	ret = vmsplice(p1[1], iov, 2, 0);
+	printf("vmsplice: %ld\n", ret);
+	assert(ret == 100 + 2 * 4096);
+
+	memset(out, 0, sizeof(out));
+	assert(read(p1[0], out, SPLICE_SIZE) == ret);
+	assert(!memcmp(out, buf, 100));
+	assert(!memcmp(out + 100, buf + 4096, 2 * 4096));
+
+	close(p1[0]);
+	close(p1[1]);
+	close(p2[0]);
+	close(p2[1]);
+	close(in);
+	close(outfd);
+	unlink(in_name);
+	unlink(out_name);
+	return 0;
+}
+
 void sigpipe_sighand(void)
 {
 	printf("PID: %d get SIGPIPE!!\n", getpid());
@@ -159,5 +412,9 @@ int main()
 
 	test_slow_write_fast_read();
 	test_fast_write_slow_read();
+	test_pipe_size();
+	test_pipe_buf_atomic();
+	test_large_write();
+	test_splice();
 	return 0;
 }
@@ -6,16 +6,151 @@
 #include <string.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <poll.h>
 
 #define PORT	12345
 
+/* Fixed size messages of the epoll test, see client.c */
+#define MSG_LEN	5
+
 void error(char *msg)
 {
     perror(msg);
     exit(1);
 }
 
+static void check(int cond, char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		exit(1);
+	}
+	printf("ok: %s\n", what);
+}
+
+static void read_msg(int fd, char *buf)
+{
+	int n, done = 0;
+
+	while (done < MSG_LEN) {
+		n = read(fd, buf + done, MSG_LEN - done);
+		if (n <= 0)
+			error("ERROR reading from socket");
+		done += n;
+	}
+	buf[MSG_LEN] = '\0';
+}
+
+static int wait_one(int epfd, int timeout, int fd)
+{
+	struct epoll_event ev;
+	int n;
+
+	n = epoll_wait(epfd, &ev, 1, timeout);
+	if (n < 0)
+		error("ERROR epoll_wait");
+	if (n == 1 && (ev.data.fd != fd || !(ev.events & EPOLLIN)))
+		check(0, "epoll_wait returns the right fd and events");
+	return n;
+}
+
+static int poll_one(int fd, short events, int timeout)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = fd, .events = events },
+		{ .fd = -1, .events = POLLIN },		/* ignored */
+	};
+	int n;
+
+	n = poll(pfd, 2, timeout);
+	if (n < 0)
+		error("ERROR poll");
+	check(n == !!pfd[0].revents, "poll returns the nr of ready fds");
+	check(pfd[1].revents == 0, "poll ignores negative fd");
+	return pfd[0].revents;
+}
+
+static int poll_in(int fd, int timeout)
+{
+	return poll_one(fd, POLLIN, timeout) & POLLIN;
+}
+
+/* Ask the client for a message, without reading it */
+static void ping(int fd, char nr)
+{
+	char msg[MSG_LEN + 1] = "ping?";
+
+	msg[4] = nr;
+	if (write(fd, msg, MSG_LEN) != MSG_LEN)
+		error("ERROR writing to socket");
+}
+
+/*
+ * EPOLLONESHOT and its re-arm by EPOLL_CTL_MOD, level trigger,
+ * EPOLL_CTL_DEL, and poll() revents on one connected socket.
+ */
+static void test_epoll(int fd)
+{
+	struct epoll_event ev;
+	char buf[MSG_LEN + 1];
+	int epfd;
+
+	read_msg(fd, buf);
+	check(!strcmp(buf, "ready"), "client is ready");
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		error("ERROR epoll_create1");
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = fd;
+	check(!epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev), "EPOLL_CTL_ADD");
+	check(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno == EEXIST,
+	      "EPOLL_CTL_ADD twice fails with EEXIST");
+
+	check(wait_one(epfd, 0, fd) == 0, "nothing ready yet");
+	check(!poll_in(fd, 0), "poll reports no POLLIN yet");
+	check(poll_one(fd, POLLIN | POLLOUT, 0) == POLLOUT, "poll reports POLLOUT only");
+
+	ping(fd, '1');
+	check(wait_one(epfd, 5000, fd) == 1, "EPOLLONESHOT reports once");
+	check(wait_one(epfd, 100, fd) == 0, "EPOLLONESHOT is disarmed afterwards");
+	check(poll_in(fd, 0), "poll reports POLLIN on unread data");
+
+	check(!epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev), "EPOLL_CTL_MOD re-arms");
+	check(wait_one(epfd, 0, fd) == 1, "re-armed fd reports unread data");
+	read_msg(fd, buf);
+	check(!strcmp(buf, "pong1"), "read pong1");
+
+	ev.events = EPOLLIN;
+	check(!epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev), "EPOLL_CTL_MOD to level trigger");
+	ping(fd, '2');
+	check(wait_one(epfd, 5000, fd) == 1, "level trigger reports");
+	check(wait_one(epfd, 0, fd) == 1, "level trigger reports again until read");
+	read_msg(fd, buf);
+	check(!strcmp(buf, "pong2"), "read pong2");
+	check(wait_one(epfd, 0, fd) == 0, "level trigger stops after read");
+
+	check(!epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL), "EPOLL_CTL_DEL");
+	ping(fd, '3');
+	check(poll_in(fd, 5000), "poll waits for POLLIN");
+	check(wait_one(epfd, 100, fd) == 0, "deleted fd is not reported");
+	check(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno == ENOENT,
+	      "EPOLL_CTL_DEL twice fails with ENOENT");
+	check(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT,
+	      "EPOLL_CTL_MOD of deleted fd fails with ENOENT");
+	read_msg(fd, buf);
+	check(!strcmp(buf, "pong3"), "read pong3");
+
+	if (write(fd, "done!", MSG_LEN) != MSG_LEN)
+		error("ERROR writing to socket");
+	close(epfd);
+	printf("PASS: epoll and poll\n");
+}
+
 int main(int argc, char *argv[])
 {
 	int sockfd, newsockfd, clilen, portno;
@@ -54,5 +189,6 @@ int main(int argc, char *argv[])
 	if (n < 0) 
 		error("ERROR writing to socket");
 
+	test_epoll(newsockfd);
 	return 0; 
 }
@@ -0,0 +1,65 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#define __NR_spawn	603
+
+/* fork() + execve() in one go, return the pid of the child */
+static pid_t spawn(const char *filename, char *const argv[], char *const envp[])
+{
+	return syscall(__NR_spawn, filename, argv, envp);
+}
+
+#define CHILD_EXIT_CODE	42
+
+/*
+ * Usage: spawn [program [args...]]
+ * Without arguments, spawn ourselves as the child.
+ */
+int main(int argc, char **argv, char **envp)
+{
+	char *self_argv[] = { argv[0], "child", NULL };
+	char **child_argv;
+	int status, expected;
+	pid_t pid;
+
+	setbuf(stdout, NULL);
+
+	if (argc == 2 && !strcmp(argv[1], "child")) {
+		printf("Child: pid: %d ppid: %d\n", getpid(), getppid());
+		exit(CHILD_EXIT_CODE);
+	}
+
+	if (argc > 1) {
+		child_argv = argv + 1;
+		expected = 0;
+	} else {
+		child_argv = self_argv;
+		expected = CHILD_EXIT_CODE;
+	}
+
+	pid = spawn(child_argv[0], child_argv, envp);
+	if (pid < 0) {
+		printf("Fail to spawn %s: %s\n", child_argv[0], strerror(errno));
+		return 1;
+	}
+	printf("Parent: pid: %d spawned %s as %d\n", getpid(), child_argv[0], pid);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		return 1;
+	}
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == expected) {
+		printf("PASS: child %d exited with %d\n", pid, expected);
+		return 0;
+	}
+	printf("FAIL: child %d status %#x, expected exit code %d\n",
+		pid, status, expected);
+	return 1;
+}